@@ -55,4 +55,5 @@ else()
 endif()
 
 message(STATUS "UPNP_VERBOSE	= ${UPNP_VERBOSE}")
+message(STATUS "USE_IO_URING	= ${USE_IO_URING}")
 
@@ -28,6 +28,10 @@ else()
 	endif()
 endif()
 
+if (USE_IO_URING)
+	set(cxx_definitions ${cxx_definitions} LIBED2K_USE_IO_URING=1)
+endif()
+
 source_group(include FILES ${headers})
 source_group(include\\kademlia FILES ${headers_kad})
 
@@ -23,6 +23,7 @@ namespace libed2k
         std::string file_path; // full filename in UTF8 always!
         size_type  file_size;
         std::vector<md4_hash> piece_hashses;
+        std::vector<sha1_hash> aich_hashes;    // AICH tree blocks, empty when unknown
         std::vector<char>* resume_data;
         storage_mode_t storage_mode;
         bool duplicate_is_error;
@@ -0,0 +1,111 @@
+
+#ifndef __LIBED2K_AICH__
+#define __LIBED2K_AICH__
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <boost/cstdint.hpp>
+
+#include "libed2k/constants.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/address.hpp"
+
+namespace libed2k
+{
+    /**
+      * tree node hash with identifier - path from root to node,
+      * root is 1 and every step down appends bit 1 for left child or 0 for right child
+     */
+    typedef std::pair<boost::uint32_t, sha1_hash> aich_node_hash;
+
+    /**
+      * SHA1 of AICH blocks in one part, data comes sequentially from part start
+     */
+    class aich_part_hasher
+    {
+    public:
+        aich_part_hasher();
+        void update(const char* data, int len);
+
+        /**
+          * completes last short block
+          * @return block hashes of part
+         */
+        const std::vector<sha1_hash>& final();
+    private:
+        sha1_hasher m_hasher;
+        int         m_block_offset;     //!< bytes in current block
+        std::vector<sha1_hash> m_hashes;
+    };
+
+    /**
+      * AICH hash tree - binary tree of SHA1 hashes over 180 KB blocks of file in eMule layout,
+      * every part is a subtree. Recovery data of one part verifies its block hashes against
+      * master hash, so after failed part check only corrupted blocks are downloaded again
+     */
+    class aich_hash_tree
+    {
+    public:
+        aich_hash_tree();
+
+        /**
+          * @param block_hashes hashes of all blocks in file order, tree is empty when count is wrong
+         */
+        aich_hash_tree(size_type file_size, const std::vector<sha1_hash>& block_hashes);
+
+        static int blocks_count(size_type file_size);
+        static int blocks_in_part(size_type file_size, int part);
+
+        bool empty() const { return m_block_hashes.empty(); }
+        size_type file_size() const { return m_file_size; }
+        const sha1_hash& master_hash() const { return m_master; }
+        const std::vector<sha1_hash>& block_hashes() const { return m_block_hashes; }
+
+        /**
+          * hashes which downloader needs to check blocks of part: siblings on path
+          * from root to part and all block hashes of part
+         */
+        bool part_recovery_data(int part, std::vector<aich_node_hash>& data) const;
+
+        /**
+          * check recovery data of part against trusted master hash
+          * @param blocks receives block hashes of part on success
+         */
+        static bool verify_part_recovery_data(size_type file_size, const sha1_hash& master, int part,
+            const std::vector<aich_node_hash>& data, std::vector<sha1_hash>& blocks);
+    private:
+        sha1_hash node_hash(size_type offset, size_type size, bool left_branch) const;
+        void append_blocks(size_type offset, size_type size, bool left_branch,
+            boost::uint32_t ident, std::vector<aich_node_hash>& data) const;
+
+        size_type   m_file_size;
+        sha1_hash   m_master;
+        std::vector<sha1_hash> m_block_hashes;
+    };
+
+    /**
+      * AICH master hashes reported by peers. Like in eMule every source has one vote,
+      * IPv4 sources of one /24 network count as one, and hash is trusted when enough
+      * sources report it and the vast majority of sources agrees
+     */
+    class aich_master_votes
+    {
+    public:
+        enum { min_sources = 10, min_percent = 92 };
+
+        /**
+          * record or replace hash reported by source
+          * @return trusted master hash after vote, zero when there is no consensus
+         */
+        const sha1_hash& add(const address& source, const sha1_hash& master);
+
+        const sha1_hash& trusted() const { return m_trusted; }
+        int sources() const { return m_votes.size(); }
+    private:
+        std::map<address, sha1_hash> m_votes;   //!< last hash reported from each source
+        sha1_hash   m_trusted;
+    };
+}
+
+#endif
@@ -2,11 +2,13 @@
 #define __LIBED2K_ARCHIVE__
 
 #include <iostream>
+#include <string.h>
 #include <boost/mpl/eval_if.hpp>
 #include <boost/mpl/identity.hpp>
 #include <boost/type_traits/is_fundamental.hpp>
 #include <boost/type_traits/is_class.hpp>
 #include "libed2k/error_code.hpp"
+#include "libed2k/assert.hpp"
 
 namespace libed2k
 {
@@ -142,6 +144,11 @@ namespace libed2k
             std::ostream& m_container;
         };
 
+        /**
+          * input archive works in two modes: over stream, where any read error throws libed2k_exception,
+          * or in place over raw buffer. Buffer mode never throws from archive itself - first error is saved,
+          * all next reads give zeroes, so packet decoder checks error() once after whole structure was read
+         */
         class ed2k_iarchive
         {
         public:
@@ -149,21 +156,58 @@ namespace libed2k
             typedef boost::mpl::bool_<false> is_saving;
 
 
-            ed2k_iarchive(std::istream& container) : m_container(container)
+            ed2k_iarchive(std::istream& container) : m_container(&container), m_data(NULL), m_pos(0)
+            {
+                m_container->seekg (0, std::ios::end);
+                m_length = m_container->tellg();
+                m_container->seekg (0, std::ios::beg);
+            }
+
+            /**
+              * @param data buffer must live longer than archive
+             */
+            ed2k_iarchive(const char* data, size_t size) :
+                m_container(NULL), m_data(data), m_pos(0), m_length(size)
             {
-                m_container.seekg (0, std::ios::end);
-                m_length = m_container.tellg();
-                m_container.seekg (0, std::ios::beg);
             }
 
             size_t bytes_left() const
             {
-                return m_length - m_container.tellg();
+                if (!m_container) return m_length - m_pos;
+                return m_length - m_container->tellg();
             }
 
-            std::istream& container()
+            const error_code& error() const
             {
-                return (m_container);
+                return m_error;
+            }
+
+            bool operator!() const
+            {
+                return m_error.value() != 0;
+            }
+
+            /**
+              * stop reading because of incorrect data
+             */
+            void fail(errors::error_code_enum e)
+            {
+                if (m_container) throw libed2k::libed2k_exception(e);
+                if (!m_error) m_error = errors::make_error_code(e);
+                m_pos = m_length;
+            }
+
+            void skip(size_t nSize)
+            {
+                if (!m_container)
+                {
+                    take(nSize);
+                    return;
+                }
+
+                if (nSize > bytes_left()) fail(errors::unexpected_istream_error);
+                m_container->seekg(nSize, std::ios::cur);
+                if (!m_container->good()) fail(errors::unexpected_istream_error);
             }
 
             template<typename T>
@@ -183,9 +227,17 @@ namespace libed2k
             template<typename T>
             void raw_read(T t, size_t nSize)
             {
-                m_container.read(t, nSize);
+                if (!m_container)
+                {
+                    const char* p = take(nSize);
+                    if (p) memcpy(t, p, nSize);
+                    else memset(t, 0, nSize);
+                    return;
+                }
 
-                if (!m_container.good())
+                m_container->read(t, nSize);
+
+                if (!m_container->good())
                 {
                     throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
                 }
@@ -195,22 +247,36 @@ namespace libed2k
             // this function doesn't read object size because in some cases size can was stored in uint16 or uint32
             ed2k_iarchive& operator>>(std::string& str)
             {
-                size_t nSize = str.size();
+                if (!str.empty()) raw_read(&str[0], str.size());
+                return *this;
+            }
 
-                if (nSize != 0)
+        private:
+            std::istream*   m_container;    //!< NULL in buffer mode
+            const char*     m_data;
+            size_t          m_pos;
+            size_t          m_length;
+            error_code      m_error;
+
+            /**
+              * takes next nSize bytes of buffer in buffer mode
+              * @return place of bytes in buffer or NULL when buffer is too short
+             */
+            const char* take(size_t nSize)
+            {
+                LIBED2K_ASSERT(!m_container);
+
+                if (nSize > bytes_left())
                 {
-                    char* v = new char[nSize];
-                    raw_read(&v[0], nSize);
-                    str.assign(&v[0], nSize);
-                    delete [] v;
+                    fail(errors::unexpected_istream_error);
+                    return NULL;
                 }
 
-                return *this;
+                const char* p = m_data + m_pos;
+                m_pos += nSize;
+                return p;
             }
 
-        private:
-            std::istream& m_container;
-
             template<typename T>
             inline void deserialize_impl(T & val, typename boost::enable_if<boost::is_fundamental<T> >::type* = 0)
             {
@@ -223,9 +289,6 @@ namespace libed2k
             {
                 val.serialize(*this);
             }
-
-            int m_length;
-
         };
     }
 }
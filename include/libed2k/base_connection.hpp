@@ -18,12 +18,15 @@
 #include "libed2k/config.hpp"
 #include "libed2k/size_type.hpp"
 #include "libed2k/socket.hpp"
+#include "libed2k/socket_type.hpp"
+#include "libed2k/io_service.hpp"
 #include "libed2k/chained_buffer.hpp"
 #include "libed2k/log.hpp"
 #include "libed2k/archive.hpp"
 #include "libed2k/packet_struct.hpp"
 #include "libed2k/deadline_timer.hpp"
 #include "libed2k/bandwidth_limit.hpp"
+#include "libed2k/send_queue.hpp"
 
 namespace libed2k{
 
@@ -41,20 +44,32 @@ namespace libed2k{
     public:
 
         base_connection(aux::session_impl& ses);
-        base_connection(aux::session_impl& ses, boost::shared_ptr<tcp::socket> s,
+        base_connection(aux::session_impl& ses, boost::shared_ptr<socket_type> s,
                         const tcp::endpoint& remote);
         virtual ~base_connection();
 
         virtual void disconnect(const error_code& ec, int error = 0);
         bool is_disconnecting() const { return m_disconnecting; }
 
-        /** connection closed when his socket is not opened */
-        bool is_closed() const { return !m_socket || !m_socket->is_open(); }
+        /** connection closed when it is disconnecting or his socket is not opened */
+        bool is_closed() const { return m_disconnecting || !m_socket_open; }
+
+        /**
+         * passes settings which connection shard uses to it, call on network thread
+         * when settings change
+         */
+        void update_settings();
         const tcp::endpoint& remote() const { return m_remote; }
-        boost::shared_ptr<tcp::socket> socket() { return m_socket; }
+        boost::shared_ptr<socket_type> socket() { return m_socket; }
 
         const stat& statistics() const { return m_statistics; }
 
+        /**
+         * operations on connection shard hold references to connection too, the last one
+         * may go there, so connection is always destroyed on network thread
+         */
+        friend void intrusive_ptr_release(base_connection const* c);
+
         typedef boost::iostreams::basic_array_source<char> Device;
 
         enum channels
@@ -72,42 +87,166 @@ namespace libed2k{
         virtual void do_write(int quota = (std::numeric_limits<int>::max)());
 
         template<typename T>
-        void write_struct(const T& t) { write_message(make_message(t)); }
+        void write_struct(const T& t)
+        {
+            if (serialize_message(m_send_buffer, t)) do_write();
+        }
 
-        void write_message(const message& msg);
+        /**
+         * serialize packet in place to the end of buffer without intermediate copies,
+         * header is reserved before body and gets body size when body is written
+         * @return false when packet can't be stored and connection was disconnected
+         */
+        template<typename T>
+        bool serialize_message(chained_buffer& buffer, const T& t)
+        {
+            char* header = begin_message(buffer);
+            if (!header) return false;
+            int body_start = buffer.size();
 
-        void copy_send_buffer(const char* buf, int size);
+            try
+            {
+                archive::ed2k_oarchive oa(m_send_stream);
+                oa << const_cast<T&>(t);
+            }
+            catch(libed2k_exception& e)
+            {
+                ERR("packet serialization error " << e.what() << " ==> " << m_remote);
+                disconnect(e.error());
+                return false;
+            }
+
+            // body wasn't stored completely - truncated packet must not go out under full size header
+            if (!m_send_stream)
+            {
+                ERR("packet serialization error: out of send buffers ==> " << m_remote);
+                disconnect(errors::no_memory);
+                return false;
+            }
+
+            libed2k_header h;
+            h.m_protocol = packet_type<T>::protocol;
+            // packet size without protocol type and packet body size field plus one byte for opcode
+            h.m_size = body_size(t, size_t(buffer.size() - body_start)) + 1;
+            h.m_type = packet_type<T>::value;
+            std::memcpy(header, &h, header_size);
+            return true;
+        }
 
         template <class Destructor>
         void append_send_buffer(char* buffer, int size, Destructor const& destructor)
         { m_send_buffer.append_buffer(buffer, size, size, destructor); }
 
+        /**
+         * socket belongs to io_service of connection shard, so operations on it are started
+         * there and handlers are called back on network thread
+         * @param some read any available bytes instead of whole buffer
+         */
+        typedef boost::function<void (const error_code&, std::size_t)> io_handler;
+        void async_read(char* buffer, int size, bool some, const io_handler& handler);
+        void async_connect(const boost::function<void (const error_code&)>& handler);
+
+        /**
+         * queues block which is spliced from pipe to socket after everything
+         * appended before it, socket must be plain TCP
+         */
+        void append_send_pipe(const boost::intrusive_ptr<block_pipe>& pipe);
+
         int send_buffer_size() const { return m_send_buffer.size(); }
         int send_buffer_capacity() const { return m_send_buffer.capacity(); }
 
+        /** bytes waiting to be sent - buffers and pipes */
+        int send_queue_size() const { return m_send_buffer.size() + m_send_pipes.bytes(); }
+        bool send_queue_empty() const { return m_send_buffer.empty() && m_send_pipes.empty(); }
+
         virtual void on_timeout(const error_code& e);
         virtual void on_sent(const error_code& e, std::size_t bytes_transferred) = 0;
 
         /**
-         * call when socket got packets header
+         * output stream buffer which appends data to chained buffer in place,
+         * new pooled send buffers are chained when last one is full
+         */
+        class send_streambuf : public std::streambuf
+        {
+        public:
+            send_streambuf(aux::session_impl& ses) : m_ses(ses), m_target(NULL) {}
+            void target(chained_buffer* buffer) { m_target = buffer; }
+
+            /** contiguous size bytes at the end of target, null when out of memory */
+            char* allocate(int size);
+        protected:
+            virtual std::streamsize xsputn(const char* s, std::streamsize n);
+            virtual int_type overflow(int_type c);
+        private:
+            aux::session_impl& m_ses;
+            chained_buffer* m_target;
+        };
+
+        /**
+         * prepares stream to write packet body into buffer
+         * @return place of packet header or null when connection was disconnected
+         */
+        char* begin_message(chained_buffer& buffer);
+
+        /**
+         * call when socket got packets header, runs on connection shard
          */
         void on_read_header(const error_code& error, size_t nSize);
 
         /**
-         * call when socket got packets body and call users call back
+         * call when socket got packets body, runs on connection shard and inflates packed body
          */
         void on_read_packet(const error_code& error, size_t nSize);
 
+        /**
+         * dispatch of received packet to users call back on network thread
+         * @param valid false when packed body can't be inflated
+         */
+        void on_packet(bool valid, size_t nSize);
+
+        /**
+         * corks connection while packet handler runs, clears cork and flushes
+         * collected messages on scope exit also when handler throws
+         */
+        class cork
+        {
+        public:
+            explicit cork(base_connection& c) : m_connection(c) { m_connection.m_corked = true; }
+            ~cork()
+            {
+                m_connection.m_corked = false;
+                m_connection.do_write();
+            }
+        private:
+            base_connection& m_connection;
+        };
+
         /**
          * order write handler - executed while message order not empty
          */
         void on_write(const error_code& error, size_t nSize);
 
+        /**
+         * pipe write handler, pipe at front of queue has gone partially or at all
+         */
+        void on_pipe_write(const error_code& error, size_t nSize);
+
         /**
          * deadline timer handler
          */
         void check_deadline();
 
+        // operations executed on connection shard
+        void read_header();
+        void start_write(chained_buffer::iovec_range buffers);
+        void start_pipe_write(boost::intrusive_ptr<block_pipe> pipe, int size);
+        void on_pipe_writable(const error_code& error, boost::intrusive_ptr<block_pipe> pipe, int size);
+        void start_read(char* buffer, int size, bool some, const io_handler& handler);
+        void start_connect(const boost::function<void (const error_code&)>& handler);
+        static void close_socket(boost::shared_ptr<socket_type> s);
+        void set_max_inflated_size(int size) { m_max_inflated_size = size; }
+        void on_io(const error_code& error, std::size_t nSize, const io_handler& handler);
+
         /**
          * will call from external handlers for extract buffer into structure
          * on error return false
@@ -115,22 +254,17 @@ namespace libed2k{
         template<typename T>
         bool decode_packet(T& t)
         {
-            try
+            if (!m_in_container.empty())
             {
-                if (!m_in_container.empty())
+                archive::ed2k_iarchive ia(&m_in_container[0], m_in_container.size());
+                ia >> t;
+
+                if (ia.error())
                 {
-                    boost::iostreams::stream_buffer<base_connection::Device> buffer(
-                        &m_in_container[0], m_in_header.m_size - 1);
-                    std::istream in_array_stream(&buffer);
-                    archive::ed2k_iarchive ia(in_array_stream);
-                    ia >> t;
+                    DBG("Error on conversion " << ia.error().message());
+                    return (false);
                 }
             }
-            catch(libed2k_exception& e)
-            {
-                DBG("Error on conversion " << e.what());
-                return (false);
-            }
 
             return (true);
         }
@@ -144,24 +278,62 @@ namespace libed2k{
         { return boost::intrusive_ptr<const Self>((const Self*)this); }
 
         /**
-         * handler on receive data packet
-         * @param read data buffer
+         * handler on receive data packet, packet is decoded from m_in_container
          * @param error code
          */
-        typedef boost::function<void (const error_code&)> packet_handler;
+        typedef void (base_connection::*packet_handler)(const error_code&);
 
-        // handler storage type - first argument opcode + protocol
-        typedef std::map<std::pair<proto_type, proto_type>, packet_handler> handler_map;
+        /**
+         * handlers of connection class indexed by protocol and opcode,
+         * one table is built for class and shared by all its connections
+         */
+        class handler_table
+        {
+        public:
+            handler_table();
+
+            template<typename Connection>
+            void add(std::pair<proto_type, proto_type> ptype, void (Connection::*handler)(const error_code&))
+            {
+                int index = protocol_index(ptype.second);
+                LIBED2K_ASSERT(index >= 0);
+                m_handlers[index][ptype.first] = static_cast<packet_handler>(handler);
+            }
 
-        void add_handler(std::pair<proto_type, proto_type> ptype, packet_handler handler);
+            /** @return null when packet has no handler or unknown protocol */
+            packet_handler find(proto_type type, proto_type protocol) const
+            {
+                int index = protocol_index(protocol);
+                return index < 0 ? NULL : m_handlers[index][type];
+            }
+
+        private:
+            // packed packets are unpacked emule extension packets
+            static int protocol_index(proto_type protocol)
+            {
+                switch (protocol)
+                {
+                    case OP_EDONKEYPROT: return 0;
+                    case OP_EMULEPROT:
+                    case OP_PACKEDPROT: return 1;
+                    default: return -1;
+                }
+            }
+
+            packet_handler m_handlers[2][256];
+        };
 
         aux::session_impl& m_ses;
-        boost::shared_ptr<tcp::socket> m_socket;
+        boost::shared_ptr<socket_type> m_socket;
+        io_service& m_io;              //!< io_service of connection shard, owner of socket
         deadline_timer m_deadline;     //!< deadline timer for reading operations
         libed2k_header m_in_header;    //!< incoming message header
         socket_buffer m_in_container; //!< buffer for incoming messages
         socket_buffer m_in_gzip_container; //!< buffer for compressed data
         chained_buffer m_send_buffer;  //!< buffer for outgoing messages
+        pipe_queue m_send_pipes;       //!< spliced blocks between send buffer bytes
+        send_streambuf m_send_streambuf;
+        std::ostream m_send_stream;    //!< packets serialization stream over m_send_streambuf
         tcp::endpoint m_remote;
 
         // upload and download channel state
@@ -171,7 +343,18 @@ namespace libed2k{
         // to the list of connections that will be closed.
         bool m_disconnecting;
 
-        handler_map m_handlers;
+        // network thread view of socket state, socket itself is
+        // used on connection shard only
+        bool m_socket_open;
+
+        // copy of settings for connection shard, only used there
+        int m_max_inflated_size;
+
+        // set while received packet is handled - messages written by handler
+        // are collected in send buffer and go out by one gather write
+        bool m_corked;
+
+        const handler_table* m_handlers;   //!< set by derived class
 
         // statistics about upload and download speeds
         // and total amount of uploads and downloads for
@@ -0,0 +1,52 @@
+
+#ifndef __LIBED2K_BLOCK_PIPE__
+#define __LIBED2K_BLOCK_PIPE__
+
+#include <boost/noncopyable.hpp>
+
+#include "libed2k/config.hpp"
+#include "libed2k/size_type.hpp"
+#include "libed2k/error_code.hpp"
+#include "libed2k/intrusive_ptr_base.hpp"
+
+namespace libed2k
+{
+    /**
+      * kernel pipe which carries one block from file to socket by splice(), data
+      * never comes into user space. Disk thread fills pipe, so waiting for disk
+      * stays there, connection shard drains it into socket. Linux only, pipe
+      * can't be created on other systems
+     */
+    class block_pipe : public intrusive_ptr_base<block_pipe>, boost::noncopyable
+    {
+    public:
+        /**
+          * pipe big enough for size bytes, fails when system limits pipe size
+         */
+        block_pipe(int size, error_code& ec);
+        ~block_pipe();
+
+        /**
+          * moves size bytes at offset of file into pipe, blocks while they are read
+          * @return false on error or when file ends before
+         */
+        bool fill(int fd, size_type offset, error_code& ec);
+
+        /**
+          * moves up to size bytes into non-blocking socket
+          * @return bytes sent, would_block error when socket buffer is full
+         */
+        int send(int socket, int size, error_code& ec);
+
+        /**
+          * bytes left in pipe
+         */
+        int size() const { return m_size; }
+    private:
+        int m_fds[2];
+        int m_capacity;
+        int m_size;
+    };
+}
+
+#endif
@@ -92,7 +92,33 @@ namespace libed2k
 		// enough room, returns 0
 		char* allocate_appendix(int s);
 
-		std::list<asio::const_buffer> const& build_iovec(int to_send);
+		// moves all buffers of c to the end of this chain,
+		// c is left empty
+		void splice(chained_buffer& c);
+
+		// asio doesn't pass more buffers than this to one
+		// gather write anyway
+		enum { max_iovec = 64 };
+
+		// buffer sequence of one gather write. It refers to the
+		// iovec array of the chained buffer, so it's cheap to copy
+		// and stays valid until the next build_iovec() call
+		struct iovec_range
+		{
+			typedef asio::const_buffer value_type;
+			typedef asio::const_buffer const* const_iterator;
+
+			iovec_range(const_iterator b, const_iterator e): m_begin(b), m_end(e) {}
+			const_iterator begin() const { return m_begin; }
+			const_iterator end() const { return m_end; }
+		private:
+			const_iterator m_begin;
+			const_iterator m_end;
+		};
+
+		// gathers up to to_send bytes from the front of the chain,
+		// fewer when the chain is split into more than max_iovec buffers
+		iovec_range build_iovec(int to_send);
 
 		~chained_buffer();
 
@@ -112,8 +138,8 @@ namespace libed2k
 		int m_capacity;
 
 		// this is the vector of buffers used when
-		// invoking the async write call
-		std::list<asio::const_buffer> m_tmp_vec;
+		// invoking the async write call, reused by every call
+		asio::const_buffer m_tmp_vec[max_iovec];
 
 #if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
 		bool m_destructed;
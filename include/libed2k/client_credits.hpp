@@ -0,0 +1,126 @@
+
+#ifndef __LIBED2K_CLIENT_CREDITS__
+#define __LIBED2K_CLIENT_CREDITS__
+
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+#include "libed2k/file.hpp"
+
+namespace libed2k
+{
+    const size_t SECURE_IDENT_KEY_SIZE = 80;
+
+    /**
+      * transfer totals with one remote client, eMule clients.met entry layout
+     */
+    struct credit_entry
+    {
+        md4_hash        m_hKey;             //!< client user hash
+        boost::uint32_t m_nUploadedLo;      //!< uploaded to client
+        boost::uint32_t m_nDownloadedLo;    //!< downloaded from client
+        boost::uint32_t m_nLastSeen;
+        boost::uint32_t m_nUploadedHi;
+        boost::uint32_t m_nDownloadedHi;
+        boost::uint16_t m_nReserved;
+        boost::uint8_t  m_nKeySize;         //!< secure ident public key, kept for compatibility
+        boost::uint8_t  m_abySecureIdent[SECURE_IDENT_KEY_SIZE];
+
+        credit_entry();
+        explicit credit_entry(const md4_hash& hash);
+
+        size_type uploaded() const;
+        size_type downloaded() const;
+        void add_uploaded(size_type bytes);
+        void add_downloaded(size_type bytes);
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & m_hKey;
+            ar & m_nUploadedLo;
+            ar & m_nDownloadedLo;
+            ar & m_nLastSeen;
+            ar & m_nUploadedHi;
+            ar & m_nDownloadedHi;
+            ar & m_nReserved;
+            ar & m_nKeySize;
+
+            for (size_t n = 0; n < SECURE_IDENT_KEY_SIZE; ++n)
+                ar & m_abySecureIdent[n];
+        }
+    };
+
+    /**
+      * full clients.met file content
+     */
+    struct credit_file
+    {
+        boost::uint8_t m_nVersion;
+        container_holder<boost::uint32_t, std::vector<credit_entry> > m_entries;
+
+        credit_file();
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & m_nVersion;
+            if (m_nVersion != CREDITFILE_VERSION)
+                throw libed2k_exception(errors::met_file_invalid_header_byte);
+            ar & m_entries;
+        }
+    };
+
+    /**
+      * credits of remote clients keyed by user hash. Changes are saved to clients.met
+      * by batches, with empty file path credits live in memory only. Used by network thread only
+     */
+    class client_credits
+    {
+    public:
+        client_credits();
+
+        /**
+          * replace credits by file content, entries not seen for long time are dropped
+         */
+        void load(const std::string& filepath);
+
+        /**
+          * write file when credits were changed since last save
+         */
+        void save();
+
+        /**
+          * save changes when flush interval passed
+         */
+        void second_tick(ptime now);
+
+        void add_uploaded(const md4_hash& client, size_type bytes);
+        void add_downloaded(const md4_hash& client, size_type bytes);
+
+        /**
+          * @return NULL when client is unknown
+         */
+        const credit_entry* find(const md4_hash& client) const;
+
+        /**
+          * eMule credit modifier of upload queue score, from 1 to 10 -
+          * clients which gave us more than got from us are served first
+         */
+        double score_ratio(const md4_hash& client) const;
+
+        int size() const { return int(m_credits.size()); }
+    private:
+        typedef boost::unordered_map<md4_hash, credit_entry> credit_map;
+
+        credit_entry& entry(const md4_hash& client);
+
+        std::string m_filepath;
+        credit_map  m_credits;
+        bool        m_dirty;
+        ptime       m_last_save;
+    };
+}
+
+#endif
@@ -0,0 +1,59 @@
+
+#ifndef __LIBED2K_COMPRESSED_CACHE__
+#define __LIBED2K_COMPRESSED_CACHE__
+
+#include <list>
+#include <map>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include "libed2k/size_type.hpp"
+#include "libed2k/hasher.hpp"
+
+namespace libed2k
+{
+    /**
+      * zlib data of one uploaded block, empty when block isn't worth compression
+     */
+    typedef boost::shared_ptr<const std::vector<char> > compressed_block;
+
+    /**
+      * LRU of compressed upload blocks - blocks of hot files are requested by many peers,
+      * so each one is compressed once. Used by network thread only
+     */
+    class compressed_cache
+    {
+    public:
+        compressed_cache(int limit);
+
+        /**
+          * @return cached block or NULL pointer
+         */
+        compressed_block find(const md4_hash& hash, size_type offset, int length);
+        void insert(const md4_hash& hash, size_type offset, int length, const compressed_block& block);
+
+        void set_limit(int limit);
+        int size() const { return int(m_index.size()); }
+    private:
+        struct key
+        {
+            md4_hash    hash;
+            size_type   offset;
+            int         length;
+
+            bool operator<(const key& k) const;
+        };
+
+        typedef std::list<std::pair<key, compressed_block> > lru_list;
+        typedef std::map<key, lru_list::iterator> index_map;
+
+        static key mk_key(const md4_hash& hash, size_type offset, int length);
+        void trim();
+
+        int         m_limit;    //!< max blocks count
+        lru_list    m_lru;      //!< most recently used first
+        index_map   m_index;
+    };
+}
+
+#endif
@@ -436,6 +436,11 @@ namespace libed2k
 #define LIBED2K_USE_READV 1
 #endif
 
+// io_uring needs Linux 5.1 headers, so it's opt-in
+#ifndef LIBED2K_USE_IO_URING
+#define LIBED2K_USE_IO_URING 0
+#endif
+
 #ifndef LIBED2K_NO_FPU
 #define LIBED2K_NO_FPU 0
 #endif
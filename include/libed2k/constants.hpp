@@ -8,6 +8,7 @@ namespace libed2k
 {
     const size_type PIECE_SIZE = 9728000ull;
     const size_type BLOCK_SIZE = 256*1024;  // gcd(PIECE_SIZE, BLOCK_SIZE) / 2 = 10240;
+    const size_type AICH_BLOCK_SIZE = 184320ull;  // AICH hash tree leaf, 53 per full piece
     const size_t HIGHEST_LOWID_ED2K = 16777216;
     const size_t MAX_ED2K_PACKET_LEN = 2*BLOCK_SIZE;
     const size_t MAX_COLLECTION_SIZE = BLOCK_SIZE; // tentative collection size
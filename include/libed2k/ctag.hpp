@@ -826,7 +826,14 @@ void tag_list<size_type>::load(archive::ed2k_iarchive& ar)
     size_type nSize;
     ar & nSize;
 
-    for (size_t n = 0; n < nSize; n++)
+    // every tag takes at least two bytes - type and short name id
+    if (static_cast<size_t>(nSize) > ar.bytes_left() / 2)
+    {
+        ar.fail(errors::decode_packet_error);
+        return;
+    }
+
+    for (size_t n = 0; n < nSize && !ar.error(); n++)
     {
         // read tag header
         tg_type nType       = 0;
@@ -861,28 +868,7 @@ void tag_list<size_type>::load(archive::ed2k_iarchive& ar)
             // this tag must been passed
             boost::uint16_t nLength;
             ar & nLength;
-
-#ifdef WIN32
-			// windows generates exceptions independent by exceptions flags in stream
-			try
-			{
-                ar.container().seekg((nLength/8) + 1, std::ios::cur);
-			}
-			catch(std::ios_base::failure&)
-			{
-				throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-			}
-#else
-			ar.container().seekg((nLength/8) + 1, std::ios::cur);
-#endif
-
-
-            // check status
-            if (!ar.container().good())
-            {
-                throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-            }
-
+            ar.skip((nLength/8) + 1);
             continue;
         }
 
@@ -890,27 +876,7 @@ void tag_list<size_type>::load(archive::ed2k_iarchive& ar)
         if (nType == TAGTYPE_BSOB) {
             uint8_t len;
             ar & len;
-
-#ifdef WIN32
-            // windows generates exceptions independent by exceptions flags in stream
-            try
-            {
-                ar.container().seekg((len), std::ios::cur);
-            }
-            catch (std::ios_base::failure&)
-            {
-                throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-            }
-#else
-            ar.container().seekg((len), std::ios::cur);
-#endif
-
-            // check status
-            if (!ar.container().good())
-            {
-                throw libed2k::libed2k_exception(libed2k::errors::unexpected_istream_error);
-            }
-
+            ar.skip(len);
             continue;
         }
 
@@ -960,8 +926,8 @@ void tag_list<size_type>::load(archive::ed2k_iarchive& ar)
                 m_container.push_back(value_type(new string_tag(static_cast<tg_types>(nType), strName, nNameId)));
                 break;
         default:
-            throw libed2k_exception(errors::invalid_tag_type);
-            break;
+            ar.fail(errors::invalid_tag_type);
+            return;
         };
 
         ar & *m_container.back();
@@ -89,6 +89,9 @@ namespace libed2k
 
         void free_buffer_impl(char* buf, mutex::scoped_lock& l);
 
+        // m_settings is read under the pool mutex
+        void set_settings(session_settings const& s);
+
         // number of bytes per block. The ED2K
         // protocol defines the block size to BLOCK_SIZE.
         const int m_block_size;
@@ -45,11 +45,16 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/optional.hpp>
 #include <deque>
 #include <list>
+#include <map>
 
 #include <libed2k/config.hpp>
 #include <libed2k/thread.hpp>
 #include <libed2k/disk_buffer_pool.hpp>
+#include <libed2k/file_mapping.hpp>
+#include <libed2k/block_pipe.hpp>
 #include <libed2k/constants.hpp>
+#include <libed2k/uring_storage.hpp>
+#include <libed2k/read_cache.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/member.hpp>
@@ -106,12 +111,20 @@ namespace libed2k
             , read_and_hash
             , cache_piece
             , finalize_file
+            , aich_hash
+            , read_pipe
         };
 
         action_t action;
 
         char* buffer;
         int buffer_size;
+        // when set, a read job's buffer points into this file mapping
+        // rather than to a disk buffer, and must not be freed
+        boost::intrusive_ptr<file_mapping> mapping;
+        // set when read_pipe job delivers the block in a pipe, otherwise
+        // the job falls back to read and returns a buffer
+        boost::intrusive_ptr<block_pipe> pipe;
         boost::intrusive_ptr<piece_manager> storage;
         // arguments used for read and write
         int piece, offset;
@@ -164,6 +177,8 @@ namespace libed2k
             , queued_bytes(0)
             , cache_size(0)
             , read_cache_size(0)
+            , read_cache_hot_size(0)
+            , ghost_hits(0)
             , total_used_buffers(0)
             , average_queue_time(0)
             , average_read_time(0)
@@ -204,6 +219,14 @@ namespace libed2k
         // the number of blocks in the cache used for read cache
         int read_cache_size;
 
+        // the part of read_cache_size in pieces which were read more than
+        // once, the rest is probationary and is evicted first
+        int read_cache_hot_size;
+
+        // pieces which were read again shortly after they were evicted
+        // and went straight to the hot part of the read cache
+        size_type ghost_hits;
+
         // the total number of blocks that are currently in use
         // this includes send and receive buffers
         mutable int total_used_buffers;
@@ -224,10 +247,40 @@ namespace libed2k
         boost::uint32_t cumulative_sort_time;
         int total_read_back;
         int read_queue_size;
+
+        // read cache hits of every transfer which has read something
+        std::vector<transfer_cache_status> transfers;
+    };
+
+    // queue and accounting of jobs served by the worker of one device
+    struct disk_device_status
+    {
+        disk_device_status()
+            : device(0)
+            , job_queue_length(0)
+            , read_queue_size(0)
+            , queued_bytes(0)
+            , jobs(0)
+            , blocks_read(0)
+            , blocks_written(0)
+        {}
+
+        // id of the device as reported by stat(), 0 for the default worker
+        boost::uint64_t device;
+        int job_queue_length;
+        int read_queue_size;
+        // bytes of write jobs waiting in this queue
+        size_type queued_bytes;
+        // the number of jobs completed
+        size_type jobs;
+        // blocks served by read jobs and taken by write jobs
+        size_type blocks_read;
+        size_type blocks_written;
     };
 
-    // this is a singleton consisting of the thread and a queue
-    // of disk io jobs
+    // this is a singleton consisting of the disk io job queues,
+    // one per storage device, each served by its own thread. All
+    // the queues share the buffer pool and the block cache
     struct LIBED2K_EXTRA_EXPORT disk_io_thread : disk_buffer_pool
     {
         disk_io_thread(io_service& ios
@@ -258,8 +311,7 @@ namespace libed2k
             , std::vector<cached_piece_info>& ret) const;
 
         cache_status status() const;
-
-        void thread_fun();
+        void device_status(std::vector<disk_device_status>& ret) const;
 
 #ifdef LIBED2K_DEBUG
         void check_invariant() const;
@@ -272,6 +324,9 @@ namespace libed2k
             // or 0
             char* buf;
 
+            // bytes of the block copied out of the read cache
+            copied_range copied;
+
             // callback for when this block is flushed to disk
             boost::function<void(int, disk_io_job const&)> callback;
         };
@@ -296,6 +351,9 @@ namespace libed2k
             // is used to determine if flushing a range would force us
             // to read it back later when hashing
             int next_block_to_hash;
+            // read cache only. A piece enters the cache probationary and
+            // becomes hot when bytes of one of its blocks are read again
+            bool hot;
 
             std::pair<void*, int> storage_piece_pair() const
             { return std::pair<void*, int>(storage.get(), piece); }
@@ -315,13 +373,69 @@ namespace libed2k
 
     private:
 
+        typedef std::multimap<size_type, disk_io_job> read_jobs_t;
+
+        // jobs of all the storages living on one device. Storages are
+        // bound to a device when created, so the jobs of one storage are
+        // always served in order by the same thread
+        struct device_queue
+        {
+            device_queue(boost::uint64_t dev, session_settings const& s);
+
+            boost::uint64_t device;
+            // the worker's copy of the settings, updated in order with
+            // its jobs. The storages of the device read it too
+            session_settings settings;
+            condition signal;
+            bool abort;
+            std::deque<disk_io_job> jobs;
+            // read jobs sorted by physical offset, served by the elevator
+            read_jobs_t sorted_read_jobs;
+            size_type queue_buffer_size;
+            libed2k::ptime last_file_check;
+            // when completion notifications are queued, they're stuck
+            // in this list
+            std::list<std::pair<disk_io_job, int> > queued_completions;
+            disk_device_status stats;
+#if LIBED2K_USE_IO_URING
+            // only the worker submits to it
+            io_ring ring;
+#endif
+            boost::shared_ptr<thread> worker;
+        };
+
+        void thread_fun(device_queue& q);
+
+        // publishes s to the cache and the file pool and queues a copy
+        // for every worker. Must be called with m_queue_mutex held
+        void publish_settings(session_settings const& s, mutex::scoped_lock& l);
+        // settings which take effect per thread, every worker
+        // applies them for itself
+        void apply_thread_settings(session_settings const& s);
+
+        // returns the queue of the storage's device, starting its
+        // worker on first use. Must be called with m_queue_mutex held
+        device_queue& queue_for(piece_manager const* s);
+
         int add_job(disk_io_job const& j
             , mutex::scoped_lock& l
             , boost::function<void(int, disk_io_job const&)> const& f
             = boost::function<void(int, disk_io_job const&)>());
 
         bool test_error(disk_io_job& j);
-        void post_callback(disk_io_job const& j, int ret);
+
+        // points the read job at mapped file memory when its storage
+        // supports it and the block has no dirty copy in the cache
+        bool try_map_block(disk_io_job& j);
+        bool try_pipe_block(disk_io_job& j);
+
+        // write cache may hold newer data of the block than the file
+        bool has_dirty_block(disk_io_job const& j);
+        void post_callback(device_queue& q, disk_io_job const& j, int ret);
+        // moves hash jobs for the same storage from the front of the
+        // queue into batch, up to the number of hasher lanes
+        void take_hash_jobs(device_queue& q, disk_io_job const& j
+            , std::vector<disk_io_job>& batch);
 
         // cache operations
         cache_piece_index_t::iterator find_cached_piece(
@@ -340,11 +454,13 @@ namespace libed2k
             piece_manager* storage;
         };
 
-        // write cache operations
+        // write cache operations. A worker only evicts or flushes cache
+        // entries of its own device, since the cache mutex is released
+        // during disk I/O and entries of other devices may be in use
         enum options_t { dont_flush_write_blocks = 1, ignore_cache_size = 2 };
-        int flush_cache_blocks(mutex::scoped_lock& l
+        int flush_cache_blocks(mutex::scoped_lock& l, boost::uint64_t device
             , int blocks, ignore_t ignore = ignore_t(), int options = 0);
-        void flush_expired_pieces();
+        void flush_expired_pieces(boost::uint64_t device);
         int flush_contiguous_blocks(cached_piece_entry& p
             , mutex::scoped_lock& l, int lower_limit = 0, bool avoid_readback = false);
         int flush_range(cached_piece_entry& p, int start, int end, mutex::scoped_lock& l);
@@ -354,8 +470,8 @@ namespace libed2k
             , mutex::scoped_lock& l);
 
         // read cache operations
-        int clear_oldest_read_piece(int num_blocks, ignore_t ignore
-            , mutex::scoped_lock& l);
+        int clear_oldest_read_piece(boost::uint64_t device, int num_blocks
+            , ignore_t ignore, mutex::scoped_lock& l);
         int read_into_piece(cached_piece_entry& p, int start_block
             , int options, int num_blocks, mutex::scoped_lock& l);
         int cache_read_block(disk_io_job const& j, mutex::scoped_lock& l);
@@ -363,6 +479,11 @@ namespace libed2k
         int drain_piece_bufs(cached_piece_entry& p, std::vector<char*>& buf
             , mutex::scoped_lock& l);
 
+        // 2Q ghost list of pieces evicted while probationary
+        void remember_evicted(cached_piece_entry const& p);
+        bool was_evicted(disk_io_job const& j);
+        void count_read(disk_io_job const& j, bool hit);
+
         enum cache_flags_t {
             cache_only = 1
         };
@@ -371,16 +492,22 @@ namespace libed2k
         int cache_piece(disk_io_job const& j, cache_piece_index_t::iterator& p
             , bool& hit, int options, mutex::scoped_lock& l);
 
-        // this mutex only protects m_jobs, m_queue_buffer_size,
-        // m_exceeded_write_queue and m_abort
+        // this mutex only protects the device queues, m_devices,
+        // m_queue_buffer_size, m_exceeded_write_queue and m_abort.
+        // m_settings is written holding this mutex and m_piece_mutex
         mutable mutex m_queue_mutex;
-        event m_signal;
         bool m_abort;
         bool m_waiting_to_shutdown;
-        std::deque<disk_io_job> m_jobs;
+        // total of write jobs over all the device queues
         size_type m_queue_buffer_size;
 
-        libed2k::ptime m_last_file_check;
+        // device id -> its queue. Jobs without storage go to the
+        // default queue under device id 0
+        typedef std::map<boost::uint64_t, boost::shared_ptr<device_queue> > device_map_t;
+        device_map_t m_devices;
+        // workers which haven't quit yet, the last one to quit
+        // clears the cache
+        int m_running_workers;
 
         // this protects the piece cache and related members
         mutable mutex m_piece_mutex;
@@ -390,6 +517,9 @@ namespace libed2k
         // read cache
         cache_t m_read_pieces;
 
+        ghost_list m_ghost_pieces;
+        transfer_cache_stats m_transfer_stats;
+
         void flip_stats(libed2k::ptime now);
 
         // total number of blocks in use by both the read
@@ -420,9 +550,6 @@ namespace libed2k
         // latest value in m_cache_stats
         libed2k::ptime m_last_stats_flip;
 
-        typedef std::multimap<size_type, disk_io_job> read_jobs_t;
-        read_jobs_t m_sorted_read_jobs;
-
 #ifdef LIBED2K_DISK_STATS
         std::ofstream m_log;
 #endif
@@ -454,13 +581,6 @@ namespace libed2k
         // reference to the file_pool which is a member of
         // the session_impl object
         file_pool& m_file_pool;
-
-        // when completion notifications are queued, they're stuck
-        // in this list
-        std::list<std::pair<disk_io_job, int> > m_queued_completions;
-
-        // thread for performing blocking disk io operations
-        thread m_disk_io_thread;
     };
 
 }
@@ -5,10 +5,12 @@
 #include <string>
 #include <vector>
 #include <deque>
+#include <map>
 
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "libed2k/config.hpp"
 #include "libed2k/error_code.hpp"
@@ -18,6 +20,7 @@
 #include "libed2k/hasher.hpp"
 #include "libed2k/packet_struct.hpp"
 #include "libed2k/alert_types.hpp"
+#include "libed2k/time.hpp"
 
 namespace libed2k
 {
@@ -143,6 +146,11 @@ namespace libed2k
                             boost::uint64_t nTransferred,
                             boost::uint8_t  nPriority);
 
+        /**
+          * entry for just hashed file, tags are taken from params instead of disk
+         */
+        known_file_entry(const add_transfer_params& atp, boost::uint32_t nLastChanged);
+
         template<typename Archive>
         void serialize(Archive& ar)
         {
@@ -157,16 +165,54 @@ namespace libed2k
 
     typedef container_holder<boost::uint32_t, std::deque<known_file_entry> > known_file_list;
 
+    /**
+      * known file lookup key - file name without path and BOM, last change time and size
+     */
+    struct known_file_key
+    {
+        known_file_key(const std::string& name, boost::uint32_t changed, size_type size);
+        explicit known_file_key(const known_file_entry& entry);
+        bool operator==(const known_file_key& key) const;
+
+        std::string     m_name;
+        boost::uint32_t m_changed;
+        size_type       m_size;
+    };
+
+    std::size_t hash_value(const known_file_key& key);
+
+    /**
+      * move file over existing one, met files are written to temporary file and replaced by it
+     */
+    void replace_file(const std::string& from, const std::string& to, error_code& ec);
+
     /**
       * full known.met file content
      */
     struct known_file_collection
     {
+        typedef boost::unordered_map<known_file_key, size_t> known_file_index;
+
         met_file_header     m_header;
         known_file_list     m_known_file_list;
+        known_file_index    m_index;    //!< entry position in list, isn't serialized
 
         known_file_collection();
-        add_transfer_params extract_transfer_params(time_t, const std::string&);
+
+        /**
+          * rebuild lookup index, call after collection was loaded
+         */
+        void build_index();
+
+        /**
+          * @return params with undefined hash when file isn't known or was changed
+         */
+        add_transfer_params extract_transfer_params(time_t, size_type, const std::string&);
+
+        /**
+          * add entry for hashed file or replace entry with same key
+         */
+        void append(const add_transfer_params& atp, time_t write_ts);
 
         template<typename Archive>
         void serialize(Archive& ar)
@@ -215,22 +261,62 @@ namespace libed2k
         }
     };
 
+    /**
+      * hash file from disk, blocks are read by separate thread into ring of buffers
+      * while previous blocks are hashed, so disk and CPU work together
+     */
     struct file2atp : public std::binary_function<const std::string&, bool&, std::pair<add_transfer_params, error_code> >
     {
+        enum { pipeline_depth = 2 };    //!< read buffers in ring
+        enum { step_bytes = 16*1024*1024 }; //!< read by one step over all pieces of group
+
+        file2atp() : read_time(seconds(0)), hash_time(seconds(0)) {}
         std::pair<add_transfer_params, error_code> operator()(const std::string&, const bool&);
+
+        time_duration read_time;    //!< time spent in disk reads by last call
+        time_duration hash_time;    //!< time spent in hasher by last call
+    };
+
+    /**
+      * hashing pool counters, rates are averaged over time when pool had active workers
+     */
+    struct hashing_status
+    {
+        hashing_status() : workers(0), active(0), queued(0),
+            total_files(0), total_bytes(0), files_rate(0), bytes_rate(0),
+            read_time(0), hash_time(0)
+        {}
+
+        int         workers;        //!< hashing threads in pool
+        int         active;         //!< threads hashing file right now
+        int         queued;         //!< files wait in order
+        size_type   total_files;    //!< files were hashed
+        size_type   total_bytes;    //!< bytes were hashed
+        float       files_rate;     //!< files per second
+        size_type   bytes_rate;     //!< bytes per second
+        size_type   read_time;      //!< milliseconds threads spent reading files
+        size_type   hash_time;      //!< milliseconds threads spent hashing data
     };
 
     class transfer_params_maker
     {
     public:
-        transfer_params_maker(alert_manager& am, const std::string& known_filepath);
+        /**
+          * @param workers count of hashing threads
+          * @param io_per_device max files hashed simultaneously from one device, zero means no limit
+         */
+        transfer_params_maker(alert_manager& am, const std::string& known_filepath,
+            int workers = 1, int io_per_device = 1);
         virtual ~transfer_params_maker();
         bool start();
         void stop();
-        void operator()();
 
         size_t order_size();
+        /**
+          * @return one of files in progress or empty string when all workers are idle
+         */
         std::string current_filepath();
+        hashing_status status() const;
 
         /**
           * @param filepath in UTF-8
@@ -238,21 +324,93 @@ namespace libed2k
         void make_transfer_params(const std::string& filepath);
         void cancel_transfer_params(const std::string& filepath);
     protected:
-        virtual void process_item();
+        /**
+          * executed in worker thread, must post transfer_params_alert for filepath
+          * @param cancel becomes true when file was cancelled or maker is stopping
+         */
+        virtual void process_item(const std::string& filepath, const bool& cancel);
+        void on_file_hashed(size_type bytes, time_duration read_time, time_duration hash_time);
         alert_manager&      m_am;
-        mutable bool        m_abort;                //!< cancel thread
-        mutable bool        m_abort_current;       //!< cancel one file
-        std::string         m_current_filepath;     //!< current file path
     private:
+        struct order_entry
+        {
+            std::string     m_filepath;
+            boost::uint64_t m_device;
+            bool            m_resolved;     //!< device is known, file was stat'ed by worker
+        };
+
+        struct worker_slot
+        {
+            worker_slot() : m_device(0), m_resolving(false), m_abort(false), m_cancels(0) {}
+            std::string     m_filepath;     //!< current file path
+            boost::uint64_t m_device;
+            bool            m_resolving;    //!< file is stat'ed to find its device, not hashed
+            bool            m_abort;        //!< cancel current file
+            int             m_cancels;      //!< cancel alerts to post when current file is done
+        };
+
+        enum { checkpoint_files = 100 };        //!< save known file after this count of new files
+        enum { checkpoint_interval = 60 };      //!< or after this count of seconds
+
+        void worker(int index);
+        void load_known_file();
+
+        /**
+          * add hashed file to known collection and save collection when checkpoint came
+         */
+        void remember_file(const add_transfer_params& atp, time_t write_ts);
+
+        /**
+          * append files hashed after last save to known file, or rewrite it when it
+          * wasn't loaded. Serialization and disk writes go out of collection lock
+         */
+        void save_known_file();
+
+        /**
+          * write entries after last counted entry, sync, then write new entries count
+          * in header. Crash before count is written leaves tail which loader doesn't read
+         */
+        void append_known_file(const std::deque<known_file_entry>& entries, error_code& ec);
+
+        /**
+          * write collection to temporary file, sync it and replace known file by rename
+         */
+        void write_known_file(const known_file_collection& kfc, error_code& ec);
+        bool pop_order(worker_slot& slot);
+        void release_slot(worker_slot& slot);
+
         std::string m_known_filepath;
         known_file_collection m_kfc;
-        boost::shared_ptr<boost::thread> m_thread;
-
-        boost::mutex m_mutex;
-        std::deque<std::string>    m_order;
+        boost::mutex m_kfc_mutex;
+        std::deque<known_file_entry> m_kfc_pending; //!< files added after last save
+        ptime       m_kfc_saved;                //!< last save time
+        bool        m_kfc_loaded;
+
+        // known file on disk, guarded by m_kfc_save_mutex
+        boost::mutex m_kfc_save_mutex;
+        bool        m_kfc_rewrite;              //!< file is missing or broken, append is impossible
+        size_type   m_kfc_end;                  //!< offset after last counted entry
+        boost::uint32_t m_kfc_count;            //!< entries count in header
+        int         m_workers;
+        int         m_io_per_device;
+        bool        m_abort;                //!< cancel all threads
+        std::vector<boost::shared_ptr<boost::thread> > m_threads;
+        std::vector<worker_slot>    m_slots;
+        std::map<boost::uint64_t, int> m_device_load;  //!< active workers per device
+
+        mutable boost::mutex m_mutex;
+        std::deque<order_entry>    m_order;
         std::queue<std::string>    m_cancel_order;  //!< order for store signals to cancel after
         boost::condition           m_condition;
 
+        // throughput counters
+        int         m_active;
+        size_type   m_total_files;
+        size_type   m_total_bytes;
+        time_duration m_read_time;
+        time_duration m_hash_time;
+        ptime       m_busy_start;
+        time_duration m_busy_time;
     };
 
     /**
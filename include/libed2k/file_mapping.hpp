@@ -0,0 +1,45 @@
+
+#ifndef __LIBED2K_FILE_MAPPING__
+#define __LIBED2K_FILE_MAPPING__
+
+#include <boost/noncopyable.hpp>
+
+#include "libed2k/config.hpp"
+#include "libed2k/size_type.hpp"
+#include "libed2k/error_code.hpp"
+#include "libed2k/intrusive_ptr_base.hpp"
+
+namespace libed2k
+{
+    /**
+      * read-only shared mapping of file head. Blocks given out of it as send
+      * buffers hold the mapping by reference, so memory stays valid after
+      * storage remaps or closes the file
+     */
+    class file_mapping : public intrusive_ptr_base<file_mapping>, boost::noncopyable
+    {
+    public:
+#ifndef LIBED2K_WINDOWS
+        /**
+          * maps first size bytes of opened file
+         */
+        file_mapping(int fd, size_type size, error_code& ec);
+#endif
+        ~file_mapping();
+
+        char* data() const { return m_data; }
+        size_type size() const { return m_size; }
+    private:
+        char*       m_data;
+        size_type   m_size;
+    };
+
+    /**
+      * send buffer destructor of mapped block, file is unmapped with last reference
+     */
+    inline void release_mapped_block(char*, boost::intrusive_ptr<file_mapping>)
+    {
+    }
+}
+
+#endif
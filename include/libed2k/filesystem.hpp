@@ -91,6 +91,9 @@ namespace libed2k
         time_t atime;
         time_t mtime;
         time_t ctime;
+        // id of the device containing the file, used to
+        // group I/O of files living on the same disk
+        boost::uint64_t device;
         enum {
 #if defined LIBED2K_WINDOWS
             directory = _S_IFDIR,
@@ -120,6 +123,8 @@ namespace libed2k
     LIBED2K_EXPORT void remove_all(std::string const& f
         , error_code& ec);
     LIBED2K_EXPORT void remove(std::string const& f, error_code& ec);
+    // makes renames and new entries in directory durable, no-op on windows
+    LIBED2K_EXPORT void sync_directory(std::string const& f, error_code& ec);
     LIBED2K_EXPORT bool exists(std::string const& f);
     LIBED2K_EXPORT size_type file_size(std::string const& f);
     LIBED2K_EXPORT bool is_directory(std::string const& f
@@ -191,6 +196,9 @@ namespace libed2k
             no_atime = 16,
             random_access = 32,
             lock_file = 64,
+            // advise OS about sequential scan of whole file,
+            // read-ahead window is enlarged
+            sequential_access = 128,
 
             attribute_hidden = 0x1000,
             attribute_executable = 0x2000,
@@ -248,6 +256,9 @@ namespace libed2k
         size_type readv(size_type file_offset, iovec_t const* bufs, int num_bufs, error_code& ec);
         void hint_read(size_type file_offset, int len);
 
+        // waits until written data reaches the device
+        bool sync(error_code& ec);
+
         size_type get_size(error_code& ec) const;
 
         // return the offset of the first byte that
@@ -52,6 +52,18 @@ LIBED2K_EXTRA_EXPORT void MD4_Final(boost::uint8_t result[MD4_DIGEST_LENGTH], st
 
 namespace libed2k
 {
+    // SHA-1 for AICH hash trees, implemented in sha1.cpp
+    struct LIBED2K_EXTRA_EXPORT sha_ctx
+    {
+        boost::uint32_t state[5];
+        boost::uint32_t count[2];
+        boost::uint8_t buffer[64];
+    };
+
+    LIBED2K_EXTRA_EXPORT void SHA1_init(sha_ctx* context);
+    LIBED2K_EXTRA_EXPORT void SHA1_update(sha_ctx* context, boost::uint8_t const* data, boost::uint32_t len);
+    LIBED2K_EXTRA_EXPORT void SHA1_final(boost::uint8_t* digest, sha_ctx* context);
+
     class md4_hash {
         public:
             friend class archive::access;
@@ -130,6 +142,8 @@ namespace libed2k
             md4hash_container   m_hash;
         };
 
+    std::size_t hash_value(const md4_hash& hash);
+
 #if LIBED2K_USE_IOSTREAM
     inline std::ostream& operator<<(std::ostream& os, md4_hash const& peer)
     {
@@ -189,8 +203,75 @@ namespace libed2k
         }
 
 	private:
+		friend class multi_hasher;
 		MD4_CTX m_context;
 	};
+
+    class sha1_hasher
+    {
+    public:
+        sha1_hasher() { SHA1_init(&m_context); }
+        sha1_hasher(const char* data, int len)
+        {
+            LIBED2K_ASSERT(data != 0);
+            LIBED2K_ASSERT(len > 0);
+            SHA1_init(&m_context);
+            update(data, len);
+        }
+
+        void update(const char* data, int len)
+        {
+            LIBED2K_ASSERT(data != 0);
+            LIBED2K_ASSERT(len > 0);
+            SHA1_update(&m_context, reinterpret_cast<boost::uint8_t const*>(data), len);
+        }
+
+        sha1_hash final()
+        {
+            sha1_hash digest;
+            SHA1_final(digest.begin(), &m_context);
+            return digest;
+        }
+
+        void reset() { SHA1_init(&m_context); }
+    private:
+        sha_ctx m_context;
+    };
+
+    /**
+      * multi-buffer MD4 - hashes several independent streams at once in SSE2 or AVX2 lanes,
+      * the instruction set is selected at runtime. Every update call feeds all streams by
+      * equal amount of data, so it fits pieces of one file or pieces of one transfer
+     */
+    class multi_hasher
+    {
+    public:
+        enum { max_streams = 8 };
+
+        /**
+          * streams processed in one pass: 8 with AVX2, 4 with SSE2, 1 on other CPUs
+         */
+        static int lanes();
+
+        /**
+          * hash count buffers of len bytes each in one call, result[i] is hash of data[i]
+         */
+        static void hash(const char* const* data, int len, int count, md4_hash* result);
+
+        explicit multi_hasher(int streams);
+
+        /**
+          * continue stream from partial hash state, all streams must have
+          * hashed the same amount of data modulo 64 bytes
+         */
+        void assign(int stream, const hasher& h);
+        void update(const char* const* data, int len);
+        void final(md4_hash* result);
+        int streams() const { return m_streams; }
+    private:
+        int m_streams;
+        MD4_CTX m_context[max_streams];
+    };
 }
 
 #endif // LIBED2K_HASHER_HPP_INCLUDED
@@ -79,7 +79,7 @@ namespace libed2k
 #if !defined LIBED2K_LOGGING \
 		&& !defined LIBED2K_VERBOSE_LOGGING \
 		&& !defined LIBED2K_ERROR_LOGGING
-	private:
+	protected:
 #endif
 		// reference counter for intrusive_ptr
 		mutable boost::detail::atomic_count m_refs;
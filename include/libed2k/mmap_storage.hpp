@@ -0,0 +1,53 @@
+
+#ifndef __LIBED2K_MMAP_STORAGE__
+#define __LIBED2K_MMAP_STORAGE__
+
+#include "libed2k/config.hpp"
+
+#ifndef LIBED2K_WINDOWS
+
+#include <map>
+
+#include "libed2k/storage.hpp"
+#include "libed2k/file_mapping.hpp"
+#include "libed2k/thread.hpp"
+
+namespace libed2k
+{
+    /**
+      * default_storage which serves block reads as regions of files mapped into
+      * memory, so uploads take page cache pages instead of disk buffers and copies.
+      * Files are mapped on first read and remapped when they grow, writes and
+      * everything else go the default way. File truncated behind our back
+      * raises SIGBUS on access, so it suits read-mostly seeding of finished files
+     */
+    class mmap_storage : public default_storage
+    {
+    public:
+        mmap_storage(file_storage const& fs, file_storage const* mapped, std::string const& path
+            , file_pool& fp, std::vector<boost::uint8_t> const& file_prio);
+
+        bool map_block(int slot, int offset, int size, char*& data
+            , boost::intrusive_ptr<file_mapping>& mapping);
+
+        bool rename_file(int index, std::string const& new_filename);
+        bool release_files();
+        bool delete_files();
+        bool move_storage(std::string const& save_path);
+    private:
+        /**
+          * @return mapping which covers file up to end offset, null when file is shorter
+         */
+        boost::intrusive_ptr<file_mapping> file_map(file_storage::iterator fe, size_type end);
+        void unmap_files();
+
+        typedef std::map<int, boost::intrusive_ptr<file_mapping> > mapping_map;
+
+        mutex       m_mappings_mutex;
+        mapping_map m_mappings;     //!< by file index, send buffers may outlive entries
+    };
+}
+
+#endif
+
+#endif
@@ -16,6 +16,7 @@
 #include "libed2k/util.hpp"
 #include "libed2k/assert.hpp"
 #include "libed2k/hasher.hpp"
+#include "libed2k/aich.hpp"
 #include "libed2k/error_code.hpp"
 #include <sstream>
 
@@ -286,7 +287,8 @@ namespace libed2k
     const proto_type    OP_KADEMLIAHEADER       = 0xE4u;
     const proto_type    OP_KADEMLIAPACKEDPROT = 0xE5u;
 
-    #define SOURCE_EXCHG_LEVEL 0
+    #define SOURCE_EXCHG_LEVEL  4
+    #define SOURCE_EXCHG2_LEVEL 4
 
 
     /**
@@ -324,10 +326,12 @@ namespace libed2k
         {
             ar & m_size;
 
-            // avoid huge memory allocation
-            if (static_cast<size_t>(m_size) > MAX_COLLECTION_SIZE)
+            // avoid huge memory allocation, element takes at least one byte
+            if (static_cast<size_t>(m_size) > MAX_COLLECTION_SIZE ||
+                static_cast<size_t>(m_size) > ar.bytes_left())
             {
-                throw libed2k_exception(libed2k::errors::decode_packet_error);
+                ar.fail(libed2k::errors::decode_packet_error);
+                m_size = 0;
             }
 
             m_collection.resize(static_cast<size_t>(m_size));
@@ -533,6 +537,8 @@ namespace libed2k
 
     extern std::ostream& operator<<(std::ostream&, const net_identifier& np);
 
+    std::size_t hash_value(const net_identifier& np);
+
     /**
       * shared file item structure in offer list
      */
@@ -1260,6 +1266,116 @@ namespace libed2k
         }
     };
 
+    /**
+      * AICH tree node in recovery data, identifier is path from root to node
+     */
+    template<typename ident_type>
+    struct aich_hash_entry
+    {
+        ident_type  m_nIdent;
+        sha1_hash   m_hash;
+
+        aich_hash_entry() : m_nIdent(0) {}
+        aich_hash_entry(ident_type ident, const sha1_hash& hash) : m_nIdent(ident), m_hash(hash) {}
+
+        template<typename Archive>
+        void serialize(Archive& ar){
+            ar & m_nIdent & m_hash;
+        }
+    };
+
+    /**
+      * AICH recovery data of one part: nodes with 16 bit identifiers, then nodes
+      * which need 32 bit identifiers (deep trees of big files), old clients send first list only
+     */
+    struct aich_recovery_data
+    {
+        container_holder<boost::uint16_t, std::vector<aich_hash_entry<boost::uint16_t> > > m_hashes16;
+        container_holder<boost::uint16_t, std::vector<aich_hash_entry<boost::uint32_t> > > m_hashes32;
+
+        aich_recovery_data() {}
+        aich_recovery_data(const std::vector<aich_node_hash>& nodes);
+        std::vector<aich_node_hash> nodes() const;
+
+        template<typename Archive>
+        void save(Archive& ar)
+        {
+            ar & m_hashes16 & m_hashes32;
+        }
+
+        template<typename Archive>
+        void load(Archive& ar)
+        {
+            ar & m_hashes16;
+            if (ar.bytes_left() > 0) ar & m_hashes32;
+        }
+
+        LIBED2K_SERIALIZATION_SPLIT_MEMBER()
+    };
+
+    struct client_aich_request
+    {
+        md4_hash        m_hFile;
+        boost::uint16_t m_nPart;
+        sha1_hash       m_hMaster;
+
+        template<typename Archive>
+        void serialize(Archive& ar){
+            ar & m_hFile & m_nPart & m_hMaster;
+        }
+    };
+
+    /**
+      * answer without part and master hash means peer has no recovery data
+     */
+    struct client_aich_answer
+    {
+        md4_hash        m_hFile;
+        boost::uint16_t m_nPart;
+        sha1_hash       m_hMaster;
+        aich_recovery_data m_data;
+
+        client_aich_answer() : m_nPart(0) {}
+
+        template<typename Archive>
+        void save(Archive& ar)
+        {
+            ar & m_hFile;
+            if (!m_data.m_hashes16.m_collection.empty() || !m_data.m_hashes32.m_collection.empty())
+                ar & m_nPart & m_hMaster & m_data;
+        }
+
+        template<typename Archive>
+        void load(Archive& ar)
+        {
+            ar & m_hFile;
+            if (ar.bytes_left() > 0) ar & m_nPart & m_hMaster & m_data;
+        }
+
+        LIBED2K_SERIALIZATION_SPLIT_MEMBER()
+    };
+
+    struct client_aich_file_hash_request
+    {
+        md4_hash m_hFile;
+
+        template<typename Archive>
+        void serialize(Archive& ar){
+            ar & m_hFile;
+        }
+    };
+
+    struct client_aich_file_hash_answer
+    {
+        md4_hash  m_hFile;
+        sha1_hash m_hMaster;
+
+        template<typename Archive>
+        void serialize(Archive& ar){
+            ar & m_hFile & m_hMaster;
+        }
+    };
+
     struct client_start_upload
     {
         md4_hash m_hFile;
@@ -1442,11 +1558,7 @@ namespace libed2k
         {
             ar & m_list;
             m_captcha.resize(ar.bytes_left());
-
-            for(size_t n = 0; n < m_captcha.size(); ++n)
-            {
-                ar & m_captcha[n];
-            }
+            if (!m_captcha.empty()) ar.raw_read(reinterpret_cast<char*>(&m_captcha[0]), m_captcha.size());
         }
 
         LIBED2K_SERIALIZATION_SPLIT_MEMBER()
@@ -1530,19 +1642,37 @@ namespace libed2k
 
     struct sources_request: public sources_request_base{};
 
-    struct sources_request2: public sources_request_base{	// incomplete structure
-    	boost::uint8_t	option1;
-    	boost::uint16_t	option2;
+    struct sources_request2: public sources_request_base{
+        boost::uint8_t  version;    //!< max source exchange version requester understands
+        boost::uint16_t options;
+
+        sources_request2() : version(SOURCE_EXCHG2_LEVEL), options(0) {}
+
+        template<typename Archive>
+        void serialize(Archive& ar) {
+            ar & version & options & file_hash;
+        }
     };
 
+    /**
+      * source exchange entry, client id is ed2k id before version 3 and hybrid id
+      * (host order IP for HighID) since version 3
+     */
     struct sources_answer_element{
         net_identifier  client_id;
         net_identifier  server_id;
         md4_hash        client_hash;
-        boost::uint8_t  flag;   // something unknown
+        boost::uint8_t  flag;   // crypt options
         int sx_version;
 
         sources_answer_element(int version): flag(0u), sx_version(version){}
+
+        /**
+          * endpoint of HighID source, false for LowID source reachable by callback through its server only
+          * client id is ed2k id before version 3 and hybrid (host order) id since
+         */
+        bool source_endpoint(tcp::endpoint& ep) const;
+
         template<typename Archive>
         void serialize(Archive& ar) {
             ar & client_id & server_id;
@@ -1564,7 +1694,7 @@ namespace libed2k
         template<typename Archive>
         void load(Archive& ar) {
             ar & file_hash & size;
-            for (int i = 0; i < size; ++i){
+            for (int i = 0; i < size && !ar.error(); ++i){
                 sources_answer_element sae(sx_version);
                 ar & sae;
                 elems.push_back(sae);
@@ -1573,8 +1703,8 @@ namespace libed2k
 
         template<typename Archive>
         void save(Archive& ar) {
-            size = elems.size();
-            ar & file_hash;
+            size = static_cast<boost::uint16_t>(elems.size());
+            ar & file_hash & size;
             for(sae_container::iterator itr = elems.begin(); itr != elems.end(); ++itr){
                 ar & *itr;
             }
@@ -1587,8 +1717,28 @@ namespace libed2k
         sources_answer(int version): sources_answer_base(version){}
     };
 
+    /**
+      * source exchange 2 answer carries its version before file hash
+     */
     struct sources_answer2 : public sources_answer_base {
         sources_answer2(int version) : sources_answer_base(version) {}
+
+        template<typename Archive>
+        void load(Archive& ar) {
+            boost::uint8_t version;
+            ar & version;
+            sx_version = version;
+            sources_answer_base::load(ar);
+        }
+
+        template<typename Archive>
+        void save(Archive& ar) {
+            boost::uint8_t version = static_cast<boost::uint8_t>(sx_version);
+            ar & version;
+            sources_answer_base::save(ar);
+        }
+
+        LIBED2K_SERIALIZATION_SPLIT_MEMBER()
     };
 
     template<> struct packet_type<client_hello> {
@@ -1667,6 +1817,22 @@ namespace libed2k
         static const proto_type value = OP_HASHSETANSWER;
         static const proto_type protocol = OP_EDONKEYPROT;
     };
+    template<> struct packet_type<client_aich_request> {
+        static const proto_type value = OP_AICHREQUEST;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_answer> {
+        static const proto_type value = OP_AICHANSWER;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_file_hash_request> {
+        static const proto_type value = OP_AICHFILEHASHREQ;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_file_hash_answer> {
+        static const proto_type value = OP_AICHFILEHASHANS;
+        static const proto_type protocol = OP_EMULEPROT;
+    };
     template<> struct packet_type<client_start_upload> {
         static const proto_type value = OP_STARTUPLOADREQ;
         static const proto_type protocol = OP_EDONKEYPROT;
@@ -1892,12 +2058,20 @@ namespace libed2k
     typedef std::pair<libed2k_header, std::string> message;
 
     template <typename Struct>
-    inline size_t body_size(const Struct& s, const std::string& body)
-    { return body.size(); }
+    inline size_t body_size(const Struct& s, size_t body)
+    { return body; }
+
+    template<typename size_type>
+    inline size_t body_size(const client_sending_part<size_type>&s, size_t body)
+    { return body + s.m_end_offset - s.m_begin_offset; }
 
     template<typename size_type>
-    inline size_t body_size(const client_sending_part<size_type>&s, const std::string& body)
-    { return body.size() + s.m_end_offset - s.m_begin_offset; }
+    inline size_t body_size(const client_compressed_part<size_type>&s, size_t body)
+    { return body + s.m_compressed_size; }
+
+    template <typename Struct>
+    inline size_t body_size(const Struct& s, const std::string& body)
+    { return body_size(s, body.size()); }
 
 	template <typename T>
 	inline message make_message(const T& t)
@@ -14,7 +14,7 @@ namespace libed2k {
         peer(const tcp::endpoint& ep, bool conn, int src):
             endpoint(ep), connection(NULL), last_connected(0), next_connect(0),
             connectable(conn), seed(false), failcount(0), fast_reconnects(0),
-            trust_points(0), source(src)
+            trust_points(0), source(src), supports_utp(true)
 #ifndef LIBED2K_DISABLE_DHT
             , added_to_dht(false)
 #endif
@@ -66,6 +66,10 @@ namespace libed2k {
         // from peer_info.
         unsigned source;
 
+        // set to false when uTP connection attempt failed,
+        // next attempts to this peer go over TCP
+        bool supports_utp;
+
 #ifndef LIBED2K_DISABLE_DHT
         // this is set to true when this peer as been
         // pinged by the DHT
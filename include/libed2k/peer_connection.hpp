@@ -16,6 +16,8 @@
 #include "libed2k/peer_request.hpp"
 #include "libed2k/piece_picker.hpp"
 #include "libed2k/peer_info.hpp"
+#include "libed2k/compressed_cache.hpp"
+#include "libed2k/upload_queue.hpp"
 
 #define DECODE_PACKET(packet_struct, name)       \
     packet_struct name;                          \
@@ -30,10 +32,12 @@ namespace libed2k
     class md4_hash;
     class known_file;
     class transfer;
+    class session_settings;
     namespace aux{
         class session_impl;
     }
     struct disk_io_job;
+    class file_mapping;
 
     struct pending_block
     {
@@ -87,20 +91,62 @@ namespace libed2k
         { return pb.block == block; }
     };
 
-    class peer_connection : public base_connection
+    /**
+      * blocks to keep requested so the peer's bandwidth-delay product is covered:
+      * rate (bytes/s) over request_queue_time plus rtt (ms), clamped to
+      * [min_request_queue, max_out_request_queue] and at least one
+     */
+    int request_queue_depth(int rate, int rtt, const session_settings& settings);
+
+    /**
+      * other peer delivered the block in endgame: drop the request if it wasn't sent yet,
+      * otherwise mark it not_wanted - ed2k can't cancel single request
+      * returns false when block isn't requested at all
+     */
+    bool cancel_pending_block(std::vector<pending_block>& request_queue,
+                              std::vector<pending_block>& download_queue,
+                              const piece_block& block);
+
+    /**
+      * skip not_wanted request r, erase the block from download queue when all of its
+      * data is skipped. Returns count of redundant bytes - whole request, bytes of it
+      * which were read already are thrown away too
+     */
+    int skip_pending_block(std::vector<pending_block>& download_queue,
+                           std::vector<pending_block>::iterator block,
+                           const peer_request& r);
+
+    /**
+      * bytes of completed requests of block, they are redundant when block is cancelled
+     */
+    int received_block_bytes(const pending_block& b);
+
+    /**
+      * outgoing connection goes over uTP when it is enabled and peer wasn't found TCP only
+     */
+    bool use_utp(const peer& p, const session_settings& settings);
+
+    /**
+      * most ed2k clients don't speak uTP - failed uTP connect marks peer TCP only
+      * and makes it connectable at once. Returns false when the failure counts
+     */
+    bool utp_connect_failed(peer* p, bool utp);
+
+    class peer_connection : public base_connection, public upload_peer
     {
+        friend class aux::session_impl;
     public:
 
         // this is the constructor where the we are the active part.
         // The peer_conenction should handshake and verify that the
         // other end has the correct id
         peer_connection(aux::session_impl& ses, boost::weak_ptr<transfer>,
-                        boost::shared_ptr<tcp::socket> s,
+                        boost::shared_ptr<socket_type> s,
                         const tcp::endpoint& remote, peer* peerinfo);
 
         // with this constructor we have been contacted and we still don't
         // know which transfer the connection belongs to
-        peer_connection(aux::session_impl& ses, boost::shared_ptr<tcp::socket> s,
+        peer_connection(aux::session_impl& ses, boost::shared_ptr<socket_type> s,
                         const tcp::endpoint& remote, peer* peerinfo);
 
         ~peer_connection();
@@ -202,8 +248,21 @@ namespace libed2k
         misc_options get_misc_options() const { return m_misc_options; }
         misc_options2 get_misc_options2() const { return m_misc_options2; }
 
+        bool supports_aich() const { return m_misc_options.m_nAICHVersion > 0; }
+        bool supports_compression() const { return m_misc_options.m_nDataCompVer > 0; }
+        // asks AICH recovery data of failed piece, answer goes to transfer::on_aich_recovery_data
+        void request_aich_recovery(int piece, const sha1_hash& master);
+
         net_identifier get_network_point() const;
         md4_hash get_connection_hash() const { return m_hClient; }
+
+        // upload_peer
+        virtual md4_hash upload_client() const { return m_hClient; }
+        virtual size_type uploaded_payload() const { return m_statistics.total_payload_upload(); }
+        virtual bool upload_closing() const { return is_disconnecting(); }
+        virtual void upload_accepted() { write_accept_upload(); }
+        virtual void upload_ranked(boost::uint16_t rank) { write_queue_ranking(rank); }
+        virtual void upload_slot_over();
         peer_connection_options get_options() const { return m_options; }
 
         bool has_network_point(const net_identifier& np) const;
@@ -216,6 +275,12 @@ namespace libed2k
         }
 
         void send_block_requests();
+
+        /**
+          * block was received from other peer - drops it from request queue,
+          * data of sent request will be skipped
+         */
+        void cancel_request(const piece_block& b);
         void cancel_all_requests();
 
         void assign_bandwidth(int channel, int amount);
@@ -233,6 +298,11 @@ namespace libed2k
 
         // constructor method
         void reset();
+
+        /** packet handlers table shared by all peer connections */
+        static const handler_table& packet_handlers();
+        static handler_table make_packet_handlers();
+
         bool attach_to_transfer(const md4_hash& hash);
         void finalize_handshake();
 
@@ -249,6 +319,13 @@ namespace libed2k
         bool has_download_bandwidth();
 
         void request_block();
+
+        /**
+          * pipeline depth as bandwidth-delay product of the peer - blocks for
+          * request_queue_time seconds and round trip of its download rate
+         */
+        void update_desired_queue_size();
+
         // adds a block to the request queue
         // returns true if successful, false otherwise
         enum flags_t { req_time_critical = 1, req_busy = 2 };
@@ -263,6 +340,12 @@ namespace libed2k
         void fill_send_buffer();
         void send_data(const peer_request& r);
         void on_disk_read_complete(int ret, disk_io_job const& j, peer_request r, peer_request left);
+        void append_part(const peer_request& r, disk_buffer_holder& buffer);
+        void append_mapped_part(const peer_request& r, char* data, const boost::intrusive_ptr<file_mapping>& mapping);
+        void append_piped_part(const peer_request& r, const boost::intrusive_ptr<block_pipe>& pipe);
+        // runs on compression thread
+        void compress_part(char* buffer, peer_request r, peer_request left);
+        void on_part_compressed(char* buffer, peer_request r, peer_request left, compressed_block z);
         void receive_data(const peer_request& r, bool compressed);
         void receive_data();
         void on_disk_write_complete(int ret, disk_io_job const& j,
@@ -297,12 +380,26 @@ namespace libed2k
         void write_file_status(const md4_hash& file_hash, const bitfield& status);
         void write_hashset_request(const md4_hash& file_hash);
         void write_hashset_answer(const md4_hash& file_hash, const std::vector<md4_hash>& hash_set);
+        void write_aich_answer(const md4_hash& file_hash, int piece, const sha1_hash& master,
+            const std::vector<aich_node_hash>& nodes);
+        void write_aich_file_hash_request(const md4_hash& file_hash);
+        void write_aich_file_hash_answer(const md4_hash& file_hash, const sha1_hash& master);
         void write_start_upload(const md4_hash& file_hash);
         void write_queue_ranking(boost::uint16_t rank);
         void write_accept_upload();
+        void write_out_parts();
+        void write_sources_request(const md4_hash& file_hash);
+
+        // source exchange answer with fresh peers of transfer
+        void fill_sources_answer(sources_answer_base& sa, transfer& t);
+        void add_exchanged_sources(const sources_answer_base& sa);
+
+        // add payload transferred since last call to credits of remote client
+        void update_credits();
         void write_cancel_transfer();
         void write_request_parts(client_request_parts_64 rp);
         void write_part(const peer_request& r);
+        void write_compressed_part(const peer_request& r, const compressed_block& z);
 
         // protocol handlers
         void on_hello(const error_code& error);
@@ -317,6 +414,10 @@ namespace libed2k
         void on_file_status(const error_code& error);
         void on_hashset_request(const error_code& error);
         void on_hashset_answer(const error_code& error);
+        void on_aich_request(const error_code& error);
+        void on_aich_answer(const error_code& error);
+        void on_aich_file_hash_request(const error_code& error);
+        void on_aich_file_hash_answer(const error_code& error);
         void on_start_upload(const error_code& error);
         void on_queue_ranking(const error_code& error);
         void on_accept_upload(const error_code& error);
@@ -337,7 +438,9 @@ namespace libed2k
         void on_client_captcha_result(const error_code& error);
         void on_client_public_ip_request(const error_code& error);
         void on_client_sources_request(const error_code& error);
+        void on_client_sources_request2(const error_code& error);
         void on_client_sources_answer(const error_code& error);
+        void on_client_sources_answer2(const error_code& error);
 
         template <typename Struct> void on_request_parts(const error_code& error);
         template <typename Struct> void on_sending_part(const error_code& error);
@@ -391,6 +494,13 @@ namespace libed2k
         // at the remote end.
         size_t m_desired_queue_size;
 
+        // time of requests sent to idle peer, min_time() when
+        // no round trip is measured now
+        ptime m_requested;
+
+        // smoothed time from request to its first data, in milliseconds
+        int m_rtt;
+
         // the maximum number of busy blocks we can
         // request at a time
         size_t m_max_busy_blocks;
@@ -458,12 +568,17 @@ namespace libed2k
         // this flag will active after hello -> hello_answer order
         bool m_handshake_complete;
 
-        std::deque<message> m_deferred;
+        // packets serialized while data of part is sent, they follow it
+        chained_buffer m_deferred;
 
         // client information
         md4_hash        m_hClient;
         peer_connection_options m_options;
 
+        // keys of this connection in session lookup indices
+        net_identifier  m_indexed_point;
+        md4_hash        m_indexed_hash;
+
         // initialized in hello answer
         misc_options    m_misc_options;
         misc_options2   m_misc_options2;
@@ -474,24 +589,29 @@ namespace libed2k
         peer_request m_recv_req;
         // current received data compression
         bool m_recv_compressed;
+        // blocks are sent by OP_COMPRESSEDPART when it pays off, chosen on handshake for whole connection
+        bool m_send_compressed;
+
+        // piece of outstanding AICH recovery request, -1 when none
+        int m_aich_piece;
+        // AICH master hash was asked from peer, only the answer to it is a vote
+        bool m_aich_master_requested;
+
+        // source exchange was asked from peer, answer is expected
+        bool m_sources_requested;
+        // peer got sources once on this connection, further requests are ignored
+        bool m_sources_answered;
+
+        // payload totals already added to client credits
+        size_type m_credited_upload;
+        size_type m_credited_download;
 
         // this is a queue of ranges that describes
         // where in the send buffer actual payload
         // data is located. This is currently
         // only used to be able to gather statistics
         // seperately on payload and protocol data.
-        struct range
-        {
-            range(int s, int l) : start(s), length(l)
-            {
-                LIBED2K_ASSERT(s >= 0);
-                LIBED2K_ASSERT(l > 0);
-            }
-            int start;
-            int length;
-        };
-        static bool range_below_zero(const range& r) { return r.start < 0; }
-        std::vector<range> m_payloads;
+        std::vector<payload_range> m_payloads;
     };
 }
 
@@ -245,6 +245,14 @@ namespace libed2k
 		std::string to_string() const
 		{ return std::string((char const*)&m_number[0], number_size); }
 
+		// raw bytes in ed2k archives
+		template<typename Archive>
+		void serialize(Archive& ar)
+		{
+			for (int i = 0; i < number_size; ++i)
+				ar & m_number[i];
+		}
+
 	private:
 
 		unsigned char m_number[number_size];
@@ -103,6 +103,13 @@ namespace libed2k
 			prio_factor = priority_levels - 4
 		};
 
+		// why received data was thrown away, index of redundant bytes counter
+		enum wasted_reason_t
+		{
+			piece_timed_out, piece_cancelled, piece_unknown, piece_seed
+			, piece_end_game, piece_closing, waste_reason_max
+		};
+
 		struct block_info
 		{
 			block_info(): peer(0), num_peers(0), state(state_none) {}
@@ -343,6 +350,11 @@ namespace libed2k
 		// the number of pieces we want and don't have
 		int num_want_left() const { return num_pieces() - m_num_have - m_num_filtered; }
 
+		// every wanted piece is downloading already - blocks which are
+		// requested from slow peers may be requested from other peers too
+		bool is_endgame() const
+		{ return num_want_left() > 0 && int(m_downloads.size()) >= num_want_left(); }
+
 #ifdef LIBED2K_DEBUG
 		// used in debug mode
 		void verify_priority(int start, int end, int prio) const;
@@ -45,6 +45,14 @@ namespace libed2k {
         void erase_peer(peer* p);
         void erase_peer(peers_t::iterator i);
 
+        /**
+          * peers worth to be given away by source exchange - connected ones and
+          * recently connected without failures, IPv4 only
+          * @param requester peer which asks sources, it doesn't get itself
+         */
+        void exchangeable_peers(std::vector<const peer*>& res, const ip::address& requester,
+            int session_time, size_t limit) const;
+
     private:
 
         struct peer_address_compare
@@ -0,0 +1,203 @@
+#ifndef __LIBED2K_READ_CACHE__
+#define __LIBED2K_READ_CACHE__
+
+#include <deque>
+#include <map>
+#include <vector>
+#include <utility>
+
+#include "libed2k/config.hpp"
+#include "libed2k/assert.hpp"
+#include "libed2k/size_type.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/time.hpp"
+
+namespace libed2k
+{
+    /**
+      * bytes of a read cache block copied out to peers. Requests aren't
+      * aligned to cache blocks, so a peer reading a file through copies
+      * the boundary blocks out in two adjacent parts. Only a request which
+      * copies bytes copied before re-references the block.
+      * A gap between two copied parts counts as copied
+     */
+    class copied_range
+    {
+    public:
+        copied_range(): m_begin(0), m_end(0) {}
+
+        /**
+          * @return true when [begin, end) overlaps bytes copied before
+         */
+        bool copy(int begin, int end);
+
+        bool empty() const { return m_begin == m_end; }
+    private:
+        int m_begin;
+        int m_end;
+    };
+
+    typedef std::pair<void*, int> cache_piece_key;  //!< storage and piece
+
+    /**
+      * 2Q ghost list - keys of the most recently evicted probationary read
+      * pieces, oldest first. A piece read again while it is here was evicted
+      * too early and goes straight to the hot part of the cache
+     */
+    class ghost_list
+    {
+    public:
+        /**
+          * @param capacity keys kept, the oldest are forgotten
+         */
+        void push_back(const cache_piece_key& key, int capacity);
+
+        /**
+          * @return true when key was here, it is removed
+         */
+        bool take(const cache_piece_key& key);
+
+        /**
+          * piece left the cache, only probationary pieces are remembered
+         */
+        void evicted(const cache_piece_key& key, bool hot, int capacity)
+        {
+            if (!hot) push_back(key, capacity);
+        }
+
+        /**
+          * forgets all pieces of storage, its address may be reused
+         */
+        void remove_storage(void* storage);
+
+        int size() const { return int(m_keys.size()); }
+    private:
+        std::deque<cache_piece_key> m_keys;
+    };
+
+    /**
+      * 2Q choice of the read cache piece to evict. Pieces of the device are
+      * offered in LRU order. Probationary pieces go first as long as they
+      * take more than a quarter of the read cache, so a peer reading a file
+      * through once doesn't push out pieces other peers keep reading
+     */
+    template <class Iter>
+    class two_queue_victim
+    {
+    public:
+        explicit two_queue_victim(Iter none)
+            : m_probationary(none)
+            , m_hot(none)
+            , m_none(none)
+            , m_blocks(0)
+            , m_probationary_blocks(0)
+        {}
+
+        /**
+          * piece takes read cache space but can't be evicted
+         */
+        void pinned(int blocks) { m_blocks += blocks; }
+
+        void add(Iter i, bool hot, int blocks)
+        {
+            m_blocks += blocks;
+            if (hot)
+            {
+                if (m_hot == m_none) m_hot = i;
+            }
+            else
+            {
+                if (m_probationary == m_none) m_probationary = i;
+                m_probationary_blocks += blocks;
+            }
+        }
+
+        /**
+          * @return piece to evict, none when there are no candidates
+         */
+        Iter first() const { return probationary_first() ? m_probationary : m_hot; }
+
+        /**
+          * @return piece to evict when the first one has to stay in cache yet
+         */
+        Iter second() const { return probationary_first() ? m_hot : m_probationary; }
+    private:
+        bool probationary_first() const
+        {
+            return m_probationary != m_none
+                && (m_hot == m_none || m_probationary_blocks * 4 > m_blocks);
+        }
+
+        Iter m_probationary;    //!< least recently used probationary piece
+        Iter m_hot;             //!< least recently used hot piece
+        Iter m_none;
+        int m_blocks;               //!< read cache blocks of device
+        int m_probationary_blocks;  //!< part of m_blocks in probationary pieces
+    };
+
+    /**
+      * part a read cache piece takes in choosing the piece to evict
+     */
+    enum read_piece_role
+    {
+        piece_elsewhere,    //!< piece is on another device
+        piece_pinned,       //!< piece takes space of the device but must stay
+        piece_evictable
+    };
+
+    /**
+      * 2Q replacement step of a device read cache. Pieces come in LRU order and
+      * have hot, num_blocks and expire, role(piece) tells read_piece_role of each.
+      * A piece which hasn't expired yet stays
+      * @return piece to evict, end when nothing can be evicted now
+     */
+    template <class Iter, class Role>
+    Iter read_cache_victim(Iter begin, Iter end, Role const& role, ptime now)
+    {
+        two_queue_victim<Iter> victim(end);
+        for (Iter k = begin; k != end; ++k)
+        {
+            switch (role(*k))
+            {
+                case piece_pinned: victim.pinned(k->num_blocks); break;
+                case piece_evictable: victim.add(k, k->hot, k->num_blocks); break;
+                default: break;
+            }
+        }
+
+        Iter i = victim.first();
+        if (i == end || !(now < i->expire)) return i;
+
+        i = victim.second();
+        return (i == end || now < i->expire) ? end : i;
+    }
+
+    // read cache accounting of one transfer
+    struct transfer_cache_status
+    {
+        transfer_cache_status()
+            : blocks_read(0)
+            , blocks_read_hit(0)
+        {}
+
+        md4_hash hash;
+        size_type blocks_read;
+        size_type blocks_read_hit;
+    };
+
+    /**
+      * read cache accounting per transfer
+     */
+    class transfer_cache_stats
+    {
+    public:
+        void count_read(const md4_hash& hash, bool hit);
+        void remove(const md4_hash& hash);
+        void status(std::vector<transfer_cache_status>& ret) const;
+    private:
+        typedef std::map<md4_hash, transfer_cache_status> stats_t;
+        stats_t m_stats;
+    };
+}
+
+#endif
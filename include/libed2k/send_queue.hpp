@@ -0,0 +1,76 @@
+#ifndef __LIBED2K_SEND_QUEUE__
+#define __LIBED2K_SEND_QUEUE__
+
+#include <deque>
+#include <vector>
+#include <boost/intrusive_ptr.hpp>
+
+#include "libed2k/config.hpp"
+#include "libed2k/assert.hpp"
+#include "libed2k/block_pipe.hpp"
+
+namespace libed2k
+{
+    /**
+      * spliced blocks of connection's outgoing stream, each one goes to socket
+      * when all send buffer bytes queued before it are sent
+     */
+    class pipe_queue
+    {
+    public:
+        pipe_queue(): m_bytes(0) {}
+
+        /**
+          * @param buffer_size bytes in send buffer which go out before pipe
+         */
+        void push_back(const boost::intrusive_ptr<block_pipe>& pipe, int buffer_size);
+
+        /**
+          * @return pipe which goes next, null when send buffer bytes go first
+         */
+        boost::intrusive_ptr<block_pipe> ready() const;
+
+        /**
+          * @return part of amount send buffer bytes which goes before next pipe
+         */
+        int buffer_limit(int amount) const;
+
+        void buffer_sent(int bytes);
+        void pipe_sent(int bytes);
+
+        int bytes() const { return m_bytes; }
+        bool empty() const { return m_pipes.empty(); }
+    private:
+        struct send_pipe
+        {
+            int                                 position;   //!< bytes of send buffer before pipe
+            boost::intrusive_ptr<block_pipe>    pipe;
+        };
+
+        std::deque<send_pipe>   m_pipes;    //!< spliced blocks in send order
+        int                     m_bytes;    //!< bytes left in all pipes
+    };
+
+    /**
+      * payload bytes in connection's outgoing stream, start is relative to
+      * the first byte not sent yet
+     */
+    struct payload_range
+    {
+        payload_range(int s, int l) : start(s), length(l)
+        {
+            LIBED2K_ASSERT(s >= 0);
+            LIBED2K_ASSERT(l > 0);
+        }
+        int start;
+        int length;
+    };
+
+    /**
+      * moves payload ranges by sent bytes and removes ranges sent completely
+      * @return payload bytes among sent bytes
+     */
+    int sent_payload(std::vector<payload_range>& payloads, int bytes);
+}
+
+#endif
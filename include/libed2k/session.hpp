@@ -85,7 +85,12 @@ namespace libed2k {
         session_settings settings() const;
 
         void set_ip_filter(const ip_filter& f);
-        const ip_filter& get_ip_filter() const;
+
+        /**
+         * copy of filter taken on network thread like settings(), filter is replaced
+         * there by set_ip_filter so reference to it would be raced
+         */
+        ip_filter get_ip_filter() const;
 
         /** search sources for file */
         void post_sources_request(const md4_hash& hFile, boost::uint64_t nSize);
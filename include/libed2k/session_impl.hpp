@@ -7,6 +7,10 @@
 #include <set>
 
 #include <boost/pool/object_pool.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "libed2k/socket.hpp"
 #include "libed2k/stat.hpp"
@@ -17,6 +21,9 @@
 #include "libed2k/ip_filter.hpp"
 #include "libed2k/session_settings.hpp"
 #include "libed2k/util.hpp"
+#include "libed2k/compressed_cache.hpp"
+#include "libed2k/upload_queue.hpp"
+#include "libed2k/client_credits.hpp"
 #include "libed2k/alert.hpp"
 #include "libed2k/packet_struct.hpp"
 #include "libed2k/file.hpp"
@@ -27,6 +34,8 @@
 #include "libed2k/session_status.hpp"
 #include "libed2k/io_service.hpp"
 #include "libed2k/udp_socket.hpp"
+#include "libed2k/socket_type.hpp"
+#include "libed2k/utp_socket_manager.hpp"
 #include "libed2k/bloom_filter.hpp"
 #include "libed2k/kademlia/dht_tracker.hpp"
 
@@ -36,6 +45,7 @@
 
 namespace libed2k {
 
+    class base_connection;
     class peer_connection;
     class server_connection;
     class transfer;
@@ -151,7 +161,21 @@ namespace libed2k {
 
             // the size of each allocation that is chained in the send buffer
             enum { send_buffer_size = 128 };
-            typedef std::set<boost::intrusive_ptr<peer_connection> > connection_map;
+
+            /** hashes connections by raw pointer, so lookup doesn't need to hold reference */
+            struct connection_hash
+            {
+                std::size_t operator()(const peer_connection* p) const
+                { return boost::hash<const peer_connection*>()(p); }
+                std::size_t operator()(const boost::intrusive_ptr<peer_connection>& c) const
+                { return (*this)(c.get()); }
+                bool operator()(const peer_connection* p, const boost::intrusive_ptr<peer_connection>& c) const
+                { return p == c.get(); }
+            };
+
+            typedef boost::unordered_set<boost::intrusive_ptr<peer_connection>, connection_hash> connection_map;
+            typedef boost::unordered_multimap<net_identifier, peer_connection*> connection_point_index;
+            typedef boost::unordered_multimap<md4_hash, peer_connection*> connection_hash_index;
 
             session_impl(const fingerprint& id, const char* listen_interface,
                          const session_settings& settings);
@@ -176,11 +200,11 @@ namespace libed2k {
             void update_disk_thread_settings();
 
             void async_accept(boost::shared_ptr<tcp::acceptor> const& listener);
-            void on_accept_connection(boost::shared_ptr<tcp::socket> const& s,
+            void on_accept_connection(boost::shared_ptr<socket_type> const& s,
                                       boost::weak_ptr<tcp::acceptor> listener,
                                       error_code const& e);
 
-            void incoming_connection(boost::shared_ptr<tcp::socket> const& s);
+            void incoming_connection(boost::shared_ptr<socket_type> const& s);
 
             void on_port_map_log(char const* msg, int map_transport);
 
@@ -217,6 +241,12 @@ namespace libed2k {
 
             void close_connection(const peer_connection* p, const error_code& ec);
 
+            /** store new connection and index it by network point and user hash */
+            void insert_connection(const boost::intrusive_ptr<peer_connection>& c);
+
+            /** call when network point or user hash of connection has changed */
+            void update_connection_index(peer_connection* p);
+
             session_status status() const;
             const tcp::endpoint& server() const;
 
@@ -246,10 +276,7 @@ namespace libed2k {
 
             bool has_peer(const peer_connection* p) const
             {
-                return std::find_if(
-                    m_connections.begin(), m_connections.end(),
-                    boost::bind(&boost::intrusive_ptr<peer_connection>::get, _1) == p)
-                    != m_connections.end();
+                return m_connections.find(p, connection_hash(), connection_hash()) != m_connections.end();
             }
 
             void add_redundant_bytes(size_type b, int reason)
@@ -286,11 +313,43 @@ namespace libed2k {
             // if there are any trasfers and any free slots
             void connect_new_peers();
 
-            /** must be locked before access data in this class */
+            /**
+              * session state belongs to the network thread, mutex only guards
+              * completion of calls marshalled from other threads
+             */
             typedef boost::mutex mutex_t;
             mutable mutex_t m_mutex;
+            mutable boost::condition m_cond;
+
+            /**
+              * runs f on the network thread and waits for its completion,
+              * from the network thread itself f is called in place. When the
+              * network thread has stopped, nobody else touches session state
+              * and f is called in place too
+             */
+            void sync_call(const boost::function<void()>& f) const;
+
+            template<typename R>
+            R sync_call_ret(const boost::function<R()>& f) const
+            {
+                R r = R();
+                sync_call(boost::bind(&session_impl::assign_result<R>, &r, f));
+                return r;
+            }
+
+            void setup_socket_buffers(socket_type& s);
 
-            void setup_socket_buffers(tcp::socket& s);
+            /**
+              * socket for outgoing peer connection. uTP sockets work over session udp socket
+              * and live on main io_service, TCP sockets are spread over shards
+             */
+            boost::shared_ptr<socket_type> create_peer_socket(bool utp);
+
+            /** io_service for socket of new peer connection, round robin over shards */
+            io_service& connection_io_service();
+
+            /** io_service of upload compression thread, thread starts on first use */
+            io_service& compression_io_service();
 
             /** search file on server */
             void post_search_request(search_request& sr);
@@ -325,16 +384,17 @@ namespace libed2k {
 			                                , int source_type, address const& source);
 			address const& external_address() const { return m_external_address; }
 
-			// TODO - should be implemented
             bool is_network_thread() const
             {
-#if defined BOOST_HAS_PTHREADS
-                    //if (m_network_thread == 0) return true;
-                    //return m_network_thread == pthread_self();
-#endif
-                    return true;
+                return m_network_thread == boost::this_thread::get_id();
             }
 
+            /**
+             * destroys connection which lost its last reference, on network thread only
+             * while that thread runs, shard threads hand it over there
+             */
+            void release_connection(const base_connection* c);
+
 
             struct external_ip_t
             {
@@ -436,6 +496,19 @@ namespace libed2k {
             // used to skipping data in connections
             std::vector<char> m_skip_buffer;
 
+            // recently compressed upload blocks
+            compressed_cache m_compressed_blocks;
+
+            // disk buffers of upload parts queued for compression, network thread only.
+            // Handlers which own them never run after shutdown, so they are freed here
+            std::set<char*> m_compression_buffers;
+
+            // transfer totals of remote clients, feed upload queue score
+            client_credits m_credits;
+
+            // upload slots and peers waiting for them
+            upload_queue m_upload_queue;
+
             // the file pool that all storages in this session's
             // torrents uses. It sets a limit on the number of
             // open files by this session.
@@ -486,6 +559,11 @@ namespace libed2k {
             // peers.
             connection_map m_connections;
 
+            // connections by network point and by user hash, connections
+            // without port or hash yet aren't indexed
+            connection_point_index m_connections_by_point;
+            connection_hash_index m_connections_by_hash;
+
             // filters incoming connections
             ip_filter m_ip_filter;
 
@@ -527,6 +605,9 @@ namespace libed2k {
 
             rate_limited_udp_socket m_udp_socket;
 
+            // uTP peer connections multiplexed over m_udp_socket
+            utp_socket_manager m_utp_socket_manager;
+
             boost::intrusive_ptr<natpmp> m_natpmp;
             boost::intrusive_ptr<upnp> m_upnp;
 
@@ -542,6 +623,38 @@ namespace libed2k {
             int m_ssl_mapping[2];
 #endif
 
+            template<typename R>
+            static void assign_result(R* r, const boost::function<R()>& f) { *r = f(); }
+            void call_and_notify(const boost::function<void()>& f, bool* done) const;
+
+            /**
+              * connection shard - sockets of its peer connections are served by own io_service
+              * and thread, all packets are dispatched to the network thread which owns transfers.
+              * Upload compression thread is the same pair of io_service and thread
+             */
+            struct network_shard
+            {
+                void run() { error_code ec; ios.run(ec); }
+
+                io_service ios;
+                boost::scoped_ptr<io_service::work> work;
+                boost::scoped_ptr<boost::thread> thread;
+            };
+
+            void start_shards();
+            void stop_shards();
+
+            void index_connection(peer_connection* p);
+            void unindex_connection(const peer_connection* p);
+
+            std::vector<boost::shared_ptr<network_shard> > m_shards;
+            size_t m_next_shard;
+            boost::scoped_ptr<network_shard> m_compressor;
+
+            boost::thread::id m_network_thread;
+            // network thread left its loop and runs no more handlers, guarded by m_mutex
+            bool m_network_done;
+
             // the main working thread
             // !!! should be last in the member list
             boost::scoped_ptr<boost::thread> m_thread;            
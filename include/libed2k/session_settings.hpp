@@ -64,6 +64,9 @@ namespace libed2k
             peer_timeout(120)
             , peer_connect_timeout(7)
             , block_request_timeout(10)
+            , request_queue_time(3)
+            , min_request_queue(2)
+            , max_out_request_queue(32)
             , max_failcount(3)
             , min_reconnect_time(60)
             , connection_speed(6)
@@ -71,10 +74,17 @@ namespace libed2k
             , recv_socket_buffer_size(0)
             , send_socket_buffer_size(0)
             , send_buffer_watermark(3 * BLOCK_SIZE)
+            , max_inflated_packet_size(4 * 1024 * 1024)
+            , compress_uploads(false)
+            , compressed_cache_blocks(16)
+            , upload_slot_bytes(int(PIECE_SIZE))
+            , upload_slot_time(15 * 60)
+            , upload_queue_size(5000)
             , listen_port(4662)
             , client_name("libed2k")
             , mod_name("libed2k")
             , max_peerlist_size(4000)
+            , source_exchange_interval(60)
             , max_paused_peerlist_size(4000)
             , tick_interval(100)
             , download_rate_limit(-1)
@@ -82,7 +92,8 @@ namespace libed2k
             , unchoke_slots_limit(8)
             , half_open_limit(0)
             , connections_limit(200)
-            , enable_outgoing_utp(true)
+            , network_threads(1)
+            , enable_outgoing_utp(false)
             , enable_incoming_utp(true)
             , utp_target_delay(100) // milliseconds
             , utp_gain_factor(1500) // bytes per rtt
@@ -109,6 +120,8 @@ namespace libed2k
             , no_recheck_incomplete_resume(false)
             , seeding_outgoing_connections(false)
             , alert_queue_size(1000)
+            , hashing_threads(1)
+            , hashing_io_per_device(1)
             // Disk IO settings
             , file_pool_size(40)
             , max_queued_disk_bytes(16*1024*1024)
@@ -140,6 +153,9 @@ namespace libed2k
             , use_disk_read_ahead(true)
             , lock_files(false)
             , low_prio_disk(true)
+            , use_io_uring(false)
+            , mmap_seed_storage(false)
+            , zero_copy_uploads(false)
             , peer_tos(0)
             , upnp_ignore_nonrouters(false)
         {
@@ -158,6 +174,15 @@ namespace libed2k
         // the number of seconds to wait for block request.
         int block_request_timeout;
 
+        /**
+          * blocks requested from peer cover this count of seconds of its download rate
+          * plus request round trip, so the peer never waits for our next request.
+          * Count of requested blocks is kept between min_request_queue and max_out_request_queue
+         */
+        int request_queue_time;
+        int min_request_queue;
+        int max_out_request_queue;
+
         // the number of times we can fail to connect to a peer
         // before we stop retrying it.
         int max_failcount;
@@ -187,6 +212,31 @@ namespace libed2k
         // the upload rate is low, this is the upper limit.
         int send_buffer_watermark;
 
+        // upper limit of unpacked size of compressed peer and server
+        // packets, bigger packets are dropped as malformed
+        int max_inflated_packet_size;
+
+        // send uploaded blocks as OP_COMPRESSEDPART to peers which
+        // support data compression, blocks are compressed by separate
+        // thread and sent raw when compression doesn't pay off. Connection
+        // picks it up on handshake and keeps it until it is closed
+        bool compress_uploads;
+
+        // count of recently compressed upload blocks kept in memory,
+        // one block takes up to 180 KB
+        int compressed_cache_blocks;
+
+        /**
+          * upload slot goes to next waiting peer after the peer got this
+          * count of bytes or after this count of seconds in slot.
+          * Count of slots is unchoke_slots_limit
+         */
+        int upload_slot_bytes;
+        int upload_slot_time;
+
+        // max count of peers waiting for upload slot, requests over it are ignored
+        int upload_queue_size;
+
         // ed2k peer port for incoming peer connections
         int listen_port;
         // ed2k client name
@@ -199,6 +249,10 @@ namespace libed2k
         // about, not necessarily connected to.
         int max_peerlist_size;
 
+        // min count of seconds between source exchange requests of one transfer,
+        // -1 disables requests
+        int source_exchange_interval;
+
         // when a torrent is paused, this is the max peer
         // list size that's used
         int max_paused_peerlist_size;
@@ -214,8 +268,8 @@ namespace libed2k
         int download_rate_limit;
         int upload_rate_limit;
 
-        // the max number of unchoke slots in the session (might be
-        // overridden by unchoke algorithm)
+        // the max number of upload slots in the session, other peers
+        // wait in upload queue. -1 unlimits
         int unchoke_slots_limit;
 
         // the max number of half-open TCP connections
@@ -224,7 +278,15 @@ namespace libed2k
         // the max number of connections in the session
         int connections_limit;
 
-        // when set to true, libtorrent will try to make outgoing utp connections
+        // the number of threads serving peer sockets, connections
+        // are spread over them. 1 keeps sockets on the session
+        // thread. Transfers state is always handled by the session
+        // thread. Takes effect on session start only
+        int network_threads;
+
+        // when set to true, outgoing peer connections try uTP first and fall back
+        // to TCP for peers which don't answer. Off by default since most ed2k
+        // clients speak TCP only and every fallback delays the connection
         bool enable_outgoing_utp;
 
         // if set to false, libtorrent will reject incoming utp connections
@@ -300,6 +362,9 @@ namespace libed2k
         //!< known.met file
         std::string m_known_file;
 
+        //!< clients.met file with credits of remote clients, credits aren't saved when empty
+        std::string m_credits_file;
+
         //!< users files and directories
         //!< second parameter true for recursive search and false otherwise
         fd_list m_fd_list;
@@ -329,6 +394,16 @@ namespace libed2k
         // the max alert queue size
         int alert_queue_size;
 
+        // the number of threads used to hash files shared by
+        // make_transfer_parameters. All of them share one order
+        int hashing_threads;
+
+        // the max number of files hashed at the same time from
+        // one storage device. Keep it at 1 for spinning disks
+        // to avoid head seeks between files, SSD arrays may
+        // use hashing_threads here. 0 means no limit
+        int hashing_io_per_device;
+
         /********************
          * Disk IO settings *
          ********************/
@@ -496,6 +571,22 @@ namespace libed2k
         // in the background
         bool low_prio_disk;
 
+        // new transfers read and write their files through io_uring,
+        // one submission per request instead of a syscall per file.
+        // Takes effect only in builds with LIBED2K_USE_IO_URING, when
+        // the kernel refuses io_uring storage falls back to plain readv
+        bool use_io_uring;
+
+        // transfers added in seed mode send file regions mapped into
+        // memory instead of reading blocks into disk buffers. Uploads
+        // then don't take disk cache and don't copy data in user space
+        bool mmap_seed_storage;
+
+        // uploads over plain TCP are spliced from file to socket through
+        // a kernel pipe on Linux, so payload never comes into user space.
+        // Blocks which can't be spliced are read into buffers as usual
+        bool zero_copy_uploads;
+
         // the TOS byte of all peer traffic (including
         // web seeds) is set to this value. The default
         // is the QBSS scavenger service
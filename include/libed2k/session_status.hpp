@@ -128,6 +128,19 @@ namespace libed2k
 		int disk_write_queue;
 		int disk_read_queue;
 
+		// files waiting for hashing, hashed totals and
+		// throughput of hashing threads while they work
+		int hash_queue;
+		size_type total_hashed_files;
+		size_type total_hashed_bytes;
+		float hash_files_rate;
+		size_type hash_rate;
+
+		// milliseconds hashing threads spent in disk reads and
+		// in hasher, shows whether disk or CPU limits hashing
+		size_type total_hash_read_time;
+		size_type total_hash_compute_time;
+
 #ifndef LIBED2K_DISABLE_DHT
 		int dht_nodes;
 		int dht_node_cache;
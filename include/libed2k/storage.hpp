@@ -71,6 +71,9 @@ namespace libed2k
     struct file_pool;
     struct disk_io_job;
     struct disk_buffer_pool;
+    class file_mapping;
+    class block_pipe;
+    class io_ring;
 
     LIBED2K_EXTRA_EXPORT std::vector<std::pair<size_type, std::time_t> > get_filesizes(
         file_storage const& t
@@ -102,7 +105,7 @@ namespace libed2k
 
     struct LIBED2K_EXPORT storage_interface
     {
-        storage_interface(): m_disk_pool(0), m_settings(0) {}
+        storage_interface(): m_disk_pool(0), m_settings(0), m_ring(0) {}
         // create directories and set file sizes
         // if allocate_files is true.
         // allocate_files is true if allocation mode
@@ -116,6 +119,15 @@ namespace libed2k
         virtual int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
 
         virtual void hint_read(int, int, int) {}
+
+        // gives out the block as read-only memory instead of reading it.
+        // mapping keeps data valid, false means the block must be read
+        virtual bool map_block(int, int, int, char*&, boost::intrusive_ptr<file_mapping>&) { return false; }
+
+        // moves the block into a pipe for splicing it to a socket,
+        // false means the block must be read
+        virtual bool pipe_block(int, int, int, boost::intrusive_ptr<block_pipe>&) { return false; }
+
         // negative return value indicates an error
         virtual int read(char* buf, int slot, int offset, int size) = 0;
 
@@ -179,6 +191,8 @@ namespace libed2k
 
         disk_buffer_pool* m_disk_pool;
         session_settings* m_settings;
+        // io_uring of the storage's device, set by its disk worker
+        io_ring* m_ring;
     };
 
     class LIBED2K_EXPORT default_storage : public storage_interface, boost::noncopyable
@@ -199,6 +213,7 @@ namespace libed2k
         int write(char const* buf, int slot, int offset, int size);
         int sparse_end(int start) const;
         void hint_read(int slot, int offset, int len);
+        bool pipe_block(int slot, int offset, int size, boost::intrusive_ptr<block_pipe>& pipe);
         int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
         int writev(file::iovec_t const* buf, int slot, int offset, int num_bufs);
         size_type physical_offset(int slot, int offset);
@@ -324,6 +339,13 @@ namespace libed2k
             , int cache_line_size = 0
             , int cache_expiry = 0);
 
+        /**
+          * reads block into pipe when storage can, otherwise into buffer like async_read
+         */
+        void async_read_pipe(
+            peer_request const& r
+            , boost::function<void(int, disk_io_job const&)> const& handler);
+
         void async_read_and_hash(
             peer_request const& r
             , boost::function<void(int, disk_io_job const&)> const& handler
@@ -341,6 +363,9 @@ namespace libed2k
 
         void async_hash(int piece, boost::function<void(int, disk_io_job const&)> const& f);
 
+        // AICH block hashes of piece come concatenated in disk_io_job::str
+        void async_aich_hash(int piece, boost::function<void(int, disk_io_job const&)> const& f);
+
         void async_release_files(
             boost::function<void(int, disk_io_job const&)> const& handler
             = boost::function<void(int, disk_io_job const&)>());
@@ -372,6 +397,11 @@ namespace libed2k
 
         storage_interface* get_storage_impl() { return m_storage.get(); }
 
+        // device holding the save path when the storage was created. Disk
+        // jobs are queued by it and it stays put after move_storage, so
+        // the jobs of the storage are never served by two threads
+        boost::uint64_t device() const { return m_device; }
+
     private:
 
         std::string save_path() const;
@@ -424,6 +454,12 @@ namespace libed2k
 
         void hint_read_impl(int piece_index, int offset, int size);
 
+        bool map_block_impl(int piece_index, int offset, int size, char*& data
+            , boost::intrusive_ptr<file_mapping>& mapping);
+
+        bool pipe_block_impl(int piece_index, int offset, int size
+            , boost::intrusive_ptr<block_pipe>& pipe);
+
         int read_impl(
             file::iovec_t* bufs
             , int piece_index
@@ -452,6 +488,12 @@ namespace libed2k
 
         void switch_to_full_mode();
         md4_hash hash_for_piece_impl(int piece, int* readback = 0);
+        // hashes up to multi_hasher::max_streams pieces at once,
+        // hashes[i] is the hash of pieces[i]
+        void hash_for_pieces_impl(std::vector<int> const& pieces
+            , std::vector<md4_hash>& hashes, int* readback = 0);
+        // AICH block hashes of the piece, returns bytes read or -1
+        int aich_hash_for_piece_impl(int piece, std::vector<sha1_hash>& hashes);
 
         int release_files_impl() { return m_storage->release_files(); }
         int delete_files_impl() { return m_storage->delete_files(); }
@@ -499,6 +541,7 @@ namespace libed2k
         std::vector<int> m_slot_to_piece;
 
         std::string m_save_path;
+        boost::uint64_t m_device;
 
         mutable mutex m_mutex;
 
@@ -62,6 +62,20 @@ namespace libed2k
         file_storage const&, file_storage const* mapped, std::string const&, file_pool&
         , std::vector<boost::uint8_t> const&);
 
+    /**
+      * io_uring backed storage when built with LIBED2K_USE_IO_URING, default one otherwise
+     */
+    LIBED2K_EXPORT storage_interface* uring_storage_constructor(
+        file_storage const&, file_storage const* mapped, std::string const&, file_pool&
+        , std::vector<boost::uint8_t> const&);
+
+    /**
+      * memory mapped storage for seeding, default one on Windows
+     */
+    LIBED2K_EXPORT storage_interface* mmap_storage_constructor(
+        file_storage const&, file_storage const* mapped, std::string const&, file_pool&
+        , std::vector<boost::uint8_t> const&);
+
     LIBED2K_EXPORT storage_interface* disabled_storage_constructor(
         file_storage const&, file_storage const* mapped, std::string const&, file_pool&
         , std::vector<boost::uint8_t> const&);
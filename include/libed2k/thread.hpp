@@ -63,6 +63,8 @@ namespace libed2k
 		condition();
 		~condition();
 		void wait(mutex::scoped_lock& l);
+		// returns false if it timed out without being signalled
+		bool timed_wait(mutex::scoped_lock& l, int milliseconds);
 		void signal_all(mutex::scoped_lock& l);
 	private:
 #ifdef BOOST_HAS_PTHREADS
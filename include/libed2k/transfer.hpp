@@ -3,6 +3,7 @@
 #define __LIBED2K_TRANSFER__
 
 #include <set>
+#include <map>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/intrusive_ptr.hpp>
@@ -20,6 +21,7 @@
 #include "libed2k/stat.hpp"
 #include "libed2k/transfer_handle.hpp"
 #include "libed2k/bandwidth_limit.hpp"
+#include "libed2k/aich.hpp"
 
 namespace libed2k
 {
@@ -76,6 +78,12 @@ namespace libed2k
         bool want_more_peers() const;
         void request_peers();
         void add_peer(const tcp::endpoint& peer, int source);
+
+        /**
+          * rate limit of source exchange requests, true means one request may be sent
+          * now and starts next interval
+         */
+        bool want_source_exchange();
         bool connect_to_peer(peer* peerinfo);
         // used by peer_connection to attach itself to a torrent
         // since incoming connections don't know what torrent
@@ -90,6 +98,13 @@ namespace libed2k
         bool has_peer(peer_connection* p) const
         { return m_connections.find(p) != m_connections.end(); }
 
+        /**
+          * block came from one peer - other peers requested it in endgame don't need to send it
+         */
+        void cancel_block(piece_block block, peer_connection* except);
+
+        void add_redundant_bytes(int b, piece_picker::wasted_reason_t reason);
+
         void disconnect_all(const error_code& ec);
         int disconnect_peers(int num, const error_code& ec);
         bool try_connect_peer();
@@ -190,6 +205,19 @@ namespace libed2k
         // piece_failed is called when a piece fails the hash check
         void piece_failed(int index);
 
+        // AICH hash tree of the file, empty unless file was hashed locally
+        const aich_hash_tree& aich() const { return m_aich; }
+
+        // trusted AICH master hash: own tree or agreed by peers, false when unknown
+        bool aich_master(sha1_hash& master) const;
+
+        // peer answered our AICH master hash request
+        void add_aich_master(const address& source, const sha1_hash& master);
+
+        // peer answered AICH recovery request for failed piece, empty nodes on reject
+        void on_aich_recovery_data(int index, const sha1_hash& master,
+            const std::vector<aich_node_hash>& nodes);
+
         // this will restore the piece picker state for a piece
         // by re marking all the requests to blocks in this piece
         // that are still outstanding in peers' download queues.
@@ -289,6 +317,7 @@ namespace libed2k
         void on_resume_data_checked(int ret, disk_io_job const& j);
         void on_piece_checked(int ret, disk_io_job const& j);
         void on_piece_verified(int ret, disk_io_job const& j, boost::function<void(int)> f);
+        void on_aich_piece_hashed(int ret, disk_io_job const& j, std::vector<sha1_hash> blocks);
 
         void handle_disk_write(const disk_io_job& j, peer_connection* c);
         void handle_disk_error(const disk_io_job& j, peer_connection* c = 0);
@@ -312,6 +341,12 @@ namespace libed2k
         void init();
         void bytes_done(transfer_status& st) const;
         void add_failed_bytes(int b);
+
+        // asks AICH capable peer which has the failed piece for recovery data
+        bool request_aich_recovery(int index);
+        // drops downloaded data of failed piece and requests it again
+        void restore_failed_piece(int index);
+
         int block_bytes_wanted(const piece_block& p) const { return BLOCK_SIZE; }
 
         void write_resume_data(entry& rd) const;
@@ -433,6 +468,13 @@ namespace libed2k
 
         // the number of seconds since the last active state
         boost::uint16_t m_last_active;
+
+        aich_hash_tree m_aich;
+        sha1_hash m_aich_master;                    //!< trusted master hash, zero when unknown
+        aich_master_votes m_aich_votes;             //!< master hashes reported by peers
+        std::map<int, ptime> m_aich_recovery;       //!< failed pieces waiting for recovery data
+
+        ptime m_last_source_exchange;               //!< last source exchange request to any peer
     };
 
     extern shared_file_entry transfer2sfe(const std::pair<md4_hash, boost::shared_ptr<transfer> >& tran);
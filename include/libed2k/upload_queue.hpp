@@ -0,0 +1,128 @@
+
+#ifndef __LIBED2K_UPLOAD_QUEUE__
+#define __LIBED2K_UPLOAD_QUEUE__
+
+#include <map>
+#include <vector>
+
+#include "libed2k/size_type.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/time.hpp"
+
+namespace libed2k
+{
+    class session_settings;
+    class client_credits;
+
+    /**
+      * peer as upload queue sees it, implemented by peer_connection
+     */
+    class upload_peer
+    {
+    public:
+        virtual ~upload_peer() {}
+
+        virtual md4_hash upload_client() const = 0;         //!< key of queue entry
+        virtual size_type uploaded_payload() const = 0;     //!< payload sent over connection
+        virtual bool upload_closing() const = 0;            //!< connection is disconnecting
+        virtual void upload_accepted() = 0;                 //!< tell peer it has slot
+        virtual void upload_ranked(boost::uint16_t rank) = 0;   //!< tell peer its rank in queue
+        virtual void upload_slot_over() = 0;                //!< drop requests, tell peer slot is gone
+    };
+
+    /**
+      * eMule-style upload scheduler - peers download in limited count of slots,
+      * other requesters wait in queue ordered by score and receive their ranks.
+      * Slot goes to next peer after data or time quantum, so slots are few and fast.
+      * Queue entries are keyed by client hash and outlive connections - peer keeps
+      * its waiting time when it reconnects to ask again. Used by network thread only
+     */
+    class upload_queue
+    {
+    public:
+        upload_queue(const client_credits& credits);
+
+        /**
+          * peer asks upload - grants slot when one is free and no connected waiter
+          * is ahead of peer, otherwise peer waits in queue and gets its rank.
+          * Full queue ignores new peers
+          * @param priority upload priority of requested file
+          * @return true when peer has slot
+         */
+        bool request_upload(upload_peer* c, int priority, const session_settings& settings, ptime now);
+
+        bool has_slot(const upload_peer* c) const;
+
+        /**
+          * peer doesn't download anymore, slot goes to next waiting peer on next tick
+         */
+        void release_slot(const upload_peer* c);
+
+        /**
+          * connection is closed - frees its slot, queue entry waits for peer to ask again
+         */
+        void remove_connection(const upload_peer* c);
+
+        /**
+          * rotates expired slots, fills free slots, drops forgotten entries
+          * and sends changed ranks
+         */
+        void second_tick(const session_settings& settings, ptime now);
+
+        int slots() const { return int(m_slots.size()); }
+        int queue_size() const { return int(m_queue.size()); }
+
+        /**
+          * @return 1-based position of client in queue or 0 when client doesn't wait
+         */
+        int rank(const md4_hash& client, ptime now) const;
+
+        /**
+          * waiting time scaled by eMule file priority modifier and client credit ratio
+         */
+        static double score(int priority, time_duration waiting, double credit);
+    private:
+        struct slot
+        {
+            upload_peer*    connection;
+            int                 priority;
+            ptime               started;
+            size_type           uploaded;   //!< payload counter of connection at slot start
+        };
+
+        struct waiter
+        {
+            upload_peer*    connection; //!< NULL while peer is disconnected
+            int                 priority;
+            ptime               enqueued;
+            ptime               last_request;
+            int                 sent_rank;  //!< last rank told to peer
+        };
+
+        typedef std::vector<slot> slot_list;
+        typedef std::map<md4_hash, waiter> queue_map;
+
+        bool slot_free(const session_settings& settings) const;
+
+        /**
+          * no connected and not closing waiter has better score than entry
+         */
+        bool first_connected(queue_map::const_iterator itr, ptime now) const;
+        double entry_score(const queue_map::value_type& e, ptime now) const;
+        void grant(upload_peer* c, int priority, ptime now);
+        void enqueue(upload_peer* c, int priority, ptime now);
+
+        /**
+          * queue entries ordered by score, best first
+         */
+        void ordered(std::vector<queue_map::iterator>& res, ptime now);
+        void send_rankings(ptime now);
+
+        const client_credits& m_credits;
+        slot_list   m_slots;
+        queue_map   m_queue;
+        ptime       m_last_rankings;
+    };
+}
+
+#endif
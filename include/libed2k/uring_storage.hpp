@@ -0,0 +1,152 @@
+
+#ifndef __LIBED2K_URING_STORAGE__
+#define __LIBED2K_URING_STORAGE__
+
+#include "libed2k/config.hpp"
+
+#if LIBED2K_USE_IO_URING
+
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+#include "libed2k/storage.hpp"
+#include "libed2k/thread.hpp"
+
+namespace libed2k
+{
+    /**
+      * io_uring submission and completion rings over raw syscalls. Every disk worker
+      * owns the ring of its device, storages of the device get it through
+      * storage_interface::m_ring. Not thread safe, only the worker uses it
+     */
+    class io_ring : boost::noncopyable
+    {
+    public:
+        struct op
+        {
+            int                     fd;
+            bool                    write;
+            size_type               offset;
+            file::iovec_t const*    bufs;
+            int                     num_bufs;
+        };
+
+        /**
+          * called with transferred bytes or -errno when a queued operation completes
+         */
+        typedef boost::function<void(int)> handler_t;
+
+        io_ring();
+        ~io_ring();
+
+        /**
+          * opens the ring on first use
+          * @return false when the kernel doesn't provide io_uring or the ring failed
+         */
+        bool usable();
+
+        /**
+          * runs operations and waits until all of them complete, up to ring size
+          * of them are in flight at once
+          * @param res receives transferred bytes or -errno of each operation
+          * @return false when the ring itself failed, it's closed then
+         */
+        bool run(op const* ops, int num_ops, int* res, error_code& ec);
+
+        /**
+          * operations queued until the outermost end_batch() go to the kernel
+          * together instead of one request at a time
+         */
+        void begin_batch() { ++m_batch_depth; }
+        bool batching() const { return m_batch_depth > 0; }
+
+        /**
+          * queues operation of the batch, buffers must stay valid until end_batch()
+          * @param f file is kept open until the operation completes
+         */
+        void queue(op const& o, boost::intrusive_ptr<file> const& f, handler_t const& h);
+
+        /**
+          * submits queued operations, waits for them and calls their handlers
+         */
+        void end_batch();
+    private:
+        struct pending_op
+        {
+            op                          o;
+            std::vector<file::iovec_t>  bufs;   //!< own copy, caller's array may be gone
+            boost::intrusive_ptr<file>  handle;
+            handler_t                   handler;
+            int                         res;
+            bool                        done;
+        };
+
+        bool open(unsigned entries, error_code& ec);
+        bool is_open() const { return m_fd >= 0; }
+        void close();
+        /**
+          * keeps the ring full until every operation completes
+         */
+        bool execute(std::vector<pending_op>& ops, error_code& ec);
+        /**
+          * takes completions from the completion ring
+          * @return number of operations completed
+         */
+        unsigned reap(std::vector<pending_op>& ops);
+
+        int         m_fd;
+        bool        m_failed;       //!< io_uring is unavailable, don't try again
+        unsigned    m_entries;
+        int         m_batch_depth;
+        std::vector<pending_op> m_batch;
+
+        void*       m_sq_ring;
+        size_t      m_sq_ring_size;
+        void*       m_cq_ring;
+        size_t      m_cq_ring_size;
+        void*       m_sqes;         //!< io_uring_sqe array
+        size_t      m_sqes_size;
+
+        unsigned*   m_sq_tail;
+        unsigned*   m_sq_mask;
+        unsigned*   m_sq_array;
+        unsigned*   m_cq_head;
+        unsigned*   m_cq_tail;
+        unsigned*   m_cq_mask;
+        void*       m_cqes;         //!< io_uring_cqe array
+    };
+
+    /**
+      * default_storage which hands the file slices of one read or write to the io_uring
+      * of its device instead of lseek() + readv() per file. Writes of a write cache
+      * flush are batched and their results come back when the disk worker ends the
+      * batch. Requests go the default way when the kernel has no io_uring or files
+      * skip the OS cache
+     */
+    class uring_storage : public default_storage
+    {
+    public:
+        uring_storage(file_storage const& fs, file_storage const* mapped, std::string const& path
+            , file_pool& fp, std::vector<boost::uint8_t> const& file_prio);
+
+        int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+        int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+    private:
+        /**
+          * @return bytes transferred, -1 on error, -2 when request must go the default way
+         */
+        int uring_readwritev(file::iovec_t const* bufs, int slot, int offset
+            , int num_bufs, fileop const& op);
+
+        /**
+          * completion of a batched write of size bytes to file
+         */
+        void on_write_done(int file, int size, int res);
+    };
+}
+
+#endif
+
+#endif
@@ -137,6 +137,14 @@ namespace libed2k
 
         bool empty() const { return m_segments.empty(); }
 
+        T size() const
+        {
+            T res = 0;
+            for (typename segments::const_iterator i = m_segments.begin(); i != m_segments.end(); ++i)
+                res += i->second - i->first;
+            return res;
+        }
+
         void shrink_end(T size)
         {
             LIBED2K_ASSERT(m_segments.size() == 1);
@@ -249,6 +257,20 @@ namespace libed2k
       * this function converts line from DAT file and generate filters pair
      */
     extern dat_rule datline2filter(const std::string&, error_code&);
+
+    /**
+      * inflate zlib stream of packed packet, output buffer grows from its current capacity
+      * and decompressor state is reused by the calling thread
+      * @return false on corrupted stream or when unpacked data is longer than max_size
+     */
+    extern bool inflate_packet(const char* data, size_t size, socket_buffer& out, size_t max_size);
+
+    /**
+      * zlib compression of upload block, compressor state is reused by the calling thread
+      * @return false when data looks already compressed by entropy of its sample
+      * or compression saves less than 10 percents, out is empty in this case
+     */
+    extern bool deflate_block(const char* data, size_t size, std::vector<char>& out);
 }
 
 #endif
@@ -0,0 +1,260 @@
+#include <map>
+#include <algorithm>
+
+#include "libed2k/aich.hpp"
+#include "libed2k/util.hpp"
+
+namespace libed2k
+{
+    namespace
+    {
+        const int blocks_per_part = static_cast<int>((PIECE_SIZE + AICH_BLOCK_SIZE - 1) / AICH_BLOCK_SIZE);
+
+        /**
+          * eMule tree layout: node above one part is split by parts, inside part by blocks,
+          * odd count of units goes to left child on left branches and to right child on right
+         */
+        void split(size_type size, bool left_branch, size_type& left, size_type& right)
+        {
+            size_type base = (size <= PIECE_SIZE) ? AICH_BLOCK_SIZE : PIECE_SIZE;
+            size_type units = div_ceil(size, base);
+            left = ((left_branch ? units + 1 : units) / 2) * base;
+            right = size - left;
+        }
+
+        size_t block_index(size_type offset)
+        {
+            return static_cast<size_t>((offset / PIECE_SIZE) * blocks_per_part + (offset % PIECE_SIZE) / AICH_BLOCK_SIZE);
+        }
+
+        sha1_hash join(const sha1_hash& left, const sha1_hash& right)
+        {
+            sha1_hasher h;
+            h.update(reinterpret_cast<const char*>(left.begin()), sha1_hash::size);
+            h.update(reinterpret_cast<const char*>(right.begin()), sha1_hash::size);
+            return h.final();
+        }
+
+        typedef std::map<boost::uint32_t, sha1_hash> node_map;
+
+        /**
+          * restore node hash from received nodes, block hashes are collected in file order
+         */
+        bool build_node(const node_map& nodes, size_type size, bool left_branch, boost::uint32_t ident,
+            sha1_hash& hash, std::vector<sha1_hash>& blocks)
+        {
+            if (size <= AICH_BLOCK_SIZE)
+            {
+                node_map::const_iterator itr = nodes.find(ident);
+                if (itr == nodes.end()) return false;
+                hash = itr->second;
+                blocks.push_back(hash);
+                return true;
+            }
+
+            size_type left, right;
+            split(size, left_branch, left, right);
+            sha1_hash lh, rh;
+
+            if (!build_node(nodes, left, true, (ident << 1) | 1, lh, blocks) ||
+                !build_node(nodes, right, false, ident << 1, rh, blocks))
+                return false;
+
+            hash = join(lh, rh);
+            return true;
+        }
+    }
+
+    aich_part_hasher::aich_part_hasher() : m_block_offset(0)
+    {
+    }
+
+    void aich_part_hasher::update(const char* data, int len)
+    {
+        while (len > 0)
+        {
+            int n = std::min<int>(len, AICH_BLOCK_SIZE - m_block_offset);
+            m_hasher.update(data, n);
+            data += n;
+            len -= n;
+            m_block_offset += n;
+
+            if (m_block_offset == AICH_BLOCK_SIZE)
+            {
+                m_hashes.push_back(m_hasher.final());
+                m_hasher.reset();
+                m_block_offset = 0;
+            }
+        }
+    }
+
+    const std::vector<sha1_hash>& aich_part_hasher::final()
+    {
+        if (m_block_offset > 0)
+        {
+            m_hashes.push_back(m_hasher.final());
+            m_hasher.reset();
+            m_block_offset = 0;
+        }
+
+        return m_hashes;
+    }
+
+    aich_hash_tree::aich_hash_tree() : m_file_size(0)
+    {
+    }
+
+    aich_hash_tree::aich_hash_tree(size_type file_size, const std::vector<sha1_hash>& block_hashes) :
+        m_file_size(file_size)
+    {
+        if (file_size > 0 && int(block_hashes.size()) == blocks_count(file_size))
+        {
+            m_block_hashes = block_hashes;
+            m_master = node_hash(0, m_file_size, true);
+        }
+    }
+
+    int aich_hash_tree::blocks_count(size_type file_size)
+    {
+        return static_cast<int>((file_size / PIECE_SIZE) * blocks_per_part +
+            div_ceil(file_size % PIECE_SIZE, AICH_BLOCK_SIZE));
+    }
+
+    int aich_hash_tree::blocks_in_part(size_type file_size, int part)
+    {
+        size_type part_size = std::min<size_type>(PIECE_SIZE, file_size - size_type(part)*PIECE_SIZE);
+        return static_cast<int>(div_ceil(part_size, AICH_BLOCK_SIZE));
+    }
+
+    sha1_hash aich_hash_tree::node_hash(size_type offset, size_type size, bool left_branch) const
+    {
+        if (size <= AICH_BLOCK_SIZE) return m_block_hashes[block_index(offset)];
+
+        size_type left, right;
+        split(size, left_branch, left, right);
+        return join(node_hash(offset, left, true), node_hash(offset + left, right, false));
+    }
+
+    void aich_hash_tree::append_blocks(size_type offset, size_type size, bool left_branch,
+        boost::uint32_t ident, std::vector<aich_node_hash>& data) const
+    {
+        if (size <= AICH_BLOCK_SIZE)
+        {
+            data.push_back(std::make_pair(ident, m_block_hashes[block_index(offset)]));
+            return;
+        }
+
+        size_type left, right;
+        split(size, left_branch, left, right);
+        append_blocks(offset, left, true, (ident << 1) | 1, data);
+        append_blocks(offset + left, right, false, ident << 1, data);
+    }
+
+    bool aich_hash_tree::part_recovery_data(int part, std::vector<aich_node_hash>& data) const
+    {
+        data.clear();
+        size_type part_offset = size_type(part)*PIECE_SIZE;
+        if (empty() || part < 0 || part_offset >= m_file_size) return false;
+        size_type part_size = std::min<size_type>(PIECE_SIZE, m_file_size - part_offset);
+
+        size_type offset = 0;
+        size_type size = m_file_size;
+        bool left_branch = true;
+        boost::uint32_t ident = 1;
+
+        // go down to part node and remember siblings of path
+        while (size != part_size)
+        {
+            size_type left, right;
+            split(size, left_branch, left, right);
+
+            if (part_offset < offset + left)
+            {
+                data.push_back(std::make_pair(ident << 1, node_hash(offset + left, right, false)));
+                ident = (ident << 1) | 1;
+                size = left;
+                left_branch = true;
+            }
+            else
+            {
+                data.push_back(std::make_pair((ident << 1) | 1, node_hash(offset, left, true)));
+                ident = ident << 1;
+                offset += left;
+                size = right;
+                left_branch = false;
+            }
+        }
+
+        append_blocks(offset, size, left_branch, ident, data);
+        return true;
+    }
+
+    bool aich_hash_tree::verify_part_recovery_data(size_type file_size, const sha1_hash& master, int part,
+        const std::vector<aich_node_hash>& data, std::vector<sha1_hash>& blocks)
+    {
+        blocks.clear();
+        size_type part_offset = size_type(part)*PIECE_SIZE;
+        if (part < 0 || part_offset >= file_size) return false;
+        size_type part_size = std::min<size_type>(PIECE_SIZE, file_size - part_offset);
+
+        node_map nodes(data.begin(), data.end());
+        std::vector<std::pair<sha1_hash, bool> > path;  // sibling hash and whether it is right sibling
+        size_type offset = 0;
+        size_type size = file_size;
+        bool left_branch = true;
+        boost::uint32_t ident = 1;
+
+        while (size != part_size)
+        {
+            size_type left, right;
+            split(size, left_branch, left, right);
+            bool go_left = part_offset < offset + left;
+            node_map::const_iterator itr = nodes.find(go_left ? (ident << 1) : ((ident << 1) | 1));
+            if (itr == nodes.end()) return false;
+            path.push_back(std::make_pair(itr->second, go_left));
+
+            ident = go_left ? ((ident << 1) | 1) : (ident << 1);
+            if (!go_left) offset += left;
+            size = go_left ? left : right;
+            left_branch = go_left;
+        }
+
+        sha1_hash hash;
+        if (!build_node(nodes, size, left_branch, ident, hash, blocks)) return false;
+
+        for (std::vector<std::pair<sha1_hash, bool> >::reverse_iterator itr = path.rbegin(); itr != path.rend(); ++itr)
+        {
+            hash = itr->second ? join(hash, itr->first) : join(itr->first, hash);
+        }
+
+        if (hash != master || int(blocks.size()) != blocks_in_part(file_size, part))
+        {
+            blocks.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    const sha1_hash& aich_master_votes::add(const address& source, const sha1_hash& master)
+    {
+        address key = source;
+        if (source.is_v4()) key = address_v4(source.to_v4().to_ulong() & 0xffffff00);
+        m_votes[key] = master;
+
+        std::map<sha1_hash, int> counts;
+        std::map<sha1_hash, int>::const_iterator best = counts.end();
+
+        for (std::map<address, sha1_hash>::const_iterator itr = m_votes.begin(); itr != m_votes.end(); ++itr)
+        {
+            std::map<sha1_hash, int>::iterator c = counts.insert(std::make_pair(itr->second, 0)).first;
+            ++c->second;
+            if (best == counts.end() || c->second > best->second) best = c;
+        }
+
+        int total = m_votes.size();
+        m_trusted = (best->second >= min_sources && best->second * 100 >= total * min_percent) ?
+            best->first : sha1_hash();
+        return m_trusted;
+    }
+}
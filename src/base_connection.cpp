@@ -1,22 +1,27 @@
 #include "libed2k/base_connection.hpp"
 #include "libed2k/session.hpp"
 #include "libed2k/session_impl.hpp"
-#define MINIZ_HEADER_FILE_ONLY
-#include "miniz.c"
+#include "libed2k/util.hpp"
 
 namespace libed2k
 {
     base_connection::base_connection(aux::session_impl& ses):
-        m_ses(ses), m_socket(new tcp::socket(ses.m_io_service)),
-        m_deadline(ses.m_io_service)
+        m_ses(ses), m_socket(new socket_type(ses.m_io_service)), m_io(ses.m_io_service),
+        m_deadline(ses.m_io_service), m_send_streambuf(ses), m_send_stream(&m_send_streambuf),
+        m_socket_open(false), m_max_inflated_size(ses.settings().max_inflated_packet_size),
+        m_handlers(NULL)
     {
+        m_socket->instantiate<stream_socket>(ses.m_io_service);
         reset();
     }
 
     base_connection::base_connection(
-        aux::session_impl& ses, boost::shared_ptr<tcp::socket> s, 
+        aux::session_impl& ses, boost::shared_ptr<socket_type> s,
         const tcp::endpoint& remote):
-        m_ses(ses), m_socket(s), m_deadline(ses.m_io_service), m_remote(remote)
+        m_ses(ses), m_socket(s), m_io(s->get_io_service()), m_deadline(ses.m_io_service),
+        m_send_streambuf(ses), m_send_stream(&m_send_streambuf), m_remote(remote),
+        m_socket_open(s->is_open()), m_max_inflated_size(ses.settings().max_inflated_packet_size),
+        m_handlers(NULL)
     {
         reset();
     }
@@ -25,99 +30,215 @@ namespace libed2k
     {
     }
 
+    void intrusive_ptr_release(base_connection const* c)
+    {
+        LIBED2K_ASSERT(c != 0);
+        LIBED2K_ASSERT(c->m_refs > 0);
+        if (--c->m_refs == 0) c->m_ses.release_connection(c);
+    }
+
     void base_connection::reset()
     {
         m_deadline.expires_at(max_time());
         m_channel_state[upload_channel] = peer_info::bw_idle;
         m_channel_state[download_channel] = peer_info::bw_idle;
         m_disconnecting = false;
+        m_corked = false;
     }
 
     void base_connection::disconnect(const error_code& ec, int error)
     {
         DBG("close connection {remote: " << m_remote << ", msg: "<< ec.message() << "}");
         m_disconnecting = true;
-        m_socket->close();
+        m_socket_open = false;
+        m_io.dispatch(boost::bind(&base_connection::close_socket, m_socket));
         m_deadline.cancel();
     }
 
+    void base_connection::update_settings()
+    {
+        m_io.dispatch(boost::bind(&base_connection::set_max_inflated_size, self(),
+            m_ses.settings().max_inflated_packet_size));
+    }
+
+    void base_connection::close_socket(boost::shared_ptr<socket_type> s)
+    {
+        error_code ec;
+        s->close(ec);
+    }
+
     void base_connection::do_read()
     {
         if (is_closed()) return;
         if (m_channel_state[download_channel] & (peer_info::bw_network | peer_info::bw_limit)) return;
 
         m_deadline.expires_from_now(seconds(m_ses.settings().peer_timeout));
+        m_channel_state[download_channel] |= peer_info::bw_network;
+        m_io.dispatch(boost::bind(&base_connection::read_header, self()));
+    }
+
+    void base_connection::read_header()
+    {
         boost::asio::async_read(
             *m_socket, boost::asio::buffer(&m_in_header, header_size),
             boost::bind(&base_connection::on_read_header, self(), _1, _2));
-        m_channel_state[download_channel] |= peer_info::bw_network;
     }
 
     void base_connection::do_write(int quota)
     {
-        if (is_closed()) return;
+        if (is_closed() || m_corked) return;
         if (m_channel_state[upload_channel] & (peer_info::bw_network | peer_info::bw_limit)) return;
 
-        int amount_to_send = std::min<int>(m_send_buffer.size(), quota);
+        // pipe goes when buffers before it are sent
+        if (boost::intrusive_ptr<block_pipe> pipe = m_send_pipes.ready())
+        {
+            int amount_to_send = std::min<int>(pipe->size(), quota);
+            if (amount_to_send == 0) return;
+
+            m_deadline.expires_from_now(seconds(m_ses.settings().peer_timeout));
+            m_channel_state[upload_channel] |= peer_info::bw_network;
+            m_io.dispatch(boost::bind(&base_connection::start_pipe_write, self(),
+                                      pipe, amount_to_send));
+            return;
+        }
+
+        int amount_to_send = m_send_pipes.buffer_limit(std::min<int>(m_send_buffer.size(), quota));
         if (amount_to_send == 0) return;
 
         // set deadline timer
         m_deadline.expires_from_now(seconds(m_ses.settings().peer_timeout));
 
-        const std::list<boost::asio::const_buffer>& buffers =
-            m_send_buffer.build_iovec(amount_to_send);
-        boost::asio::async_write(*m_socket, buffers, make_write_handler(
-                                     boost::bind(&base_connection::on_write, self(), _1, _2)));
         m_channel_state[upload_channel] |= peer_info::bw_network;
+        m_io.dispatch(boost::bind(&base_connection::start_write, self(),
+                                  m_send_buffer.build_iovec(amount_to_send)));
     }
 
-    void base_connection::write_message(const message& msg) {
-        copy_send_buffer((char*)(&msg.first), header_size);
-        copy_send_buffer(msg.second.c_str(), msg.second.size());
-        do_write();
+    void base_connection::append_send_pipe(const boost::intrusive_ptr<block_pipe>& pipe)
+    {
+        LIBED2K_ASSERT(m_socket->get<stream_socket>());
+        m_send_pipes.push_back(pipe, m_send_buffer.size());
     }
 
-    void base_connection::copy_send_buffer(char const* buf, int size)
+    void base_connection::start_write(chained_buffer::iovec_range buffers)
     {
-        int free_space = m_send_buffer.space_in_last_buffer();
-        if (free_space > size) free_space = size;
-        if (free_space > 0)
-        {
-            m_send_buffer.append(buf, free_space);
-            size -= free_space;
-            buf += free_space;
-        }
-        if (size <= 0) return;
+        boost::asio::async_write(*m_socket, buffers, make_write_handler(
+                                     boost::bind(&base_connection::on_io, self(), _1, _2,
+                                                 io_handler(boost::bind(&base_connection::on_write, self(), _1, _2)))));
+    }
 
-        std::pair<char*, int> buffer = m_ses.allocate_send_buffer(size);
-        if (buffer.first == 0)
+    void base_connection::start_pipe_write(boost::intrusive_ptr<block_pipe> pipe, int size)
+    {
+        stream_socket* s = m_socket->get<stream_socket>();
+        error_code ec;
+        int sent = 0;
+
+        // splice doesn't wait for socket, so it must not block
+        s->native_non_blocking(true, ec);
+        if (!ec) sent = pipe->send(s->native_handle(), size, ec);
+
+        if (ec == boost::asio::error::would_block)
         {
-            disconnect(errors::no_memory);
+            s->async_write_some(boost::asio::null_buffers(), make_write_handler(
+                                    boost::bind(&base_connection::on_pipe_writable, self(), _1, pipe, size)));
             return;
         }
 
-        std::memcpy(buffer.first, buf, size);
-        m_send_buffer.append_buffer(
+        on_io(ec, sent, io_handler(boost::bind(&base_connection::on_pipe_write, self(), _1, _2)));
+    }
+
+    void base_connection::on_pipe_writable(const error_code& error, boost::intrusive_ptr<block_pipe> pipe, int size)
+    {
+        if (error)
+            on_io(error, 0, io_handler(boost::bind(&base_connection::on_pipe_write, self(), _1, _2)));
+        else
+            start_pipe_write(pipe, size);
+    }
+
+    void base_connection::async_read(char* buffer, int size, bool some, const io_handler& handler)
+    {
+        m_io.dispatch(boost::bind(&base_connection::start_read, self(), buffer, size, some, handler));
+    }
+
+    void base_connection::start_read(char* buffer, int size, bool some, const io_handler& handler)
+    {
+        if (some)
+            m_socket->async_read_some(boost::asio::buffer(buffer, size), make_read_handler(
+                                          boost::bind(&base_connection::on_io, self(), _1, _2, handler)));
+        else
+            boost::asio::async_read(*m_socket, boost::asio::buffer(buffer, size), make_read_handler(
+                                        boost::bind(&base_connection::on_io, self(), _1, _2, handler)));
+    }
+
+    void base_connection::async_connect(const boost::function<void (const error_code&)>& handler)
+    {
+        // connect opens socket on shard
+        m_socket_open = true;
+        m_io.dispatch(boost::bind(&base_connection::start_connect, self(), handler));
+    }
+
+    void base_connection::start_connect(const boost::function<void (const error_code&)>& handler)
+    {
+        // uTP stream reports early connect errors with extra argument, bind drops it
+        m_socket->async_connect(m_remote, m_ses.m_io_service.wrap(boost::bind(handler, _1)));
+    }
+
+    void base_connection::on_io(const error_code& error, std::size_t nSize, const io_handler& handler)
+    {
+        m_ses.m_io_service.dispatch(boost::bind(handler, error, nSize));
+    }
+
+    char* base_connection::begin_message(chained_buffer& buffer)
+    {
+        m_send_streambuf.target(&buffer);
+        m_send_stream.clear();
+
+        char* header = m_send_streambuf.allocate(header_size);
+        if (!header) disconnect(errors::no_memory);
+        return header;
+    }
+
+    char* base_connection::send_streambuf::allocate(int size)
+    {
+        char* insert = m_target->allocate_appendix(size);
+        if (insert) return insert;
+
+        // chain new buffer big enough for following small packets too
+        std::pair<char*, int> buffer =
+            m_ses.allocate_send_buffer(std::max<int>(size, aux::session_impl::send_buffer_size * 8));
+        if (buffer.first == 0) return NULL;
+
+        m_target->append_buffer(
             buffer.first, buffer.second, size,
             boost::bind(&aux::session_impl::free_send_buffer,
                         boost::ref(m_ses), _1, buffer.second));
+        return buffer.first;
     }
 
-    void base_connection::on_timeout(const error_code& e)
+    std::streamsize base_connection::send_streambuf::xsputn(const char* s, std::streamsize n)
     {
+        int head = std::min<std::streamsize>(n, m_target->space_in_last_buffer());
+        if (head > 0) m_target->append(s, head);
+        if (head == n) return n;
+
+        char* tail = allocate(n - head);
+        if (!tail) return head;
+        std::memcpy(tail, s + head, n - head);
+        return n;
     }
 
-    void base_connection::on_read_header(const error_code& error, size_t nSize)
+    base_connection::send_streambuf::int_type base_connection::send_streambuf::overflow(int_type c)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
-
-        // keep ourselves alive in until this function exits in
-        // case we disconnect
-        boost::intrusive_ptr<base_connection> me(self());
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        char ch = traits_type::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
 
-        m_statistics.received_bytes(0, nSize);
-        if (is_closed()) return;
+    void base_connection::on_timeout(const error_code& e)
+    {
+    }
 
+    void base_connection::on_read_header(const error_code& error, size_t nSize)
+    {
         error_code ec = error;
 
         if (!ec)
@@ -139,7 +260,7 @@ namespace libed2k
                     if (size == 0)
                     {
                         // all data was read - execute callback
-                        m_ses.m_io_service.post(
+                        m_io.post(
                             boost::bind(&base_connection::on_read_packet,
                                         self(), boost::system::error_code(), 0));
                     }
@@ -165,72 +286,75 @@ namespace libed2k
         }
         else
         {
-            disconnect(ec,1);
+            m_ses.m_io_service.dispatch(boost::bind(&base_connection::disconnect, self(), ec, 1));
         }
 
     }
 
     void base_connection::on_read_packet(const error_code& error, size_t nSize)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
-
-        // keep ourselves alive in until this function exits in
-        // case we disconnect
-        boost::intrusive_ptr<base_connection> me(self());
-
-        m_statistics.received_bytes(0, nSize);
-        if (is_closed()) return;
+        if (error)
+        {
+            m_ses.m_io_service.dispatch(boost::bind(&base_connection::disconnect, self(), error, 0));
+            return;
+        }
 
-        if (!error)
+        bool valid = true;
+        if (m_in_header.m_protocol == OP_PACKEDPROT)
         {
-            // temporary support compression on client to client channel by copy paste code
-            int rc = Z_OK;
-            if (m_in_header.m_protocol == OP_PACKEDPROT)
+            valid = inflate_packet(m_in_gzip_container.empty() ? NULL : &m_in_gzip_container[0],
+                m_in_gzip_container.size(), m_in_container, m_max_inflated_size);
+
+            if (!valid)
             {
-                m_in_container.resize(m_in_gzip_container.size() * 10 + 300);
-                uLongf nSize = m_in_container.size();
-                rc = uncompress((Bytef*)&m_in_container[0], &nSize, (const Bytef*)&m_in_gzip_container[0], m_in_gzip_container.size());
+                ERR("Unzip error: corrupted or too big packed packet " << std::hex << int(m_in_header.m_type));
+            }
+        }
 
-                if (rc != Z_OK){
-                    ERR("Unzip error: " << mz_error(rc));
-                }
-                else{
-                    m_in_container.resize(nSize);
-                }
+        m_ses.m_io_service.dispatch(
+            boost::bind(&base_connection::on_packet, self(), valid, header_size + nSize));
+    }
 
-            }
+    void base_connection::on_packet(bool valid, size_t nSize)
+    {
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
-            m_channel_state[download_channel] &= ~peer_info::bw_network;
+        // keep ourselves alive in until this function exits in
+        // case we disconnect
+        boost::intrusive_ptr<base_connection> me(self());
 
-            //!< search appropriate dispatcher
-            handler_map::iterator itr = m_handlers.find(
-                std::make_pair(m_in_header.m_type, m_in_header.m_protocol));
+        m_statistics.received_bytes(0, nSize);
+        if (is_closed()) return;
 
-            if (rc == Z_OK && itr != m_handlers.end())
-            {
-                itr->second(error);
-            }
-            else
-            {
-                DBG("ignore unhandled packet: " << std::hex << int(m_in_header.m_type) << " <<< " << m_remote);
-            }
+        m_channel_state[download_channel] &= ~peer_info::bw_network;
 
-            m_in_gzip_container.clear();
-            m_in_container.clear();
+        //!< search appropriate dispatcher
+        packet_handler handler = m_handlers ? m_handlers->find(m_in_header.m_type, m_in_header.m_protocol) : NULL;
 
-            // don't read data as header
-            if (m_in_header.m_type != OP_SENDINGPART && m_in_header.m_type != OP_SENDINGPART_I64)
-                do_read();
+        if (valid && handler)
+        {
+            cork c(*this);
+            (this->*handler)(error_code());
         }
         else
         {
-            disconnect(error);
+            DBG("ignore unhandled packet: " << std::hex << int(m_in_header.m_type) << " <<< " << m_remote);
         }
+
+        m_in_gzip_container.clear();
+        m_in_container.clear();
+
+        // don't hold memory of rare huge unpacked packet
+        if (m_in_container.capacity() > MAX_ED2K_PACKET_LEN) socket_buffer().swap(m_in_container);
+
+        // don't read data as header
+        if (m_in_header.m_type != OP_SENDINGPART && m_in_header.m_type != OP_SENDINGPART_I64)
+            do_read();
     }
 
     void base_connection::on_write(const error_code& error, size_t nSize)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         // keep ourselves alive in until this function exits in
         // case we disconnect
@@ -239,6 +363,29 @@ namespace libed2k
         LIBED2K_ASSERT(m_channel_state[upload_channel] & peer_info::bw_network);
 
         m_send_buffer.pop_front(nSize);
+        m_send_pipes.buffer_sent(nSize);
+
+        m_channel_state[upload_channel] &= ~peer_info::bw_network;
+
+        if (error) {
+            disconnect(error);
+            return;
+        }
+        if (is_closed()) return;
+
+        on_sent(error, nSize);
+
+        do_write();
+    }
+
+    void base_connection::on_pipe_write(const error_code& error, size_t nSize)
+    {
+        LIBED2K_ASSERT(m_ses.is_network_thread());
+
+        boost::intrusive_ptr<base_connection> me(self());
+
+        LIBED2K_ASSERT(m_channel_state[upload_channel] & peer_info::bw_network);
+        m_send_pipes.pipe_sent(nSize);
 
         m_channel_state[upload_channel] &= ~peer_info::bw_network;
 
@@ -279,9 +426,10 @@ namespace libed2k
         m_deadline.async_wait(boost::bind(&base_connection::check_deadline, self()));
     }
 
-    void base_connection::add_handler(std::pair<proto_type, proto_type> ptype, packet_handler handler)
+    base_connection::handler_table::handler_table()
     {
-        m_handlers.insert(make_pair(ptype, handler));
+        std::fill(&m_handlers[0][0], &m_handlers[0][0] + sizeof(m_handlers)/sizeof(m_handlers[0][0]),
+                  packet_handler(NULL));
     }
 
 }
@@ -0,0 +1,95 @@
+#include <boost/asio/error.hpp>
+
+#include "libed2k/block_pipe.hpp"
+
+#ifdef LIBED2K_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace libed2k
+{
+    block_pipe::block_pipe(int size, error_code& ec) : m_capacity(size), m_size(0)
+    {
+        m_fds[0] = m_fds[1] = -1;
+#ifdef LIBED2K_LINUX
+        if (pipe(m_fds) < 0)
+        {
+            m_fds[0] = m_fds[1] = -1;
+            ec.assign(errno, get_posix_category());
+            return;
+        }
+
+        // default pipe holds 64 kiB, larger pipe may exceed user limit.
+        // Pipe takes file data by pages, unaligned block spans one more
+        // page than its size, without it fill() waits for space forever
+        if (fcntl(m_fds[1], F_SETPIPE_SZ, size + int(sysconf(_SC_PAGESIZE))) < 0)
+            ec.assign(errno, get_posix_category());
+#else
+        ec = boost::asio::error::operation_not_supported;
+#endif
+    }
+
+    block_pipe::~block_pipe()
+    {
+#ifdef LIBED2K_LINUX
+        if (m_fds[0] >= 0) close(m_fds[0]);
+        if (m_fds[1] >= 0) close(m_fds[1]);
+#endif
+    }
+
+    bool block_pipe::fill(int fd, size_type offset, error_code& ec)
+    {
+#ifdef LIBED2K_LINUX
+        LIBED2K_ASSERT(m_fds[1] >= 0);
+        loff_t off = offset;
+        while (m_size < m_capacity)
+        {
+            ssize_t ret = splice(fd, &off, m_fds[1], NULL, m_capacity - m_size, SPLICE_F_MOVE);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret < 0)
+            {
+                ec.assign(errno, get_posix_category());
+                return false;
+            }
+            if (ret == 0)
+            {
+                ec = errors::file_too_short;
+                return false;
+            }
+            m_size += int(ret);
+        }
+
+        close(m_fds[1]);
+        m_fds[1] = -1;
+        return true;
+#else
+        ec = boost::asio::error::operation_not_supported;
+        return false;
+#endif
+    }
+
+    int block_pipe::send(int socket, int size, error_code& ec)
+    {
+#ifdef LIBED2K_LINUX
+        LIBED2K_ASSERT(size <= m_size);
+        ssize_t ret;
+        do ret = splice(m_fds[0], NULL, socket, NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        while (ret < 0 && errno == EINTR);
+
+        if (ret < 0)
+        {
+            if (errno == EAGAIN) ec = boost::asio::error::would_block;
+            else ec.assign(errno, get_posix_category());
+            return 0;
+        }
+
+        m_size -= int(ret);
+        return int(ret);
+#else
+        ec = boost::asio::error::operation_not_supported;
+        return 0;
+#endif
+    }
+}
@@ -115,24 +115,34 @@ namespace libed2k
 		return insert;
 	}
 
-	std::list<asio::const_buffer> const& chained_buffer::build_iovec(int to_send)
+	void chained_buffer::splice(chained_buffer& c)
 	{
-		m_tmp_vec.clear();
+		m_vec.splice(m_vec.end(), c.m_vec);
+		m_bytes += c.m_bytes;
+		m_capacity += c.m_capacity;
+		c.m_bytes = 0;
+		c.m_capacity = 0;
+		LIBED2K_ASSERT(m_bytes <= m_capacity);
+	}
+
+	chained_buffer::iovec_range chained_buffer::build_iovec(int to_send)
+	{
+		int n = 0;
 
 		for (std::list<buffer_t>::iterator i = m_vec.begin()
-			, end(m_vec.end()); to_send > 0 && i != end; ++i)
+			, end(m_vec.end()); to_send > 0 && i != end && n < max_iovec; ++i)
 		{
 			if (i->used_size > to_send)
 			{
 			    LIBED2K_ASSERT(to_send > 0);
-				m_tmp_vec.push_back(asio::const_buffer(i->start, to_send));
+				m_tmp_vec[n++] = asio::const_buffer(i->start, to_send);
 				break;
 			}
 			LIBED2K_ASSERT(i->used_size > 0);
-			m_tmp_vec.push_back(asio::const_buffer(i->start, i->used_size));
+			m_tmp_vec[n++] = asio::const_buffer(i->start, i->used_size);
 			to_send -= i->used_size;
 		}
-		return m_tmp_vec;
+		return iovec_range(m_tmp_vec, m_tmp_vec + n);
 	}
 
 	chained_buffer::~chained_buffer()
@@ -0,0 +1,203 @@
+#include <fstream>
+#include <algorithm>
+#include <ctime>
+#include <cmath>
+#include <string.h>
+
+#include "libed2k/client_credits.hpp"
+#include "libed2k/archive.hpp"
+#include "libed2k/log.hpp"
+
+namespace libed2k
+{
+    namespace
+    {
+        // eMule forgets clients not seen for 150 days
+        const boost::uint32_t credit_expiration = 150 * 24 * 60 * 60;
+
+        // changed credits are saved not more often than once per this count of seconds
+        const int credits_save_interval = 5 * 60;
+
+        const size_type credit_threshold = 1024 * 1024;
+
+        boost::uint32_t now_seconds()
+        {
+            return static_cast<boost::uint32_t>(std::time(NULL));
+        }
+    }
+
+    credit_entry::credit_entry() :
+        m_nUploadedLo(0), m_nDownloadedLo(0), m_nLastSeen(0),
+        m_nUploadedHi(0), m_nDownloadedHi(0), m_nReserved(0), m_nKeySize(0)
+    {
+        memset(m_abySecureIdent, 0, sizeof(m_abySecureIdent));
+    }
+
+    credit_entry::credit_entry(const md4_hash& hash) :
+        m_hKey(hash), m_nUploadedLo(0), m_nDownloadedLo(0), m_nLastSeen(now_seconds()),
+        m_nUploadedHi(0), m_nDownloadedHi(0), m_nReserved(0), m_nKeySize(0)
+    {
+        memset(m_abySecureIdent, 0, sizeof(m_abySecureIdent));
+    }
+
+    size_type credit_entry::uploaded() const
+    {
+        return (size_type(m_nUploadedHi) << 32) | m_nUploadedLo;
+    }
+
+    size_type credit_entry::downloaded() const
+    {
+        return (size_type(m_nDownloadedHi) << 32) | m_nDownloadedLo;
+    }
+
+    void credit_entry::add_uploaded(size_type bytes)
+    {
+        size_type total = uploaded() + bytes;
+        m_nUploadedLo = static_cast<boost::uint32_t>(total);
+        m_nUploadedHi = static_cast<boost::uint32_t>(total >> 32);
+        m_nLastSeen = now_seconds();
+    }
+
+    void credit_entry::add_downloaded(size_type bytes)
+    {
+        size_type total = downloaded() + bytes;
+        m_nDownloadedLo = static_cast<boost::uint32_t>(total);
+        m_nDownloadedHi = static_cast<boost::uint32_t>(total >> 32);
+        m_nLastSeen = now_seconds();
+    }
+
+    credit_file::credit_file() : m_nVersion(CREDITFILE_VERSION)
+    {
+    }
+
+    client_credits::client_credits() : m_dirty(false), m_last_save(time_now())
+    {
+    }
+
+    void client_credits::load(const std::string& filepath)
+    {
+        m_filepath = filepath;
+        m_credits.clear();
+        m_dirty = false;
+        if (m_filepath.empty()) return;
+
+        std::ifstream fstream(convert_to_native(m_filepath).c_str(), std::ios_base::binary | std::ios_base::in);
+        if (!fstream) return;
+
+        credit_file cf;
+
+        try
+        {
+            libed2k::archive::ed2k_iarchive ifa(fstream);
+            ifa >> cf;
+        }
+        catch(libed2k_exception& e)
+        {
+            ERR("unable to load credits {" << convert_to_native(m_filepath) << "}: " << e.what());
+            return;
+        }
+
+        boost::uint32_t expired = now_seconds() - credit_expiration;
+
+        for (std::vector<credit_entry>::const_iterator i = cf.m_entries.m_collection.begin();
+             i != cf.m_entries.m_collection.end(); ++i)
+        {
+            if (i->m_nLastSeen < expired) m_dirty = true;
+            else m_credits[i->m_hKey] = *i;
+        }
+
+        DBG("credits loaded {" << m_credits.size() << " clients}");
+    }
+
+    void client_credits::save()
+    {
+        m_last_save = time_now();
+        if (m_filepath.empty() || !m_dirty) return;
+
+        credit_file cf;
+        cf.m_entries.m_collection.reserve(m_credits.size());
+
+        for (credit_map::const_iterator i = m_credits.begin(); i != m_credits.end(); ++i)
+            cf.m_entries.m_collection.push_back(i->second);
+
+        std::string tmp_filepath = m_filepath + ".tmp";
+
+        {
+            std::ofstream fstream(convert_to_native(tmp_filepath).c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+
+            if (!fstream)
+            {
+                ERR("unable to open {" << convert_to_native(tmp_filepath) << "} for write");
+                return;
+            }
+
+            libed2k::archive::ed2k_oarchive ofa(fstream);
+            ofa << cf;
+            fstream.flush();
+
+            if (!fstream)
+            {
+                ERR("unable to write {" << convert_to_native(tmp_filepath) << "}");
+                return;
+            }
+        }
+
+        error_code ec;
+        replace_file(tmp_filepath, m_filepath, ec);
+
+        if (ec)
+        {
+            ERR("unable to replace {" << convert_to_native(m_filepath) << "}: " << ec.message());
+            return;
+        }
+
+        DBG("credits saved {" << m_credits.size() << " clients}");
+        m_dirty = false;
+    }
+
+    void client_credits::second_tick(ptime now)
+    {
+        if (m_dirty && total_seconds(now - m_last_save) >= credits_save_interval) save();
+    }
+
+    void client_credits::add_uploaded(const md4_hash& client, size_type bytes)
+    {
+        if (bytes <= 0) return;
+        entry(client).add_uploaded(bytes);
+        m_dirty = true;
+    }
+
+    void client_credits::add_downloaded(const md4_hash& client, size_type bytes)
+    {
+        if (bytes <= 0) return;
+        entry(client).add_downloaded(bytes);
+        m_dirty = true;
+    }
+
+    const credit_entry* client_credits::find(const md4_hash& client) const
+    {
+        credit_map::const_iterator itr = m_credits.find(client);
+        return itr == m_credits.end() ? NULL : &itr->second;
+    }
+
+    double client_credits::score_ratio(const md4_hash& client) const
+    {
+        const credit_entry* ce = find(client);
+        if (!ce || ce->downloaded() < credit_threshold) return 1;
+
+        double result1 = ce->uploaded() == 0 ? 10 : double(ce->downloaded() * 2) / double(ce->uploaded());
+        double result2 = std::sqrt(double(ce->downloaded()) / credit_threshold + 2);
+        double result = std::min(result1, result2);
+
+        if (result < 1) return 1;
+        if (result > 10) return 10;
+        return result;
+    }
+
+    credit_entry& client_credits::entry(const md4_hash& client)
+    {
+        credit_map::iterator itr = m_credits.find(client);
+        if (itr == m_credits.end()) itr = m_credits.insert(std::make_pair(client, credit_entry(client))).first;
+        return itr->second;
+    }
+}
@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#include "libed2k/compressed_cache.hpp"
+
+namespace libed2k
+{
+    bool compressed_cache::key::operator<(const key& k) const
+    {
+        if (hash != k.hash) return hash < k.hash;
+        if (offset != k.offset) return offset < k.offset;
+        return length < k.length;
+    }
+
+    compressed_cache::compressed_cache(int limit) : m_limit(limit)
+    {
+    }
+
+    compressed_cache::key compressed_cache::mk_key(const md4_hash& hash, size_type offset, int length)
+    {
+        key k;
+        k.hash = hash;
+        k.offset = offset;
+        k.length = length;
+        return k;
+    }
+
+    compressed_block compressed_cache::find(const md4_hash& hash, size_type offset, int length)
+    {
+        index_map::iterator itr = m_index.find(mk_key(hash, offset, length));
+        if (itr == m_index.end()) return compressed_block();
+
+        m_lru.splice(m_lru.begin(), m_lru, itr->second);
+        return itr->second->second;
+    }
+
+    void compressed_cache::insert(const md4_hash& hash, size_type offset, int length, const compressed_block& block)
+    {
+        if (m_limit <= 0) return;
+
+        key k = mk_key(hash, offset, length);
+        index_map::iterator itr = m_index.find(k);
+
+        if (itr != m_index.end())
+        {
+            itr->second->second = block;
+            m_lru.splice(m_lru.begin(), m_lru, itr->second);
+            return;
+        }
+
+        m_lru.push_front(std::make_pair(k, block));
+        m_index.insert(std::make_pair(k, m_lru.begin()));
+        trim();
+    }
+
+    void compressed_cache::set_limit(int limit)
+    {
+        m_limit = limit;
+        trim();
+    }
+
+    void compressed_cache::trim()
+    {
+        while (int(m_index.size()) > std::max(m_limit, 0))
+        {
+            m_index.erase(m_lru.back().first);
+            m_lru.pop_back();
+        }
+    }
+}
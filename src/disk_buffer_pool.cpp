@@ -213,5 +213,11 @@ namespace libed2k
         m_pool.release_memory();
 #endif
     }
+
+    void disk_buffer_pool::set_settings(session_settings const& s)
+    {
+        mutex::scoped_lock l(m_pool_mutex);
+        m_settings = s;
+    }
 }
 
@@ -69,6 +69,17 @@ namespace libed2k
 
 // ------- disk_io_thread ------
 
+    disk_io_thread::device_queue::device_queue(boost::uint64_t dev
+        , session_settings const& s)
+        : device(dev)
+        , settings(s)
+        , abort(false)
+        , queue_buffer_size(0)
+        , last_file_check(libed2k::time_now_hires())
+    {
+        stats.device = dev;
+    }
+
     disk_io_thread::disk_io_thread(io_service& ios
         , boost::function<void()> const& queue_callback
         , file_pool& fp
@@ -77,7 +88,7 @@ namespace libed2k
         , m_abort(false)
         , m_waiting_to_shutdown(false)
         , m_queue_buffer_size(0)
-        , m_last_file_check(libed2k::time_now_hires())
+        , m_running_workers(0)
         , m_last_stats_flip(libed2k::time_now())
         , m_physical_ram(0)
         , m_exceeded_write_queue(false)
@@ -85,11 +96,57 @@ namespace libed2k
         , m_queue_callback(queue_callback)
         , m_work(io_service::work(m_ios))
         , m_file_pool(fp)
-        , m_disk_io_thread(boost::bind(&disk_io_thread::thread_fun, this))
     {
-        // don't do anything in here. Essentially all members
-        // of this object are owned by the newly created thread.
-        // initialize stuff in thread_fun().
+#ifdef LIBED2K_DISK_STATS
+        m_log.open("disk_io_thread.log", std::ios::trunc);
+#endif
+
+        // figure out how much physical RAM there is in
+        // this machine. This is used for automatically
+        // sizing the disk cache size when it's set to
+        // automatic.
+#ifdef LIBED2K_BSD
+#ifdef HW_MEMSIZE
+        int mib[2] = { CTL_HW, HW_MEMSIZE };
+#else
+        // not entirely sure this sysctl supports 64
+        // bit return values, but it's probably better
+        // than not building
+        int mib[2] = { CTL_HW, HW_PHYSMEM };
+#endif
+        size_t len = sizeof(m_physical_ram);
+        if (sysctl(mib, 2, &m_physical_ram, &len, NULL, 0) != 0)
+            m_physical_ram = 0;
+#elif defined LIBED2K_WINDOWS
+        MEMORYSTATUSEX ms;
+        ms.dwLength = sizeof(MEMORYSTATUSEX);
+        if (GlobalMemoryStatusEx(&ms))
+            m_physical_ram = ms.ullTotalPhys;
+        else
+            m_physical_ram = 0;
+#elif defined LIBED2K_LINUX
+        m_physical_ram = sysconf(_SC_PHYS_PAGES);
+        m_physical_ram *= sysconf(_SC_PAGESIZE);
+#elif defined LIBED2K_AMIGA
+        m_physical_ram = AvailMem(MEMF_PUBLIC);
+#endif
+
+#if LIBED2K_USE_RLIMIT
+        if (m_physical_ram > 0)
+        {
+            struct rlimit r;
+            if (getrlimit(RLIMIT_AS, &r) == 0 && r.rlim_cur != RLIM_INFINITY)
+            {
+                if (m_physical_ram > r.rlim_cur)
+                    m_physical_ram = r.rlim_cur;
+            }
+        }
+#endif
+
+        // the default queue serves settings updates and storages
+        // whose device is unknown. Other workers start on demand
+        mutex::scoped_lock l(m_queue_mutex);
+        queue_for(0);
     }
 
     disk_io_thread::~disk_io_thread()
@@ -100,20 +157,40 @@ namespace libed2k
     void disk_io_thread::abort()
     {
         mutex::scoped_lock l(m_queue_mutex);
-        disk_io_job j;
         m_waiting_to_shutdown = true;
-        j.action = disk_io_job::abort_thread;
-        j.start_time = libed2k::time_now_hires();
-        m_jobs.insert(m_jobs.begin(), j);
-        m_signal.signal(l);
+        for (device_map_t::iterator i = m_devices.begin(); i != m_devices.end(); ++i)
+        {
+            disk_io_job j;
+            j.action = disk_io_job::abort_thread;
+            j.start_time = libed2k::time_now_hires();
+            i->second->jobs.push_front(j);
+            i->second->signal.signal_all(l);
+        }
     }
 
     void disk_io_thread::join()
     {
-        m_disk_io_thread.join();
+        // workers may still be started while the others quit,
+        // so take them one by one until none is left
+        for (;;)
+        {
+            boost::shared_ptr<thread> t;
+            mutex::scoped_lock l(m_queue_mutex);
+            for (device_map_t::iterator i = m_devices.begin(); i != m_devices.end(); ++i)
+            {
+                if (!i->second->worker) continue;
+                t.swap(i->second->worker);
+                break;
+            }
+            l.unlock();
+            if (!t) break;
+            t->join();
+        }
+
         mutex::scoped_lock l(m_queue_mutex);
         LIBED2K_ASSERT(m_abort == true);
-        m_jobs.clear();
+        for (device_map_t::iterator i = m_devices.begin(); i != m_devices.end(); ++i)
+            i->second->jobs.clear();
     }
 
     bool disk_io_thread::can_write() const
@@ -124,6 +201,7 @@ namespace libed2k
 
     void disk_io_thread::flip_stats(libed2k::ptime now)
     {
+        mutex::scoped_lock l(m_piece_mutex);
         // calling mean() will actually reset the accumulators
         m_cache_stats.average_queue_time = m_queue_time.mean();
         m_cache_stats.average_read_time = m_read_time.mean();
@@ -176,25 +254,59 @@ namespace libed2k
 
     cache_status disk_io_thread::status() const
     {
+        mutex::scoped_lock jl(m_queue_mutex);
         mutex::scoped_lock l(m_piece_mutex);
         m_cache_stats.total_used_buffers = in_use();
         m_cache_stats.queued_bytes = m_queue_buffer_size;
 
         cache_status ret = m_cache_stats;
 
-        ret.job_queue_length = m_jobs.size() + m_sorted_read_jobs.size();
-        ret.read_queue_size = m_sorted_read_jobs.size();
+        for (cache_t::const_iterator i = m_read_pieces.begin(); i != m_read_pieces.end(); ++i)
+            if (i->hot) ret.read_cache_hot_size += i->num_blocks;
+
+        m_transfer_stats.status(ret.transfers);
+
+        ret.job_queue_length = 0;
+        ret.read_queue_size = 0;
+        for (device_map_t::const_iterator i = m_devices.begin(); i != m_devices.end(); ++i)
+        {
+            ret.job_queue_length += i->second->jobs.size() + i->second->sorted_read_jobs.size();
+            ret.read_queue_size += i->second->sorted_read_jobs.size();
+        }
 
         return ret;
     }
 
+    void disk_io_thread::device_status(std::vector<disk_device_status>& ret) const
+    {
+        mutex::scoped_lock l(m_queue_mutex);
+        ret.clear();
+        ret.reserve(m_devices.size());
+        for (device_map_t::const_iterator i = m_devices.begin(); i != m_devices.end(); ++i)
+        {
+            device_queue const& q = *i->second;
+            disk_device_status st = q.stats;
+            st.job_queue_length = q.jobs.size() + q.sorted_read_jobs.size();
+            st.read_queue_size = q.sorted_read_jobs.size();
+            st.queued_bytes = q.queue_buffer_size;
+            ret.push_back(st);
+        }
+    }
+
+    typedef std::list<std::pair<disk_io_job, int> > job_queue_t;
+    void completion_queue_handler(job_queue_t* completed_jobs);
+
     // aborts read operations
     void disk_io_thread::stop(boost::intrusive_ptr<piece_manager> s)
     {
         mutex::scoped_lock l(m_queue_mutex);
+        device_queue& q = queue_for(s.get());
+        // the worker owns its completion list, cancelled
+        // jobs are posted from here directly
+        job_queue_t* cancelled = new job_queue_t;
         // read jobs are aborted, write and move jobs are syncronized
-        for (std::deque<disk_io_job>::iterator i = m_jobs.begin();
-            i != m_jobs.end();)
+        for (std::deque<disk_io_job>::iterator i = q.jobs.begin();
+            i != q.jobs.end();)
         {
             if (i->storage != s)
             {
@@ -207,13 +319,17 @@ namespace libed2k
                 {
                     LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
                     m_queue_buffer_size -= i->buffer_size;
+                    q.queue_buffer_size -= i->buffer_size;
                 }
-                post_callback(*i, -3);
-                i = m_jobs.erase(i);
+                if (i->callback) cancelled->push_back(std::make_pair(*i, -3));
+                i = q.jobs.erase(i);
                 continue;
             }
             ++i;
         }
+        if (cancelled->empty()) delete cancelled;
+        else m_ios.post(boost::bind(completion_queue_handler, cancelled));
+
         disk_io_job j;
         j.action = disk_io_job::abort_torrent;
         j.storage = s;
@@ -242,7 +358,30 @@ namespace libed2k
         return i;
     }
 
-    void disk_io_thread::flush_expired_pieces()
+    bool on_device(disk_io_thread::cached_piece_entry const& p, boost::uint64_t device)
+    {
+        return p.storage->device() == device;
+    }
+
+    // read cache pieces of the device, the ignored one stays
+    struct device_piece_role
+    {
+        device_piece_role(boost::uint64_t d, int piece, piece_manager* storage)
+            : device(d), ignore_piece(piece), ignore_storage(storage) {}
+
+        read_piece_role operator()(disk_io_thread::cached_piece_entry const& p) const
+        {
+            if (!on_device(p, device)) return piece_elsewhere;
+            if (p.piece == ignore_piece && p.storage == ignore_storage) return piece_pinned;
+            return piece_evictable;
+        }
+
+        boost::uint64_t device;
+        int ignore_piece;
+        piece_manager* ignore_storage;
+    };
+
+    void disk_io_thread::flush_expired_pieces(boost::uint64_t device)
     {
         libed2k::ptime now = libed2k::time_now();
 
@@ -256,6 +395,11 @@ namespace libed2k
         while (i != widx.end() && now - i->expire > cut_off)
         {
             LIBED2K_ASSERT(i->storage);
+            if (!on_device(*i, device))
+            {
+                ++i;
+                continue;
+            }
             flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
             LIBED2K_ASSERT(i->num_blocks == 0);
 
@@ -276,6 +420,11 @@ namespace libed2k
             else ++i;
         }
 
+        // the workers of other devices don't evict blocks of this
+        // one, so shrink the cache back to its limit here as well
+        if (in_use() > m_settings.cache_size)
+            flush_cache_blocks(l, device, in_use() - m_settings.cache_size);
+
         if (m_settings.explicit_read_cache) return;
 
         // flush read cache
@@ -284,6 +433,11 @@ namespace libed2k
         i = ridx.begin();
         while (i != ridx.end() && now - i->expire > cut_off)
         {
+            if (!on_device(*i, device))
+            {
+                ++i;
+                continue;
+            }
             drain_piece_bufs(const_cast<cached_piece_entry&>(*i), bufs, l);
             ridx.erase(i++);
         }
@@ -335,23 +489,17 @@ namespace libed2k
     }
 
     // returns the number of blocks that were freed
-    int disk_io_thread::clear_oldest_read_piece(
-        int num_blocks, ignore_t ignore, mutex::scoped_lock& l)
+    int disk_io_thread::clear_oldest_read_piece(boost::uint64_t device
+        , int num_blocks, ignore_t ignore, mutex::scoped_lock& l)
     {
         LIBED2K_INVARIANT_CHECK;
 
         cache_lru_index_t& idx = m_read_pieces.get<1>();
-        if (idx.empty()) return 0;
 
-        cache_lru_index_t::iterator i = idx.begin();
-        if (i->piece == ignore.piece && i->storage == ignore.storage)
-        {
-            ++i;
-            if (i == idx.end()) return 0;
-        }
+        cache_lru_index_t::iterator i = read_cache_victim(idx.begin(), idx.end()
+            , device_piece_role(device, ignore.piece, ignore.storage), libed2k::time_now());
+        if (i == idx.end()) return 0;
 
-        // don't replace an entry that hasn't expired yet
-        if (libed2k::time_now() < i->expire) return 0;
         int blocks = 0;
 
         // build a vector of all the buffers we need to free
@@ -398,12 +546,38 @@ namespace libed2k
                 --num_blocks;
             }
         }
-        if (i->num_blocks == 0) idx.erase(i);
+        if (i->num_blocks == 0)
+        {
+            remember_evicted(*i);
+            idx.erase(i);
+        }
 
         if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
         return blocks;
     }
 
+    void disk_io_thread::remember_evicted(cached_piece_entry const& p)
+    {
+        // remember about as many pieces as the whole cache holds
+        int capacity = (std::max)(int(size_type(m_settings.cache_size) * m_block_size / PIECE_SIZE), 8);
+        m_ghost_pieces.evicted(p.storage_piece_pair(), p.hot, capacity);
+    }
+
+    bool disk_io_thread::was_evicted(disk_io_job const& j)
+    {
+        if (!m_ghost_pieces.take(cache_piece_key(j.storage.get(), j.piece))) return false;
+        ++m_cache_stats.ghost_hits;
+        return true;
+    }
+
+    void disk_io_thread::count_read(disk_io_job const& j, bool hit)
+    {
+        ++m_cache_stats.blocks_read;
+        if (hit) ++m_cache_stats.blocks_read_hit;
+
+        m_transfer_stats.count_read(j.storage->info()->info_hash(), hit);
+    }
+
     int contiguous_blocks(disk_io_thread::cached_piece_entry const& b)
     {
         int ret = 0;
@@ -477,8 +651,21 @@ namespace libed2k
         return lhs.num_contiguous_blocks < rhs.num_contiguous_blocks;
     }
 
-    // flushes 'blocks' blocks from the cache
-    int disk_io_thread::flush_cache_blocks(mutex::scoped_lock& l
+    // the entry of the device with the largest contiguous range of blocks
+    disk_io_thread::cache_lru_index_t::iterator largest_contiguous(
+        disk_io_thread::cache_lru_index_t& idx, boost::uint64_t device)
+    {
+        disk_io_thread::cache_lru_index_t::iterator ret = idx.end();
+        for (disk_io_thread::cache_lru_index_t::iterator i = idx.begin(); i != idx.end(); ++i)
+        {
+            if (!on_device(*i, device)) continue;
+            if (ret == idx.end() || cmp_contiguous(*ret, *i)) ret = i;
+        }
+        return ret;
+    }
+
+    // flushes 'blocks' blocks of the device from the cache
+    int disk_io_thread::flush_cache_blocks(mutex::scoped_lock& l, boost::uint64_t device
         , int blocks, ignore_t ignore, int options)
     {
         // first look if there are any read cache entries that can
@@ -486,7 +673,7 @@ namespace libed2k
         int ret = 0;
         int tmp = 0;
         do {
-            tmp = clear_oldest_read_piece(blocks, ignore, l);
+            tmp = clear_oldest_read_piece(device, blocks, ignore, l);
             blocks -= tmp;
             ret += tmp;
         } while (tmp > 0 && blocks > 0);
@@ -504,6 +691,7 @@ namespace libed2k
             while (blocks > 0)
             {
                 cache_lru_index_t::iterator i = idx.begin();
+                while (i != idx.end() && !on_device(*i, device)) ++i;
                 if (i == idx.end()) return ret;
                 tmp = flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
                 idx.erase(i);
@@ -516,7 +704,7 @@ namespace libed2k
             cache_lru_index_t& idx = m_pieces.get<1>();
             while (blocks > 0)
             {
-                cache_lru_index_t::iterator i = std::max_element(idx.begin(), idx.end(), &cmp_contiguous);
+                cache_lru_index_t::iterator i = largest_contiguous(idx, device);
                 if (i == idx.end()) return ret;
                 tmp = flush_contiguous_blocks(const_cast<cached_piece_entry&>(*i), l);
                 if (i->num_blocks == 0) idx.erase(i);
@@ -531,9 +719,12 @@ namespace libed2k
             {
                 cached_piece_entry& p = const_cast<cached_piece_entry&>(*i);
                 cache_lru_index_t::iterator piece = i;
-                ++i;
 
-                if (!piece->blocks[p.next_block_to_hash].buf) continue;
+                if (!on_device(p, device) || !piece->blocks[p.next_block_to_hash].buf)
+                {
+                    ++i;
+                    continue;
+                }
                 int piece_size = p.storage->info()->piece_size(p.piece);
                 int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
                 int start = p.next_block_to_hash;
@@ -541,6 +732,9 @@ namespace libed2k
                 while (end < blocks_in_piece && p.blocks[end].buf) ++end;
                 tmp = flush_range(p, start, end, l);
                 p.num_contiguous_blocks = contiguous_blocks(p);
+                // the next entry is taken only now, it may belong to
+                // another worker which could drop it while we were writing
+                ++i;
                 if (p.num_blocks == 0 && p.next_block_to_hash == blocks_in_piece)
                     idx.erase(piece);
                 blocks -= tmp;
@@ -552,7 +746,7 @@ namespace libed2k
             // regardless of if we'll have to read them back later
             while (blocks > 0)
             {
-                cache_lru_index_t::iterator i = std::max_element(idx.begin(), idx.end(), &cmp_contiguous);
+                cache_lru_index_t::iterator i = largest_contiguous(idx, device);
                 if (i == idx.end() || i->num_blocks == 0) return ret;
                 tmp = flush_contiguous_blocks(const_cast<cached_piece_entry&>(*i), l);
                 // at this point, we will for sure need a read-back for
@@ -591,7 +785,16 @@ namespace libed2k
 
         end = (std::min)(end, blocks_in_piece);
         int num_write_calls = 0;
+        // start of the current run in buf. Runs don't share buf, since
+        // batched writes complete after all of them are issued
+        int run_offset = 0;
         libed2k::ptime write_start = libed2k::time_now_hires();
+#if LIBED2K_USE_IO_URING
+        // all the runs go to the device together, the ring
+        // waits for them before the buffers are released
+        io_ring* ring = p.storage->get_storage_impl()->m_ring;
+        if (ring) ring->begin_batch();
+#endif
         for (int i = start; i <= end; ++i)
         {
             if (i == end || p.blocks[i].buf == 0)
@@ -610,7 +813,7 @@ namespace libed2k
                 else
                 {
                     LIBED2K_ASSERT(buf);
-                    file::iovec_t b = { buf.get(), buffer_size };
+                    file::iovec_t b = { buf.get() + run_offset, buffer_size };
                     int ret = p.storage->write_impl(&b, p.piece, (std::min)(
                         i * m_block_size, piece_size) - buffer_size, 1);
                     if (ret > 0) ++num_write_calls;
@@ -619,7 +822,7 @@ namespace libed2k
                 ++m_cache_stats.writes;
 //              std::cerr << " flushing p: " << p.piece << " bytes: " << buffer_size << std::endl;
                 buffer_size = 0;
-                offset = 0;
+                run_offset = offset;
                 continue;
             }
             int block_size = (std::min)(piece_size - i * m_block_size, m_block_size);
@@ -647,6 +850,14 @@ namespace libed2k
             if (i == p.next_block_to_hash) ++p.next_block_to_hash;
         }
 
+#if LIBED2K_USE_IO_URING
+        if (ring)
+        {
+            l.unlock();
+            ring->end_batch();
+            l.lock();
+        }
+#endif
         libed2k::ptime done = libed2k::time_now_hires();
 
         int ret = 0;
@@ -657,6 +868,9 @@ namespace libed2k
         j.piece = p.piece;
         test_error(j);
         std::vector<char*> buffers;
+        // a flush isn't tied to the queue of the job which caused
+        // it, write completions are posted from here
+        job_queue_t* completed = new job_queue_t;
         for (int i = start; i < end; ++i)
         {
             if (p.blocks[i].buf == 0) continue;
@@ -665,12 +879,14 @@ namespace libed2k
             j.offset = i * m_block_size;
             j.callback = p.blocks[i].callback;
             buffers.push_back(p.blocks[i].buf);
-            post_callback(j, result);
+            if (j.callback) completed->push_back(std::make_pair(j, result));
             p.blocks[i].callback.clear();
             p.blocks[i].buf = 0;
             ++ret;
         }
         if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+        if (completed->empty()) delete completed;
+        else m_ios.post(boost::bind(completion_queue_handler, completed));
 
         if (num_write_calls > 0)
         {
@@ -717,6 +933,7 @@ namespace libed2k
         p.num_blocks = 1;
         p.num_contiguous_blocks = 1;
         p.next_block_to_hash = 0;
+        p.hot = false;
         p.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
         if (!p.blocks) return -1;
         int block = j.offset / m_block_size;
@@ -892,8 +1109,8 @@ namespace libed2k
         if (in_use() + blocks_to_read > m_settings.cache_size)
         {
             int clear = in_use() + blocks_to_read - m_settings.cache_size;
-            if (flush_cache_blocks(l, clear, ignore_t(j.piece, j.storage.get())
-                , dont_flush_write_blocks) < clear)
+            if (flush_cache_blocks(l, j.storage->device(), clear
+                , ignore_t(j.piece, j.storage.get()), dont_flush_write_blocks) < clear)
                 return -2;
         }
 
@@ -904,6 +1121,7 @@ namespace libed2k
         p.num_blocks = 0;
         p.num_contiguous_blocks = 0;
         p.next_block_to_hash = 0;
+        p.hot = was_evicted(j);
         p.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
         if (!p.blocks) return -1;
 
@@ -1028,6 +1246,7 @@ namespace libed2k
             pe.num_blocks = 0;
             pe.num_contiguous_blocks = 0;
             pe.next_block_to_hash = 0;
+            pe.hot = was_evicted(j);
             pe.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
             if (!pe.blocks) return -1;
             ret = read_into_piece(pe, 0, options, INT_MAX, l);
@@ -1061,7 +1280,8 @@ namespace libed2k
 
         if (in_use() + blocks_in_piece >= m_settings.cache_size)
         {
-            flush_cache_blocks(l, in_use() - m_settings.cache_size + blocks_in_piece);
+            flush_cache_blocks(l, j.storage->device()
+                , in_use() - m_settings.cache_size + blocks_in_piece);
         }
 
         cache_piece_index_t::iterator p;
@@ -1109,8 +1329,7 @@ namespace libed2k
         }
 
         ret = j.buffer_size;
-        ++m_cache_stats.blocks_read;
-        if (hit) ++m_cache_stats.blocks_read_hit;
+        count_read(j, hit);
         return ret;
     }
 
@@ -1187,8 +1406,8 @@ namespace libed2k
             if (in_use() + blocks_to_read > m_settings.cache_size)
             {
                 int clear = in_use() + blocks_to_read - m_settings.cache_size;
-                if (flush_cache_blocks(l, clear, ignore_t(p.piece, p.storage.get())
-                    , dont_flush_write_blocks) < clear)
+                if (flush_cache_blocks(l, p.storage->device(), clear
+                    , ignore_t(p.piece, p.storage.get()), dont_flush_write_blocks) < clear)
                     return -2;
             }
 
@@ -1207,6 +1426,9 @@ namespace libed2k
             LIBED2K_ASSERT(p.blocks[block].buf);
             int to_copy = (std::min)(m_block_size
                     - block_offset, size);
+            // bytes read again, by another peer or by the same one after they
+            // were evicted from the piece, make the whole piece hot
+            if (p.blocks[block].copied.copy(block_offset, block_offset + to_copy)) p.hot = true;
             std::memcpy(j.buffer + buffer_offset
                 , p.blocks[block].buf + block_offset
                 , to_copy);
@@ -1281,8 +1503,7 @@ namespace libed2k
         else idx.modify(p, update_last_use(j.cache_min_time));
 
         ret = j.buffer_size;
-        ++m_cache_stats.blocks_read;
-        if (hit) ++m_cache_stats.blocks_read_hit;
+        count_read(j, hit);
         return ret;
     }
 
@@ -1292,7 +1513,6 @@ namespace libed2k
         return m_queue_buffer_size;
     }
 
-    typedef std::list<std::pair<disk_io_job, int> > job_queue_t;
     void completion_queue_handler(job_queue_t* completed_jobs)
     {
         boost::shared_ptr<job_queue_t> holder(completed_jobs);
@@ -1309,14 +1529,110 @@ namespace libed2k
         }
     }
 
+    void disk_io_thread::publish_settings(session_settings const& s, mutex::scoped_lock& l)
+    {
+        LIBED2K_ASSERT(l.locked());
+        LIBED2K_ASSERT(s.cache_size >= 0);
+        LIBED2K_ASSERT(s.cache_expiry > 0);
+
+        session_settings copy(s);
+        if (copy.cache_size == -1)
+        {
+            // the cache size is set to automatic. Make it
+            // depend on the amount of physical RAM
+            // if we don't know how much RAM we have, just set the
+            // cache size to 16 MiB (16 MiB / BLOCK_SIZE)
+            if (m_physical_ram == 0)
+                copy.cache_size = (16*1024*1024) / m_block_size;
+            else
+                copy.cache_size = m_physical_ram / 8 / m_block_size;
+        }
+
+#if defined LIBED2K_WINDOWS
+        if (m_settings.low_prio_disk != copy.low_prio_disk)
+        {
+            m_file_pool.set_low_prio_io(copy.low_prio_disk);
+            // we need to close all files, since the prio
+            // only takes affect when files are opened
+            m_file_pool.release(0);
+        }
+#endif
+        m_file_pool.resize(copy.file_pool_size);
+
+        // the shared settings are written holding m_queue_mutex,
+        // m_piece_mutex and the buffer pool mutex, any of them
+        // is enough to read them
+        mutex::scoped_lock pl(m_piece_mutex);
+        set_settings(copy);
+        pl.unlock();
+
+        // every worker takes its own copy in order with its jobs
+        for (device_map_t::iterator i = m_devices.begin(); i != m_devices.end(); ++i)
+        {
+            disk_io_job j;
+            j.action = disk_io_job::update_settings;
+            j.buffer = (char*) new session_settings(copy);
+            j.start_time = libed2k::time_now_hires();
+            i->second->jobs.push_back(j);
+            i->second->signal.signal_all(l);
+        }
+    }
+
+    void disk_io_thread::apply_thread_settings(session_settings const& s)
+    {
+#if defined __APPLE__ && defined __MACH__ && MAC_OS_X_VERSION_MIN_REQUIRED >= 1050
+        setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD
+            , s.low_prio_disk ? IOPOL_THROTTLE : IOPOL_DEFAULT);
+#elif defined IOPRIO_WHO_PROCESS && defined __NR_ioprio_set
+        // 0 is the calling thread
+        syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE
+            , s.low_prio_disk ? 7: 0));
+#endif
+    }
+
+    disk_io_thread::device_queue& disk_io_thread::queue_for(piece_manager const* s)
+    {
+        boost::uint64_t dev = s ? s->device() : 0;
+        device_map_t::iterator i = m_devices.find(dev);
+        if (i != m_devices.end()) return *i->second;
+
+        boost::shared_ptr<device_queue> q(new device_queue(dev, m_settings));
+        m_devices.insert(std::make_pair(dev, q));
+        if (m_waiting_to_shutdown)
+        {
+            // started after abort(), the worker quits
+            // once it's done with the jobs it's given
+            disk_io_job j;
+            j.action = disk_io_job::abort_thread;
+            j.start_time = libed2k::time_now_hires();
+            q->jobs.push_back(j);
+        }
+        ++m_running_workers;
+        q->worker.reset(new thread(boost::bind(&disk_io_thread::thread_fun, this, boost::ref(*q))));
+        return *q;
+    }
+
     int disk_io_thread::add_job(disk_io_job const& j
         , mutex::scoped_lock& l
         , boost::function<void(int, disk_io_job const&)> const& f)
     {
         const_cast<disk_io_job&>(j).start_time = libed2k::time_now_hires();
 
+        if (j.action == disk_io_job::update_settings)
+        {
+            LIBED2K_ASSERT(j.buffer);
+            session_settings* s = (session_settings*)j.buffer;
+            publish_settings(*s, l);
+            delete s;
+            if (f) m_ios.post(boost::bind(f, 0, j));
+            return m_queue_buffer_size;
+        }
+
+        device_queue& q = queue_for(j.storage.get());
+
         if (j.action == disk_io_job::write)
         {
+            q.queue_buffer_size += j.buffer_size;
             m_queue_buffer_size += j.buffer_size;
             if (m_queue_buffer_size >= m_settings.max_queued_disk_bytes
                 && m_settings.max_queued_disk_bytes > 0)
@@ -1350,13 +1666,45 @@ namespace libed2k
             const_cast<disk_io_job&>(j).buffer = 0;
         }
 */
-        m_jobs.push_back(j);
-        m_jobs.back().callback.swap(const_cast<boost::function<void(int, disk_io_job const&)>&>(f));
+        q.jobs.push_back(j);
+        q.jobs.back().callback.swap(const_cast<boost::function<void(int, disk_io_job const&)>&>(f));
 
-        m_signal.signal(l);
+        q.signal.signal_all(l);
         return m_queue_buffer_size;
     }
 
+    bool disk_io_thread::try_map_block(disk_io_job& j)
+    {
+        LIBED2K_ASSERT(j.action == disk_io_job::read);
+        if (has_dirty_block(j)) return false;
+
+        char* data = 0;
+        boost::intrusive_ptr<file_mapping> mapping;
+        if (!j.storage->map_block_impl(j.piece, j.offset, j.buffer_size, data, mapping)) return false;
+
+        j.buffer = data;
+        j.mapping = mapping;
+        return true;
+    }
+
+    bool disk_io_thread::try_pipe_block(disk_io_job& j)
+    {
+        LIBED2K_ASSERT(j.action == disk_io_job::read_pipe);
+        if (has_dirty_block(j)) return false;
+
+        boost::intrusive_ptr<block_pipe> pipe;
+        if (!j.storage->pipe_block_impl(j.piece, j.offset, j.buffer_size, pipe)) return false;
+
+        j.pipe = pipe;
+        return true;
+    }
+
+    bool disk_io_thread::has_dirty_block(disk_io_job const& j)
+    {
+        mutex::scoped_lock l(m_piece_mutex);
+        return find_cached_piece(m_pieces, j, l) != m_pieces.get<0>().end();
+    }
+
     int disk_io_thread::add_job(disk_io_job const& j
         , boost::function<void(int, disk_io_job const&)> const& f)
     {
@@ -1388,10 +1736,28 @@ namespace libed2k
         return false;
     }
 
-    void disk_io_thread::post_callback(disk_io_job const& j, int ret)
+    void disk_io_thread::take_hash_jobs(device_queue& q, disk_io_job const& j
+        , std::vector<disk_io_job>& batch)
+    {
+        const int lanes = multi_hasher::lanes();
+        if (lanes == 1) return;
+
+        // only jobs at the front of the queue are taken, all the writes
+        // they depend on were already handled before them
+        mutex::scoped_lock l(m_queue_mutex);
+        while (!q.jobs.empty() && int(batch.size()) + 1 < lanes
+            && q.jobs.front().action == disk_io_job::hash
+            && q.jobs.front().storage == j.storage)
+        {
+            batch.push_back(q.jobs.front());
+            q.jobs.pop_front();
+        }
+    }
+
+    void disk_io_thread::post_callback(device_queue& q, disk_io_job const& j, int ret)
     {
         if (!j.callback) return;
-        m_queued_completions.push_back(std::make_pair(j, ret));
+        q.queued_completions.push_back(std::make_pair(j, ret));
     }
 
     enum action_flags_t
@@ -1420,6 +1786,8 @@ namespace libed2k
         , read_operation + cancel_on_abort // read_and_hash
         , read_operation + cancel_on_abort // cache_piece
         , 0 // finalize_file
+        , 0 // aich_hash
+        , read_operation + cancel_on_abort // read_pipe
     };
 
     bool should_cancel_on_abort(disk_io_job const& j)
@@ -1440,61 +1808,18 @@ namespace libed2k
         return action_flags[j.action] & buffer_operation;
     }
 
-    void disk_io_thread::thread_fun()
+    void disk_io_thread::thread_fun(device_queue& q)
     {
-#ifdef LIBED2K_DISK_STATS
-        m_log.open("disk_io_thread.log", std::ios::trunc);
-#endif
-
-        // figure out how much physical RAM there is in
-        // this machine. This is used for automatically
-        // sizing the disk cache size when it's set to
-        // automatic.
-#ifdef LIBED2K_BSD
-#ifdef HW_MEMSIZE
-        int mib[2] = { CTL_HW, HW_MEMSIZE };
-#else
-        // not entirely sure this sysctl supports 64
-        // bit return values, but it's probably better
-        // than not building
-        int mib[2] = { CTL_HW, HW_PHYSMEM };
-#endif
-        size_t len = sizeof(m_physical_ram);
-        if (sysctl(mib, 2, &m_physical_ram, &len, NULL, 0) != 0)
-            m_physical_ram = 0;
-#elif defined LIBED2K_WINDOWS
-        MEMORYSTATUSEX ms;
-        ms.dwLength = sizeof(MEMORYSTATUSEX);
-        if (GlobalMemoryStatusEx(&ms))
-            m_physical_ram = ms.ullTotalPhys;
-        else
-            m_physical_ram = 0;
-#elif defined LIBED2K_LINUX
-        m_physical_ram = sysconf(_SC_PHYS_PAGES);
-        m_physical_ram *= sysconf(_SC_PAGESIZE);
-#elif defined LIBED2K_AMIGA
-        m_physical_ram = AvailMem(MEMF_PUBLIC);
-#endif
-
-#if LIBED2K_USE_RLIMIT
-        if (m_physical_ram > 0)
-        {
-            struct rlimit r;
-            if (getrlimit(RLIMIT_AS, &r) == 0 && r.rlim_cur != RLIM_INFINITY)
-            {
-                if (m_physical_ram > r.rlim_cur)
-                    m_physical_ram = r.rlim_cur;
-            }
-        }
-#endif
         // 1 = forward in list, -1 = backwards in list
         int elevator_direction = 1;
 
-        read_jobs_t::iterator elevator_job_pos = m_sorted_read_jobs.begin();
+        read_jobs_t::iterator elevator_job_pos = q.sorted_read_jobs.begin();
         size_type last_elevator_pos = 0;
         bool need_update_elevator_pos = false;
         int immediate_jobs_in_row = 0;
 
+        apply_thread_settings(q.settings);
+
         for (;;)
         {
 #ifdef LIBED2K_DISK_STATS
@@ -1504,38 +1829,55 @@ namespace libed2k
 
             mutex::scoped_lock jl(m_queue_mutex);
 
-            if (m_queued_completions.size() >= 30 || (m_jobs.empty() && !m_queued_completions.empty()))
+            if (q.queued_completions.size() >= 30 || (q.jobs.empty() && !q.queued_completions.empty()))
             {
-                job_queue_t* q = new job_queue_t;
-                q->swap(m_queued_completions);
-                m_ios.post(boost::bind(completion_queue_handler, q));
+                job_queue_t* completed = new job_queue_t;
+                completed->swap(q.queued_completions);
+                m_ios.post(boost::bind(completion_queue_handler, completed));
             }
 
 
             libed2k::ptime job_start;
-            while (m_jobs.empty() && m_sorted_read_jobs.empty() && !m_abort)
+            while (q.jobs.empty() && q.sorted_read_jobs.empty() && !q.abort)
             {
                 // if there hasn't been an event in one second
-                // see if we should flush the cache
-//              if (!m_signal.timed_wait(jl, boost::posix_time::seconds(1)))
-//                  flush_expired_pieces();
-                m_signal.wait(jl);
-                m_signal.clear(jl);
+                // see if we should flush the cache. No other worker
+                // flushes the blocks of this device
+                if (!q.signal.timed_wait(jl, 1000))
+                {
+                    jl.unlock();
+                    flush_expired_pieces(q.device);
+                    jl.lock();
+                }
 
                 job_start = libed2k::time_now();
                 if (job_start >= m_last_stats_flip + libed2k::seconds(1)) flip_stats(job_start);
             }
 
-            if (m_abort && m_jobs.empty())
+            if (q.abort && q.jobs.empty())
             {
                 jl.unlock();
 
                 mutex::scoped_lock l(m_piece_mutex);
-                // flush all disk caches
+                // flush the write cache of this device
                 cache_piece_index_t& widx = m_pieces.get<0>();
                 for (cache_piece_index_t::iterator i = widx.begin()
                     , end(widx.end()); i != end; ++i)
+                {
+                    if (!on_device(*i, q.device)) continue;
                     flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+                }
+                l.unlock();
+
+                // the last worker to quit frees the cache, all
+                // the others are done with it by then
+                jl.lock();
+                bool last = --m_running_workers == 0;
+                if (last) m_abort = true;
+                jl.unlock();
+                if (!last) return;
+
+                l.lock();
 
 #ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
                 // since we're aborting the thread, we don't actually
@@ -1567,22 +1909,22 @@ namespace libed2k
             // with a configurable ratio
             // this rate must increase to every other jobs if the queued
             // up read jobs increases too far.
-            int read_job_every = m_settings.read_job_every;
+            int read_job_every = q.settings.read_job_every;
 
-            int unchoke_limit = m_settings.unchoke_slots_limit;
+            int unchoke_limit = q.settings.unchoke_slots_limit;
             if (unchoke_limit < 0) unchoke_limit = 100;
 
-            if ((int)m_sorted_read_jobs.size() > unchoke_limit * 2)
+            if ((int)q.sorted_read_jobs.size() > unchoke_limit * 2)
             {
                 int range = unchoke_limit;
-                int exceed = m_sorted_read_jobs.size() - range * 2;
+                int exceed = q.sorted_read_jobs.size() - range * 2;
                 read_job_every = (exceed * 1 + (range - exceed) * read_job_every) / 2;
                 if (read_job_every < 1) read_job_every = 1;
             }
 
-            bool pick_read_job = m_jobs.empty()
+            bool pick_read_job = q.jobs.empty()
                 || (immediate_jobs_in_row >= read_job_every
-                    && !m_sorted_read_jobs.empty());
+                    && !q.sorted_read_jobs.empty());
 
             if (!pick_read_job)
             {
@@ -1591,12 +1933,13 @@ namespace libed2k
                 // reorder jobs, sort it into the read job
                 // list and continue, otherwise just pop it
                 // and use it later
-                j = m_jobs.front();
-                m_jobs.pop_front();
+                j = q.jobs.front();
+                q.jobs.pop_front();
                 if (j.action == disk_io_job::write)
                 {
                     LIBED2K_ASSERT(m_queue_buffer_size >= j.buffer_size);
                     m_queue_buffer_size -= j.buffer_size;
+                    q.queue_buffer_size -= j.buffer_size;
 
                     if (m_exceeded_write_queue)
                     {
@@ -1629,7 +1972,7 @@ namespace libed2k
                     // at is a read operation. If this read operation
                     // can be fully satisfied by the read cache, handle
                     // it immediately
-                    if (m_settings.use_read_cache)
+                    if (q.settings.use_read_cache)
                     {
 #ifdef LIBED2K_DISK_STATS
                         m_log << log_time() << " check_cache_hit" << std::endl;
@@ -1649,13 +1992,13 @@ namespace libed2k
                     }
                 }
 
-                if (m_settings.use_disk_read_ahead && defer)
+                if (q.settings.use_disk_read_ahead && defer)
                 {
                     j.storage->hint_read_impl(j.piece, j.offset, j.buffer_size);
                 }
 
                 LIBED2K_ASSERT(j.offset >= 0);
-                if (m_settings.allow_reordered_disk_operations && defer)
+                if (q.settings.allow_reordered_disk_operations && defer)
                 {
 #ifdef LIBED2K_DISK_STATS
                     m_log << log_time() << " sorting_job" << std::endl;
@@ -1663,10 +2006,11 @@ namespace libed2k
                     libed2k::ptime sort_start = libed2k::time_now_hires();
 
                     size_type phys_off = j.storage->physical_offset(j.piece, j.offset);
-                    need_update_elevator_pos = need_update_elevator_pos || m_sorted_read_jobs.empty();
-                    m_sorted_read_jobs.insert(std::pair<size_type, disk_io_job>(phys_off, j));
+                    need_update_elevator_pos = need_update_elevator_pos || q.sorted_read_jobs.empty();
+                    q.sorted_read_jobs.insert(std::pair<size_type, disk_io_job>(phys_off, j));
 
                     libed2k::ptime now = libed2k::time_now_hires();
+                    mutex::scoped_lock l(m_piece_mutex);
                     m_sort_time.add_sample(total_microseconds(now - sort_start));
                     m_job_time.add_sample(total_microseconds(now - operation_start));
                     m_cache_stats.cumulative_sort_time += total_milliseconds(now - sort_start);
@@ -1685,31 +2029,31 @@ namespace libed2k
 
                 immediate_jobs_in_row = 0;
 
-                LIBED2K_ASSERT(!m_sorted_read_jobs.empty());
+                LIBED2K_ASSERT(!q.sorted_read_jobs.empty());
 
-                // if m_sorted_read_jobs used to be empty,
+                // if q.sorted_read_jobs used to be empty,
                 // we need to update the elevator position
                 if (need_update_elevator_pos)
                 {
-                    elevator_job_pos = m_sorted_read_jobs.lower_bound(last_elevator_pos);
+                    elevator_job_pos = q.sorted_read_jobs.lower_bound(last_elevator_pos);
                     need_update_elevator_pos = false;
                 }
 
                 // if we've reached the end, change the elevator direction
-                if (elevator_job_pos == m_sorted_read_jobs.end())
+                if (elevator_job_pos == q.sorted_read_jobs.end())
                 {
                     elevator_direction = -1;
                     --elevator_job_pos;
                 }
-                LIBED2K_ASSERT(!m_sorted_read_jobs.empty());
+                LIBED2K_ASSERT(!q.sorted_read_jobs.empty());
 
-                LIBED2K_ASSERT(elevator_job_pos != m_sorted_read_jobs.end());
+                LIBED2K_ASSERT(elevator_job_pos != q.sorted_read_jobs.end());
                 j = elevator_job_pos->second;
                 read_jobs_t::iterator to_erase = elevator_job_pos;
 
                 // if we've reached the begining of the sorted list,
                 // change the elvator direction
-                if (elevator_job_pos == m_sorted_read_jobs.begin())
+                if (elevator_job_pos == q.sorted_read_jobs.begin())
                     elevator_direction = 1;
 
                 // move the elevator before erasing the job we're processing
@@ -1719,10 +2063,12 @@ namespace libed2k
 
                 LIBED2K_ASSERT(to_erase != elevator_job_pos);
                 last_elevator_pos = to_erase->first;
-                m_sorted_read_jobs.erase(to_erase);
+                q.sorted_read_jobs.erase(to_erase);
             }
 
+            mutex::scoped_lock sl(m_piece_mutex);
             m_queue_time.add_sample(total_microseconds(now - j.start_time));
+            sl.unlock();
 
             // if there's a buffer in this job, it will be freed
             // when this holder is destructed, unless it has been
@@ -1730,7 +2076,7 @@ namespace libed2k
             disk_buffer_holder holder(*this
                 , operation_has_buffer(j) ? j.buffer : 0);
 
-            flush_expired_pieces();
+            flush_expired_pieces(q.device);
 
             int ret = 0;
 
@@ -1742,14 +2088,18 @@ namespace libed2k
 #endif
 
             if (j.cache_min_time < 0)
-                j.cache_min_time = j.cache_min_time == 0 ? m_settings.default_cache_min_age
-                    : (std::max)(m_settings.default_cache_min_age, j.cache_min_time);
+                j.cache_min_time = j.cache_min_time == 0 ? q.settings.default_cache_min_age
+                    : (std::max)(q.settings.default_cache_min_age, j.cache_min_time);
 
             LIBED2K_TRY
             {
 
             if (j.storage && j.storage->get_storage_impl()->m_settings == 0)
-                j.storage->get_storage_impl()->m_settings = &m_settings;
+                j.storage->get_storage_impl()->m_settings = &q.settings;
+#if LIBED2K_USE_IO_URING
+            if (j.storage && j.storage->get_storage_impl()->m_ring == 0)
+                j.storage->get_storage_impl()->m_ring = &q.ring;
+#endif
 
             switch (j.action)
             {
@@ -1758,42 +2108,13 @@ namespace libed2k
 #ifdef LIBED2K_DISK_STATS
                     m_log << log_time() << " update_settings " << std::endl;
 #endif
+                    // the settings were published by add_job already, this
+                    // worker takes its own copy in order with its jobs
                     LIBED2K_ASSERT(j.buffer);
                     session_settings const* s = ((session_settings*)j.buffer);
-                    LIBED2K_ASSERT(s->cache_size >= 0);
-                    LIBED2K_ASSERT(s->cache_expiry > 0);
-
-#if defined LIBED2K_WINDOWS
-                    if (m_settings.low_prio_disk != s->low_prio_disk)
-                    {
-                        m_file_pool.set_low_prio_io(s->low_prio_disk);
-                        // we need to close all files, since the prio
-                        // only takes affect when files are opened
-                        m_file_pool.release(0);
-                    }
-#endif
-                    m_settings = *s;
+                    q.settings = *s;
                     delete s;
-
-                    m_file_pool.resize(m_settings.file_pool_size);
-#if defined __APPLE__ && defined __MACH__ && MAC_OS_X_VERSION_MIN_REQUIRED >= 1050
-                    setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD
-                        , m_settings.low_prio_disk ? IOPOL_THROTTLE : IOPOL_DEFAULT);
-#elif defined IOPRIO_WHO_PROCESS
-                    syscall(ioprio_set, IOPRIO_WHO_PROCESS, getpid(), IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE
-                        , m_settings.get_bool(settings_pack::low_prio_disk) ? 7: 0));
-#endif
-                    if (m_settings.cache_size == -1)
-                    {
-                        // the cache size is set to automatic. Make it
-                        // depend on the amount of physical RAM
-                        // if we don't know how much RAM we have, just set the
-                        // cache size to 16 MiB (16 MiB / BLOCK_SIZE)
-                        if (m_physical_ram == 0)
-                            m_settings.cache_size = (16*1024*1024) / m_block_size;
-                        else
-                            m_settings.cache_size = m_physical_ram / 8 / m_block_size;
-                    }
+                    apply_thread_settings(q.settings);
                     break;
                 }
                 case disk_io_job::abort_torrent:
@@ -1802,8 +2123,8 @@ namespace libed2k
                     m_log << log_time() << " abort_torrent " << std::endl;
 #endif
                     mutex::scoped_lock jl(m_queue_mutex);
-                    for (std::deque<disk_io_job>::iterator i = m_jobs.begin();
-                        i != m_jobs.end();)
+                    for (std::deque<disk_io_job>::iterator i = q.jobs.begin();
+                        i != q.jobs.end();)
                     {
                         if (i->storage != j.storage)
                         {
@@ -1812,29 +2133,32 @@ namespace libed2k
                         }
                         if (should_cancel_on_abort(*i))
                         {
+                            if (i->action == disk_io_job::update_settings)
+                                delete (session_settings*)i->buffer;
                             if (i->action == disk_io_job::write)
                             {
                                 LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
                                 m_queue_buffer_size -= i->buffer_size;
+                                q.queue_buffer_size -= i->buffer_size;
                             }
-                            post_callback(*i, -3);
-                            i = m_jobs.erase(i);
+                            post_callback(q, *i, -3);
+                            i = q.jobs.erase(i);
                             continue;
                         }
                         ++i;
                     }
                     // now clear all the read jobs
-                    for (read_jobs_t::iterator i = m_sorted_read_jobs.begin();
-                        i != m_sorted_read_jobs.end();)
+                    for (read_jobs_t::iterator i = q.sorted_read_jobs.begin();
+                        i != q.sorted_read_jobs.end();)
                     {
                         if (i->second.storage != j.storage)
                         {
                             ++i;
                             continue;
                         }
-                        post_callback(i->second, -3);
+                        post_callback(q, i->second, -3);
                         if (elevator_job_pos == i) ++elevator_job_pos;
-                        m_sorted_read_jobs.erase(i++);
+                        q.sorted_read_jobs.erase(i++);
                     }
                     jl.unlock();
 
@@ -1856,6 +2180,9 @@ namespace libed2k
                             ++i;
                         }
                     }
+                    // the storage address may be reused by the next transfer
+                    m_ghost_pieces.remove_storage(j.storage.get());
+                    m_transfer_stats.remove(j.storage->info()->info_hash());
                     l.unlock();
                     if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
                     release_memory();
@@ -1869,8 +2196,8 @@ namespace libed2k
                     // clear all read jobs
                     mutex::scoped_lock jl(m_queue_mutex);
 
-                    for (std::deque<disk_io_job>::iterator i = m_jobs.begin();
-                        i != m_jobs.end();)
+                    for (std::deque<disk_io_job>::iterator i = q.jobs.begin();
+                        i != q.jobs.end();)
                     {
                         if (should_cancel_on_abort(*i))
                         {
@@ -1878,29 +2205,29 @@ namespace libed2k
                             {
                                 LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
                                 m_queue_buffer_size -= i->buffer_size;
+                                q.queue_buffer_size -= i->buffer_size;
                             }
-                            post_callback(*i, -3);
-                            i = m_jobs.erase(i);
+                            post_callback(q, *i, -3);
+                            i = q.jobs.erase(i);
                             continue;
                         }
                         ++i;
                     }
+                    q.abort = true;
                     jl.unlock();
 
-                    for (read_jobs_t::iterator i = m_sorted_read_jobs.begin();
-                        i != m_sorted_read_jobs.end();)
+                    for (read_jobs_t::iterator i = q.sorted_read_jobs.begin();
+                        i != q.sorted_read_jobs.end();)
                     {
                         if (i->second.storage != j.storage)
                         {
                             ++i;
                             continue;
                         }
-                        post_callback(i->second, -3);
+                        post_callback(q, i->second, -3);
                         if (elevator_job_pos == i) ++elevator_job_pos;
-                        m_sorted_read_jobs.erase(i++);
+                        q.sorted_read_jobs.erase(i++);
                     }
-
-                    m_abort = true;
                     break;
                 }
                 case disk_io_job::read_and_hash:
@@ -1944,7 +2271,7 @@ namespace libed2k
                         test_error(j);
                         break;
                     }
-                    if (!m_settings.disable_hash_checks)
+                    if (!q.settings.disable_hash_checks)
                         ret = (j.storage->info()->hash_for_piece(j.piece) == h)?ret:-3;
                     if (ret == -3)
                     {
@@ -1970,6 +2297,62 @@ namespace libed2k
                     j.storage->finalize_file(j.piece);
                     break;
                 }
+                case disk_io_job::aich_hash:
+                {
+#ifdef LIBED2K_DISK_STATS
+                    m_log << log_time() << " aich_hash " << j.piece << std::endl;
+#endif
+                    if (test_error(j))
+                    {
+                        ret = -1;
+                        break;
+                    }
+
+                    // blocks of the piece may still sit in the write cache
+                    mutex::scoped_lock l(m_piece_mutex);
+                    cache_piece_index_t& idx = m_pieces.get<0>();
+                    cache_piece_index_t::iterator i = find_cached_piece(m_pieces, j, l);
+                    if (i != idx.end())
+                    {
+                        flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+                        idx.erase(i);
+                    }
+                    l.unlock();
+
+                    std::vector<sha1_hash> hashes;
+                    ret = j.storage->aich_hash_for_piece_impl(j.piece, hashes);
+                    if (test_error(j))
+                    {
+                        ret = -1;
+                        break;
+                    }
+
+                    // block hashes are passed back concatenated
+                    j.str.clear();
+                    for (std::vector<sha1_hash>::const_iterator h = hashes.begin(); h != hashes.end(); ++h)
+                        j.str.append(h->to_string());
+                    break;
+                }
+                case disk_io_job::read_pipe:
+                {
+                    if (!test_error(j) && try_pipe_block(j))
+                    {
+#ifdef LIBED2K_DISK_STATS
+                        m_log << log_time() << " read-pipe " << j.buffer_size << std::endl;
+#endif
+                        ret = j.buffer_size;
+                        libed2k::ptime now = libed2k::time_now_hires();
+                        mutex::scoped_lock l(m_piece_mutex);
+                        count_read(j, false);
+                        m_read_time.add_sample(total_microseconds(now - operation_start));
+                        m_cache_stats.cumulative_read_time += total_milliseconds(now - operation_start);
+                        break;
+                    }
+
+                    // block which can't be spliced goes the usual way into a buffer
+                    j.action = disk_io_job::read;
+                }
+                // fall through
                 case disk_io_job::read:
                 {
                     if (test_error(j))
@@ -1981,6 +2364,20 @@ namespace libed2k
                     m_log << log_time();
 #endif
                     LIBED2K_INVARIANT_CHECK;
+                    if (j.buffer == 0 && try_map_block(j))
+                    {
+#ifdef LIBED2K_DISK_STATS
+                        m_log << " read-mapped " << j.buffer_size << std::endl;
+#endif
+                        ret = j.buffer_size;
+                        libed2k::ptime now = libed2k::time_now_hires();
+                        mutex::scoped_lock l(m_piece_mutex);
+                        count_read(j, false);
+                        m_read_time.add_sample(total_microseconds(now - operation_start));
+                        m_cache_stats.cumulative_read_time += total_milliseconds(now - operation_start);
+                        break;
+                    }
+
                     if (j.buffer == 0) j.buffer = allocate_buffer("send buffer");
                     LIBED2K_ASSERT(j.buffer_size <= m_block_size);
                     if (j.buffer == 0)
@@ -2037,12 +2434,14 @@ namespace libed2k
                             ret = -1;
                             break;
                         }
-                        ++m_cache_stats.blocks_read;
                         hit = false;
+                        mutex::scoped_lock l(m_piece_mutex);
+                        count_read(j, false);
                     }
                     if (!hit)
                     {
                         libed2k::ptime now = libed2k::time_now_hires();
+                        mutex::scoped_lock l(m_piece_mutex);
                         m_read_time.add_sample(total_microseconds(now - operation_start));
                         m_cache_stats.cumulative_read_time += total_milliseconds(now - operation_start);
                     }
@@ -2066,7 +2465,7 @@ namespace libed2k
 
                     if (in_use() >= m_settings.cache_size)
                     {
-                        flush_cache_blocks(l, in_use() - m_settings.cache_size + 1);
+                        flush_cache_blocks(l, j.storage->device(), in_use() - m_settings.cache_size + 1);
                         if (test_error(j)) break;
                     }
                     LIBED2K_ASSERT(!j.storage->error());
@@ -2154,7 +2553,7 @@ namespace libed2k
 
                     if (in_use() > m_settings.cache_size)
                     {
-                        flush_cache_blocks(l, in_use() - m_settings.cache_size);
+                        flush_cache_blocks(l, j.storage->device(), in_use() - m_settings.cache_size);
                         test_error(j);
                     }
                     LIBED2K_ASSERT(!j.storage->error());
@@ -2190,6 +2589,12 @@ namespace libed2k
                     m_log << log_time() << " hash" << std::endl;
 #endif
                     LIBED2K_ASSERT(!j.storage->error());
+
+                    // hash jobs of the same storage queued right behind this
+                    // one are hashed together in parallel hasher lanes
+                    std::vector<disk_io_job> batch;
+                    if (!q.settings.disable_hash_checks) take_hash_jobs(q, j, batch);
+
                     mutex::scoped_lock l(m_piece_mutex);
                     LIBED2K_INVARIANT_CHECK;
 
@@ -2204,11 +2609,36 @@ namespace libed2k
                         {
                             ret = -1;
                             j.storage->mark_failed(j.piece);
+                            l.unlock();
+                            for (std::vector<disk_io_job>::iterator k = batch.begin(); k != batch.end(); ++k)
+                            {
+                                k->error = j.error;
+                                k->error_file = j.error_file;
+                                post_callback(q, *k, -1);
+                            }
                             break;
                         }
                     }
+
+                    for (std::vector<disk_io_job>::iterator k = batch.begin(); k != batch.end();)
+                    {
+                        i = find_cached_piece(m_pieces, *k, l);
+                        if (i != idx.end())
+                        {
+                            flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+                            idx.erase(i);
+                            if (test_error(*k))
+                            {
+                                k->storage->mark_failed(k->piece);
+                                post_callback(q, *k, -1);
+                                k = batch.erase(k);
+                                continue;
+                            }
+                        }
+                        ++k;
+                    }
                     l.unlock();
-                    if (m_settings.disable_hash_checks)
+                    if (q.settings.disable_hash_checks)
                     {
                         ret = 0;
                         break;
@@ -2217,20 +2647,42 @@ namespace libed2k
                     libed2k::ptime hash_start = libed2k::time_now_hires();
 
                     int readback = 0;
-                    md4_hash h = j.storage->hash_for_piece_impl(j.piece, &readback);
+                    std::vector<int> pieces(1, j.piece);
+                    std::vector<md4_hash> hashes;
+                    for (std::vector<disk_io_job>::iterator k = batch.begin(); k != batch.end(); ++k)
+                        pieces.push_back(k->piece);
+
+                    j.storage->hash_for_pieces_impl(pieces, hashes, &readback);
                     if (test_error(j))
                     {
                         ret = -1;
                         j.storage->mark_failed(j.piece);
+                        for (std::vector<disk_io_job>::iterator k = batch.begin(); k != batch.end(); ++k)
+                        {
+                            k->error = j.error;
+                            k->error_file = j.error_file;
+                            k->storage->mark_failed(k->piece);
+                            post_callback(q, *k, -1);
+                        }
                         break;
                     }
 
+                    l.lock();
                     m_cache_stats.total_read_back += readback / m_block_size;
+                    l.unlock();
 
-                    ret = (j.storage->info()->hash_for_piece(j.piece) == h)?0:-2;
+                    for (size_t k = 0; k < batch.size(); ++k)
+                    {
+                        int r = (batch[k].storage->info()->hash_for_piece(batch[k].piece) == hashes[k + 1])?0:-2;
+                        if (r == -2) batch[k].storage->mark_failed(batch[k].piece);
+                        post_callback(q, batch[k], r);
+                    }
+
+                    ret = (j.storage->info()->hash_for_piece(j.piece) == hashes[0])?0:-2;
                     if (ret == -2) j.storage->mark_failed(j.piece);
 
                     libed2k::ptime done = libed2k::time_now_hires();
+                    l.lock();
                     m_hash_time.add_sample(total_microseconds(done - hash_start));
                     m_cache_stats.cumulative_hash_time += total_milliseconds(done - hash_start);
                     break;
@@ -2370,22 +2822,22 @@ namespace libed2k
                     for (int processed = 0; processed < 4 * 1024 * 1024; processed += piece_size)
                     {
                         libed2k::ptime now = libed2k::time_now_hires();
-                        LIBED2K_ASSERT(now >= m_last_file_check);
+                        LIBED2K_ASSERT(now >= q.last_file_check);
                         // this happens sometimes on windows for some reason
-                        if (now < m_last_file_check) now = m_last_file_check;
+                        if (now < q.last_file_check) now = q.last_file_check;
 
 #if BOOST_VERSION > 103600
-                        if (now - m_last_file_check < libed2k::milliseconds(m_settings.file_checks_delay_per_block))
+                        if (now - q.last_file_check < libed2k::milliseconds(q.settings.file_checks_delay_per_block))
                         {
-                            int sleep_time = m_settings.file_checks_delay_per_block
+                            int sleep_time = q.settings.file_checks_delay_per_block
                                 * (piece_size / m_block_size)
-                                - total_milliseconds(now - m_last_file_check);
+                                - total_milliseconds(now - q.last_file_check);
                             if (sleep_time < 0) sleep_time = 0;
                             LIBED2K_ASSERT(sleep_time < 5 * 1000);
 
                             sleep(sleep_time);
                         }
-                        m_last_file_check = libed2k::time_now_hires();
+                        q.last_file_check = libed2k::time_now_hires();
 #endif
 
                         libed2k::ptime hash_start = libed2k::time_now_hires();
@@ -2394,13 +2846,15 @@ namespace libed2k
                         ret = j.storage->check_files(j.piece, j.offset, j.error);
 
                         libed2k::ptime done = libed2k::time_now_hires();
+                        mutex::scoped_lock l(m_piece_mutex);
                         m_hash_time.add_sample(total_microseconds(done - hash_start));
                         m_cache_stats.cumulative_hash_time += total_milliseconds(done - hash_start);
+                        l.unlock();
 
                         LIBED2K_TRY {
                             LIBED2K_ASSERT(j.callback);
                             if (j.callback && ret == piece_manager::need_full_check)
-                                post_callback(j, ret);
+                                post_callback(q, j, ret);
                         } LIBED2K_CATCH(std::exception&) {}
                         if (ret != piece_manager::need_full_check) break;
                     }
@@ -2458,8 +2912,17 @@ namespace libed2k
             LIBED2K_ASSERT(!j.storage || !j.storage->error());
 
             libed2k::ptime done = libed2k::time_now_hires();
+            sl.lock();
             m_job_time.add_sample(total_microseconds(done - operation_start));
             m_cache_stats.cumulative_job_time += total_milliseconds(done - operation_start);
+            sl.unlock();
+
+            jl.lock();
+            ++q.stats.jobs;
+            if (ret >= 0 && (j.action == disk_io_job::read || j.action == disk_io_job::read_pipe))
+                ++q.stats.blocks_read;
+            else if (ret >= 0 && j.action == disk_io_job::write) ++q.stats.blocks_written;
+            jl.unlock();
 
 //          if (!j.callback) std::cerr << "DISK THREAD: no callback specified" << std::endl;
 //          else std::cerr << "DISK THREAD: invoking callback" << std::endl;
@@ -2468,10 +2931,10 @@ namespace libed2k
                     || j.action == disk_io_job::hash);
 #if LIBED2K_DISK_STATS
                 if ((j.action == disk_io_job::read || j.action == disk_io_job::read_and_hash)
-                    && j.buffer != 0)
+                    && j.buffer != 0 && !j.mapping)
                     rename_buffer(j.buffer, "posted send buffer");
 #endif
-                post_callback(j, ret);
+                post_callback(q, j, ret);
             } LIBED2K_CATCH(std::exception&) {
                 LIBED2K_ASSERT(false);
             }
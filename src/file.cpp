@@ -5,10 +5,14 @@
 #include <algorithm>
 #include <locale>
 
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+
 #include "libed2k/constants.hpp"
 #include "libed2k/log.hpp"
 #include "libed2k/file.hpp"
 #include "libed2k/hasher.hpp"
+#include "libed2k/aich.hpp"
 #include "libed2k/util.hpp"
 #include "libed2k/thread.hpp"
 
@@ -585,6 +589,32 @@ namespace libed2k
         }
     }
 
+    known_file_entry::known_file_entry(const add_transfer_params& atp, boost::uint32_t nLastChanged) :
+                                        m_nLastChanged(nLastChanged),
+                                        m_hFile(atp.file_hash)
+    {
+        __file_size fs_trans;
+        fs_trans.nQuadPart = atp.transferred;
+
+        // single hash is stored as file hash only
+        if (atp.piece_hashses.size() > 1)
+            m_hash_list.m_collection.assign(atp.piece_hashses.begin(), atp.piece_hashses.end());
+
+        m_list.add_tag(make_string_tag(libed2k::filename(atp.file_path), FT_FILENAME, true));
+        m_list.add_tag(make_string_tag(libed2k::filename(atp.file_path), FT_FILENAME, true));  // write same name for backward compatibility
+
+        if (atp.file_size > 0xFFFFFFFFLL)
+            m_list.add_tag(make_typed_tag(static_cast<boost::uint64_t>(atp.file_size), FT_FILESIZE, true));
+        else
+            m_list.add_tag(make_typed_tag(static_cast<boost::uint32_t>(atp.file_size), FT_FILESIZE, true));
+
+        m_list.add_tag(make_typed_tag(fs_trans.u.nLowPart, FT_ATTRANSFERRED, true));
+        m_list.add_tag(make_typed_tag(fs_trans.u.nHighPart, FT_ATTRANSFERREDHI, true));
+        m_list.add_tag(make_typed_tag(atp.requested, FT_ATREQUESTED, true));
+        m_list.add_tag(make_typed_tag(atp.accepted, FT_ATACCEPTED, true));
+        m_list.add_tag(make_typed_tag(atp.priority, FT_ULPRIORITY, true));
+    }
+
     void known_file_entry::dump() const
     {
         DBG("known_file_entry::dump(TS: " << m_nLastChanged
@@ -593,90 +623,135 @@ namespace libed2k
                 << " tag list size: " << m_list.size());
     }
 
+    known_file_key::known_file_key(const std::string& name, boost::uint32_t changed, size_type size) :
+        m_name(bom_filter(name)), m_changed(changed), m_size(size)
+    {
+    }
+
+    known_file_key::known_file_key(const known_file_entry& entry) :
+        m_name(bom_filter(entry.m_list.getStringTagByNameId(FT_FILENAME))),
+        m_changed(entry.m_nLastChanged),
+        m_size(entry.m_list.getIntTagByNameId(FT_FILESIZE) + (entry.m_list.getIntTagByNameId(FT_FILESIZE_HI) << 32))
+    {
+    }
+
+    bool known_file_key::operator==(const known_file_key& key) const
+    {
+        return (m_changed == key.m_changed && m_size == key.m_size && m_name == key.m_name);
+    }
+
+    std::size_t hash_value(const known_file_key& key)
+    {
+        std::size_t seed = boost::hash_value(key.m_name);
+        boost::hash_combine(seed, key.m_changed);
+        boost::hash_combine(seed, key.m_size);
+        return seed;
+    }
+
     known_file_collection::known_file_collection()
     {
     }
 
-    add_transfer_params known_file_collection::extract_transfer_params(time_t write_ts, const std::string& filepath)
+    void known_file_collection::build_index()
     {
-        add_transfer_params atp;
+        m_index.clear();
+        m_index.rehash(m_known_file_list.m_collection.size());
 
         for (size_t n = 0; n < m_known_file_list.m_collection.size(); n++)
         {
-            // pass files when change time isn't equal
-            if (write_ts != static_cast<time_t>(m_known_file_list.m_collection[n].m_nLastChanged))
-            {
-                continue;
-            }
+            // later entry wins like in sequential search from the end
+            m_index[known_file_key(m_known_file_list.m_collection[n])] = n;
+        }
+    }
 
-            // ok, we have equal change time - let's check filepath
-            if (bom_filter(filename(filepath)) != bom_filter(m_known_file_list.m_collection[n].m_list.getStringTagByNameId(FT_FILENAME)))
-            {
-                DBG("orig: " << convert_to_native(filepath)
-                    << " isn't equal: " << convert_to_native(bom_filter(m_known_file_list.m_collection[n].m_list.getStringTagByNameId(FT_FILENAME))));
-                continue;
-            }
+    add_transfer_params known_file_collection::extract_transfer_params(time_t write_ts, size_type size, const std::string& filepath)
+    {
+        add_transfer_params atp;
+        known_file_index::const_iterator itr =
+            m_index.find(known_file_key(filename(filepath), static_cast<boost::uint32_t>(write_ts), size));
 
-            atp.file_path = filepath;
-            atp.file_hash = m_known_file_list.m_collection[n].m_hFile;
+        if (itr == m_index.end())
+        {
+            return atp;
+        }
 
-            if (m_known_file_list.m_collection[n].m_hash_list.m_collection.empty())
-            {
-                // when file contain only one hash - we save main hash directly into container
-                atp.piece_hashses.push_back(m_known_file_list.m_collection[n].m_hFile);
-            }
-            else
-            {
-                atp.piece_hashses = m_known_file_list.m_collection[n].m_hash_list.m_collection;
-            }
+        const known_file_entry& entry = m_known_file_list.m_collection[itr->second];
 
-            for (size_t j = 0; j < m_known_file_list.m_collection[n].m_list.size(); j++)
-            {
-                const boost::shared_ptr<base_tag> p = m_known_file_list.m_collection[n].m_list[j];
-                // we process only int tags - check only ints
-                if (!is_int_tag(p))
-                    continue;
+        atp.file_path = filepath;
+        atp.file_hash = entry.m_hFile;
 
-                switch(p->getNameId())
-                {
-                    case FT_FILESIZE:
-                        atp.file_size = p->asInt();
-                        break;
-                    case FT_ATTRANSFERRED:
-                        atp.transferred += p->asInt();
-                        break;
-                    case FT_ATTRANSFERREDHI:
-                        atp.transferred += (p->asInt() << 32);
-                        break;
-                    case FT_ATREQUESTED:
-                        atp.requested = p->asInt();
-                        break;
-                    case FT_ATACCEPTED:
-                        atp.accepted = p->asInt();
-                        break;
-                    case FT_ULPRIORITY:
-                        atp.priority = p->asInt();
-                        break;
-                    default:
-                        // ignore unused tags like
-                        // FT_PERMISSIONS
-                        // FT_AICH_HASH:
-                        // and all kad tags
-                        // also FT_FILENAME was already checked
-                        break;
-                }
-            }
+        if (entry.m_hash_list.m_collection.empty())
+        {
+            // when file contain only one hash - we save main hash directly into container
+            atp.piece_hashses.push_back(entry.m_hFile);
+        }
+        else
+        {
+            atp.piece_hashses = entry.m_hash_list.m_collection;
+        }
+
+        for (size_t j = 0; j < entry.m_list.size(); j++)
+        {
+            const boost::shared_ptr<base_tag> p = entry.m_list[j];
+            // we process only int tags - check only ints
+            if (!is_int_tag(p))
+                continue;
 
-            atp.file_path = filepath;
-            atp.seed_mode  = true;
-            DBG("metadata was migrated for {" << convert_to_native(filepath) << "}{"
-                    << atp.file_hash.toString() << "}{" << atp.file_size << "}");
-            break;
+            switch(p->getNameId())
+            {
+                case FT_FILESIZE:
+                    atp.file_size += p->asInt();
+                    break;
+                case FT_FILESIZE_HI:
+                    atp.file_size += (p->asInt() << 32);
+                    break;
+                case FT_ATTRANSFERRED:
+                    atp.transferred += p->asInt();
+                    break;
+                case FT_ATTRANSFERREDHI:
+                    atp.transferred += (p->asInt() << 32);
+                    break;
+                case FT_ATREQUESTED:
+                    atp.requested = p->asInt();
+                    break;
+                case FT_ATACCEPTED:
+                    atp.accepted = p->asInt();
+                    break;
+                case FT_ULPRIORITY:
+                    atp.priority = p->asInt();
+                    break;
+                default:
+                    // ignore unused tags like
+                    // FT_PERMISSIONS
+                    // FT_AICH_HASH:
+                    // and all kad tags
+                    // also FT_FILENAME was already checked
+                    break;
+            }
         }
 
+        atp.seed_mode  = true;
+        DBG("metadata was migrated for {" << convert_to_native(filepath) << "}{"
+                << atp.file_hash.toString() << "}{" << atp.file_size << "}");
         return atp;
     }
 
+    void known_file_collection::append(const add_transfer_params& atp, time_t write_ts)
+    {
+        known_file_entry entry(atp, static_cast<boost::uint32_t>(write_ts));
+        std::pair<known_file_index::iterator, bool> res =
+            m_index.insert(std::make_pair(known_file_key(entry), m_known_file_list.m_collection.size()));
+
+        if (res.second)
+        {
+            m_known_file_list.m_collection.push_back(entry);
+        }
+        else
+        {
+            m_known_file_list.m_collection[res.first->second] = entry;
+        }
+    }
+
     void known_file_collection::dump() const
     {
         for (size_t n = 0; n < m_known_file_list.m_collection.size(); n++)
@@ -685,26 +760,46 @@ namespace libed2k
         }
     }
 
-    transfer_params_maker::transfer_params_maker(alert_manager& am, const std::string& known_filepath) :
+    transfer_params_maker::transfer_params_maker(alert_manager& am, const std::string& known_filepath,
+            int workers /*= 1*/, int io_per_device /*= 1*/) :
             m_am(am),
+            m_known_filepath(known_filepath),
+            m_kfc_saved(time_now_hires()),
+            m_kfc_loaded(false),
+            m_kfc_rewrite(true),
+            m_kfc_end(0),
+            m_kfc_count(0),
+            m_workers(std::max(workers, 1)),
+            m_io_per_device(io_per_device),
             m_abort(false),
-            m_abort_current(false),
-            m_current_filepath(""),
-            m_known_filepath(known_filepath)
+            m_active(0),
+            m_total_files(0),
+            m_total_bytes(0),
+            m_read_time(seconds(0)),
+            m_hash_time(seconds(0)),
+            m_busy_time(seconds(0))
     {
     }
 
     bool transfer_params_maker::start()
     {
-        LIBED2K_ASSERT(!m_thread);
-        m_thread.reset(new boost::thread(boost::ref(*this)));
-#ifdef WIN32
-        HANDLE th = m_thread->native_handle();
-        if (!SetThreadPriority(th, THREAD_PRIORITY_IDLE))
+        LIBED2K_ASSERT(m_threads.empty());
+        m_slots.assign(m_workers, worker_slot());
+        m_kfc_loaded = false;
+
+        for (int i = 0; i < m_workers; ++i)
         {
-            ERR("Unable to set idle priority to hasher thread");
-        }
+            m_threads.push_back(boost::shared_ptr<boost::thread>(
+                new boost::thread(boost::bind(&transfer_params_maker::worker, this, i))));
+#ifdef WIN32
+            HANDLE th = m_threads.back()->native_handle();
+            if (!SetThreadPriority(th, THREAD_PRIORITY_IDLE))
+            {
+                ERR("Unable to set idle priority to hasher thread");
+            }
 #endif
+        }
+
         return true;
     }
 
@@ -717,19 +812,27 @@ namespace libed2k
     {
         boost::mutex::scoped_lock lock(m_mutex);
         m_order.clear();
-        m_abort_current = true;
         m_abort = true;
-        m_condition.notify_one();
+
+        for (std::vector<worker_slot>::iterator itr = m_slots.begin(); itr != m_slots.end(); ++itr)
+        {
+            itr->m_abort = true;
+        }
+
+        m_condition.notify_all();
 
         lock.unlock();
 
-        // when thread exists - wait it
-        if (m_thread.get())
+        // when threads exist - wait them
+        for (size_t n = 0; n < m_threads.size(); ++n)
         {
-            m_thread->join();
+            m_threads[n]->join();
         }
 
-        m_thread.reset();   //!< remove thread
+        m_threads.clear();  //!< remove threads
+        save_known_file();
+        m_slots.clear();
+        m_device_load.clear();
         m_abort = false;
     }
 
@@ -742,38 +845,97 @@ namespace libed2k
     std::string transfer_params_maker::current_filepath()
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        return m_current_filepath;
+
+        for (std::vector<worker_slot>::const_iterator itr = m_slots.begin(); itr != m_slots.end(); ++itr)
+        {
+            if (!itr->m_filepath.empty()) return itr->m_filepath;
+        }
+
+        return std::string();
+    }
+
+    hashing_status transfer_params_maker::status() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        hashing_status hs;
+        hs.workers = m_workers;
+        hs.active = m_active;
+        hs.queued = m_order.size();
+        hs.total_files = m_total_files;
+        hs.total_bytes = m_total_bytes;
+        hs.read_time = total_microseconds(m_read_time) / 1000;
+        hs.hash_time = total_microseconds(m_hash_time) / 1000;
+
+        time_duration busy = m_busy_time;
+        if (m_active > 0) busy += time_now_hires() - m_busy_start;
+        boost::int64_t busy_ms = total_milliseconds(busy);
+
+        if (busy_ms > 0)
+        {
+            hs.files_rate = static_cast<float>(m_total_files * 1000) / busy_ms;
+            hs.bytes_rate = m_total_bytes * 1000 / busy_ms;
+        }
+
+        return hs;
     }
 
     void transfer_params_maker::make_transfer_params(const std::string& filepath)
     {
+        // device is found by worker, stat may block on slow or network volumes
+        order_entry e;
+        e.m_filepath = filepath;
+        e.m_device = 0;
+        e.m_resolved = false;
+
         boost::mutex::scoped_lock lock(m_mutex);
-        m_order.push_front(filepath);
+        m_order.push_front(e);
         m_condition.notify_one();
     }
 
     void transfer_params_maker::cancel_transfer_params(const std::string& filepath)
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        std::deque<std::string>::iterator itr = std::remove(m_order.begin(), m_order.end(), filepath);
 
-        // we got target in order - simply erase it and exit
-        // it doesn't claim any signals
-        if (itr != m_order.end())
+        for (std::deque<order_entry>::iterator itr = m_order.begin(); itr != m_order.end(); ++itr)
         {
-            m_order.erase(itr, m_order.end());
-            return;
+            // we got target in order - simply erase it and exit
+            // it doesn't claim any signals
+            if (itr->m_filepath == filepath)
+            {
+                m_order.erase(itr);
+                return;
+            }
         }
 
-        if (m_current_filepath == filepath)
+        for (std::vector<worker_slot>::iterator itr = m_slots.begin(); itr != m_slots.end(); ++itr)
         {
-            m_abort_current = true;               // erase flag available only on current iteration
+            if (itr->m_filepath == filepath)
+            {
+                itr->m_abort = true;    // erase flag available only on current iteration
+                ++itr->m_cancels;       // worker emits alert after current file processing completed
+                return;
+            }
         }
 
-        m_cancel_order.push(filepath);  // this alert will emit after current file processing completed
+        m_cancel_order.push(filepath);  // nobody hashes this file, alert goes out at once
+        m_condition.notify_one();
+    }
+
+    void replace_file(const std::string& from, const std::string& to, error_code& ec)
+    {
+#if defined LIBED2K_WINDOWS && LIBED2K_USE_WSTRING
+        // rename doesn't replace existing file on windows
+        if (!MoveFileExW(convert_to_wstring(from).c_str(), convert_to_wstring(to).c_str(), MOVEFILE_REPLACE_EXISTING))
+            ec.assign(GetLastError(), boost::system::get_system_category());
+#elif defined LIBED2K_WINDOWS
+        if (!MoveFileExA(convert_to_native(from).c_str(), convert_to_native(to).c_str(), MOVEFILE_REPLACE_EXISTING))
+            ec.assign(GetLastError(), boost::system::get_system_category());
+#else
+        rename(from, to, ec);
+#endif
     }
 
-    void transfer_params_maker::operator()()
+    void transfer_params_maker::load_known_file()
     {
         // when we have known filepath path - attempt to extract its content
         if (!m_known_filepath.empty())
@@ -787,6 +949,11 @@ namespace libed2k
                 try
                 {
                     ifa >> m_kfc;
+
+                    boost::mutex::scoped_lock lock(m_kfc_save_mutex);
+                    m_kfc_rewrite = false;
+                    m_kfc_end = fstream.tellg();
+                    m_kfc_count = m_kfc.m_known_file_list.m_collection.size();
                 }
                 catch(libed2k_exception&)
                 {
@@ -795,12 +962,230 @@ namespace libed2k
             }
         }
 
+        {
+            boost::mutex::scoped_lock lock(m_kfc_mutex);
+            m_kfc.build_index();
+        }
+
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_kfc_loaded = true;
+        m_condition.notify_all();
+    }
+
+    bool transfer_params_maker::pop_order(worker_slot& slot)
+    {
+        // order is filled from front, take the oldest file whose device has free I/O slot
+        for (std::deque<order_entry>::reverse_iterator itr = m_order.rbegin(); itr != m_order.rend(); ++itr)
+        {
+            if (!itr->m_resolved)
+            {
+                slot.m_filepath = itr->m_filepath;
+                slot.m_resolving = true;
+                m_order.erase(--itr.base());
+                return true;
+            }
+
+            int& load = m_device_load[itr->m_device];
+            if (m_io_per_device > 0 && load >= m_io_per_device) continue;
+
+            ++load;
+            slot.m_filepath = itr->m_filepath;
+            slot.m_device = itr->m_device;
+            m_order.erase(--itr.base());
+
+            if (m_active++ == 0) m_busy_start = time_now_hires();
+            return true;
+        }
+
+        return false;
+    }
+
+    void transfer_params_maker::release_slot(worker_slot& slot)
+    {
+        if (slot.m_filepath.empty()) return;
+
+        for (; slot.m_cancels > 0; --slot.m_cancels)
+        {
+            m_am.post_alert_should(transfer_params_alert(add_transfer_params(slot.m_filepath), errors::file_params_making_was_cancelled));
+        }
+
+        if (slot.m_resolving)
+        {
+            // file waits for free I/O slot of its device like the others, as the oldest one
+            if (!slot.m_abort)
+            {
+                order_entry e;
+                e.m_filepath = slot.m_filepath;
+                e.m_device = slot.m_device;
+                e.m_resolved = true;
+                m_order.push_back(e);
+            }
+
+            slot.m_resolving = false;
+            slot.m_filepath.clear();
+            m_condition.notify_all();
+            return;
+        }
+
+        std::map<boost::uint64_t, int>::iterator itr = m_device_load.find(slot.m_device);
+        LIBED2K_ASSERT(itr != m_device_load.end() && itr->second > 0);
+        if (--itr->second == 0) m_device_load.erase(itr);
+
+        if (--m_active == 0) m_busy_time += time_now_hires() - m_busy_start;
+
+        slot.m_filepath.clear();
+        // device became free - other workers could have files for it
+        m_condition.notify_all();
+    }
+
+    void transfer_params_maker::on_file_hashed(size_type bytes, time_duration read_time, time_duration hash_time)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        ++m_total_files;
+        m_total_bytes += bytes;
+        m_read_time += read_time;
+        m_hash_time += hash_time;
+    }
+
+    void transfer_params_maker::remember_file(const add_transfer_params& atp, time_t write_ts)
+    {
+        if (m_known_filepath.empty()) return;
+
+        boost::mutex::scoped_lock lock(m_kfc_mutex);
+        m_kfc.append(atp, write_ts);
+        m_kfc_pending.push_back(known_file_entry(atp, static_cast<boost::uint32_t>(write_ts)));
+        bool checkpoint = m_kfc_pending.size() >= checkpoint_files || time_now_hires() - m_kfc_saved >= seconds(checkpoint_interval);
+        lock.unlock();
+
+        if (checkpoint) save_known_file();
+    }
+
+    void transfer_params_maker::save_known_file()
+    {
+        if (m_known_filepath.empty()) return;
+
+        // one save at a time, hashing workers wait only while pending entries are taken
+        boost::mutex::scoped_lock save_lock(m_kfc_save_mutex);
+        boost::mutex::scoped_lock lock(m_kfc_mutex);
+
+        if (m_kfc_pending.empty())
+            return;
+
+        std::deque<known_file_entry> entries;
+        entries.swap(m_kfc_pending);
+        m_kfc_saved = time_now_hires();
+
+        // whole collection is copied only until known file is written first time
+        known_file_collection kfc;
+        if (m_kfc_rewrite) kfc.m_known_file_list = m_kfc.m_known_file_list;
+        lock.unlock();
+
+        error_code ec;
+        if (m_kfc_rewrite) write_known_file(kfc, ec);
+        else append_known_file(entries, ec);
+
+        if (ec)
+        {
+            ERR("unable to save {" << convert_to_native(m_known_filepath) << "}: " << ec.message());
+            // file state is unknown now, the next checkpoint writes it from scratch
+            m_kfc_rewrite = true;
+            lock.lock();
+            m_kfc_pending.insert(m_kfc_pending.begin(), entries.begin(), entries.end());
+            return;
+        }
+
+        DBG("known file saved {" << m_kfc_count << " entries}");
+    }
+
+    void transfer_params_maker::append_known_file(const std::deque<known_file_entry>& entries, error_code& ec)
+    {
+        std::ostringstream data;
+        libed2k::archive::ed2k_oarchive ofa(data);
+
+        for (std::deque<known_file_entry>::const_iterator itr = entries.begin(); itr != entries.end(); ++itr)
+            ofa << const_cast<known_file_entry&>(*itr);
+
+        boost::uint32_t count = m_kfc_count + entries.size();
+        std::ostringstream header;
+        libed2k::archive::ed2k_oarchive ofh(header);
+        ofh << count;
+
+        file f(m_known_filepath, file::read_write, ec);
+        if (ec) return;
+
+        // file was replaced or truncated behind us
+        size_type size = f.get_size(ec);
+        if (ec) return;
+        if (size < m_kfc_end)
+        {
+            ec = errors::file_was_truncated;
+            return;
+        }
+
+        std::string buffer = data.str();
+        file::iovec_t b = { const_cast<char*>(buffer.c_str()), buffer.size() };
+        if (f.writev(m_kfc_end, &b, 1, ec) != size_type(buffer.size()) && !ec)
+            ec = errors::file_was_truncated;
+        if (ec || !f.sync(ec)) return;
+
+        // count follows header byte
+        std::string count_buffer = header.str();
+        file::iovec_t c = { const_cast<char*>(count_buffer.c_str()), count_buffer.size() };
+        if (f.writev(sizeof(boost::uint8_t), &c, 1, ec) != size_type(count_buffer.size()) && !ec)
+            ec = errors::file_was_truncated;
+        if (ec || !f.sync(ec)) return;
+
+        m_kfc_end += buffer.size();
+        m_kfc_count = count;
+    }
+
+    void transfer_params_maker::write_known_file(const known_file_collection& kfc, error_code& ec)
+    {
+        std::string tmp_filepath = m_known_filepath + ".tmp";
+        std::ostringstream data;
+        libed2k::archive::ed2k_oarchive ofa(data);
+        ofa << const_cast<known_file_collection&>(kfc);
+        std::string buffer = data.str();
+
+        {
+            file f(tmp_filepath, file::write_only, ec);
+            if (ec) return;
+
+            // file is reused when previous write failed
+            if (!f.set_size(0, ec)) return;
+
+            file::iovec_t b = { const_cast<char*>(buffer.c_str()), buffer.size() };
+            if (f.writev(0, &b, 1, ec) != size_type(buffer.size()) && !ec)
+                ec = errors::file_was_truncated;
+            if (ec || !f.sync(ec)) return;
+        }
+
+        replace_file(tmp_filepath, m_known_filepath, ec);
+        if (ec) return;
+
+        // rename is durable only when directory entry reaches disk
+        if (has_parent_path(m_known_filepath))
+        {
+            sync_directory(parent_path(m_known_filepath), ec);
+            if (ec) return;
+        }
+
+        m_kfc_rewrite = false;
+        m_kfc_end = buffer.size();
+        m_kfc_count = kfc.m_known_file_list.m_collection.size();
+    }
+
+    void transfer_params_maker::worker(int index)
+    {
+        if (index == 0) load_known_file();
+
+        worker_slot& slot = m_slots[index];
 
         while(1)
         {
             boost::mutex::scoped_lock lock(m_mutex);
-            m_current_filepath.clear();
-            m_abort_current = false;
+            release_slot(slot);
+            slot.m_abort = false;
 
             if (m_abort) { break; }
 
@@ -811,23 +1196,192 @@ namespace libed2k
                 m_cancel_order.pop();
             }
 
-            if(m_order.empty())
+            if (!m_kfc_loaded || !pop_order(slot))
             {
                 m_condition.wait(lock);
+                continue;
             }
 
-            if (!m_order.empty())
+            std::string filepath = slot.m_filepath;
+            lock.unlock();
+
+            if (slot.m_resolving)
+            {
+                // files which we can't stat go to the common zero device and fail in process_item
+                file_status fs;
+                error_code ec;
+                stat_file(filepath, &fs, ec);
+                slot.m_device = ec ? 0 : fs.device;
+                continue;
+            }
+
+            process_item(filepath, slot.m_abort);
+        }
+
+        DBG("transfer_params_maker {thread " << index << " exit}");
+    }
+
+    namespace
+    {
+        /**
+          * one read step of file hashing - contiguous run of blocks at same offset in every piece of group
+         */
+        struct hash_step
+        {
+            int         piece;      //!< first piece of group
+            int         streams;    //!< pieces in group
+            size_type   offset;     //!< offset in piece
+            int         size;       //!< block size
+            bool        last;       //!< last block of pieces
+        };
+
+        /**
+          * reader thread fills ring of buffers ahead of hasher, buffer holds blocks of
+          * one step placed one by one. Next step is advised to OS before current read,
+          * so disk read-ahead goes in background too
+         */
+        class read_pipeline : boost::noncopyable
+        {
+        public:
+            read_pipeline(file& f, const std::vector<hash_step>& steps, const bool& cancel);
+            ~read_pipeline();
+
+            /**
+              * wait data of next step
+              * @return buffer or zero on read error or cancel
+             */
+            const char* front(error_code& ec);
+
+            /**
+              * release buffer of hashed step to reader
+             */
+            void pop();
+
+            time_duration read_time() const;
+        private:
+            void reader();
+            char* slot(size_t step) { return &m_buffer[(step % m_depth) * m_stride]; }
+
+            file&       m_file;
+            const std::vector<hash_step>& m_steps;
+            const bool& m_cancel;
+            size_t      m_depth;
+            size_t      m_stride;
+            std::vector<char> m_buffer;
+
+            mutable boost::mutex m_mutex;
+            boost::condition m_condition;
+            size_t      m_read;     //!< steps were read
+            size_t      m_hashed;   //!< steps were released by hasher
+            bool        m_abort;
+            error_code  m_ec;       //!< error of step m_read
+            time_duration m_read_time;
+            boost::shared_ptr<boost::thread> m_thread;
+        };
+
+        read_pipeline::read_pipeline(file& f, const std::vector<hash_step>& steps, const bool& cancel) :
+            m_file(f), m_steps(steps), m_cancel(cancel),
+            m_depth(std::min<size_t>(file2atp::pipeline_depth, steps.size())), m_stride(0),
+            m_read(0), m_hashed(0), m_abort(false), m_read_time(seconds(0))
+        {
+            for (std::vector<hash_step>::const_iterator itr = m_steps.begin(); itr != m_steps.end(); ++itr)
             {
-                m_current_filepath = m_order.back();
-                m_order.pop_back();
+                m_stride = std::max<size_t>(m_stride, itr->streams * itr->size);
             }
 
+            m_buffer.resize(m_depth * m_stride);
+
+            // nothing to overlap for one block
+            if (m_steps.size() > 1)
+                m_thread.reset(new boost::thread(boost::bind(&read_pipeline::reader, this)));
+            else
+                reader();
+        }
+
+        read_pipeline::~read_pipeline()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_abort = true;
+            m_condition.notify_all();
             lock.unlock();
 
-            if (!m_current_filepath.empty()) process_item();
+            if (m_thread) m_thread->join();
+        }
+
+        const char* read_pipeline::front(error_code& ec)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            while (m_read == m_hashed && !m_ec)
+                m_condition.wait(lock);
+
+            if (m_read == m_hashed)
+            {
+                ec = m_ec;
+                return 0;
+            }
+
+            return slot(m_hashed);
         }
 
-        DBG("transfer_params_maker {thread exit}");
+        void read_pipeline::pop()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            ++m_hashed;
+            m_condition.notify_all();
+        }
+
+        time_duration read_pipeline::read_time() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_read_time;
+        }
+
+        void read_pipeline::reader()
+        {
+            for (size_t n = 0; n < m_steps.size(); ++n)
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                while (!m_abort && n - m_hashed >= m_depth)
+                    m_condition.wait(lock);
+
+                if (m_abort) return;
+                lock.unlock();
+
+                if (n + 1 < m_steps.size())
+                {
+                    const hash_step& next = m_steps[n + 1];
+
+                    for (int i = 0; i < next.streams; ++i)
+                        m_file.hint_read(size_type(next.piece + i)*PIECE_SIZE + next.offset, next.size);
+                }
+
+                const hash_step& step = m_steps[n];
+                char* buffer = slot(n);
+                error_code ec;
+                ptime start = time_now_hires();
+
+                for (int i = 0; i < step.streams && !ec; ++i)
+                {
+                    file::iovec_t b = {buffer + i*step.size, static_cast<size_t>(step.size)};
+                    m_file.readv(size_type(step.piece + i)*PIECE_SIZE + step.offset, &b, 1, ec);
+                }
+
+                time_duration elapsed = time_now_hires() - start;
+
+                if (!ec && m_cancel)
+                    ec = errors::file_params_making_was_cancelled;
+
+                lock.lock();
+                m_read_time += elapsed;
+                m_ec = ec;
+                if (!ec) ++m_read;
+                m_condition.notify_all();
+
+                if (ec) return;
+            }
+        }
     }
 
     std::pair<add_transfer_params, error_code> file2atp::operator()(const std::string& filepath, const bool& cancel)
@@ -840,8 +1394,10 @@ namespace libed2k
         // store filepath always for search node ability!
         atp.file_path = filepath;
         atp.file_size = 0;
+        read_time = seconds(0);
+        hash_time = seconds(0);
 
-        file f(filepath, file::read_only, ec);
+        file f(filepath, file::read_only | file::sequential_access, ec);
 
         // check size when file opened successfully
         if (!ec)
@@ -857,39 +1413,80 @@ namespace libed2k
 
             // prepare results vector
             atp.piece_hashses.resize(pieces_count);
-            size_type capacity = atp.file_size;
-            size_type offset = 0;
-            char chBlock[BLOCK_SIZE];
+            atp.aich_hashes.resize(aich_hash_tree::blocks_count(atp.file_size));
+
+            // full pieces are hashed by groups in parallel hasher lanes, each step reads
+            // a run of blocks of every piece in group, the tail piece is hashed alone.
+            // Runs are megabytes long, so seeks between pieces of group cost little on HDD
+            const int full_pieces = atp.file_size / PIECE_SIZE;
+            const int lanes = multi_hasher::lanes();
+            std::vector<hash_step> steps;
 
-            for (int i = 0; i < pieces_count; ++i)
+            for (int i = 0; i < pieces_count; )
             {
-                hasher piece_hash;
-                size_type in_piece_capacity = std::min<size_type>(libed2k::PIECE_SIZE, capacity);
+                hash_step step;
+                step.piece = i;
+                step.streams = (i < full_pieces) ? std::min(lanes, full_pieces - i) : 1;
+                size_type in_piece_capacity = std::min<size_type>(libed2k::PIECE_SIZE, atp.file_size - size_type(i)*PIECE_SIZE);
+                size_type run = std::max<size_type>(1, step_bytes / BLOCK_SIZE / step.streams) * BLOCK_SIZE;
 
-                while(in_piece_capacity > 0)
+                for (step.offset = 0; step.offset < in_piece_capacity; step.offset += step.size)
                 {
-                    size_type current_block_size =  std::min(libed2k::BLOCK_SIZE, in_piece_capacity);
-                    file::iovec_t b = {chBlock, current_block_size};
-                    f.readv(offset, &b, 1, ec);
+                    step.size = std::min(run, in_piece_capacity - step.offset);
+                    step.last = (step.offset + step.size == in_piece_capacity);
+                    steps.push_back(step);
+                }
 
-                    if (!ec && cancel)
-                        ec = errors::file_params_making_was_cancelled;
+                i += step.streams;
+            }
 
-                    if (ec)
-                        break;
+            read_pipeline pipeline(f, steps, cancel);
+            multi_hasher piece_hash(1);
+            std::vector<aich_part_hasher> aich_hash(lanes);
+            const int aich_blocks = aich_hash_tree::blocks_in_part(PIECE_SIZE, 0);
+            const char* blocks[multi_hasher::max_streams];
 
-                    piece_hash.update(chBlock, current_block_size);
-                    capacity -= current_block_size;
-                    in_piece_capacity -= current_block_size;
-                    offset += current_block_size;
-                }
+            for (std::vector<hash_step>::const_iterator itr = steps.begin(); itr != steps.end(); ++itr)
+            {
+                const char* buffer = pipeline.front(ec);
 
                 if (ec)
                     break;
 
-                atp.piece_hashses[i] = piece_hash.final();
+                for (int n = 0; n < itr->streams; ++n)
+                    blocks[n] = buffer + n*itr->size;
+
+                ptime start = time_now_hires();
+                if (itr->offset == 0)
+                {
+                    piece_hash = multi_hasher(itr->streams);
+                    std::fill(aich_hash.begin(), aich_hash.end(), aich_part_hasher());
+                }
+
+                piece_hash.update(blocks, itr->size);
+                for (int n = 0; n < itr->streams; ++n)
+                    aich_hash[n].update(blocks[n], itr->size);
+
+                if (itr->last)
+                {
+                    piece_hash.final(&atp.piece_hashses[itr->piece]);
+
+                    for (int n = 0; n < itr->streams; ++n)
+                    {
+                        const std::vector<sha1_hash>& part = aich_hash[n].final();
+                        std::copy(part.begin(), part.end(),
+                            atp.aich_hashes.begin() + (itr->piece + n)*aich_blocks);
+                    }
+                }
+                hash_time += time_now_hires() - start;
+
+                pipeline.pop();
             }
 
+            read_time = pipeline.read_time();
+            DBG("file2atp{" << convert_to_native(filepath) << "} read: " << total_milliseconds(read_time)
+                << "ms, hash: " << total_milliseconds(hash_time) << "ms");
+
             if (!ec)
             {
                 if (pieces_count*libed2k::PIECE_SIZE == atp.file_size)
@@ -921,24 +1518,32 @@ namespace libed2k
         return res_pair;
     }
 
-    void transfer_params_maker::process_item()
+    void transfer_params_maker::process_item(const std::string& filepath, const bool& cancel)
     {
         error_code ec;
         file_status fs;
-        stat_file(m_current_filepath, &fs, ec);
+        stat_file(filepath, &fs, ec);
         add_transfer_params atp;
-        atp.file_path = m_current_filepath;
+        atp.file_path = filepath;
 
         if (!ec)
         {
-            atp = m_kfc.extract_transfer_params(fs.mtime, m_current_filepath);
+            {
+                boost::mutex::scoped_lock lock(m_kfc_mutex);
+                atp = m_kfc.extract_transfer_params(fs.mtime, fs.file_size, filepath);
+            }
 
             if (!atp.file_hash.defined() || (atp.file_size == 0)) // avoid some fails on zero lengths
             {
                 file2atp fatp;
-                std::pair<add_transfer_params, error_code> rp = fatp(m_current_filepath, m_abort_current);
+                std::pair<add_transfer_params, error_code> rp = fatp(filepath, cancel);
                 atp = rp.first;
                 ec =  rp.second;
+                if (!ec)
+                {
+                    on_file_hashed(atp.file_size, fatp.read_time, fatp.hash_time);
+                    remember_file(atp, fs.mtime);
+                }
             }
         }
 
@@ -207,6 +207,7 @@ namespace libed2k
         s->atime = ret.st_atime;
         s->mtime = ret.st_mtime;
         s->ctime = ret.st_ctime;
+        s->device = ret.st_dev;
         s->mode = ret.st_mode;
     }
 
@@ -649,6 +650,22 @@ namespace libed2k
         return true;
     }
 
+    void sync_directory(std::string const& f, error_code& ec)
+    {
+        ec.clear();
+#ifndef LIBED2K_WINDOWS
+        int fd = ::open(convert_to_native(f).c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            ec.assign(errno, boost::system::get_generic_category());
+            return;
+        }
+        if (::fsync(fd) != 0)
+            ec.assign(errno, boost::system::get_generic_category());
+        ::close(fd);
+#endif
+    }
+
     void remove(std::string const& inf, error_code& ec)
     {
         ec.clear();
@@ -1066,6 +1083,14 @@ namespace libed2k
         }
 #endif
 
+#ifdef POSIX_FADV_SEQUENTIAL
+        if (mode & sequential_access)
+        {
+            // double read-ahead window
+            posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+
 #endif
         m_open_mode = mode;
 
@@ -1916,6 +1941,25 @@ typedef struct _FILE_SET_SPARSE_BUFFER {
 #endif
     }
 
+    bool file::sync(error_code& ec)
+    {
+        LIBED2K_ASSERT(is_open());
+#ifdef LIBED2K_WINDOWS
+        if (::FlushFileBuffers(m_file_handle) == FALSE)
+        {
+            ec.assign(GetLastError(), get_system_category());
+            return false;
+        }
+#else
+        if (::fsync(m_fd) != 0)
+        {
+            ec.assign(errno, get_posix_category());
+            return false;
+        }
+#endif
+        return true;
+    }
+
     size_type file::get_size(error_code& ec) const
     {
 #ifdef LIBED2K_WINDOWS
@@ -470,10 +470,7 @@ namespace libed2k { namespace dht
         const char* incoming = NULL;
         if (!container.empty()) incoming = (const char*)&container[0];
 
-        typedef boost::iostreams::basic_array_source<char> Device;
-        boost::iostreams::stream_buffer<Device> buffer(incoming, container.size());
-        std::istream in_array_stream(&buffer);
-        archive::ed2k_iarchive ia(in_array_stream);
+        archive::ed2k_iarchive ia(incoming, container.size());
 
 #ifdef LIBED2K_DHT_VERBOSE_LOGGING
         LIBED2K_LOG(dht_tracker) << kad2string(uh.m_type) << " <== " << ep.address();
@@ -496,6 +493,7 @@ namespace libed2k { namespace dht
             case KADEMLIA_FIREWALLED_REQ: {
                 kad_firewalled_req p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming_request(p, ep);
                 break;
             }
@@ -506,30 +504,35 @@ namespace libed2k { namespace dht
             case KADEMLIA2_BOOTSTRAP_REQ: {
                 kad2_bootstrap_req p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming_request(p, ep);
                 break;
             }
             case KADEMLIA2_BOOTSTRAP_RES: {
                 kad2_bootstrap_res p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming(p, ep);
                 break;
             }
             case KADEMLIA2_HELLO_REQ: {
                 kad2_hello_req p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming_request(p, ep);
                 break;
             }
             case KADEMLIA2_HELLO_RES: {
                 kad2_hello_res p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming(p, ep);
                 break;
             }
             case KADEMLIA2_REQ: {
                 kademlia2_req p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming_request(p, ep);
                 break;
             }
@@ -539,6 +542,7 @@ namespace libed2k { namespace dht
             case KADEMLIA2_RES: {
                 kademlia2_res p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming(p, ep);
                 break;
             }
@@ -606,7 +610,8 @@ namespace libed2k { namespace dht
                 */
 
                 kad2_search_res p;                
-                ia >> p;                
+                ia >> p;
+                if (!ia) break;
 #ifdef LIBED2K_DHT_VERBOSE_LOGGING
                 LIBED2K_LOG(dht_tracker) << "search res incoming for{" << p.target_id << "} results count{" << p.results.m_collection.size() << "}";
 #endif
@@ -652,12 +657,14 @@ namespace libed2k { namespace dht
             case KADEMLIA2_PING: {
                 kad2_ping p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming_request(p, ep);
                 break;
             }
             case KADEMLIA2_PONG: {
                 kad2_pong p;
                 ia >> p;
+                if (!ia) break;
                 m_dht.incoming(p, ep);
                 break;
             }
@@ -672,6 +679,13 @@ namespace libed2k { namespace dht
                 break;
             }
             };
+
+            if (!ia) {
+#ifdef LIBED2K_DHT_VERBOSE_LOGGING
+                LIBED2K_LOG(dht_tracker) << " udp packet parse error " << ia.error().message();
+#endif
+                return;
+            }
         }
         catch (const libed2k_exception& e) {
 #ifdef LIBED2K_DHT_VERBOSE_LOGGING
@@ -18,6 +18,15 @@
 #include "libed2k/hasher.hpp"
 #include "libed2k/log.hpp"
 #include <string.h>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <cpuid.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#endif
 
 #ifndef LIBED2K_USE_OPENSSL
 namespace {
@@ -164,6 +173,336 @@ const unsigned char *body(struct MD4_CTX *ctx, const unsigned char *data, size_t
 #undef G
 #undef H
 
+/*
+ * Length accounting of MD4_Update, shared with the multi-buffer code.
+ */
+void count_length(struct MD4_CTX *ctx, boost::uint32_t size)
+{
+	boost::uint32_t saved_lo = ctx->lo;
+	if ((ctx->lo = (saved_lo + size) & 0x1fffffff) < saved_lo)
+		ctx->hi++;
+	ctx->hi += size >> 29;
+}
+
+/*
+ * Multi-buffer MD4: the same transformation applied to 4 (SSE2) or
+ * 8 (AVX2) independent streams, one stream per 32-bit vector lane.
+ * Every lane processes the same number of 64-byte blocks.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIBED2K_MD4_SIMD
+#define LIBED2K_TARGET(x) __attribute__((target(x)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define LIBED2K_MD4_SIMD
+#define LIBED2K_TARGET(x)
+#endif
+
+#ifdef LIBED2K_MD4_SIMD
+
+#define VF(x, y, z)	VXOR((z), VAND((x), VXOR((y), (z))))
+#define VG(x, y, z)	VOR(VAND((x), (y)), VAND((z), VOR((x), (y))))
+#define VH(x, y, z)	VXOR(VXOR((x), (y)), (z))
+
+#define VSTEP(f, a, b, c, d, x, s) \
+	(a) = VADD((a), VADD(f((b), (c), (d)), (x))); \
+	(a) = VOR(VSLL((a), (s)), VSRL((a), 32 - (s)))
+
+#define VROUNDS \
+	VSTEP(VF, a, b, c, d, X[ 0],  3); \
+	VSTEP(VF, d, a, b, c, X[ 1],  7); \
+	VSTEP(VF, c, d, a, b, X[ 2], 11); \
+	VSTEP(VF, b, c, d, a, X[ 3], 19); \
+	VSTEP(VF, a, b, c, d, X[ 4],  3); \
+	VSTEP(VF, d, a, b, c, X[ 5],  7); \
+	VSTEP(VF, c, d, a, b, X[ 6], 11); \
+	VSTEP(VF, b, c, d, a, X[ 7], 19); \
+	VSTEP(VF, a, b, c, d, X[ 8],  3); \
+	VSTEP(VF, d, a, b, c, X[ 9],  7); \
+	VSTEP(VF, c, d, a, b, X[10], 11); \
+	VSTEP(VF, b, c, d, a, X[11], 19); \
+	VSTEP(VF, a, b, c, d, X[12],  3); \
+	VSTEP(VF, d, a, b, c, X[13],  7); \
+	VSTEP(VF, c, d, a, b, X[14], 11); \
+	VSTEP(VF, b, c, d, a, X[15], 19); \
+	VSTEP(VG, a, b, c, d, VADD(X[ 0], k2),  3); \
+	VSTEP(VG, d, a, b, c, VADD(X[ 4], k2),  5); \
+	VSTEP(VG, c, d, a, b, VADD(X[ 8], k2),  9); \
+	VSTEP(VG, b, c, d, a, VADD(X[12], k2), 13); \
+	VSTEP(VG, a, b, c, d, VADD(X[ 1], k2),  3); \
+	VSTEP(VG, d, a, b, c, VADD(X[ 5], k2),  5); \
+	VSTEP(VG, c, d, a, b, VADD(X[ 9], k2),  9); \
+	VSTEP(VG, b, c, d, a, VADD(X[13], k2), 13); \
+	VSTEP(VG, a, b, c, d, VADD(X[ 2], k2),  3); \
+	VSTEP(VG, d, a, b, c, VADD(X[ 6], k2),  5); \
+	VSTEP(VG, c, d, a, b, VADD(X[10], k2),  9); \
+	VSTEP(VG, b, c, d, a, VADD(X[14], k2), 13); \
+	VSTEP(VG, a, b, c, d, VADD(X[ 3], k2),  3); \
+	VSTEP(VG, d, a, b, c, VADD(X[ 7], k2),  5); \
+	VSTEP(VG, c, d, a, b, VADD(X[11], k2),  9); \
+	VSTEP(VG, b, c, d, a, VADD(X[15], k2), 13); \
+	VSTEP(VH, a, b, c, d, VADD(X[ 0], k3),  3); \
+	VSTEP(VH, d, a, b, c, VADD(X[ 8], k3),  9); \
+	VSTEP(VH, c, d, a, b, VADD(X[ 4], k3), 11); \
+	VSTEP(VH, b, c, d, a, VADD(X[12], k3), 15); \
+	VSTEP(VH, a, b, c, d, VADD(X[ 2], k3),  3); \
+	VSTEP(VH, d, a, b, c, VADD(X[10], k3),  9); \
+	VSTEP(VH, c, d, a, b, VADD(X[ 6], k3), 11); \
+	VSTEP(VH, b, c, d, a, VADD(X[14], k3), 15); \
+	VSTEP(VH, a, b, c, d, VADD(X[ 1], k3),  3); \
+	VSTEP(VH, d, a, b, c, VADD(X[ 9], k3),  9); \
+	VSTEP(VH, c, d, a, b, VADD(X[ 5], k3), 11); \
+	VSTEP(VH, b, c, d, a, VADD(X[13], k3), 15); \
+	VSTEP(VH, a, b, c, d, VADD(X[ 3], k3),  3); \
+	VSTEP(VH, d, a, b, c, VADD(X[11], k3),  9); \
+	VSTEP(VH, c, d, a, b, VADD(X[ 7], k3), 11); \
+	VSTEP(VH, b, c, d, a, VADD(X[15], k3), 15)
+
+/*
+ * Loads 16 bytes from each of 4 streams and transposes them, so
+ * X[n] holds message word n of every stream.
+ */
+#define LOAD4(X, p0, p1, p2, p3, n) { \
+	__m128i r0 = _mm_loadu_si128((const __m128i *)((p0) + (n) * 16)); \
+	__m128i r1 = _mm_loadu_si128((const __m128i *)((p1) + (n) * 16)); \
+	__m128i r2 = _mm_loadu_si128((const __m128i *)((p2) + (n) * 16)); \
+	__m128i r3 = _mm_loadu_si128((const __m128i *)((p3) + (n) * 16)); \
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1); \
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3); \
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1); \
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3); \
+	X[(n) * 4 + 0] = _mm_unpacklo_epi64(t0, t1); \
+	X[(n) * 4 + 1] = _mm_unpackhi_epi64(t0, t1); \
+	X[(n) * 4 + 2] = _mm_unpacklo_epi64(t2, t3); \
+	X[(n) * 4 + 3] = _mm_unpackhi_epi64(t2, t3); }
+
+#define VADD(x, y)	_mm_add_epi32((x), (y))
+#define VAND(x, y)	_mm_and_si128((x), (y))
+#define VOR(x, y)	_mm_or_si128((x), (y))
+#define VXOR(x, y)	_mm_xor_si128((x), (y))
+#define VSLL(x, s)	_mm_slli_epi32((x), (s))
+#define VSRL(x, s)	_mm_srli_epi32((x), (s))
+
+LIBED2K_TARGET("sse2")
+void body_x4(struct MD4_CTX **ctx, const unsigned char **data, size_t blocks)
+{
+	const unsigned char *p[4] = { data[0], data[1], data[2], data[3] };
+	__m128i X[16];
+	__m128i a = _mm_set_epi32(ctx[3]->a, ctx[2]->a, ctx[1]->a, ctx[0]->a);
+	__m128i b = _mm_set_epi32(ctx[3]->b, ctx[2]->b, ctx[1]->b, ctx[0]->b);
+	__m128i c = _mm_set_epi32(ctx[3]->c, ctx[2]->c, ctx[1]->c, ctx[0]->c);
+	__m128i d = _mm_set_epi32(ctx[3]->d, ctx[2]->d, ctx[1]->d, ctx[0]->d);
+	const __m128i k2 = _mm_set1_epi32(0x5A827999);
+	const __m128i k3 = _mm_set1_epi32(0x6ED9EBA1);
+
+	for (; blocks > 0; --blocks) {
+		__m128i saved_a = a, saved_b = b, saved_c = c, saved_d = d;
+
+		LOAD4(X, p[0], p[1], p[2], p[3], 0);
+		LOAD4(X, p[0], p[1], p[2], p[3], 1);
+		LOAD4(X, p[0], p[1], p[2], p[3], 2);
+		LOAD4(X, p[0], p[1], p[2], p[3], 3);
+
+		VROUNDS;
+
+		a = VADD(a, saved_a);
+		b = VADD(b, saved_b);
+		c = VADD(c, saved_c);
+		d = VADD(d, saved_d);
+
+		for (int i = 0; i < 4; ++i) p[i] += 64;
+	}
+
+	boost::uint32_t out[4][4];
+	_mm_storeu_si128((__m128i *)out[0], a);
+	_mm_storeu_si128((__m128i *)out[1], b);
+	_mm_storeu_si128((__m128i *)out[2], c);
+	_mm_storeu_si128((__m128i *)out[3], d);
+
+	for (int i = 0; i < 4; ++i) {
+		ctx[i]->a = out[0][i];
+		ctx[i]->b = out[1][i];
+		ctx[i]->c = out[2][i];
+		ctx[i]->d = out[3][i];
+	}
+}
+
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VSLL
+#undef VSRL
+
+#define VADD(x, y)	_mm256_add_epi32((x), (y))
+#define VAND(x, y)	_mm256_and_si256((x), (y))
+#define VOR(x, y)	_mm256_or_si256((x), (y))
+#define VXOR(x, y)	_mm256_xor_si256((x), (y))
+#define VSLL(x, s)	_mm256_slli_epi32((x), (s))
+#define VSRL(x, s)	_mm256_srli_epi32((x), (s))
+
+LIBED2K_TARGET("avx2")
+void body_x8(struct MD4_CTX **ctx, const unsigned char **data, size_t blocks)
+{
+	const unsigned char *p[8];
+	boost::uint32_t in[4][8];
+	__m128i lo[16], hi[16];
+	__m256i X[16];
+
+	for (int i = 0; i < 8; ++i) {
+		p[i] = data[i];
+		in[0][i] = ctx[i]->a;
+		in[1][i] = ctx[i]->b;
+		in[2][i] = ctx[i]->c;
+		in[3][i] = ctx[i]->d;
+	}
+
+	__m256i a = _mm256_loadu_si256((const __m256i *)in[0]);
+	__m256i b = _mm256_loadu_si256((const __m256i *)in[1]);
+	__m256i c = _mm256_loadu_si256((const __m256i *)in[2]);
+	__m256i d = _mm256_loadu_si256((const __m256i *)in[3]);
+	const __m256i k2 = _mm256_set1_epi32(0x5A827999);
+	const __m256i k3 = _mm256_set1_epi32(0x6ED9EBA1);
+
+	for (; blocks > 0; --blocks) {
+		__m256i saved_a = a, saved_b = b, saved_c = c, saved_d = d;
+
+		for (int n = 0; n < 4; ++n) {
+			LOAD4(lo, p[0], p[1], p[2], p[3], n);
+			LOAD4(hi, p[4], p[5], p[6], p[7], n);
+		}
+
+		for (int n = 0; n < 16; ++n)
+			X[n] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo[n]), hi[n], 1);
+
+		VROUNDS;
+
+		a = VADD(a, saved_a);
+		b = VADD(b, saved_b);
+		c = VADD(c, saved_c);
+		d = VADD(d, saved_d);
+
+		for (int i = 0; i < 8; ++i) p[i] += 64;
+	}
+
+	_mm256_storeu_si256((__m256i *)in[0], a);
+	_mm256_storeu_si256((__m256i *)in[1], b);
+	_mm256_storeu_si256((__m256i *)in[2], c);
+	_mm256_storeu_si256((__m256i *)in[3], d);
+
+	for (int i = 0; i < 8; ++i) {
+		ctx[i]->a = in[0][i];
+		ctx[i]->b = in[1][i];
+		ctx[i]->c = in[2][i];
+		ctx[i]->d = in[3][i];
+	}
+}
+
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VSLL
+#undef VSRL
+#undef LOAD4
+#undef VROUNDS
+#undef VSTEP
+#undef VF
+#undef VG
+#undef VH
+
+/*
+ * Lanes supported by CPU and OS: AVX2 needs the OS to save ymm
+ * registers on context switch, SSE2 is always there on x86_64.
+ */
+int detect_lanes()
+{
+	boost::uint32_t regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 1) return 1;
+	__cpuid(info, 1);
+	regs[2] = info[2]; regs[3] = info[3];
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 1;
+	regs[2] = ecx; regs[3] = edx;
+#endif
+	const bool sse2 = (regs[3] & (1 << 26)) != 0;
+	const bool osxsave = (regs[2] & (1 << 27)) != 0;
+	bool avx2 = false;
+
+	if (osxsave) {
+#ifdef _MSC_VER
+		const bool ymm = (_xgetbv(0) & 6) == 6;
+		__cpuidex(info, 0, 0);
+		if (ymm && info[0] >= 7) {
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+		}
+#else
+		boost::uint32_t xcr0_lo, xcr0_hi;
+		__asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+		const bool ymm = (xcr0_lo & 6) == 6;
+		if (ymm && __get_cpuid_max(0, 0) >= 7) {
+			__cpuid_count(7, 0, eax, ebx, ecx, edx);
+			avx2 = (ebx & (1 << 5)) != 0;
+		}
+#endif
+	}
+
+	return avx2 ? 8 : (sse2 ? 4 : 1);
+}
+
+#else
+
+int detect_lanes() { return 1; }
+
+#endif // LIBED2K_MD4_SIMD
+
+/*
+ * Processes the same number of 64-byte blocks for every stream,
+ * widest kernel first, a lone remaining stream goes to the scalar body.
+ */
+void body_streams(int lanes, struct MD4_CTX **ctx, const unsigned char **data, int streams, size_t blocks)
+{
+	if (blocks == 0) return;
+
+	while (streams > 0) {
+		int width = 1;
+#ifdef LIBED2K_MD4_SIMD
+		if (lanes >= 8 && streams > 4) width = 8;
+		else if (lanes >= 4 && streams > 1) width = 4;
+#endif
+		if (width == 1) {
+			body(ctx[0], data[0], blocks * 64);
+		} else {
+			struct MD4_CTX *c[8];
+			const unsigned char *d[8];
+			struct MD4_CTX dummy[8];
+			// unused lanes hash copies of the first stream and are dropped
+			for (int i = 0; i < width; ++i) {
+				if (i < streams) {
+					c[i] = ctx[i];
+					d[i] = data[i];
+				} else {
+					dummy[i] = *ctx[0];
+					c[i] = &dummy[i];
+					d[i] = data[0];
+				}
+			}
+#ifdef LIBED2K_MD4_SIMD
+			if (width == 8) body_x8(c, d, blocks);
+			else body_x4(c, d, blocks);
+#endif
+		}
+
+		ctx += width;
+		data += width;
+		streams -= width;
+	}
+}
+
 }
 void MD4_Init(struct MD4_CTX *ctx)
 {
@@ -179,15 +518,10 @@ void MD4_Init(struct MD4_CTX *ctx)
 void MD4_Update(struct MD4_CTX *ctx, boost::uint8_t const *data, boost::uint32_t size)
 {
 	/* @UNSAFE */
-	boost::uint32_t saved_lo;
 	unsigned long used, free;
 
-	saved_lo = ctx->lo;
-	if ((ctx->lo = (saved_lo + size) & 0x1fffffff) < saved_lo)
-		ctx->hi++;
-	ctx->hi += size >> 29;
-
-	used = saved_lo & 0x3f;
+	used = ctx->lo & 0x3f;
+	count_length(ctx, size);
 
 	if (used) {
 		free = 64 - used;
@@ -262,6 +596,67 @@ void MD4_Final(boost::uint8_t result[MD4_DIGEST_LENGTH], struct MD4_CTX *ctx)
 
 	memset(ctx, 0, sizeof(*ctx));
 }
+
+namespace {
+/*
+ * MD4_Update for several streams fed with equal amounts of data,
+ * so their block buffers are always filled to the same level.
+ */
+void update_streams(int lanes, struct MD4_CTX **ctx, const unsigned char **data, int streams, boost::uint32_t size)
+{
+	const unsigned char *ptr[8];
+	const unsigned char *buffers[8];
+	unsigned long used, free;
+
+	used = ctx[0]->lo & 0x3f;
+
+	for (int i = 0; i < streams; ++i) {
+		count_length(ctx[i], size);
+		ptr[i] = data[i];
+		buffers[i] = ctx[i]->buffer;
+	}
+
+	if (used) {
+		free = 64 - used;
+
+		if (size < free) {
+			for (int i = 0; i < streams; ++i)
+				memcpy(&ctx[i]->buffer[used], ptr[i], size);
+			return;
+		}
+
+		for (int i = 0; i < streams; ++i) {
+			memcpy(&ctx[i]->buffer[used], ptr[i], free);
+			ptr[i] += free;
+		}
+
+		size -= free;
+		body_streams(lanes, ctx, buffers, streams, 1);
+	}
+
+	if (size >= 64) {
+		body_streams(lanes, ctx, ptr, streams, size / 64);
+
+		for (int i = 0; i < streams; ++i)
+			ptr[i] += size & ~(unsigned long)0x3f;
+
+		size &= 0x3f;
+	}
+
+	for (int i = 0; i < streams; ++i)
+		memcpy(ctx[i]->buffer, ptr[i], size);
+}
+}
+#else
+namespace {
+int detect_lanes() { return 1; }
+
+void update_streams(int, MD4_CTX **ctx, const unsigned char **data, int streams, boost::uint32_t size)
+{
+	for (int i = 0; i < streams; ++i)
+		MD4_Update(ctx[i], data[i], size);
+}
+}
 #endif
 
 namespace libed2k
@@ -271,6 +666,60 @@ namespace libed2k
     const md4_hash md4_hash::emule      = md4_hash::fromString("31D6CFE0D10EE931B73C59D7E0C06FC0");
     const md4_hash md4_hash::invalid    = md4_hash::fromString("00000000000000000000000000000000");
 
+    /*static*/
+    int multi_hasher::lanes()
+    {
+        static const int lanes = detect_lanes();
+        return lanes;
+    }
+
+    multi_hasher::multi_hasher(int streams) : m_streams(streams)
+    {
+        LIBED2K_ASSERT(streams > 0 && streams <= max_streams);
+        for (int i = 0; i < m_streams; ++i) MD4_Init(&m_context[i]);
+    }
+
+    void multi_hasher::assign(int stream, const hasher& h)
+    {
+        LIBED2K_ASSERT(stream < m_streams);
+        m_context[stream] = h.m_context;
+    }
+
+    void multi_hasher::update(const char* const* data, int len)
+    {
+        LIBED2K_ASSERT(len > 0);
+        MD4_CTX* ctx[max_streams];
+        const unsigned char* ptr[max_streams];
+
+        for (int i = 0; i < m_streams; ++i)
+        {
+            LIBED2K_ASSERT(data[i] != 0);
+            // streams are updated with one block buffer fill level
+            LIBED2K_ASSERT((m_context[i].lo & 0x3f) == (m_context[0].lo & 0x3f));
+            ctx[i] = &m_context[i];
+            ptr[i] = reinterpret_cast<const unsigned char*>(data[i]);
+        }
+
+        update_streams(lanes(), ctx, ptr, m_streams, len);
+    }
+
+    void multi_hasher::final(md4_hash* result)
+    {
+        for (int i = 0; i < m_streams; ++i)
+            MD4_Final(result[i].getContainer(), &m_context[i]);
+    }
+
+    /*static*/
+    void multi_hasher::hash(const char* const* data, int len, int count, md4_hash* result)
+    {
+        for (int i = 0; i < count; i += max_streams)
+        {
+            multi_hasher mh(std::min<int>(max_streams, count - i));
+            if (len > 0) mh.update(data + i, len);
+            mh.final(result + i);
+        }
+    }
+
     /*static*/
     md4_hash md4_hash::fromHashset(const std::vector<md4_hash>& hashset)
     {
@@ -406,6 +855,14 @@ namespace libed2k
         return !std::equal(n.m_hash, n.m_hash+number_size, m_hash);
     }
 
+    std::size_t hash_value(const md4_hash& hash)
+    {
+        // md4 digest is uniformly distributed already
+        std::size_t h;
+        memcpy(&h, hash.begin(), sizeof(h));
+        return h;
+    }
+
     bool md4_hash::operator<(md4_hash const& n) const
     {
         for (int i = 0; i < number_size; ++i)
@@ -0,0 +1,149 @@
+#include "libed2k/mmap_storage.hpp"
+#include "libed2k/file_mapping.hpp"
+#include "libed2k/storage_defs.hpp"
+
+#ifndef LIBED2K_WINDOWS
+
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "libed2k/filesystem.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/allocator.hpp" // page_size
+#include "libed2k/log.hpp"
+
+#endif
+
+namespace libed2k
+{
+#ifndef LIBED2K_WINDOWS
+    file_mapping::file_mapping(int fd, size_type size, error_code& ec) : m_data(0), m_size(0)
+    {
+        void* ret = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ret == MAP_FAILED)
+        {
+            ec.assign(errno, get_posix_category());
+            return;
+        }
+
+        m_data = static_cast<char*>(ret);
+        m_size = size;
+    }
+#endif
+
+    file_mapping::~file_mapping()
+    {
+#ifndef LIBED2K_WINDOWS
+        if (m_data) munmap(m_data, m_size);
+#endif
+    }
+
+#ifndef LIBED2K_WINDOWS
+    mmap_storage::mmap_storage(file_storage const& fs, file_storage const* mapped, std::string const& path
+        , file_pool& fp, std::vector<boost::uint8_t> const& file_prio) :
+        default_storage(fs, mapped, path, fp, file_prio)
+    {
+    }
+
+    bool mmap_storage::map_block(int slot, int offset, int size, char*& data
+        , boost::intrusive_ptr<file_mapping>& mapping)
+    {
+        std::vector<file_slice> slices = files().map_block(slot, offset, size);
+
+        // block on file boundary or in pad file is read the default way
+        if (slices.size() != 1 || slices[0].size != size) return false;
+        file_storage::iterator fe = files().begin() + slices[0].file_index;
+        if (fe->pad_file) return false;
+
+        size_type start = files().file_base(*fe) + slices[0].offset;
+        boost::intrusive_ptr<file_mapping> m = file_map(fe, start + size);
+        if (!m) return false;
+
+        data = m->data() + start;
+        mapping = m;
+
+        // fault pages in here, so the network thread doesn't wait for disk when it sends them
+        int ps = page_size();
+        char* first = m->data() + (start & ~size_type(ps - 1));
+        madvise(first, data + size - first, MADV_WILLNEED);
+
+        volatile char sink = 0;
+        for (char const* p = first; p < data + size; p += ps) sink = *p;
+        (void)sink;
+
+        return true;
+    }
+
+    boost::intrusive_ptr<file_mapping> mmap_storage::file_map(file_storage::iterator fe, size_type end)
+    {
+        int index = fe - files().begin();
+
+        mutex::scoped_lock l(m_mappings_mutex);
+        mapping_map::iterator i = m_mappings.find(index);
+        if (i != m_mappings.end() && i->second->size() >= end) return i->second;
+
+        error_code ec;
+        boost::intrusive_ptr<file> f = open_file(fe, file::read_only, ec);
+        if (!f || ec) return boost::intrusive_ptr<file_mapping>();
+
+        // mapping beyond end of file faults, so map only what is on disk
+        size_type file_size = f->get_size(ec);
+        if (ec || file_size < end) return boost::intrusive_ptr<file_mapping>();
+
+        boost::intrusive_ptr<file_mapping> m(new file_mapping(f->native_handle(), file_size, ec));
+        if (ec)
+        {
+            // address space is exhausted on 32-bit systems, read the default way
+            DBG("unable to map " << files().file_path(*fe) << ": " << ec.message());
+            return boost::intrusive_ptr<file_mapping>();
+        }
+
+        // pieces are requested out of order, kernel read-ahead only wastes cache
+        madvise(m->data(), m->size(), MADV_RANDOM);
+
+        m_mappings[index] = m;
+        return m;
+    }
+
+    void mmap_storage::unmap_files()
+    {
+        mutex::scoped_lock l(m_mappings_mutex);
+        m_mappings.clear();
+    }
+
+    bool mmap_storage::rename_file(int index, std::string const& new_filename)
+    {
+        unmap_files();
+        return default_storage::rename_file(index, new_filename);
+    }
+
+    bool mmap_storage::release_files()
+    {
+        unmap_files();
+        return default_storage::release_files();
+    }
+
+    bool mmap_storage::delete_files()
+    {
+        unmap_files();
+        return default_storage::delete_files();
+    }
+
+    bool mmap_storage::move_storage(std::string const& save_path)
+    {
+        unmap_files();
+        return default_storage::move_storage(save_path);
+    }
+#endif
+
+    storage_interface* mmap_storage_constructor(file_storage const& fs
+        , file_storage const* mapped, std::string const& path, file_pool& fp
+        , std::vector<boost::uint8_t> const& file_prio)
+    {
+#ifndef LIBED2K_WINDOWS
+        return new mmap_storage(fs, mapped, path, fp, file_prio);
+#else
+        return default_storage_constructor(fs, mapped, path, fp, file_prio);
+#endif
+    }
+}
@@ -1,3 +1,5 @@
+#include <boost/functional/hash.hpp>
+
 #include "libed2k/packet_struct.hpp"
 #include "libed2k/kademlia/kad_packet_struct.hpp"
 #include "libed2k/util.hpp"
@@ -136,6 +138,22 @@ namespace libed2k
     net_identifier::net_identifier(const tcp::endpoint& ep) :
         m_nIP(address2int(ep.address())), m_nPort(ep.port()) {}
 
+    bool sources_answer_element::source_endpoint(tcp::endpoint& ep) const
+    {
+        boost::uint32_t ed2k_id = (sx_version >= 3) ? ntohl(client_id.m_nIP) : client_id.m_nIP;
+        if (isLowId(ed2k_id) || client_id.m_nPort == 0) return false;
+        ep = tcp::endpoint(ip::address_v4(ntohl(ed2k_id)), client_id.m_nPort);
+        return true;
+    }
+
+    std::size_t hash_value(const net_identifier& np)
+    {
+        std::size_t seed = 0;
+        boost::hash_combine(seed, np.m_nIP);
+        boost::hash_combine(seed, np.m_nPort);
+        return seed;
+    }
+
     std::string net_identifier::to_string() const
     {
         std::stringstream s;
@@ -472,6 +490,31 @@ namespace libed2k
         m_strMessage.assign(strMessage, 0, m_nMsgLength);
     }
 
+    aich_recovery_data::aich_recovery_data(const std::vector<aich_node_hash>& nodes)
+    {
+        for (std::vector<aich_node_hash>::const_iterator itr = nodes.begin(); itr != nodes.end(); ++itr)
+        {
+            if (itr->first <= 0xFFFF)
+                m_hashes16.add(aich_hash_entry<boost::uint16_t>(static_cast<boost::uint16_t>(itr->first), itr->second));
+            else
+                m_hashes32.add(aich_hash_entry<boost::uint32_t>(itr->first, itr->second));
+        }
+    }
+
+    std::vector<aich_node_hash> aich_recovery_data::nodes() const
+    {
+        std::vector<aich_node_hash> res;
+        res.reserve(m_hashes16.m_collection.size() + m_hashes32.m_collection.size());
+
+        for (size_t n = 0; n < m_hashes16.m_collection.size(); ++n)
+            res.push_back(std::make_pair(boost::uint32_t(m_hashes16.m_collection[n].m_nIdent), m_hashes16.m_collection[n].m_hash));
+
+        for (size_t n = 0; n < m_hashes32.m_collection.size(); ++n)
+            res.push_back(std::make_pair(m_hashes32.m_collection[n].m_nIdent, m_hashes32.m_collection[n].m_hash));
+
+        return res;
+    }
+
     peer_connection_options::peer_connection_options() : m_nVersion(0),
         m_nModVersion(0),
         m_nPort(0),
@@ -1,8 +1,11 @@
+#include <cstring>
+
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/algorithm/string/join.hpp>
 
 #include "libed2k/storage.hpp"
+#include "libed2k/file_mapping.hpp"
 #include "libed2k/peer_connection.hpp"
 #include "libed2k/session_impl.hpp"
 #include "libed2k/transfer.hpp"
@@ -27,6 +30,9 @@ peer_request mk_peer_request(size_type begin, size_type end)
     return r;
 }
 
+// eMule limit of sources in one source exchange answer
+const size_t max_exchanged_sources = 500;
+
 std::vector<peer_request> mk_peer_requests(size_type begin, size_type end, size_type fsize)
 {
     begin = std::min(begin, fsize);
@@ -57,6 +63,65 @@ std::pair<size_type, size_type> mk_range(const peer_request& r)
     return std::make_pair(begin, end);
 }
 
+int libed2k::request_queue_depth(int rate, int rtt, const session_settings& settings)
+{
+    size_type in_flight = size_type(rate) * (settings.request_queue_time * 1000 + rtt) / 1000;
+
+    size_type desired = (in_flight + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    desired = std::min(desired, size_type(settings.max_out_request_queue));
+    desired = std::max(desired, size_type(settings.min_request_queue));
+    return std::max(int(desired), 1);
+}
+
+bool libed2k::cancel_pending_block(std::vector<pending_block>& request_queue,
+                                   std::vector<pending_block>& download_queue,
+                                   const piece_block& block)
+{
+    std::vector<pending_block>::iterator i =
+        std::find_if(request_queue.begin(), request_queue.end(), has_block(block));
+
+    // wasn't sent yet, block is not requested in picker anymore
+    if (i != request_queue.end())
+    {
+        request_queue.erase(i);
+        return true;
+    }
+
+    i = std::find_if(download_queue.begin(), download_queue.end(), has_block(block));
+    if (i == download_queue.end()) return false;
+
+    // peer sends the block anyway, skip it
+    i->not_wanted = true;
+    return true;
+}
+
+int libed2k::skip_pending_block(std::vector<pending_block>& download_queue,
+                                std::vector<pending_block>::iterator block,
+                                const peer_request& r)
+{
+    block->complete(mk_range(r));
+    if (block->completed()) download_queue.erase(block);
+    return r.length;
+}
+
+int libed2k::received_block_bytes(const pending_block& b)
+{
+    return int(b.data_size - b.data_left.size());
+}
+
+bool libed2k::use_utp(const peer& p, const session_settings& settings)
+{
+    return settings.enable_outgoing_utp && p.supports_utp;
+}
+
+bool libed2k::utp_connect_failed(peer* p, bool utp)
+{
+    if (!p || !p->supports_utp || !utp) return false;
+    p->supports_utp = false;
+    p->next_connect = 0;
+    return true;
+}
+
 inline piece_block mk_block(const peer_request& r)
 {
     return piece_block(r.piece, r.start / BLOCK_SIZE);
@@ -74,6 +139,11 @@ inline size_t offset_in_block(const peer_request& r)
     return r.start % BLOCK_SIZE;
 }
 
+// send buffer destructor of compressed block, block is released with last copy of pointer
+void release_compressed_block(char*, compressed_block)
+{
+}
+
 std::pair<peer_request, peer_request> split_request(const peer_request& req)
 {
     peer_request r = req;
@@ -100,7 +170,7 @@ pending_block::pending_block(const piece_block& b, size_type fsize):
 
 peer_connection::peer_connection(aux::session_impl& ses,
                                  boost::weak_ptr<transfer> t,
-                                 boost::shared_ptr<tcp::socket> s,
+                                 boost::shared_ptr<socket_type> s,
                                  const ip::tcp::endpoint& remote, peer* peerinfo):
     base_connection(ses, s, remote),
     m_work(ses.m_io_service),
@@ -116,7 +186,7 @@ peer_connection::peer_connection(aux::session_impl& ses,
 }
 
 peer_connection::peer_connection(aux::session_impl& ses,
-                                 boost::shared_ptr<tcp::socket> s,
+                                 boost::shared_ptr<socket_type> s,
                                  const ip::tcp::endpoint& remote,
                                  peer* peerinfo):
     base_connection(ses, s, remote),
@@ -150,69 +220,98 @@ void peer_connection::reset()
     m_upload_limit = 0;
     m_download_limit = 0;
     m_speed = slow;
-    m_desired_queue_size = 3;
+    m_desired_queue_size = std::max(m_ses.settings().min_request_queue, 1);
+    m_requested = min_time();
+    m_rtt = 0;
     m_max_busy_blocks = 1;
     m_recv_pos = 0;
     m_recv_compressed = false;
-
-    add_handler(std::make_pair(OP_HELLO, OP_EDONKEYPROT), boost::bind(&peer_connection::on_hello, this, _1));
-    add_handler(get_proto_pair<client_hello_answer>(), boost::bind(&peer_connection::on_hello_answer, this, _1));
-    add_handler(get_proto_pair<client_ext_hello>(), boost::bind(&peer_connection::on_ext_hello, this, _1));
-    add_handler(get_proto_pair<client_ext_hello_answer>(), boost::bind(&peer_connection::on_ext_hello_answer, this, _1));
-    add_handler(get_proto_pair<client_file_request>(), boost::bind(&peer_connection::on_file_request, this, _1));
-    add_handler(get_proto_pair<client_file_answer>(), boost::bind(&peer_connection::on_file_answer, this, _1));
-    add_handler(/*OP_FILEDESC*/get_proto_pair<client_file_description>(), boost::bind(&peer_connection::on_file_description, this, _1));
-    add_handler(/*OP_SETREQFILEID*/get_proto_pair<client_filestatus_request>(), boost::bind(&peer_connection::on_filestatus_request, this, _1));
-    add_handler(/*OP_FILEREQANSNOFIL*/get_proto_pair<client_no_file>(), boost::bind(&peer_connection::on_no_file, this, _1));
-    add_handler(/*OP_FILESTATUS*/get_proto_pair<client_file_status>(), boost::bind(&peer_connection::on_file_status, this, _1));
-    add_handler(/*OP_HASHSETREQUEST*/get_proto_pair<client_hashset_request>(), boost::bind(&peer_connection::on_hashset_request, this, _1));
-    add_handler(/*OP_HASHSETANSWER*/get_proto_pair<client_hashset_answer>(), boost::bind(&peer_connection::on_hashset_answer, this, _1));
-    add_handler(/*OP_STARTUPLOADREQ*/get_proto_pair<client_start_upload>(), boost::bind(&peer_connection::on_start_upload, this, _1));
-    add_handler(/*OP_QUEUERANKING*/get_proto_pair<client_queue_ranking>(), boost::bind(&peer_connection::on_queue_ranking, this, _1));
-    add_handler(std::make_pair(OP_ACCEPTUPLOADREQ, OP_EDONKEYPROT), boost::bind(&peer_connection::on_accept_upload, this, _1));
-    add_handler(/*OP_OUTOFPARTREQS*/get_proto_pair<client_out_parts>(), boost::bind(&peer_connection::on_out_parts, this, _1));
-    add_handler(std::make_pair(OP_CANCELTRANSFER, OP_EDONKEYPROT), boost::bind(&peer_connection::on_cancel_transfer, this, _1));
-    add_handler(/*OP_REQUESTPARTS*/get_proto_pair<client_request_parts_32>(),
-                boost::bind(&peer_connection::on_request_parts<client_request_parts_32>, this, _1));
-    add_handler(/*OP_REQUESTPARTS_I64*/get_proto_pair<client_request_parts_64>(),
-                boost::bind(&peer_connection::on_request_parts<client_request_parts_64>, this, _1));
-    add_handler(/*OP_SENDINGPART*/get_proto_pair<client_sending_part_32>(),
-                boost::bind(&peer_connection::on_sending_part<client_sending_part_32>, this, _1));
-    add_handler(/*OP_SENDINGPART_I64*/get_proto_pair<client_sending_part_64>(),
-                boost::bind(&peer_connection::on_sending_part<client_sending_part_64>, this, _1));
-    add_handler(/*OP_COMPRESSEDPART*/get_proto_pair<client_compressed_part_32>(),
-                boost::bind(&peer_connection::on_compressed_part<client_compressed_part_32>, this, _1));
-    add_handler(/*OP_COMPRESSEDPART_I64*/get_proto_pair<client_compressed_part_64>(),
-                boost::bind(&peer_connection::on_compressed_part<client_compressed_part_64>, this, _1));
-    add_handler(/*OP_END_OF_DOWNLOAD*/get_proto_pair<client_end_download>(), boost::bind(&peer_connection::on_end_download, this, _1));
+    m_send_compressed = false;
+    m_aich_piece = -1;
+    m_aich_master_requested = false;
+    m_sources_requested = false;
+    m_sources_answered = false;
+    m_credited_upload = 0;
+    m_credited_download = 0;
+
+    m_handlers = &packet_handlers();
+}
+
+const base_connection::handler_table& peer_connection::packet_handlers()
+{
+    // built on first connection, connections are created on network thread only
+    static const handler_table handlers = make_packet_handlers();
+    return handlers;
+}
+
+base_connection::handler_table peer_connection::make_packet_handlers()
+{
+    handler_table t;
+
+    t.add(std::make_pair(OP_HELLO, OP_EDONKEYPROT), &peer_connection::on_hello);
+    t.add(get_proto_pair<client_hello_answer>(), &peer_connection::on_hello_answer);
+    t.add(get_proto_pair<client_ext_hello>(), &peer_connection::on_ext_hello);
+    t.add(get_proto_pair<client_ext_hello_answer>(), &peer_connection::on_ext_hello_answer);
+    t.add(get_proto_pair<client_file_request>(), &peer_connection::on_file_request);
+    t.add(get_proto_pair<client_file_answer>(), &peer_connection::on_file_answer);
+    t.add(/*OP_FILEDESC*/get_proto_pair<client_file_description>(), &peer_connection::on_file_description);
+    t.add(/*OP_SETREQFILEID*/get_proto_pair<client_filestatus_request>(), &peer_connection::on_filestatus_request);
+    t.add(/*OP_FILEREQANSNOFIL*/get_proto_pair<client_no_file>(), &peer_connection::on_no_file);
+    t.add(/*OP_FILESTATUS*/get_proto_pair<client_file_status>(), &peer_connection::on_file_status);
+    t.add(/*OP_HASHSETREQUEST*/get_proto_pair<client_hashset_request>(), &peer_connection::on_hashset_request);
+    t.add(/*OP_HASHSETANSWER*/get_proto_pair<client_hashset_answer>(), &peer_connection::on_hashset_answer);
+    t.add(/*OP_AICHREQUEST*/get_proto_pair<client_aich_request>(), &peer_connection::on_aich_request);
+    t.add(/*OP_AICHANSWER*/get_proto_pair<client_aich_answer>(), &peer_connection::on_aich_answer);
+    t.add(/*OP_AICHFILEHASHREQ*/get_proto_pair<client_aich_file_hash_request>(), &peer_connection::on_aich_file_hash_request);
+    t.add(/*OP_AICHFILEHASHANS*/get_proto_pair<client_aich_file_hash_answer>(), &peer_connection::on_aich_file_hash_answer);
+    t.add(/*OP_STARTUPLOADREQ*/get_proto_pair<client_start_upload>(), &peer_connection::on_start_upload);
+    t.add(/*OP_QUEUERANKING*/get_proto_pair<client_queue_ranking>(), &peer_connection::on_queue_ranking);
+    t.add(std::make_pair(OP_ACCEPTUPLOADREQ, OP_EDONKEYPROT), &peer_connection::on_accept_upload);
+    t.add(/*OP_OUTOFPARTREQS*/get_proto_pair<client_out_parts>(), &peer_connection::on_out_parts);
+    t.add(std::make_pair(OP_CANCELTRANSFER, OP_EDONKEYPROT), &peer_connection::on_cancel_transfer);
+    t.add(/*OP_REQUESTPARTS*/get_proto_pair<client_request_parts_32>(),
+          &peer_connection::on_request_parts<client_request_parts_32>);
+    t.add(/*OP_REQUESTPARTS_I64*/get_proto_pair<client_request_parts_64>(),
+          &peer_connection::on_request_parts<client_request_parts_64>);
+    t.add(/*OP_SENDINGPART*/get_proto_pair<client_sending_part_32>(),
+          &peer_connection::on_sending_part<client_sending_part_32>);
+    t.add(/*OP_SENDINGPART_I64*/get_proto_pair<client_sending_part_64>(),
+          &peer_connection::on_sending_part<client_sending_part_64>);
+    t.add(/*OP_COMPRESSEDPART*/get_proto_pair<client_compressed_part_32>(),
+          &peer_connection::on_compressed_part<client_compressed_part_32>);
+    t.add(/*OP_COMPRESSEDPART_I64*/get_proto_pair<client_compressed_part_64>(),
+          &peer_connection::on_compressed_part<client_compressed_part_64>);
+    t.add(/*OP_END_OF_DOWNLOAD*/get_proto_pair<client_end_download>(), &peer_connection::on_end_download);
 
     // shared files request and answer
-    add_handler(/*OP_ASKSHAREDFILES*/get_proto_pair<client_shared_files_request>(), boost::bind(&peer_connection::on_shared_files_request, this, _1));
-    add_handler(/*OP_ASKSHAREDDENIEDANS*/get_proto_pair<client_shared_files_denied>(), boost::bind(&peer_connection::on_shared_files_denied, this, _1));
-    add_handler(/*OP_ASKSHAREDFILESANSWER*/get_proto_pair<client_shared_files_answer>(), boost::bind(&peer_connection::on_shared_files_answer, this, _1));
+    t.add(/*OP_ASKSHAREDFILES*/get_proto_pair<client_shared_files_request>(), &peer_connection::on_shared_files_request);
+    t.add(/*OP_ASKSHAREDDENIEDANS*/get_proto_pair<client_shared_files_denied>(), &peer_connection::on_shared_files_denied);
+    t.add(/*OP_ASKSHAREDFILESANSWER*/get_proto_pair<client_shared_files_answer>(), &peer_connection::on_shared_files_answer);
 
     // shared directories
-    add_handler(get_proto_pair<client_shared_directories_request>(), boost::bind(&peer_connection::on_shared_directories_request, this, _1));
-    add_handler(get_proto_pair<client_shared_directories_answer>(), boost::bind(&peer_connection::on_shared_directories_answer, this, _1));
+    t.add(get_proto_pair<client_shared_directories_request>(), &peer_connection::on_shared_directories_request);
+    t.add(get_proto_pair<client_shared_directories_answer>(), &peer_connection::on_shared_directories_answer);
 
     // shared files in directory
-    add_handler(get_proto_pair<client_shared_directory_files_request>(), boost::bind(&peer_connection::on_shared_directory_files_request, this, _1));
-    add_handler(get_proto_pair<client_shared_directory_files_answer>(), boost::bind(&peer_connection::on_shared_directory_files_answer, this, _1));
+    t.add(get_proto_pair<client_shared_directory_files_request>(), &peer_connection::on_shared_directory_files_request);
+    t.add(get_proto_pair<client_shared_directory_files_answer>(), &peer_connection::on_shared_directory_files_answer);
 
     //ismod collections
-    add_handler(get_proto_pair<client_directory_content_request>(), boost::bind(&peer_connection::on_ismod_files_request, this, _1));
-    add_handler(get_proto_pair<client_directory_content_result>(), boost::bind(&peer_connection::on_ismod_directory_files, this, _1));
+    t.add(get_proto_pair<client_directory_content_request>(), &peer_connection::on_ismod_files_request);
+    t.add(get_proto_pair<client_directory_content_result>(), &peer_connection::on_ismod_directory_files);
     // clients talking
-    add_handler(/*OP_MESSAGE*/get_proto_pair<client_message>(), boost::bind(&peer_connection::on_client_message, this, _1));
-    add_handler(/*OP_CHATCAPTCHAREQ*/get_proto_pair<client_captcha_request>(), boost::bind(&peer_connection::on_client_captcha_request, this, _1));
-    add_handler(/*OP_CHATCAPTCHARES*/get_proto_pair<client_captcha_result>(), boost::bind(&peer_connection::on_client_captcha_result, this, _1));
-    add_handler(/*OP_PUBLICIP_RE*/get_proto_pair<client_public_ip_request>(), boost::bind(&peer_connection::on_client_public_ip_request, this, _1));
+    t.add(/*OP_MESSAGE*/get_proto_pair<client_message>(), &peer_connection::on_client_message);
+    t.add(/*OP_CHATCAPTCHAREQ*/get_proto_pair<client_captcha_request>(), &peer_connection::on_client_captcha_request);
+    t.add(/*OP_CHATCAPTCHARES*/get_proto_pair<client_captcha_result>(), &peer_connection::on_client_captcha_result);
+    t.add(/*OP_PUBLICIP_RE*/get_proto_pair<client_public_ip_request>(), &peer_connection::on_client_public_ip_request);
 
     // sources answer
-    add_handler(get_proto_pair<sources_request>(), boost::bind(&peer_connection::on_client_sources_request, this, _1));
-    add_handler(get_proto_pair<sources_request2>(), boost::bind(&peer_connection::on_client_sources_request, this, _1));
-    add_handler(get_proto_pair<sources_answer>(), boost::bind(&peer_connection::on_client_sources_answer, this, _1));
-    add_handler(get_proto_pair<sources_answer2>(), boost::bind(&peer_connection::on_client_sources_answer, this, _1));
+    t.add(get_proto_pair<sources_request>(), &peer_connection::on_client_sources_request);
+    t.add(get_proto_pair<sources_request2>(), &peer_connection::on_client_sources_request2);
+    t.add(get_proto_pair<sources_answer>(), &peer_connection::on_client_sources_answer);
+    t.add(get_proto_pair<sources_answer2>(), &peer_connection::on_client_sources_answer2);
+
+    return t;
 }
 
 peer_connection::~peer_connection()
@@ -237,6 +336,9 @@ void peer_connection::finalize_handshake()
 
     m_handshake_complete = true;
 
+    // decided once - toggled setting must not switch format of parts in flight
+    m_send_compressed = m_ses.settings().compress_uploads && supports_compression();
+
     // consider this a successful connection, reset the failcount
     if (t && get_peer()) t->get_policy().set_failcount(get_peer(), 0);
 
@@ -245,12 +347,11 @@ void peer_connection::finalize_handshake()
         DBG("handshake completed on active peer");
 
         if (t && !t->is_finished()){
-        	// TODO - enable sources request in future
-        	//sources_request sa;
-        	//sa.file_hash = t->hash();
-        	//DBG("write sources request => " << m_remote);
-        	//write_struct(sa);
         	write_file_request(t->hash());
+
+        	if ((m_misc_options2.support_source_ext2() || m_misc_options.m_nSourceExchange1Ver > 0) &&
+        	    t->want_source_exchange())
+        	    write_sources_request(t->hash());
         }
         else fill_send_buffer();
     }
@@ -330,6 +431,10 @@ void peer_connection::get_peer_info(peer_info& p) const
     p.num_hashfails = 0;
     p.inet_as = 0xffff;
 
+    p.download_queue_length = m_download_queue.size();
+    p.target_dl_queue_length = m_desired_queue_size;
+    p.rtt = m_rtt;
+
     p.send_buffer_size = m_send_buffer.capacity();
     p.used_send_buffer = m_send_buffer.size();
     p.write_state = m_channel_state[upload_channel];
@@ -411,6 +516,8 @@ void peer_connection::second_tick(int tick_interval_ms)
         fill_send_buffer();
 
     m_statistics.second_tick(tick_interval_ms);
+    update_credits();
+    update_desired_queue_size();
 }
 
 bool peer_connection::attach_to_transfer(const md4_hash& hash)
@@ -478,7 +585,7 @@ void peer_connection::do_read()
 
 void peer_connection::do_write(int /*quota ignored*/)
 {
-    if (m_disconnecting) return;
+    if (m_disconnecting || m_corked) return;
     if (m_channel_state[upload_channel] & (peer_info::bw_network | peer_info::bw_limit)) return;
     if (!has_upload_bandwidth()) return;
     if (!can_write()) return;
@@ -493,7 +600,7 @@ int peer_connection::request_upload_bandwidth(
     boost::shared_ptr<transfer> t = m_transfer.lock();
 
     int priority;
-    priority = 1 + (float(m_send_buffer.size()) / m_ses.settings().send_buffer_watermark) * 255;
+    priority = 1 + (float(send_queue_size()) / m_ses.settings().send_buffer_watermark) * 255;
     if (priority > 255) priority = 255;
     priority += t ? t->priority() << 8 : 0;
 
@@ -504,7 +611,7 @@ int peer_connection::request_upload_bandwidth(
 
     return m_ses.m_upload_rate.request_bandwidth(
         self_as<peer_connection>(),
-        std::max(m_send_buffer.size(),
+        std::max(send_queue_size(),
                  m_statistics.upload_rate() * 2 / (1000 / m_ses.m_settings.tick_interval)),
         priority, bwc1, bwc2, bwc3, bwc4);
 }
@@ -561,7 +668,7 @@ bool peer_connection::has_upload_bandwidth()
 {
     boost::shared_ptr<transfer> t = m_transfer.lock();
 
-    if (m_quota[upload_channel] == 0 && !m_send_buffer.empty() && !m_connecting)
+    if (m_quota[upload_channel] == 0 && !send_queue_empty() && !m_connecting)
     {
         // in this case, we have data to send, but no
         // bandwidth. So, we simply request bandwidth
@@ -621,9 +728,13 @@ void peer_connection::request_block()
     // in the transfer, there are still some unrequested pieces
     // also, if we already have at least one outstanding
     // request, we shouldn't pick any busy pieces either
-    bool dont_pick_busy_blocks =
-        (p.num_have() + p.get_download_queue().size() < t->num_pieces()) ||
-        m_download_queue.size() + m_request_queue.size() > 0;
+    // in endgame remaining blocks are requested from several peers at once,
+    // redundant requests are cancelled when first copy arrives
+    bool endgame = p.is_endgame();
+    bool dont_pick_busy_blocks = !endgame &&
+        ((p.num_have() + p.get_download_queue().size() < t->num_pieces()) ||
+         m_download_queue.size() + m_request_queue.size() > 0);
+    size_t max_busy_blocks = endgame ? m_desired_queue_size : m_max_busy_blocks;
 
     // this is filled with an interesting piece
     // that some other peer is currently downloading
@@ -632,6 +743,13 @@ void peer_connection::request_block()
     for (std::vector<piece_block>::iterator i = interesting_pieces.begin();
          i != interesting_pieces.end(); ++i)
     {
+        // don't request pieces we already have in our request queue
+        // This happens when pieces time out or the peer sends us
+        // pieces we didn't request. Those aren't marked in the
+        // piece picker, but we still keep track of them in the
+        // download queue
+        if (requesting(*i)) continue;
+
         int num_block_requests = p.num_peers(*i);
         if (num_block_requests > 0)
         {
@@ -641,20 +759,14 @@ void peer_connection::request_block()
             // this block is busy. This means all the following blocks
             // in the interesting_pieces list are busy as well, we might
             // as well just exit the loop
-            if (dont_pick_busy_blocks || busy_blocks.size() >= m_max_busy_blocks) break;
+            if (dont_pick_busy_blocks || busy_blocks.size() >= max_busy_blocks) break;
 
             assert(p.num_peers(*i) > 0);
             busy_blocks.push_back(*i);
+            --num_requests;
             continue;
         }
 
-        // don't request pieces we already have in our request queue
-        // This happens when pieces time out or the peer sends us
-        // pieces we didn't request. Those aren't marked in the
-        // piece picker, but we still keep track of them in the
-        // download queue
-        if (requesting(*i)) continue;
-
         // ok, we found a piece that's not being downloaded
         // by somebody else. request it from this peer
         // and return
@@ -665,7 +777,7 @@ void peer_connection::request_block()
     // if we don't have any potential busy blocks to request
     // or if we already have outstanding requests, don't
     // pick a busy piece
-    if (!busy_blocks.empty() && m_download_queue.size() + m_request_queue.size() == 0)
+    if (!busy_blocks.empty() && (endgame || m_download_queue.size() + m_request_queue.size() == 0))
     {
         BOOST_FOREACH(piece_block& bb, busy_blocks) {
             assert(p.is_requested(bb));
@@ -691,7 +803,10 @@ bool peer_connection::add_request(const piece_block& block, int flags)
     else if (speed == medium) state = piece_picker::medium;
     else state = piece_picker::slow;
 
-    if ((flags & req_busy) && num_requesting_busy_blocks() >= m_max_busy_blocks)
+    size_t max_busy_blocks = t->has_picker() && t->picker().is_endgame() ?
+        m_desired_queue_size : m_max_busy_blocks;
+
+    if ((flags & req_busy) && num_requesting_busy_blocks() >= max_busy_blocks)
     {
         // this block is busy (i.e. it has been requested
         // from another peer already). Only allow m_max_busy_blocks busy
@@ -704,10 +819,17 @@ bool peer_connection::add_request(const piece_block& block, int flags)
         return false;
 
     pending_block pb(block, t->size());
+    pb.busy = (flags & req_busy) != 0;
     m_request_queue.push_back(pb);
     return true;
 }
 
+void peer_connection::update_desired_queue_size()
+{
+    m_desired_queue_size = request_queue_depth(
+        int(m_statistics.download_payload_rate()), m_rtt, m_ses.settings());
+}
+
 void peer_connection::send_block_requests()
 {
     if (m_channel_state[upload_channel] & peer_info::bw_seq) return;
@@ -723,11 +845,15 @@ void peer_connection::send_block_requests()
         return;
 
     // send in 3 requests at a time
-    if (m_download_queue.size() + 2 >= m_desired_queue_size || t->upload_mode()) return;
+    if (m_download_queue.size() + std::min<size_t>(3, m_desired_queue_size) > m_desired_queue_size ||
+        t->upload_mode()) return;
 
     client_request_parts_64 rp;
     rp.m_hFile = t->hash();
 
+    // peer has nothing to send before it gets these requests, its first data measures round trip
+    if (m_download_queue.empty() && !m_request_queue.empty()) m_requested = time_now();
+
     while (!m_request_queue.empty() && m_download_queue.size() < m_desired_queue_size)
     {
         pending_block block = m_request_queue.front();
@@ -838,6 +964,26 @@ void peer_connection::cancel_all_requests()
     write_cancel_transfer();
 }
 
+void peer_connection::cancel_request(const piece_block& b)
+{
+    std::vector<pending_block>::iterator i =
+        std::find_if(m_download_queue.begin(), m_download_queue.end(), has_block(b));
+    bool sent = i != m_download_queue.end() && !i->not_wanted;
+
+    // ed2k has no cancel of single request - sent requests are skipped on receive
+    if (cancel_pending_block(m_request_queue, m_download_queue, b))
+    {
+        DBG("cancel block request: {piece: " << b.piece_index << ", block: " << b.block_index
+            << ", remote: " << m_remote << "}");
+    }
+
+    // requests of block which came before cancel are wasted too,
+    // request being read now is counted when it is skipped
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    int wasted = sent ? received_block_bytes(*i) : 0;
+    if (t && wasted > 0) t->add_redundant_bytes(wasted, piece_picker::piece_end_game);
+}
+
 bool peer_connection::requesting(const piece_block& b) const
 {
     return
@@ -944,7 +1090,7 @@ char* peer_connection::release_disk_receive_buffer()
 
 void peer_connection::on_timeout()
 {
-    boost::mutex::scoped_lock l(m_ses.m_mutex);
+    LIBED2K_ASSERT(m_ses.is_network_thread());
     disconnect(errors::timed_out);
 }
 
@@ -960,34 +1106,7 @@ void peer_connection::on_sent(const error_code& error, std::size_t bytes_transfe
     m_quota[upload_channel] -= bytes_transferred;
 
     // manage the payload markers
-    int amount_payload = 0;
-    if (!m_payloads.empty())
-    {
-        for (std::vector<range>::iterator i = m_payloads.begin();
-             i != m_payloads.end(); ++i)
-        {
-            i->start -= bytes_transferred;
-            if (i->start < 0)
-            {
-                if (i->start + i->length <= 0)
-                {
-                    amount_payload += i->length;
-                }
-                else
-                {
-                    amount_payload += -i->start;
-                    i->length -= -i->start;
-                    i->start = 0;
-                }
-            }
-        }
-    }
-
-    // TODO: move the erasing into the loop above
-    // remove all payload ranges that has been sent
-    m_payloads.erase(
-        std::remove_if(m_payloads.begin(), m_payloads.end(), range_below_zero),
-        m_payloads.end());
+    int amount_payload = sent_payload(m_payloads, int(bytes_transferred));
 
     LIBED2K_ASSERT(amount_payload <= (int)bytes_transferred);
     m_statistics.sent_bytes(amount_payload, bytes_transferred - amount_payload);
@@ -999,6 +1118,7 @@ void peer_connection::disconnect(error_code const& ec, int error)
 
     if (error > 0) m_failed = true;
     boost::intrusive_ptr<peer_connection> me(this);
+    update_credits();
 
     if (m_connecting && m_connection_ticket >= 0)
     {
@@ -1037,21 +1157,19 @@ void peer_connection::disconnect(error_code const& ec, int error)
 
 void peer_connection::connect(int ticket)
 {
-    boost::mutex::scoped_lock l(m_ses.m_mutex);
+    LIBED2K_ASSERT(m_ses.is_network_thread());
 
     m_connection_ticket = ticket;
 
     DBG("CONNECTING: " << m_remote);
 
-    m_socket->async_connect(
-        m_remote, boost::bind(&peer_connection::on_connect,
-                              self_as<peer_connection>(), _1));
+    async_connect(boost::bind(&peer_connection::on_connect, self_as<peer_connection>(), _1));
 
 }
 
 void peer_connection::on_connect(error_code const& e)
 {
-    boost::mutex::scoped_lock l(m_ses.m_mutex);
+    LIBED2K_ASSERT(m_ses.is_network_thread());
 
     if (m_disconnecting) return;
 
@@ -1063,6 +1181,14 @@ void peer_connection::on_connect(error_code const& e)
     {
         DBG("CONNECTION FAILED: " << m_remote << ": " << e.message());
 
+        // reconnect immediately over TCP
+        if (utp_connect_failed(m_peer, is_utp(*m_socket)))
+        {
+            fast_reconnect(true);
+            disconnect(e, 0);
+            return;
+        }
+
         disconnect(e, 1);
         return;
     }
@@ -1131,7 +1257,7 @@ bool peer_connection::can_write() const
 {
     // if we have requests or pending data to be sent or announcements to be made
     // we want to send data
-    return !m_send_buffer.empty()
+    return !send_queue_empty()
         && m_quota[upload_channel] > 0
         && !m_connecting;
 }
@@ -1243,11 +1369,10 @@ void peer_connection::send_deferred()
 {
     LIBED2K_ASSERT((m_channel_state[upload_channel] & peer_info::bw_seq) == 0);
 
-    while (!m_deferred.empty())
-    {
-        write_message(m_deferred.front());
-        m_deferred.pop_front();
-    }
+    if (m_deferred.empty()) return;
+
+    m_send_buffer.splice(m_deferred);
+    do_write();
 }
 
 void peer_connection::fill_send_buffer()
@@ -1256,10 +1381,11 @@ void peer_connection::fill_send_buffer()
 
     if (m_handshake_complete) { send_deferred(); }
 
-    if (!m_requests.empty() && m_send_buffer.size() < m_ses.settings().send_buffer_watermark)
+    if (!m_requests.empty() && send_queue_size() < m_ses.settings().send_buffer_watermark)
     {
         const peer_request& req = m_requests.front();
-        write_part(req);
+        // compressed blocks go with own headers
+        if (!m_send_compressed) write_part(req);
         send_data(req);
         m_requests.erase(m_requests.begin());
     }
@@ -1276,8 +1402,24 @@ void peer_connection::send_data(const peer_request& req)
 
     if (r.length > 0)
     {
-        t->filesystem().async_read(r, boost::bind(&peer_connection::on_disk_read_complete,
-                                                  self_as<peer_connection>(), _1, _2, r, left));
+        compressed_block z;
+        if (m_send_compressed) z = m_ses.m_compressed_blocks.find(t->hash(), mk_range(r).first, r.length);
+
+        if (z && !z->empty())
+        {
+            write_compressed_part(r, z);
+            do_write();
+            send_data(left);
+            return;
+        }
+
+        // plain TCP takes uncompressed blocks straight from page cache
+        if (!m_send_compressed && m_ses.settings().zero_copy_uploads && m_socket->get<stream_socket>())
+            t->filesystem().async_read_pipe(r, boost::bind(&peer_connection::on_disk_read_complete,
+                                                           self_as<peer_connection>(), _1, _2, r, left));
+        else
+            t->filesystem().async_read(r, boost::bind(&peer_connection::on_disk_read_complete,
+                                                      self_as<peer_connection>(), _1, _2, r, left));
         m_channel_state[upload_channel] |= peer_info::bw_seq;
     }
     else
@@ -1290,12 +1432,13 @@ void peer_connection::send_data(const peer_request& req)
 void peer_connection::on_disk_read_complete(
     int ret, disk_io_job const& j, peer_request r, peer_request left)
 {
-    boost::mutex::scoped_lock l(m_ses.m_mutex);
+    LIBED2K_ASSERT(m_ses.is_network_thread());
 
     LIBED2K_ASSERT(r.piece == j.piece);
     LIBED2K_ASSERT(r.start == j.offset);
 
-    disk_buffer_holder buffer(m_ses.m_disk_thread, j.buffer);
+    // mapped block isn't a disk buffer, its mapping lives in the job
+    disk_buffer_holder buffer(m_ses.m_disk_thread, j.mapping ? 0 : j.buffer);
     boost::shared_ptr<transfer> t = m_transfer.lock();
 
     if (ret != r.length)
@@ -1310,11 +1453,105 @@ void peer_connection::on_disk_read_complete(
         t->handle_disk_error(j, this);
         return;
     }
+
+    if (m_send_compressed)
+    {
+        // pipes are requested for uncompressed uploads only
+        LIBED2K_ASSERT(!j.pipe);
+
+        if (!t)
+        {
+            m_channel_state[upload_channel] &= ~peer_info::bw_seq;
+            return;
+        }
+
+        // block which was compressed before isn't worth compression, send it as is
+        if (!m_ses.m_compressed_blocks.find(t->hash(), mk_range(r).first, r.length))
+        {
+            // compression works on own copy of mapped block
+            if (j.mapping)
+            {
+                buffer.reset(m_ses.allocate_disk_buffer("send buffer"));
+                if (buffer) std::memcpy(buffer.get(), j.buffer, r.length);
+            }
+
+            if (buffer)
+            {
+                char* data = buffer.release();
+                m_ses.m_compression_buffers.insert(data);
+                m_ses.compression_io_service().post(
+                    boost::bind(&peer_connection::compress_part, self_as<peer_connection>(), data, r, left));
+                return;
+            }
+        }
+
+        write_part(r);
+    }
+
+    if (j.pipe) append_piped_part(r, j.pipe);
+    else if (j.mapping) append_mapped_part(r, j.buffer, j.mapping);
+    else append_part(r, buffer);
+    do_write();
+    send_data(left);
+}
+
+void peer_connection::append_part(const peer_request& r, disk_buffer_holder& buffer)
+{
     append_send_buffer(buffer.get(), r.length,
                        boost::bind(&aux::session_impl::free_disk_buffer, boost::ref(m_ses), _1));
     buffer.release();
 
-    m_payloads.push_back(range(m_send_buffer.size() - r.length, r.length));
+    m_payloads.push_back(payload_range(send_queue_size() - r.length, r.length));
+}
+
+void peer_connection::append_mapped_part(
+    const peer_request& r, char* data, const boost::intrusive_ptr<file_mapping>& mapping)
+{
+    append_send_buffer(data, r.length, boost::bind(&release_mapped_block, _1, mapping));
+    m_payloads.push_back(payload_range(send_queue_size() - r.length, r.length));
+}
+
+void peer_connection::append_piped_part(const peer_request& r, const boost::intrusive_ptr<block_pipe>& pipe)
+{
+    LIBED2K_ASSERT(pipe->size() == r.length);
+    append_send_pipe(pipe);
+    m_payloads.push_back(payload_range(send_queue_size() - r.length, r.length));
+}
+
+void peer_connection::compress_part(char* buffer, peer_request r, peer_request left)
+{
+    boost::shared_ptr<std::vector<char> > z(new std::vector<char>());
+    deflate_block(buffer, r.length, *z);
+    m_ses.m_io_service.post(boost::bind(&peer_connection::on_part_compressed,
+                                        self_as<peer_connection>(), buffer, r, left, compressed_block(z)));
+}
+
+void peer_connection::on_part_compressed(char* buffer, peer_request r, peer_request left, compressed_block z)
+{
+    LIBED2K_ASSERT(m_ses.is_network_thread());
+
+    m_ses.m_compression_buffers.erase(buffer);
+    disk_buffer_holder holder(m_ses.m_disk_thread, buffer);
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+
+    if (!t || is_closed())
+    {
+        m_channel_state[upload_channel] &= ~peer_info::bw_seq;
+        return;
+    }
+
+    m_ses.m_compressed_blocks.insert(t->hash(), mk_range(r).first, r.length, z);
+
+    if (z->empty())
+    {
+        write_part(r);
+        append_part(r, holder);
+    }
+    else
+    {
+        write_compressed_part(r, z);
+    }
+
     do_write();
     send_data(left);
 }
@@ -1324,6 +1561,14 @@ void peer_connection::receive_data(const peer_request& req, bool compressed)
     LIBED2K_ASSERT((m_channel_state[download_channel] & (peer_info::bw_network | peer_info::bw_seq)) == 0);
     LIBED2K_ASSERT(req.length <= BLOCK_SIZE);
 
+    if (m_requested != min_time())
+    {
+        int sample = total_milliseconds(time_now() - m_requested);
+        m_rtt = m_rtt == 0 ? sample : (m_rtt * 3 + sample) / 4;
+        m_requested = min_time();
+        update_desired_queue_size();
+    }
+
     m_recv_pos = 0;
     m_recv_req = req;
     m_recv_compressed = compressed;
@@ -1358,6 +1603,16 @@ void peer_connection::receive_data()
             " : {piece: "<< block.piece_index <<
             ", block: " << block.block_index << ", length: " << block_size(block, t->size())
             << "} was not in the request queue");
+        if (m_recv_req.length > m_recv_pos)
+            t->add_redundant_bytes(m_recv_req.length - m_recv_pos, piece_picker::piece_unknown);
+        skip_data();
+        return;
+    }
+
+    if (b->not_wanted)
+    {
+        // other peer has delivered this block in endgame
+        t->add_redundant_bytes(skip_pending_block(m_download_queue, b, m_recv_req), piece_picker::piece_end_game);
         skip_data();
         return;
     }
@@ -1372,10 +1627,8 @@ void peer_connection::receive_data()
     if (max_receive > 0)
     {
         m_channel_state[download_channel] |= peer_info::bw_network;
-        boost::asio::async_read(
-            *m_socket, boost::asio::buffer(b->buffer + offset_in_block(m_recv_req) + m_recv_pos, max_receive),
-            make_read_handler(boost::bind(&peer_connection::on_receive_data,
-                                          self_as<peer_connection>(), _1, _2)));
+        async_read(b->buffer + offset_in_block(m_recv_req) + m_recv_pos, max_receive, false,
+                   boost::bind(&peer_connection::on_receive_data, self_as<peer_connection>(), _1, _2));
     }
     else
     {
@@ -1386,7 +1639,7 @@ void peer_connection::receive_data()
 
 void peer_connection::on_receive_data(const error_code& error, std::size_t bytes_transferred)
 {
-    boost::mutex::scoped_lock l(m_ses.m_mutex);
+    LIBED2K_ASSERT(m_ses.is_network_thread());
     // keep ourselves alive in until this function exits in case we disconnect
     boost::intrusive_ptr<peer_connection> me(self_as<peer_connection>());
 
@@ -1433,7 +1686,7 @@ void peer_connection::on_receive_data(const error_code& error, std::size_t bytes
             ", block: " << block_finished.block_index << ", length: " << block_size(block_finished, t->size())
             << "} is already downloaded");
 
-        //t->add_redundant_bytes(p.length);
+        t->add_redundant_bytes(m_recv_req.length, piece_picker::piece_end_game);
         m_download_queue.erase(b);
         skip_data();
         return;
@@ -1450,9 +1703,12 @@ void peer_connection::on_receive_data(const error_code& error, std::size_t bytes
                                        self_as<peer_connection>(), _1, _2, req, t));
 
             bool was_finished = picker.is_piece_finished(m_recv_req.piece);
+            bool duplicated = picker.num_peers(block_finished) > 1;
             picker.mark_as_writing(block_finished, get_peer());
             m_download_queue.erase(b);
 
+            if (duplicated) t->cancel_block(block_finished, this);
+
             // did we just finish the piece?
             // this means all blocks are either written
             // to disk or are in the disk write cache
@@ -1481,15 +1737,13 @@ void peer_connection::skip_data()
 
     LIBED2K_ASSERT(skip_bytes > 0);
     m_channel_state[download_channel] |= (peer_info::bw_network | peer_info::bw_seq);
-    m_socket->async_read_some(
-        boost::asio::buffer(skip_buf, skip_bytes),
-        make_read_handler(boost::bind(&peer_connection::on_skip_data,
-                                      self_as<peer_connection>(), _1, _2)));
+    async_read(skip_buf, skip_bytes, true,
+               boost::bind(&peer_connection::on_skip_data, self_as<peer_connection>(), _1, _2));
 }
 
 void peer_connection::on_skip_data(const error_code& error, std::size_t bytes_transferred)
 {
-    boost::mutex::scoped_lock l(m_ses.m_mutex);
+    LIBED2K_ASSERT(m_ses.is_network_thread());
     // keep ourselves alive in until this function exits in case we disconnect
     boost::intrusive_ptr<peer_connection> me(self_as<peer_connection>());
 
@@ -1512,7 +1766,7 @@ void peer_connection::on_skip_data(const error_code& error, std::size_t bytes_tr
 void peer_connection::on_disk_write_complete(
     int ret, disk_io_job const& j, peer_request req, boost::shared_ptr<transfer> t)
 {
-    boost::mutex::scoped_lock l(m_ses.m_mutex);
+    LIBED2K_ASSERT(m_ses.is_network_thread());
 
     LIBED2K_ASSERT(req.piece == j.piece);
     LIBED2K_ASSERT(req.start == j.offset);
@@ -1544,6 +1798,7 @@ void peer_connection::append_misc_info(tag_list<boost::uint32_t>& t)
     mo.m_nDataCompVer = 0;  // support data compression
     mo.m_nNoViewSharedFiles = !m_ses.settings().m_show_shared_files;
     mo.m_nSourceExchange1Ver = SOURCE_EXCHG_LEVEL;
+    mo.m_nAICHVersion = 1;
 
     misc_options2 mo2(0);
     mo2.set_captcha();
@@ -1758,6 +2013,51 @@ void peer_connection::write_hashset_answer(
     write_struct(ha);
 }
 
+void peer_connection::request_aich_recovery(int piece, const sha1_hash& master)
+{
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    if (!t) return;
+
+    DBG("request AICH recovery {file: " << t->hash() << ", piece: " << piece << "} ==> " << m_remote);
+    client_aich_request ar;
+    ar.m_hFile = t->hash();
+    ar.m_nPart = static_cast<boost::uint16_t>(piece);
+    ar.m_hMaster = master;
+    m_aich_piece = piece;
+    write_struct(ar);
+}
+
+void peer_connection::write_aich_answer(const md4_hash& file_hash, int piece, const sha1_hash& master,
+    const std::vector<aich_node_hash>& nodes)
+{
+    DBG("AICH recovery data {file: " << file_hash << ", piece: " << piece
+        << ", count: " << nodes.size() << "} ==> " << m_remote);
+    client_aich_answer aa;
+    aa.m_hFile = file_hash;
+    aa.m_nPart = static_cast<boost::uint16_t>(piece);
+    aa.m_hMaster = master;
+    aa.m_data = aich_recovery_data(nodes);
+    write_struct(aa);
+}
+
+void peer_connection::write_aich_file_hash_request(const md4_hash& file_hash)
+{
+    DBG("request AICH master hash for " << file_hash << " ==> " << m_remote);
+    client_aich_file_hash_request fhr;
+    fhr.m_hFile = file_hash;
+    write_struct(fhr);
+    m_aich_master_requested = true;
+}
+
+void peer_connection::write_aich_file_hash_answer(const md4_hash& file_hash, const sha1_hash& master)
+{
+    DBG("AICH master hash {file: " << file_hash << "} ==> " << m_remote);
+    client_aich_file_hash_answer fha;
+    fha.m_hFile = file_hash;
+    fha.m_hMaster = master;
+    write_struct(fha);
+}
+
 void peer_connection::write_start_upload(const md4_hash& file_hash)
 {
     DBG("start upload " << file_hash << " ==> " << m_remote);
@@ -1781,6 +2081,92 @@ void peer_connection::write_accept_upload()
     write_struct(au);
 }
 
+void peer_connection::write_out_parts()
+{
+    DBG("out of parts ==> " << m_remote);
+    client_out_parts op;
+    write_struct(op);
+}
+
+void peer_connection::upload_slot_over()
+{
+    m_requests.clear();
+    write_out_parts();
+}
+
+void peer_connection::write_sources_request(const md4_hash& file_hash)
+{
+    DBG("request sources " << file_hash << " ==> " << m_remote);
+    m_sources_requested = true;
+
+    if (m_misc_options2.support_source_ext2())
+    {
+        sources_request2 sr;
+        sr.file_hash = file_hash;
+        write_struct(sr);
+    }
+    else
+    {
+        sources_request sr;
+        sr.file_hash = file_hash;
+        write_struct(sr);
+    }
+}
+
+void peer_connection::fill_sources_answer(sources_answer_base& sa, transfer& t)
+{
+    m_sources_answered = true;
+    sa.file_hash = t.hash();
+
+    std::vector<const peer*> peers;
+    t.get_policy().exchangeable_peers(peers, m_remote.address(), m_ses.session_time(), max_exchanged_sources);
+
+    for (std::vector<const peer*>::const_iterator i = peers.begin(); i != peers.end(); ++i)
+    {
+        sources_answer_element sae(sa.sx_version);
+        sae.client_id = net_identifier((*i)->endpoint);
+        // hybrid id since version 3
+        if (sa.sx_version >= 3) sae.client_id.m_nIP = ntohl(sae.client_id.m_nIP);
+        if ((*i)->connection) sae.client_hash = (*i)->connection->get_connection_hash();
+        sa.elems.push_back(sae);
+    }
+
+    DBG("answer " << sa.elems.size() << " sources v" << sa.sx_version << " " << sa.file_hash << " ==> " << m_remote);
+}
+
+void peer_connection::add_exchanged_sources(const sources_answer_base& sa)
+{
+    DBG("sources answer v" << sa.sx_version << " " << sa.file_hash << ": " << sa.elems.size() << " <== " << m_remote);
+
+    // unsolicited answers could flood peer list
+    if (!m_sources_requested) return;
+    m_sources_requested = false;
+
+    boost::shared_ptr<transfer> t = m_ses.find_transfer(sa.file_hash).lock();
+    if (!t) return;
+
+    size_t count = 0;
+
+    for (sae_container::const_iterator i = sa.elems.begin();
+         i != sa.elems.end() && count < max_exchanged_sources; ++i, ++count)
+    {
+        tcp::endpoint ep;
+        if (i->source_endpoint(ep)) t->add_peer(ep, peer_info::pex);
+    }
+}
+
+void peer_connection::update_credits()
+{
+    if (!m_hClient.defined()) return;
+
+    size_type uploaded = m_statistics.total_payload_upload();
+    size_type downloaded = m_statistics.total_payload_download();
+    m_ses.m_credits.add_uploaded(m_hClient, uploaded - m_credited_upload);
+    m_ses.m_credits.add_downloaded(m_hClient, downloaded - m_credited_download);
+    m_credited_upload = uploaded;
+    m_credited_download = downloaded;
+}
+
 void peer_connection::write_cancel_transfer()
 {
     DBG("cancel ==> " << m_remote);
@@ -1808,12 +2194,32 @@ void peer_connection::write_part(const peer_request& r)
     sp.m_hFile = t->hash();
     sp.m_begin_offset = range.first;
     sp.m_end_offset = range.second;
-    write_struct(sp);
+    // part header goes before its data also inside of send sequence
+    // and waits for data to leave by one gather write
+    serialize_message(m_send_buffer, sp);
 
     DBG("part " << sp.m_hFile << " [" << sp.m_begin_offset << ", " << sp.m_end_offset << "]"
         << " ==> " << m_remote);
 }
 
+void peer_connection::write_compressed_part(const peer_request& r, const compressed_block& z)
+{
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    if (!t) return;
+
+    client_compressed_part_64 cp;
+    cp.m_hFile = t->hash();
+    cp.m_begin_offset = mk_range(r).first;
+    cp.m_compressed_size = z->size();
+    serialize_message(m_send_buffer, cp);
+
+    append_send_buffer(const_cast<char*>(&(*z)[0]), z->size(), boost::bind(&release_compressed_block, _1, z));
+    m_payloads.push_back(payload_range(send_queue_size() - z->size(), z->size()));
+
+    DBG("compressed part " << cp.m_hFile << " [" << cp.m_begin_offset << ", " << cp.m_begin_offset + r.length << "]"
+        << " " << cp.m_compressed_size << " bytes ==> " << m_remote);
+}
+
 void peer_connection::on_hello(const error_code& error)
 {
     if (!error)
@@ -1823,6 +2229,7 @@ void peer_connection::on_hello(const error_code& error)
         m_hClient = hello.m_hClient;
         m_options.m_nPort = hello.m_network_point.m_nPort;
         parse_misc_info(hello.m_list);
+        m_ses.update_connection_index(this);
         DBG("hello {"
                 << " server point = " << hello.m_server_network_point
                 << " network point = " << hello.m_network_point
@@ -1833,6 +2240,7 @@ void peer_connection::on_hello(const error_code& error)
         {
             DBG("lowid peer detected for " << file_hash.toString());
             m_active = true;
+            m_ses.update_connection_index(this);
             attach_to_transfer(file_hash);
         }
 
@@ -1852,6 +2260,7 @@ void peer_connection::on_hello_answer(const error_code& error)
         parse_misc_info(packet.m_list);
 
         m_hClient = packet.m_hClient;
+        m_ses.update_connection_index(this);
         DBG("hello answer {name: " << m_options.m_strName
             << " : mod name: " << m_options.m_strModVersion
             << ", port: " << m_options.m_nPort << "} <== " << m_remote);
@@ -2005,6 +2414,8 @@ void peer_connection::on_file_status(const error_code& error)
         {
             m_remote_pieces = fs.m_status;
             t->picker().inc_refcount(fs.m_status);
+            if (supports_aich() && t->aich().empty())
+                write_aich_file_hash_request(fs.m_hFile);
             if (t->size() < PIECE_SIZE)
                 write_start_upload(fs.m_hFile);
             else if (fs.m_status.count() > 0)
@@ -2077,6 +2488,97 @@ void peer_connection::on_hashset_answer(const error_code& error)
     }
 }
 
+void peer_connection::on_aich_request(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_request, ar);
+        DBG("AICH request {file: " << ar.m_hFile << ", piece: " << ar.m_nPart << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        std::vector<aich_node_hash> nodes;
+
+        if (t && t->hash() == ar.m_hFile && t->aich().master_hash() == ar.m_hMaster &&
+            t->aich().part_recovery_data(ar.m_nPart, nodes))
+        {
+            write_aich_answer(ar.m_hFile, ar.m_nPart, ar.m_hMaster, nodes);
+        }
+        else
+        {
+            // answer with file hash only rejects request
+            client_aich_answer aa;
+            aa.m_hFile = ar.m_hFile;
+            write_struct(aa);
+        }
+    }
+    else
+    {
+        ERR("AICH request error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_answer(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_answer, aa);
+        std::vector<aich_node_hash> nodes = aa.m_data.nodes();
+        DBG("AICH answer {file: " << aa.m_hFile << ", count: " << nodes.size() << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() != aa.m_hFile || m_aich_piece < 0) return;
+
+        int piece = m_aich_piece;
+        m_aich_piece = -1;
+
+        if (nodes.empty() || aa.m_nPart != piece)
+            t->on_aich_recovery_data(piece, sha1_hash(), std::vector<aich_node_hash>());
+        else
+            t->on_aich_recovery_data(piece, aa.m_hMaster, nodes);
+    }
+    else
+    {
+        ERR("AICH answer error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_file_hash_request(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_file_hash_request, fhr);
+        DBG("AICH master hash request " << fhr.m_hFile << " <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (t && t->hash() == fhr.m_hFile && !t->aich().empty())
+            write_aich_file_hash_answer(fhr.m_hFile, t->aich().master_hash());
+    }
+    else
+    {
+        ERR("AICH master hash request error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_file_hash_answer(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_file_hash_answer, fha);
+        DBG("AICH master hash answer " << fha.m_hFile << " <== " << m_remote);
+
+        // unsolicited or repeated answers would let one peer vote many times
+        if (!m_aich_master_requested) return;
+        m_aich_master_requested = false;
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (t && t->hash() == fha.m_hFile) t->add_aich_master(m_remote.address(), fha.m_hMaster);
+    }
+    else
+    {
+        ERR("AICH master hash answer error " << error.message() << " <== " << m_remote);
+    }
+}
+
 void peer_connection::on_start_upload(const error_code& error)
 {
     if (!error)
@@ -2089,7 +2591,7 @@ void peer_connection::on_start_upload(const error_code& error)
 
         // do not check a hash, due to mldonkey's weirdness
         // mldonkey sends zero hash here
-        write_accept_upload();
+        m_ses.m_upload_queue.request_upload(this, t->priority(), m_ses.settings(), time_now());
     }
     else
     {
@@ -2161,7 +2663,7 @@ void peer_connection::on_cancel_transfer(const error_code& error)
     if (!error)
     {
         DBG("cancel transfer <== " << m_remote);
-        // TODO: handle it.
+        m_ses.m_upload_queue.release_slot(this);
         disconnect(errors::transfer_aborted);
     }
     else
@@ -2176,6 +2678,8 @@ void peer_connection::on_end_download(const error_code& error)
     {
         DECODE_PACKET(client_end_download, ed);
         DBG("end download " << ed.m_hFile << " <== " << m_remote);
+        m_requests.clear();
+        m_ses.m_upload_queue.release_slot(this);
     }
     else
     {
@@ -2492,30 +2996,80 @@ void peer_connection::on_client_public_ip_request(const error_code& error)
     }
 }
 
-void peer_connection::on_client_sources_request(const error_code& error){
-    if (!error){
-        DECODE_PACKET(sources_request_base, packet);
-        DBG("request sources: <====" << m_remote);
-        // prepare fake answer
-        //TODO - add transfer search and peer request
-        sources_answer2 sa2(SOURCE_EXCHG_LEVEL);
-        sa2.file_hash = packet.file_hash;
-        sa2.size = 0;
-        send_throw_meta_order(sa2);
+void peer_connection::on_client_sources_request(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(sources_request, sr);
+        DBG("request sources " << sr.file_hash << " <== " << m_remote);
+        boost::shared_ptr<transfer> t = m_ses.find_transfer(sr.file_hash).lock();
+        if (!t || m_sources_answered) return;
+
+        // answer in version requester understands
+        sources_answer sa(std::max(1, std::min<int>(m_misc_options.m_nSourceExchange1Ver, SOURCE_EXCHG_LEVEL)));
+        fill_sources_answer(sa, *t);
+        write_struct(sa);
+    }
+    else
+    {
+        ERR("request sources error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_client_sources_request2(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(sources_request2, sr);
+        DBG("request sources v" << int(sr.version) << " " << sr.file_hash << " <== " << m_remote);
+        boost::shared_ptr<transfer> t = m_ses.find_transfer(sr.file_hash).lock();
+        if (!t || m_sources_answered || sr.version == 0) return;
+
+        sources_answer2 sa(std::min<int>(sr.version, SOURCE_EXCHG2_LEVEL));
+        fill_sources_answer(sa, *t);
+        write_struct(sa);
+    }
+    else
+    {
+        ERR("request sources error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_client_sources_answer(const error_code& error)
+{
+    if (!error)
+    {
+        sources_answer sa(m_misc_options.m_nSourceExchange1Ver);
+        if (!decode_packet(sa))
+        {
+            disconnect(errors::decode_packet_error);
+            return;
+        }
+
+        add_exchanged_sources(sa);
     }
-    else{
-        ERR("Error on request sources for file");
+    else
+    {
+        ERR("sources answer error " << error.message() << " <== " << m_remote);
     }
 }
 
-void peer_connection::on_client_sources_answer(const error_code& error){
-    if (!error){
-        sources_answer_base sae(m_misc_options.m_nSourceExchange1Ver);
-        decode_packet(sae);
-        DBG("sources answer: <====" << m_remote);
+void peer_connection::on_client_sources_answer2(const error_code& error)
+{
+    if (!error)
+    {
+        sources_answer2 sa(0);
+        if (!decode_packet(sa))
+        {
+            disconnect(errors::decode_packet_error);
+            return;
+        }
+
+        add_exchanged_sources(sa);
     }
-    else{
-        ERR("unable to parse sources answer: " << error.message());
+    else
+    {
+        ERR("sources answer error " << error.message() << " <== " << m_remote);
     }
 }
 
@@ -2531,6 +3085,12 @@ void peer_connection::on_request_parts(const error_code& error)
             return;
         }
 
+        if (!m_ses.m_upload_queue.has_slot(this))
+        {
+            DBG("requested parts without upload slot: {remote: " << m_remote << "}");
+            return;
+        }
+
         DECODE_PACKET(Struct, rp);
         DBG("request parts " << rp.m_hFile << ": "
             << "[" << rp.m_begin_offset[0] << ", " << rp.m_end_offset[0] << "]"
@@ -2622,7 +3182,7 @@ void peer_connection::on_compressed_part(const error_code& error)
 }
 
 template<typename T>
-void peer_connection::defer_write(const T& t) { m_deferred.push_back(make_message(t)); }
+void peer_connection::defer_write(const T& t) { serialize_message(m_deferred, t); }
 
 template<typename T>
 void peer_connection::send_throw_meta_order(const T& t)
@@ -9,60 +9,52 @@ using libed2k::aux::session_impl;
 namespace libed2k
 {
 
+    // connections are looked up on the network thread, requests post
+    // themselves there and getters wait for the result
 #ifdef BOOST_NO_EXCEPTIONS
-#define LIBED2K_PC_FORWARD(call) \
-        if (!m_pses)\
-        {\
-            return;\
-        }\
-        boost::intrusive_ptr<peer_connection> pc = m_pses->find_peer_connection(m_np);\
-        if (!pc) return;\
-        session_impl::mutex_t::scoped_lock l(m_pses->m_mutex);\
-        pc->call;
-
 #define LIBED2K_PC_FORWARD_NOLOCK(call) \
         if (!m_pses)\
         {\
             return;\
         }\
-        boost::intrusive_ptr<peer_connection> pc = m_pses->find_peer_connection(m_np);\
+        boost::intrusive_ptr<peer_connection> pc = find_connection(m_pses, m_np);\
         if (!pc) return;\
         pc->call;
 
-#define LIBED2K_PC_FORWARD_RETURN(call, def) \
+#define LIBED2K_PC_SYNC_CALL_RET(type, x, def) \
         if (!m_pses)\
         {\
             return def;\
         }\
-        boost::intrusive_ptr<peer_connection> pc = m_pses->find_peer_connection(m_np);\
+        boost::intrusive_ptr<peer_connection> pc = find_connection(m_pses, m_np);\
         if (!pc) return def;\
-        session_impl::mutex_t::scoped_lock l(m_pses->m_mutex);\
-        return pc->call;
+        return m_pses->sync_call_ret<type>(boost::bind(&peer_connection:: x, pc));
 #else
-#define LIBED2K_PC_FORWARD(call) \
-        if (!m_pses) {throw_null_session_pointer();}\
-        boost::intrusive_ptr<peer_connection> pc = m_pses->find_peer_connection(m_np);\
-        if (!pc) throw_invalid_pc_handle();\
-        session_impl::mutex_t::scoped_lock l(m_pses->m_mutex);\
-        pc->call;
-
 #define LIBED2K_PC_FORWARD_NOLOCK(call) \
         if (!m_pses) {throw_null_session_pointer();}\
-        boost::intrusive_ptr<peer_connection> pc = m_pses->find_peer_connection(m_np);\
+        boost::intrusive_ptr<peer_connection> pc = find_connection(m_pses, m_np);\
         if (!pc) throw_invalid_pc_handle();\
         pc->call;
 
-
-#define LIBED2K_PC_FORWARD_RETURN(call, def) \
+#define LIBED2K_PC_SYNC_CALL_RET(type, x, def) \
         if (!m_pses) {throw_null_session_pointer();}\
-        boost::intrusive_ptr<peer_connection> pc = m_pses->find_peer_connection(m_np);\
+        boost::intrusive_ptr<peer_connection> pc = find_connection(m_pses, m_np);\
         if (!pc) throw_invalid_pc_handle();\
-        session_impl::mutex_t::scoped_lock l(m_pses->m_mutex);\
-        return pc->call;\
-
+        return m_pses->sync_call_ret<type>(boost::bind(&peer_connection:: x, pc));\
 
 #endif
 
+    namespace
+    {
+        typedef boost::intrusive_ptr<peer_connection> (session_impl::*find_by_point_t)(const net_identifier&) const;
+
+        boost::intrusive_ptr<peer_connection> find_connection(session_impl* ses, const net_identifier& np)
+        {
+            return ses->sync_call_ret<boost::intrusive_ptr<peer_connection> >(
+                boost::bind(static_cast<find_by_point_t>(&session_impl::find_peer_connection), ses, np));
+        }
+    }
+
 #ifndef BOOST_NO_EXCEPTIONS
     inline void throw_invalid_pc_handle()
     {
@@ -112,27 +104,27 @@ namespace libed2k
 
     md4_hash peer_connection_handle::get_hash() const
     {
-        LIBED2K_PC_FORWARD_RETURN(get_connection_hash(), md4_hash())
+        LIBED2K_PC_SYNC_CALL_RET(md4_hash, get_connection_hash, md4_hash())
     }
 
     net_identifier peer_connection_handle::get_network_point() const
     {
-        LIBED2K_PC_FORWARD_RETURN(get_network_point(), net_identifier())
+        LIBED2K_PC_SYNC_CALL_RET(net_identifier, get_network_point, net_identifier())
     }
 
     peer_connection_options peer_connection_handle::get_options() const
     {
-        LIBED2K_PC_FORWARD_RETURN(get_options(), peer_connection_options())
+        LIBED2K_PC_SYNC_CALL_RET(peer_connection_options, get_options, peer_connection_options())
     }
 
     misc_options peer_connection_handle::get_misc_options() const
     {
-        LIBED2K_PC_FORWARD_RETURN(get_misc_options(), misc_options())
+        LIBED2K_PC_SYNC_CALL_RET(misc_options, get_misc_options, misc_options())
     }
 
     misc_options2 peer_connection_handle::get_misc_options2() const
     {
-        LIBED2K_PC_FORWARD_RETURN(get_misc_options2(), misc_options2())
+        LIBED2K_PC_SYNC_CALL_RET(misc_options2, get_misc_options2, misc_options2())
     }
 
     bool peer_connection_handle::empty() const
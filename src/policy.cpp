@@ -147,8 +147,8 @@ bool policy::new_connection(peer_connection& c, int session_time)
 
         if (i->connection != 0)
         {
-            boost::shared_ptr<tcp::socket> other_socket = i->connection->socket();
-            boost::shared_ptr<tcp::socket> this_socket = c.socket();
+            boost::shared_ptr<socket_type> other_socket = i->connection->socket();
+            boost::shared_ptr<socket_type> this_socket = c.socket();
 
             error_code ec1;
             error_code ec2;
@@ -868,3 +868,29 @@ bool policy::should_erase_immediately(peer const& p) const
     //if (&p == m_locked_peer) return false;
     return p.source == peer_info::resume_data;
 }
+
+void policy::exchangeable_peers(std::vector<const peer*>& res, const ip::address& requester,
+    int session_time, size_t limit) const
+{
+    // peers not seen connected during this time are considered stale
+    const int source_freshness = 30 * 60;
+
+    res.clear();
+
+    // connected peers are sure alive, they go first
+    for (peers_t::const_iterator i = m_peers.begin(); i != m_peers.end() && res.size() < limit; ++i)
+    {
+        const peer& pe = **i;
+        if (!pe.address().is_v4() || pe.address() == requester) continue;
+        if (pe.connection && pe.connectable && !pe.connection->is_disconnecting()) res.push_back(&pe);
+    }
+
+    for (peers_t::const_iterator i = m_peers.begin(); i != m_peers.end() && res.size() < limit; ++i)
+    {
+        const peer& pe = **i;
+        if (!pe.address().is_v4() || pe.address() == requester) continue;
+        if (pe.connection || !pe.connectable || pe.failcount > 0 || !pe.last_connected) continue;
+        if (session_time - pe.last_connected > source_freshness) continue;
+        res.push_back(&pe);
+    }
+}
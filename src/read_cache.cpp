@@ -0,0 +1,65 @@
+#include <algorithm>
+
+#include "libed2k/read_cache.hpp"
+
+namespace libed2k
+{
+    bool copied_range::copy(int begin, int end)
+    {
+        LIBED2K_ASSERT(begin < end);
+        if (empty())
+        {
+            m_begin = begin;
+            m_end = end;
+            return false;
+        }
+
+        bool overlaps = begin < m_end && m_begin < end;
+        m_begin = (std::min)(m_begin, begin);
+        m_end = (std::max)(m_end, end);
+        return overlaps;
+    }
+
+    void ghost_list::push_back(const cache_piece_key& key, int capacity)
+    {
+        m_keys.push_back(key);
+        while (int(m_keys.size()) > capacity) m_keys.pop_front();
+    }
+
+    bool ghost_list::take(const cache_piece_key& key)
+    {
+        std::deque<cache_piece_key>::iterator i = std::find(m_keys.begin(), m_keys.end(), key);
+        if (i == m_keys.end()) return false;
+        m_keys.erase(i);
+        return true;
+    }
+
+    void ghost_list::remove_storage(void* storage)
+    {
+        for (std::deque<cache_piece_key>::iterator i = m_keys.begin(); i != m_keys.end();)
+        {
+            if (i->first == storage) i = m_keys.erase(i);
+            else ++i;
+        }
+    }
+
+    void transfer_cache_stats::count_read(const md4_hash& hash, bool hit)
+    {
+        transfer_cache_status& st = m_stats[hash];
+        st.hash = hash;
+        ++st.blocks_read;
+        if (hit) ++st.blocks_read_hit;
+    }
+
+    void transfer_cache_stats::remove(const md4_hash& hash)
+    {
+        m_stats.erase(hash);
+    }
+
+    void transfer_cache_stats::status(std::vector<transfer_cache_status>& ret) const
+    {
+        ret.reserve(ret.size() + m_stats.size());
+        for (stats_t::const_iterator i = m_stats.begin(); i != m_stats.end(); ++i)
+            ret.push_back(i->second);
+    }
+}
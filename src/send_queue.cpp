@@ -0,0 +1,74 @@
+#include <algorithm>
+
+#include "libed2k/send_queue.hpp"
+
+namespace libed2k
+{
+    void pipe_queue::push_back(const boost::intrusive_ptr<block_pipe>& pipe, int buffer_size)
+    {
+        send_pipe p;
+        p.position = buffer_size;
+        p.pipe = pipe;
+        m_pipes.push_back(p);
+        m_bytes += pipe->size();
+    }
+
+    boost::intrusive_ptr<block_pipe> pipe_queue::ready() const
+    {
+        if (m_pipes.empty() || m_pipes.front().position > 0) return boost::intrusive_ptr<block_pipe>();
+        return m_pipes.front().pipe;
+    }
+
+    int pipe_queue::buffer_limit(int amount) const
+    {
+        if (m_pipes.empty()) return amount;
+        return (std::min)(amount, m_pipes.front().position);
+    }
+
+    void pipe_queue::buffer_sent(int bytes)
+    {
+        LIBED2K_ASSERT(bytes == 0 || m_pipes.empty() || m_pipes.front().position >= bytes);
+        for (std::deque<send_pipe>::iterator i = m_pipes.begin(); i != m_pipes.end(); ++i)
+            i->position -= bytes;
+    }
+
+    void pipe_queue::pipe_sent(int bytes)
+    {
+        LIBED2K_ASSERT(!m_pipes.empty() && m_pipes.front().position == 0);
+        m_bytes -= bytes;
+        if (m_pipes.front().pipe->size() == 0) m_pipes.pop_front();
+    }
+
+    namespace
+    {
+        bool range_below_zero(const payload_range& r) { return r.start < 0; }
+    }
+
+    int sent_payload(std::vector<payload_range>& payloads, int bytes)
+    {
+        int amount_payload = 0;
+        for (std::vector<payload_range>::iterator i = payloads.begin(); i != payloads.end(); ++i)
+        {
+            i->start -= bytes;
+            if (i->start < 0)
+            {
+                if (i->start + i->length <= 0)
+                {
+                    amount_payload += i->length;
+                }
+                else
+                {
+                    amount_payload += -i->start;
+                    i->length -= -i->start;
+                    i->start = 0;
+                }
+            }
+        }
+
+        // remove all payload ranges that has been sent
+        payloads.erase(std::remove_if(payloads.begin(), payloads.end(), range_below_zero), payloads.end());
+
+        LIBED2K_ASSERT(amount_payload <= bytes);
+        return amount_payload;
+    }
+}
@@ -466,8 +466,6 @@ namespace libed2k
     {
         CHECK_ABORTED();
 
-        typedef boost::iostreams::basic_array_source<char> Device;
-
         if (!error)
         {
             //DBG("server_connection::handle_read_packet(" << error.message() << ", " << nSize << ", " << packetToString(m_in_header.m_type));
@@ -477,25 +475,19 @@ namespace libed2k
             {
                 DBG("packed packet reseived");
                 // unzip data
-                m_in_container.resize(m_in_gzip_container.size() * 10 + 300);
-                uLongf nSize = m_in_container.size();
-                int nRet = uncompress((Bytef*)&m_in_container[0], &nSize, (const Bytef*)&m_in_gzip_container[0], m_in_gzip_container.size());
-
-                if (nRet != Z_OK)
+                if (!inflate_packet(m_in_gzip_container.empty() ? NULL : &m_in_gzip_container[0],
+                        m_in_gzip_container.size(),
+                        m_in_container, m_ses.settings().max_inflated_packet_size))
                 {
-                    ERR("Unzip error: " << mz_error(nRet));
+                    ERR("Unzip error: corrupted or too big packed packet");
                     //unpack error - pass packet
                     do_read();
                     return;
                 }
-
-                m_in_container.resize(nSize);
             }
 
 
-            boost::iostreams::stream_buffer<Device> buffer(&m_in_container[0], m_in_container.size());
-            std::istream in_array_stream(&buffer);
-            archive::ed2k_iarchive ia(in_array_stream);
+            archive::ed2k_iarchive ia(m_in_container.empty() ? NULL : &m_in_container[0], m_in_container.size());
 
             try
             {
@@ -512,6 +504,7 @@ namespace libed2k
                     {
                         server_message smsg;
                         ia >> smsg;
+                        if (!ia) break;
                         m_ses.m_alerts.post_alert_should(server_message_alert(params.name, params.host, params.port, smsg.m_strMessage));
                         break;
                     }
@@ -525,6 +518,7 @@ namespace libed2k
                     {
                         server_status sss;
                         ia >> sss;
+                        if (!ia) break;
                         m_ses.m_alerts.post_alert_should(server_status_alert(params.name, params.host, params.port, sss.m_nFilesCount, sss.m_nUserCount));
                         break;
                     }
@@ -536,6 +530,7 @@ namespace libed2k
                         current_operation = scs_start;
                         id_change idc;
                         ia >> idc;
+                        if (!ia) break;
 
                         m_client_id = idc.m_client_id;
                         m_tcp_flags = idc.m_tcp_flags;
@@ -548,6 +543,7 @@ namespace libed2k
                     {
                         server_info_entry se;
                         ia >> se;
+                        if (!ia) break;
                         se.dump();
                         m_hServer = se.m_hServer;
                         m_ses.m_alerts.post_alert_should(server_identity_alert(params.name, params.host, params.port, se.m_hServer, se.m_network_point,
@@ -559,6 +555,7 @@ namespace libed2k
                     {
                         found_file_sources fs;
                         ia >> fs;
+                        if (!ia) break;
                         fs.dump();
                         on_found_peers(fs);
                         break;
@@ -567,6 +564,7 @@ namespace libed2k
                     {
                         search_result sfl;
                         ia >> sfl;
+                        if (!ia) break;
 
                         m_ses.m_alerts.post_alert_should(
                                 shared_files_alert(net_identifier(address2int(m_target.address()), m_target.port()), m_hServer,
@@ -577,6 +575,7 @@ namespace libed2k
                     {
                         callback_request_in cb;
                         ia >> cb;
+                        if (!ia) break;
                         // connect to requested client
                         error_code ec;
                         m_ses.add_peer_connection(cb.m_network_point, ec);
@@ -594,6 +593,13 @@ namespace libed2k
                         break;
                 }
 
+                if (!ia)
+                {
+                    ERR("packet parse error: " << ia.error().message());
+                    stop(errors::decode_packet_error);
+                    return;
+                }
+
                 m_in_gzip_container.clear();
                 m_in_container.clear();
 
@@ -7,6 +7,11 @@
 
 namespace libed2k
 {
+    // session state lives on the network thread: getters wait for the call there,
+    // setters are posted and ordered with the following calls by the io_service
+    typedef peer_connection_handle (aux::session_impl::*find_by_point_t)(const net_identifier&);
+    typedef peer_connection_handle (aux::session_impl::*find_by_hash_t)(const md4_hash&);
+
     void session::init(const fingerprint& id, const char* listen_interface,
                        const session_settings& settings)
     {
@@ -15,60 +20,55 @@ namespace libed2k
 
     session::~session()
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-
         // if there is at least one destruction-proxy
         // abort the session and let the destructor
         // of the proxy to syncronize
-        if (!m_impl.unique()) m_impl->abort();
+        if (!m_impl.unique()) m_impl->sync_call(boost::bind(&aux::session_impl::abort, m_impl.get()));
     }
 
     session_status session::status() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->status();
+        return m_impl->sync_call_ret<session_status>(boost::bind(&aux::session_impl::status, m_impl.get()));
     }
 
     transfer_handle session::add_transfer(const add_transfer_params& params)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-
         error_code ec;
-        transfer_handle ret = m_impl->add_transfer(params, ec);
+        transfer_handle ret = m_impl->sync_call_ret<transfer_handle>(
+            boost::bind(&aux::session_impl::add_transfer, m_impl.get(), boost::cref(params), boost::ref(ec)));
         if (ec) throw libed2k_exception(ec);
         return ret;
     }
 
     void session::post_transfer(const add_transfer_params& params)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
         m_impl->post_transfer(params);
     }
 
     peer_connection_handle session::add_peer_connection(const net_identifier& np)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
         error_code ec;
-        peer_connection_handle ret = m_impl->add_peer_connection(np, ec);
+        peer_connection_handle ret = m_impl->sync_call_ret<peer_connection_handle>(
+            boost::bind(&aux::session_impl::add_peer_connection, m_impl.get(), np, boost::ref(ec)));
         if (ec) throw libed2k_exception(ec);
         return ret;
     }
 
     peer_connection_handle session::find_peer_connection(const net_identifier& np) const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->find_peer_connection_handle(np);
+        return m_impl->sync_call_ret<peer_connection_handle>(boost::bind(
+            static_cast<find_by_point_t>(&aux::session_impl::find_peer_connection_handle), m_impl.get(), np));
     }
 
     peer_connection_handle session::find_peer_connection(const md4_hash& hash) const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->find_peer_connection_handle(hash);
+        return m_impl->sync_call_ret<peer_connection_handle>(boost::bind(
+            static_cast<find_by_hash_t>(&aux::session_impl::find_peer_connection_handle), m_impl.get(), hash));
     }
 
     std::auto_ptr<alert> session::pop_alert()
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
+        // alert manager has own lock
         return m_impl->pop_alert();
     }
 
@@ -86,13 +86,11 @@ namespace libed2k
 
     void session::set_alert_mask(boost::uint32_t m)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
         m_impl->set_alert_mask(m);
     }
 
     size_t session::set_alert_queue_size_limit(size_t queue_size_limit_)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
         return m_impl->set_alert_queue_size_limit(queue_size_limit_);
     }
 
@@ -123,74 +121,66 @@ namespace libed2k
 
     bool session::is_listening() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->is_listening();
+        return m_impl->sync_call_ret<bool>(boost::bind(&aux::session_impl::is_listening, m_impl.get()));
     }
 
     unsigned short session::listen_port() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->listen_port();
+        return m_impl->sync_call_ret<unsigned short>(boost::bind(&aux::session_impl::listen_port, m_impl.get()));
     }
 
     void session::set_settings(const session_settings& settings)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->set_settings(settings);
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::set_settings, m_impl, settings));
     }
 
     session_settings session::settings() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->m_settings;
+        return m_impl->sync_call_ret<session_settings>(boost::bind(&aux::session_impl::settings, m_impl.get()));
     }
 
     void session::set_ip_filter(const ip_filter& f)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->set_ip_filter(f);
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::set_ip_filter, m_impl, f));
     }
 
-    const ip_filter& session::get_ip_filter() const
+    ip_filter session::get_ip_filter() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->get_ip_filter();
+        // copy is taken on the network thread, which replaces the filter
+        return m_impl->sync_call_ret<ip_filter>(boost::bind(&aux::session_impl::get_ip_filter, m_impl.get()));
     }
 
     transfer_handle session::find_transfer(const md4_hash & hash) const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->find_transfer_handle(hash);
+        return m_impl->sync_call_ret<transfer_handle>(
+            boost::bind(&aux::session_impl::find_transfer_handle, m_impl.get(), hash));
     }
 
     std::vector<transfer_handle> session::get_transfers() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->get_transfers();
+        return m_impl->sync_call_ret<std::vector<transfer_handle> >(
+            boost::bind(&aux::session_impl::get_transfers, m_impl.get()));
     }
 
     std::vector<transfer_handle> session::get_active_transfers() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->get_active_transfers();
+        return m_impl->sync_call_ret<std::vector<transfer_handle> >(
+            boost::bind(&aux::session_impl::get_active_transfers, m_impl.get()));
     }
 
     void session::remove_transfer(const transfer_handle& h, int options)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->remove_transfer(h, options);
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::remove_transfer, m_impl, h, options));
     }
 
     int session::download_rate_limit() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->m_settings.download_rate_limit;
+        return settings().download_rate_limit;
     }
 
     int session::upload_rate_limit() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->m_settings.upload_rate_limit;
+        return settings().upload_rate_limit;
     }
 
     void session::server_connect(const server_connection_parameters& scp)
@@ -205,20 +195,17 @@ namespace libed2k
 
     bool session::server_connection_established() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->m_server_connection->connected();
+        return m_impl->sync_call_ret<bool>(boost::bind(&server_connection::connected, m_impl->m_server_connection));
     }
 
     void session::pause()
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->pause();
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::pause, m_impl));
     }
 
     void session::resume()
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->resume();
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::resume, m_impl));
     }
 
     void session::make_transfer_parameters(const std::string& filepath)
@@ -241,14 +228,12 @@ namespace libed2k
 
     void session::stop_natpmp()
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->stop_natpmp();
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::stop_natpmp, m_impl));
     }
     
     void session::stop_upnp()
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->stop_upnp();
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::stop_upnp, m_impl));
     }
 
 #ifndef LIBED2K_DISABLE_DHT
@@ -265,8 +250,7 @@ namespace libed2k
 
     void session::set_dht_settings(dht_settings const& settings)
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->set_dht_settings(settings);
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::set_dht_settings, m_impl, settings));
     }
 
     void session::add_dht_node(std::pair<std::string, int> const& node)
@@ -285,9 +269,7 @@ namespace libed2k
 
     bool session::is_dht_running() const
     {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        bool r = m_impl->is_dht_running();
-        return r;
+        return m_impl->sync_call_ret<bool>(boost::bind(&aux::session_impl::is_dht_running, m_impl.get()));
     }
 
     void session::find_keyword(const std::string& keyword) {
@@ -295,24 +277,21 @@ namespace libed2k
     }
 
     entry session::dht_state() {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->dht_state();
+        return m_impl->sync_call_ret<entry>(boost::bind(&aux::session_impl::dht_state, m_impl.get()));
     }
 
     kad_state session::dht_estate() {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->dht_estate();
+        return m_impl->sync_call_ret<kad_state>(boost::bind(&aux::session_impl::dht_estate, m_impl.get()));
     }
 
 #endif
 
     int session::add_port_mapping(protocol_type t, int external_port, int local_port) {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        return m_impl->add_port_mapping(t, external_port, local_port);
+        return m_impl->sync_call_ret<int>(
+            boost::bind(&aux::session_impl::add_port_mapping, m_impl.get(), int(t), external_port, local_port));
     }
 
     void session::delete_port_mapping(int handle) {
-        boost::mutex::scoped_lock l(m_impl->m_mutex);
-        m_impl->delete_port_mapping(handle);
+        m_impl->m_io_service.post(boost::bind(&aux::session_impl::delete_port_mapping, m_impl, handle));
     }
 }
@@ -21,6 +21,7 @@
 #include "libed2k/file.hpp"
 #include "libed2k/util.hpp"
 #include "libed2k/random.hpp"
+#include "libed2k/instantiate_connection.hpp"
 
 namespace libed2k{
 namespace aux{
@@ -32,7 +33,7 @@ session_impl_base::session_impl_base(const session_settings& settings) :
     m_transfers(),
     m_active_transfers(),
     m_alerts(m_io_service),
-    m_tpm(m_alerts, settings.m_known_file)
+    m_tpm(m_alerts, settings.m_known_file, settings.hashing_threads, settings.hashing_io_per_device)
 {
 }
 
@@ -119,6 +120,8 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
     m_send_buffers(send_buffer_size),
     m_z_buffers(BLOCK_SIZE),
     m_skip_buffer(4096),
+    m_compressed_blocks(settings.compressed_cache_blocks),
+    m_upload_queue(m_credits),
     m_filepool(40),
     m_disk_thread(m_io_service, boost::bind(&session_impl::on_disk_queue, this), m_filepool, BLOCK_SIZE),
     m_half_open(m_io_service),
@@ -138,12 +141,18 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
                  boost::bind(&session_impl::on_receive_udp, this, _1, _2, _3, _4),
                  boost::bind(&session_impl::on_receive_udp_hostname, this, _1, _2, _3, _4),
                  m_half_open)
+    , m_utp_socket_manager(m_settings, m_udp_socket,
+                           boost::bind(&session_impl::incoming_connection, this, _1))
 #ifndef LIBED2K_DISABLE_DHT
         , m_dht_announce_timer(m_io_service)
 #endif
+        , m_next_shard(0)
+        , m_network_done(false)
 {
     DBG("*** create ed2k session ***");
 
+    memset(m_redundant_bytes, 0, sizeof(m_redundant_bytes));
+
     if (!listen_interface) listen_interface = "0.0.0.0";
     error_code ec;
     m_listen_interface = tcp::endpoint(
@@ -256,6 +265,7 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
 
     update_rate_settings();
     update_connections_limit();
+    m_credits.load(m_settings.m_credits_file);
 
     m_io_service.post(boost::bind(&session_impl::on_tick, this, ec));
 
@@ -271,6 +281,7 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
 #ifdef LIBED2K_UPNP_LOGGING
      m_upnp_log.open("upnp.log", std::ios::in | std::ios::out | std::ios::trunc);
 #endif
+    start_shards();
     m_thread.reset(new boost::thread(boost::ref(*this)));
 }
 
@@ -291,6 +302,15 @@ session_impl::~session_impl()
     DBG("waiting for main thread");
     m_thread->join();
 
+    // connections were closed by main thread, shards have nothing to serve
+    DBG("waiting for network shards");
+    stop_shards();
+
+    DBG("freeing " << m_compression_buffers.size() << " buffers of uncompressed parts");
+    for (std::set<char*>::iterator i = m_compression_buffers.begin(); i != m_compression_buffers.end(); ++i)
+        free_disk_buffer(*i);
+    m_compression_buffers.clear();
+
     DBG("shutdown complete!");
 }
 
@@ -336,11 +356,13 @@ void session_impl::set_settings(const session_settings& s)
         update_disk_io_thread = true;
 
     bool connections_limit_changed = m_settings.connections_limit != s.connections_limit;
+    bool connection_settings_changed = m_settings.max_inflated_packet_size != s.max_inflated_packet_size;
 
     if (m_settings.alert_queue_size != s.alert_queue_size)
         m_alerts.set_alert_queue_size_limit(s.alert_queue_size);
 
     m_settings = s;
+    m_compressed_blocks.set_limit(m_settings.compressed_cache_blocks);
 
     if (m_settings.cache_buffer_chunk_size <= 0)
         m_settings.cache_buffer_chunk_size = 1;
@@ -349,6 +371,12 @@ void session_impl::set_settings(const session_settings& s)
 
     if (connections_limit_changed) update_connections_limit();
 
+    if (connection_settings_changed)
+    {
+        for (connection_map::iterator i = m_connections.begin(); i != m_connections.end(); ++i)
+            (*i)->update_settings();
+    }
+
     if (m_settings.connection_speed < 0) m_settings.connection_speed = 200;
 
     if (update_disk_io_thread)
@@ -358,12 +386,12 @@ void session_impl::set_settings(const session_settings& s)
 void session_impl::operator()()
 {
     // main session thread
+    m_network_thread = boost::this_thread::get_id();
 
     //eh_initializer();
 
     if (m_listen_interface.port() != 0)
     {
-        boost::mutex::scoped_lock l(m_mutex);
         open_listen_port();
         //m_server_connection->start();
     }
@@ -389,6 +417,116 @@ void session_impl::operator()()
     boost::mutex::scoped_lock l(m_mutex);
     m_transfers.clear();
     m_active_transfers.clear();
+
+    // calls posted after the last run() stay in queue, their callers run them
+    m_network_done = true;
+    m_cond.notify_all();
+}
+
+void session_impl::sync_call(const boost::function<void()>& f) const
+{
+    if (is_network_thread())
+    {
+        f();
+        return;
+    }
+
+    bool done = false;
+    mutex_t::scoped_lock l(m_mutex);
+
+    if (!m_network_done)
+    {
+        m_io_service.post(boost::bind(&session_impl::call_and_notify, this, f, &done));
+        while (!done && !m_network_done) m_cond.wait(l);
+    }
+
+    if (!done)
+    {
+        l.unlock();
+        f();
+    }
+}
+
+void session_impl::call_and_notify(const boost::function<void()>& f, bool* done) const
+{
+    f();
+    mutex_t::scoped_lock l(m_mutex);
+    *done = true;
+    m_cond.notify_all();
+}
+
+void session_impl::release_connection(const base_connection* c)
+{
+    if (!is_network_thread())
+    {
+        mutex_t::scoped_lock l(m_mutex);
+
+        if (!m_network_done)
+        {
+            m_io_service.post(boost::bind(&session_impl::release_connection, this, c));
+            return;
+        }
+    }
+
+    // after network thread finished session is used by one shutting down thread only
+    delete c;
+}
+
+void session_impl::start_shards()
+{
+    // with one thread sockets are served by the network thread itself
+    if (m_settings.network_threads <= 1) return;
+
+    for (int i = 0; i < m_settings.network_threads; ++i)
+    {
+        boost::shared_ptr<network_shard> shard(new network_shard);
+        shard->work.reset(new io_service::work(shard->ios));
+        shard->thread.reset(new boost::thread(boost::bind(&network_shard::run, shard.get())));
+        m_shards.push_back(shard);
+    }
+
+    DBG("network shards: " << m_shards.size());
+}
+
+void session_impl::stop_shards()
+{
+    for (std::vector<boost::shared_ptr<network_shard> >::iterator i = m_shards.begin();
+         i != m_shards.end(); ++i)
+    {
+        (*i)->work.reset();
+        (*i)->thread->join();
+    }
+
+    m_shards.clear();
+
+    if (m_compressor)
+    {
+        // nobody waits for the rest of the queue, its buffers are freed by owner
+        m_compressor->ios.stop();
+        m_compressor->thread->join();
+        m_compressor.reset();
+    }
+}
+
+io_service& session_impl::connection_io_service()
+{
+    if (m_shards.empty()) return m_io_service;
+    m_next_shard = (m_next_shard + 1) % m_shards.size();
+    return m_shards[m_next_shard]->ios;
+}
+
+io_service& session_impl::compression_io_service()
+{
+    LIBED2K_ASSERT(is_network_thread());
+
+    if (!m_compressor)
+    {
+        m_compressor.reset(new network_shard);
+        m_compressor->work.reset(new io_service::work(m_compressor->ios));
+        m_compressor->thread.reset(new boost::thread(boost::bind(&network_shard::run, m_compressor.get())));
+    }
+
+    return m_compressor->ios;
 }
 
 void session_impl::open_listen_port()
@@ -520,13 +658,15 @@ void session_impl::update_disk_thread_settings()
 
 void session_impl::async_accept(boost::shared_ptr<ip::tcp::acceptor> const& listener)
 {
-    boost::shared_ptr<tcp::socket> c(new tcp::socket(m_io_service));
+    io_service& ios = connection_io_service();
+    boost::shared_ptr<socket_type> c(new socket_type(ios));
+    c->instantiate<stream_socket>(ios);
     listener->async_accept(
-        *c, bind(&session_impl::on_accept_connection, this, c,
+        *c->get<stream_socket>(), bind(&session_impl::on_accept_connection, this, c,
                  boost::weak_ptr<tcp::acceptor>(listener), _1));
 }
 
-void session_impl::on_accept_connection(boost::shared_ptr<tcp::socket> const& s,
+void session_impl::on_accept_connection(boost::shared_ptr<socket_type> const& s,
                                         boost::weak_ptr<ip::tcp::acceptor> listen_socket,
                                         error_code const& e)
 {
@@ -582,7 +722,7 @@ void session_impl::on_accept_connection(boost::shared_ptr<tcp::socket> const& s,
     incoming_connection(s);
 }
 
-void session_impl::incoming_connection(boost::shared_ptr<tcp::socket> const& s)
+void session_impl::incoming_connection(boost::shared_ptr<socket_type> const& s)
 {
     if (m_paused)
     {
@@ -590,6 +730,12 @@ void session_impl::incoming_connection(boost::shared_ptr<tcp::socket> const& s)
         return;
     }
 
+    if (!m_settings.enable_incoming_utp && is_utp(*s))
+    {
+        DBG("INCOMING CONNECTION [ ignored, uTP disabled ]");
+        return;
+    }
+
     error_code ec;
     // we got a connection request!
     tcp::endpoint endp = s->remote_endpoint(ec);
@@ -630,7 +776,7 @@ void session_impl::incoming_connection(boost::shared_ptr<tcp::socket> const& s)
         // store connection in map only for real peers
         if (m_server_connection->m_target.address() != endp.address())
         {
-            m_connections.insert(c);
+            insert_connection(c);
         }
 
         c->start();
@@ -710,6 +856,8 @@ void session_impl::on_receive_udp(error_code const& e, udp::endpoint const& ep,
         return;
     }
 
+    if (m_utp_socket_manager.incoming_packet(buf, len, ep)) return;
+
     // now process only dht packets
 #ifndef LIBED2K_DISABLE_DHT
     // this is probably a dht message
@@ -784,17 +932,15 @@ boost::weak_ptr<transfer> session_impl::find_transfer(const std::string& filenam
 
 boost::intrusive_ptr<peer_connection> session_impl::find_peer_connection(const net_identifier& np) const
 {
-    connection_map::const_iterator itr = std::find_if(
-        m_connections.begin(), m_connections.end(), boost::bind(&peer_connection::has_network_point, _1, np));
-    if (itr != m_connections.end())  {  return *itr; }
+    connection_point_index::const_iterator itr = m_connections_by_point.find(np);
+    if (itr != m_connections_by_point.end())  {  return itr->second; }
     return boost::intrusive_ptr<peer_connection>();
 }
 
 boost::intrusive_ptr<peer_connection> session_impl::find_peer_connection(const md4_hash& hash) const
 {
-    connection_map::const_iterator itr =
-        std::find_if(m_connections.begin(), m_connections.end(), boost::bind(&peer_connection::has_hash, _1, hash));
-    if (itr != m_connections.end())  {  return *itr; }
+    connection_hash_index::const_iterator itr = m_connections_by_hash.find(hash);
+    if (itr != m_connections_by_hash.end())  {  return itr->second; }
     return boost::intrusive_ptr<peer_connection>();
 }
 
@@ -888,10 +1034,65 @@ void session_impl::close_connection(const peer_connection* p, const error_code&
 {
     assert(p->is_disconnecting());
 
-    connection_map::iterator i =
-        std::find_if(m_connections.begin(), m_connections.end(),
-                     boost::bind(&boost::intrusive_ptr<peer_connection>::get, _1) == p);
-    if (i != m_connections.end()) m_connections.erase(i);
+    m_upload_queue.remove_connection(p);
+
+    connection_map::iterator i = m_connections.find(p, connection_hash(), connection_hash());
+    if (i == m_connections.end()) return;
+
+    unindex_connection(p);
+    m_connections.erase(i);
+}
+
+void session_impl::insert_connection(const boost::intrusive_ptr<peer_connection>& c)
+{
+    if (m_connections.insert(c).second) index_connection(c.get());
+}
+
+void session_impl::update_connection_index(peer_connection* p)
+{
+    // connections to server peers aren't stored
+    if (!has_peer(p)) return;
+
+    if (p->get_network_point() == p->m_indexed_point &&
+        p->get_connection_hash() == p->m_indexed_hash) return;
+
+    unindex_connection(p);
+    index_connection(p);
+}
+
+namespace
+{
+    template<typename Index>
+    void erase_index_entry(Index& index, const typename Index::key_type& key, const peer_connection* p)
+    {
+        std::pair<typename Index::iterator, typename Index::iterator> range = index.equal_range(key);
+
+        for (typename Index::iterator i = range.first; i != range.second; ++i)
+        {
+            if (i->second == p)
+            {
+                index.erase(i);
+                return;
+            }
+        }
+    }
+}
+
+void session_impl::index_connection(peer_connection* p)
+{
+    p->m_indexed_point = p->get_network_point();
+    p->m_indexed_hash = p->get_connection_hash();
+
+    if (!p->m_indexed_point.empty())
+        m_connections_by_point.insert(std::make_pair(p->m_indexed_point, p));
+    if (p->m_indexed_hash.defined())
+        m_connections_by_hash.insert(std::make_pair(p->m_indexed_hash, p));
+}
+
+void session_impl::unindex_connection(const peer_connection* p)
+{
+    erase_index_entry(m_connections_by_point, p->m_indexed_point, p);
+    erase_index_entry(m_connections_by_hash, p->m_indexed_hash, p);
 }
 
 transfer_handle session_impl::add_transfer(add_transfer_params const& params, error_code& ec)
@@ -1002,13 +1203,12 @@ peer_connection_handle session_impl::add_peer_connection(net_identifier np, erro
     }
 
     tcp::endpoint endp(boost::asio::ip::address::from_string(int2ipstr(np.m_nIP)), np.m_nPort);
-    boost::shared_ptr<tcp::socket> sock(new tcp::socket(m_io_service));
-    setup_socket_buffers(*sock);
+    boost::shared_ptr<socket_type> sock = create_peer_socket(false);
 
     boost::intrusive_ptr<peer_connection> c(
         new peer_connection(*this, boost::weak_ptr<transfer>(), sock, endp, NULL));
 
-    m_connections.insert(c);
+    insert_connection(c);
 
     m_half_open.enqueue(boost::bind(&peer_connection::connect, c, _1),
                         boost::bind(&peer_connection::on_timeout, c),
@@ -1081,7 +1281,7 @@ session_status session_impl::status() const
 
     s.num_peers = (int)m_connections.size();
 
-    //s.total_redundant_bytes = m_total_redundant_bytes;
+    s.total_redundant_bytes = m_total_redundant_bytes;
     //s.total_failed_bytes = m_total_failed_bytes;
 
     s.up_bandwidth_queue = m_upload_rate.queue_size();
@@ -1116,6 +1316,16 @@ session_status session_impl::status() const
     s.tracker_upload_rate = m_stat.transfer_rate(stat::upload_tracker_protocol);
     s.total_tracker_upload = m_stat.total_transfer(stat::upload_tracker_protocol);
 
+    // files hashing
+    hashing_status hs = m_tpm.status();
+    s.hash_queue = hs.queued;
+    s.total_hashed_files = hs.total_files;
+    s.total_hashed_bytes = hs.total_bytes;
+    s.hash_files_rate = hs.files_rate;
+    s.hash_rate = hs.bytes_rate;
+    s.total_hash_read_time = hs.read_time;
+    s.total_hash_compute_time = hs.hash_time;
+
     return s;
 }
 
@@ -1176,6 +1386,9 @@ void session_impl::abort()
         (*m_connections.begin())->disconnect(errors::stopping_transfer);
     }
 
+    // connections gave their last payload to credits
+    m_credits.save();
+
     DBG("connection queue: " << m_half_open.size());
 
     m_download_rate.close();
@@ -1235,8 +1448,6 @@ initialize_timer::initialize_timer()
 
 void session_impl::on_tick(error_code const& e)
 {
-    boost::mutex::scoped_lock l(m_mutex);
-
     if (m_abort) return;
 
     if (e == boost::asio::error::operation_aborted) return;
@@ -1260,6 +1471,9 @@ void session_impl::on_tick(error_code const& e)
 
     m_last_tick = now;
 
+    // uTP resends and timeouts are measured in milliseconds
+    m_utp_socket_manager.tick(now);
+
     // only tick the following once per second
     if (!m_second_timer.expired(now)) return;
 
@@ -1272,6 +1486,8 @@ void session_impl::on_tick(error_code const& e)
 
     m_server_connection->second_tick(tick_interval_ms);
     update_active_transfers();
+    m_upload_queue.second_tick(m_settings, now);
+    m_credits.second_tick(now);
 
     // --------------------------------------------------------------
     // second_tick every active transfer
@@ -1376,7 +1592,7 @@ void session_impl::connect_new_peers()
     }
 }
 
-void session_impl::setup_socket_buffers(ip::tcp::socket& s)
+void session_impl::setup_socket_buffers(socket_type& s)
 {
     error_code ec;
     if (m_settings.send_socket_buffer_size)
@@ -1391,6 +1607,22 @@ void session_impl::setup_socket_buffers(ip::tcp::socket& s)
     }
 }
 
+boost::shared_ptr<socket_type> session_impl::create_peer_socket(bool utp)
+{
+    if (utp)
+    {
+        boost::shared_ptr<socket_type> s(new socket_type(m_io_service));
+        instantiate_connection(m_io_service, proxy_settings(), *s, 0, &m_utp_socket_manager, true);
+        return s;
+    }
+
+    io_service& ios = connection_io_service();
+    boost::shared_ptr<socket_type> s(new socket_type(ios));
+    s->instantiate<stream_socket>(ios);
+    setup_socket_buffers(*s);
+    return s;
+}
+
 session_impl::listen_socket_t session_impl::setup_listener(
     ip::tcp::endpoint ep, bool v6_only)
 {
@@ -0,0 +1,184 @@
+/*
+ * SHA-1 in C
+ * By Steve Reid <steve@edmweb.com>
+ * 100% Public Domain
+ *
+ * Adapted for libed2k AICH hash trees: state structure and function
+ * names are declared in hasher.hpp, byte order is detected at runtime.
+ */
+
+#include "libed2k/hasher.hpp"
+#include <string.h>
+
+namespace
+{
+    union char64long16
+    {
+        boost::uint8_t c[64];
+        boost::uint32_t l[16];
+    };
+
+#define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+    // blk0() and blk() perform the initial expand.
+    // I got the idea of expanding during the round function from SSLeay
+    struct little_endian_blk0
+    {
+        static boost::uint32_t apply(char64long16* block, int i)
+        {
+            return block->l[i] = (rol(block->l[i],24)&0xFF00FF00)
+                | (rol(block->l[i],8)&0x00FF00FF);
+        }
+    };
+
+    struct big_endian_blk0
+    {
+        static boost::uint32_t apply(char64long16* block, int i)
+        {
+            return block->l[i];
+        }
+    };
+
+#define blk(i) (block->l[i&15] = rol(block->l[(i+13)&15]^block->l[(i+8)&15] \
+    ^block->l[(i+2)&15]^block->l[i&15],1))
+
+    // (R0+R1), R2, R3, R4 are the different operations used in SHA1
+#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+BlkFun::apply(block, i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define R1(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk(i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define R2(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0x6ED9EBA1+rol(v,5);w=rol(w,30);
+#define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
+#define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
+
+    // Hash a single 512-bit block. This is the core of the algorithm.
+    template <class BlkFun>
+    void SHA1transform(boost::uint32_t state[5], boost::uint8_t const buffer[64])
+    {
+        boost::uint32_t a, b, c, d, e;
+
+        char64long16 workspace;
+        char64long16* block = &workspace;
+        memcpy(block, buffer, 64);
+
+        // Copy context->state[] to working vars
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        // 4 rounds of 20 operations each. Loop unrolled.
+        R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
+        R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
+        R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
+        R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
+        R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
+        R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
+        R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
+        R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
+        R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
+        R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
+        R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
+        R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
+        R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
+        R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
+        R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
+        R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
+        R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
+        R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
+        R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
+        R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+        // Add the working vars back into context.state[]
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+
+#undef blk
+#undef R0
+#undef R1
+#undef R2
+#undef R3
+#undef R4
+#undef rol
+
+    bool is_big_endian()
+    {
+        boost::uint16_t test = 0x0102;
+        return *reinterpret_cast<boost::uint8_t const*>(&test) == 0x01;
+    }
+
+    template <class BlkFun>
+    void internal_update(libed2k::sha_ctx* context, boost::uint8_t const* data, boost::uint32_t len)
+    {
+        boost::uint32_t i, j;   // JHB
+
+        j = (context->count[0] >> 3) & 63;
+        if ((context->count[0] += len << 3) < (len << 3)) context->count[1]++;
+        context->count[1] += (len >> 29);
+        if ((j + len) > 63)
+        {
+            memcpy(&context->buffer[j], data, (i = 64-j));
+            SHA1transform<BlkFun>(context->state, context->buffer);
+            for ( ; i + 63 < len; i += 64)
+            {
+                SHA1transform<BlkFun>(context->state, &data[i]);
+            }
+            j = 0;
+        }
+        else
+        {
+            i = 0;
+        }
+        memcpy(&context->buffer[j], &data[i], len - i);
+    }
+}
+
+namespace libed2k
+{
+    // SHA1Init - Initialize new context
+    void SHA1_init(sha_ctx* context)
+    {
+        // SHA1 initialization constants
+        context->state[0] = 0x67452301;
+        context->state[1] = 0xEFCDAB89;
+        context->state[2] = 0x98BADCFE;
+        context->state[3] = 0x10325476;
+        context->state[4] = 0xC3D2E1F0;
+        context->count[0] = context->count[1] = 0;
+    }
+
+    // Run your data through this.
+    void SHA1_update(sha_ctx* context, boost::uint8_t const* data, boost::uint32_t len)
+    {
+        if (is_big_endian())
+            internal_update<big_endian_blk0>(context, data, len);
+        else
+            internal_update<little_endian_blk0>(context, data, len);
+    }
+
+    // Add padding and return the message digest.
+    void SHA1_final(boost::uint8_t* digest, sha_ctx* context)
+    {
+        boost::uint8_t finalcount[8];
+
+        for (boost::uint32_t i = 0; i < 8; ++i)
+        {
+            // Endian independent
+            finalcount[i] = static_cast<boost::uint8_t>(
+                (context->count[(i >= 4 ? 0 : 1)]
+                >> ((3-(i & 3)) * 8) ) & 255);
+        }
+
+        SHA1_update(context, (boost::uint8_t const*)"\200", 1);
+        while ((context->count[0] & 504) != 448)
+            SHA1_update(context, (boost::uint8_t const*)"\0", 1);
+        SHA1_update(context, finalcount, 8);  // Should cause a SHA1transform()
+
+        for (boost::uint32_t i = 0; i < 20; ++i)
+        {
+            digest[i] = static_cast<unsigned char>(
+                (context->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
+        }
+    }
+}
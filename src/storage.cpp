@@ -63,6 +63,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libed2k/alloca.hpp"
 #include "libed2k/allocator.hpp" // page_size
 #include "libed2k/lazy_entry.hpp"
+#include "libed2k/aich.hpp"
+#include "libed2k/block_pipe.hpp"
 
 #include <cstdio>
 
@@ -1044,6 +1046,31 @@ ret:
         }
     }
 
+    bool default_storage::pipe_block(int slot, int offset, int size
+        , boost::intrusive_ptr<block_pipe>& pipe)
+    {
+        std::vector<file_slice> slices = files().map_block(slot, offset, size);
+
+        // block on file boundary or in pad file is read the usual way
+        if (slices.size() != 1 || slices[0].size != size) return false;
+        file_storage::iterator fe = files().begin() + slices[0].file_index;
+        if (fe->pad_file) return false;
+
+        error_code ec;
+        boost::intrusive_ptr<file> file_handle = open_file(fe, file::read_only, ec);
+        // unbuffered file doesn't go through page cache, read errors are reported by usual read
+        if (!file_handle || ec || (file_handle->open_mode() & file::no_buffer)) return false;
+
+        boost::intrusive_ptr<block_pipe> p(new block_pipe(size, ec));
+        if (ec) return false;
+
+        if (!p->fill(file_handle->native_handle(), files().file_base(*fe) + slices[0].offset, ec))
+            return false;
+
+        pipe = p;
+        return true;
+    }
+
     int default_storage::readv(file::iovec_t const* bufs, int slot, int offset
         , int num_bufs)
     {
@@ -1444,6 +1471,21 @@ ret:
 
     // -- piece_manager -----------------------------------------------------
 
+    // id of the device holding the path. The path may not be created
+    // yet, then its nearest existing parent is asked. 0 when unknown
+    boost::uint64_t path_device(std::string p)
+    {
+        for (;;)
+        {
+            error_code ec;
+            file_status s;
+            stat_file(p, &s, ec);
+            if (!ec) return s.device;
+            if (!has_parent_path(p)) return 0;
+            p = parent_path(p);
+        }
+    }
+
     piece_manager::piece_manager(
         boost::shared_ptr<void> const& torrent
         , boost::intrusive_ptr<transfer_info const> info
@@ -1459,6 +1501,7 @@ ret:
             ? &m_info->files() : 0, save_path, fp, file_prio))
         , m_storage_mode(sm)
         , m_save_path(complete(save_path))
+        , m_device(path_device(m_save_path))
         , m_state(state_none)
         , m_current_slot(0)
         , m_out_of_place(false)
@@ -1570,6 +1613,21 @@ ret:
         m_io_thread.add_job(j, handler);
     }
 
+    void piece_manager::async_read_pipe(
+        peer_request const& r
+        , boost::function<void(int, disk_io_job const&)> const& handler)
+    {
+        disk_io_job j;
+        j.storage = this;
+        j.action = disk_io_job::read_pipe;
+        j.piece = r.piece;
+        j.offset = r.start;
+        j.buffer_size = r.length;
+        j.buffer = 0;
+        LIBED2K_ASSERT(r.length <= m_storage->disk_pool()->block_size());
+        m_io_thread.add_job(j, handler);
+    }
+
     void piece_manager::async_read_and_hash(
         peer_request const& r
         , boost::function<void(int, disk_io_job const&)> const& handler
@@ -1669,6 +1727,17 @@ ret:
         m_io_thread.add_job(j, handler);
     }
 
+    void piece_manager::async_aich_hash(int piece
+        , boost::function<void(int, disk_io_job const&)> const& handler)
+    {
+        disk_io_job j;
+        j.storage = this;
+        j.action = disk_io_job::aich_hash;
+        j.piece = piece;
+
+        m_io_thread.add_job(j, handler);
+    }
+
     std::string piece_manager::save_path() const
     {
         mutex::scoped_lock l(m_mutex);
@@ -1696,6 +1765,120 @@ ret:
         return ph.h.final();
     }
 
+    int piece_manager::aich_hash_for_piece_impl(int piece, std::vector<sha1_hash>& hashes)
+    {
+        LIBED2K_ASSERT(!m_storage->error());
+        hashes.clear();
+
+        int slot = slot_for(piece);
+        if (slot == has_no_slot) return -1;
+
+        disk_buffer_holder holder(*m_storage->disk_pool()
+            , m_storage->disk_pool()->allocate_buffer("aich temp"));
+        file::iovec_t buf;
+        buf.iov_base = holder.get();
+
+        aich_part_hasher h;
+        const int piece_size = m_files.piece_size(piece);
+        const int block_size = m_storage->disk_pool()->block_size();
+        int num_read = 0;
+
+        for (int offset = 0; offset < piece_size; offset += block_size)
+        {
+            buf.iov_len = (std::min)(block_size, piece_size - offset);
+            int ret = m_storage->readv(&buf, slot, offset, 1);
+            if (m_storage->error() || ret != int(buf.iov_len)) return -1;
+            h.update((char const*)buf.iov_base, ret);
+            num_read += ret;
+        }
+
+        hashes = h.final();
+        return num_read;
+    }
+
+    void piece_manager::hash_for_pieces_impl(std::vector<int> const& pieces
+        , std::vector<md4_hash>& hashes, int* readback)
+    {
+        LIBED2K_ASSERT(!m_storage->error());
+        LIBED2K_ASSERT(int(pieces.size()) <= multi_hasher::max_streams);
+
+        const int num = pieces.size();
+        hashes.assign(num, md4_hash());
+        if (readback) *readback = 0;
+
+        partial_hash ph[multi_hasher::max_streams];
+        int slot[multi_hasher::max_streams];
+        int left[multi_hasher::max_streams];
+
+        for (int n = 0; n < num; ++n)
+        {
+            std::map<int, partial_hash>::iterator i = m_piece_hasher.find(pieces[n]);
+            if (i != m_piece_hasher.end())
+            {
+                ph[n] = i->second;
+                m_piece_hasher.erase(i);
+            }
+
+            slot[n] = slot_for(pieces[n]);
+            LIBED2K_ASSERT(slot[n] != has_no_slot);
+            left[n] = m_files.piece_size(pieces[n]) - ph[n].offset;
+        }
+
+        int block_size = BLOCK_SIZE;
+        if (m_storage->disk_pool()) block_size = m_storage->disk_pool()->block_size();
+
+        // pieces with the same amount of data left to hash go into one
+        // multi_hasher, all streams are fed equally. Its streams share one
+        // fill level of MD4 block buffer, so hashed parts must match modulo 64 too
+        std::vector<bool> done(num, false);
+        for (int n = 0; n < num; ++n)
+        {
+            if (done[n]) continue;
+
+            int group[multi_hasher::max_streams];
+            int streams = 0;
+            for (int k = n; k < num; ++k)
+            {
+                if (done[k] || left[k] != left[n] || ph[k].offset % 64 != ph[n].offset % 64) continue;
+                group[streams++] = k;
+                done[k] = true;
+            }
+
+            multi_hasher mh(streams);
+            char* bufs[multi_hasher::max_streams];
+            for (int k = 0; k < streams; ++k)
+            {
+                mh.assign(k, ph[group[k]].h);
+                bufs[k] = m_storage->disk_pool()->allocate_buffer("hash temp");
+            }
+
+            for (int offset = 0; offset < left[n] && !error(); offset += block_size)
+            {
+                file::iovec_t buf;
+                buf.iov_len = (std::min)(block_size, left[n] - offset);
+
+                for (int k = 0; k < streams && !error(); ++k)
+                {
+                    buf.iov_base = bufs[k];
+                    int ret = m_storage->readv(&buf, slot[group[k]], ph[group[k]].offset + offset, 1);
+                    if (ret > 0 && readback) *readback += ret;
+                }
+
+                if (!error()) mh.update(bufs, buf.iov_len);
+            }
+
+            for (int k = 0; k < streams; ++k)
+                m_storage->disk_pool()->free_buffer(bufs[k]);
+
+            if (error()) return;
+
+            md4_hash result[multi_hasher::max_streams];
+            mh.final(result);
+            for (int k = 0; k < streams; ++k)
+                hashes[group[k]] = result[k];
+        }
+    }
+
     int piece_manager::move_storage_impl(std::string const& save_path)
     {
         if (m_storage->move_storage(save_path))
@@ -1762,6 +1945,24 @@ ret:
         m_storage->hint_read(slot, offset, size);
     }
 
+    bool piece_manager::map_block_impl(int piece_index, int offset, int size, char*& data
+        , boost::intrusive_ptr<file_mapping>& mapping)
+    {
+        m_last_piece = piece_index;
+        int slot = slot_for(piece_index);
+        if (slot < 0) return false;
+        return m_storage->map_block(slot, offset, size, data, mapping);
+    }
+
+    bool piece_manager::pipe_block_impl(int piece_index, int offset, int size
+        , boost::intrusive_ptr<block_pipe>& pipe)
+    {
+        m_last_piece = piece_index;
+        int slot = slot_for(piece_index);
+        if (slot < 0) return false;
+        return m_storage->pipe_block(slot, offset, size, pipe);
+    }
+
     int piece_manager::read_impl(
         file::iovec_t* bufs
         , int piece_index
@@ -37,6 +37,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <kernel/OS.h>
 #endif
 
+#ifdef BOOST_HAS_PTHREADS
+#include <sys/time.h>
+#include <errno.h>
+#endif
+
 namespace libed2k
 {
 	void sleep(int milliseconds)
@@ -69,6 +74,22 @@ namespace libed2k
 		pthread_cond_wait(&m_cond, (::pthread_mutex_t*)&l.mutex());
 	}
 
+	bool condition::timed_wait(mutex::scoped_lock& l, int milliseconds)
+	{
+		LIBED2K_ASSERT(l.locked());
+		timeval tv;
+		gettimeofday(&tv, 0);
+		timespec ts;
+		ts.tv_sec = tv.tv_sec + milliseconds / 1000;
+		ts.tv_nsec = tv.tv_usec * 1000 + (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000)
+		{
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000;
+		}
+		return pthread_cond_timedwait(&m_cond, (::pthread_mutex_t*)&l.mutex(), &ts) != ETIMEDOUT;
+	}
+
 	void condition::signal_all(mutex::scoped_lock& l)
 	{
 		LIBED2K_ASSERT(l.locked());
@@ -96,6 +117,17 @@ namespace libed2k
 		--m_num_waiters;
 	}
 
+	bool condition::timed_wait(mutex::scoped_lock& l, int milliseconds)
+	{
+		LIBED2K_ASSERT(l.locked());
+		++m_num_waiters;
+		l.unlock();
+		DWORD r = WaitForSingleObject(m_sem, milliseconds);
+		l.lock();
+		--m_num_waiters;
+		return r != WAIT_TIMEOUT;
+	}
+
 	void condition::signal_all(mutex::scoped_lock& l)
 	{
 		LIBED2K_ASSERT(l.locked());
@@ -123,6 +155,17 @@ namespace libed2k
 		--m_num_waiters;
 	}
 
+	bool condition::timed_wait(mutex::scoped_lock& l, int milliseconds)
+	{
+		LIBED2K_ASSERT(l.locked());
+		++m_num_waiters;
+		l.unlock();
+		status_t r = acquire_sem_etc(m_sem, 1, B_RELATIVE_TIMEOUT, bigtime_t(milliseconds) * 1000);
+		l.lock();
+		--m_num_waiters;
+		return r != B_TIMED_OUT;
+	}
+
 	void condition::signal_all(mutex::scoped_lock& l)
 	{
 		LIBED2K_ASSERT(l.locked());
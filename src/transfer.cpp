@@ -57,9 +57,12 @@ namespace libed2k
         m_total_redundant_bytes(0),
         m_minute_timer(minutes(1), min_time()),
         m_need_save_resume_data(true),
-        m_last_active(0)
+        m_last_active(0),
+        m_aich(p.file_size, p.aich_hashes),
+        m_last_source_exchange(min_time())
     {
         if (p.resume_data) m_resume_data.swap(*p.resume_data);
+        if (!m_aich.empty()) m_aich_master = m_aich.master_hash();
     }
 
     transfer::~transfer()
@@ -91,6 +94,7 @@ namespace libed2k
         res.file_path = file_path();
         res.file_size = size();
         res.piece_hashses = piece_hashses();
+        res.aich_hashes = m_aich.block_hashes();
         //res.resume_data = &m_resume_data;
         res.storage_mode = m_storage_mode;
         //res.duplicate_is_error = ???
@@ -211,6 +215,20 @@ namespace libed2k
         state_updated();
     }
 
+    bool transfer::want_source_exchange()
+    {
+        const session_settings& s = settings();
+        ptime now = time_now();
+
+        if (s.source_exchange_interval < 0 || m_abort || is_paused() || is_finished() ||
+            int(m_policy.num_peers()) >= s.max_peerlist_size ||
+            total_seconds(now - m_last_source_exchange) < s.source_exchange_interval)
+            return false;
+
+        m_last_source_exchange = now;
+        return true;
+    }
+
     bool transfer::connect_to_peer(peer* peerinfo)
     {
         LIBED2K_ASSERT(peerinfo);
@@ -223,15 +241,15 @@ namespace libed2k
         tcp::endpoint ep(peerinfo->endpoint);
         LIBED2K_ASSERT((m_ses.m_ip_filter.access(peerinfo->address()) & ip_filter::blocked) == 0);
 
-        boost::shared_ptr<tcp::socket> sock(new tcp::socket(m_ses.m_io_service));
-        m_ses.setup_socket_buffers(*sock);
+        boost::shared_ptr<socket_type> sock = m_ses.create_peer_socket(
+            use_utp(*peerinfo, m_ses.settings()));
 
         boost::intrusive_ptr<peer_connection> c(
             new peer_connection(m_ses, shared_from_this(), sock, ep, peerinfo));
 
         // add the newly connected peer to this transfer's peer list
         m_connections.insert(boost::get_pointer(c));
-        m_ses.m_connections.insert(c);
+        m_ses.insert_connection(c);
         m_policy.set_connection(peerinfo, c.get());
         c->start();
 
@@ -277,7 +295,7 @@ namespace libed2k
             return false;
         }
 
-        if (m_ses.m_connections.find(p) == m_ses.m_connections.end())
+        if (!m_ses.has_peer(p))
         {
             p->disconnect(errors::peer_not_constructed);
             return false;
@@ -298,6 +316,21 @@ namespace libed2k
         return true;
     }
 
+    void transfer::cancel_block(piece_block block, peer_connection* except)
+    {
+        for (std::set<peer_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); ++i)
+        {
+            if (*i != except) (*i)->cancel_request(block);
+        }
+    }
+
+    void transfer::add_redundant_bytes(int b, piece_picker::wasted_reason_t reason)
+    {
+        LIBED2K_ASSERT(b > 0);
+        m_total_redundant_bytes += b;
+        m_ses.add_redundant_bytes(b, reason);
+    }
+
     void transfer::remove_peer(peer_connection* c)
     {
         std::set<peer_connection*>::iterator i = m_connections.find(c);
@@ -742,6 +775,14 @@ namespace libed2k
 
         m_ses.m_alerts.post_alert_should(hash_failed_alert(handle(), index));
 
+        // piece stays finished in the picker until recovery data shows which blocks are corrupted
+        if (request_aich_recovery(index)) return;
+
+        restore_failed_piece(index);
+    }
+
+    void transfer::restore_failed_piece(int index)
+    {
         // increase the total amount of failed bytes
         add_failed_bytes(PIECE_SIZE);
 
@@ -765,6 +806,123 @@ namespace libed2k
         LIBED2K_ASSERT(m_picker->have_piece(index) == false);
     }
 
+    bool transfer::aich_master(sha1_hash& master) const
+    {
+        if (m_aich_master.is_all_zeros()) return false;
+        master = m_aich_master;
+        return true;
+    }
+
+    void transfer::add_aich_master(const address& source, const sha1_hash& master)
+    {
+        if (!m_aich.empty() || master.is_all_zeros()) return;
+
+        sha1_hash trusted = m_aich_votes.add(source, master);
+
+        if (trusted != m_aich_master)
+        {
+            DBG("AICH master hash " << (trusted.is_all_zeros() ? "lost" : "trusted") <<
+                ": {transfer: " << hash() << ", sources: " << m_aich_votes.sources() << "}");
+            m_aich_master = trusted;
+            m_need_save_resume_data = true;
+        }
+    }
+
+    bool transfer::request_aich_recovery(int index)
+    {
+        if (m_aich_master.is_all_zeros() || m_aich_recovery.count(index)) return false;
+
+        for (std::set<peer_connection*>::const_iterator i = m_connections.begin();
+             i != m_connections.end(); ++i)
+        {
+            peer_connection* p = *i;
+            if (!p->supports_aich() || p->is_connecting()) continue;
+            if (p->remote_pieces().size() <= size_t(index) || !p->remote_pieces()[index]) continue;
+
+            DBG("request AICH recovery data: {transfer: " << hash() << ", piece: " << index << "}");
+            p->request_aich_recovery(index, m_aich_master);
+            m_aich_recovery[index] = time_now();
+            return true;
+        }
+
+        return false;
+    }
+
+    void transfer::on_aich_recovery_data(int index, const sha1_hash& master,
+        const std::vector<aich_node_hash>& nodes)
+    {
+        std::map<int, ptime>::iterator itr = m_aich_recovery.find(index);
+        if (itr == m_aich_recovery.end() || !has_picker()) return;
+        m_aich_recovery.erase(itr);
+
+        std::vector<sha1_hash> blocks;
+        if (master != m_aich_master ||
+            !aich_hash_tree::verify_part_recovery_data(size(), master, index, nodes, blocks))
+        {
+            DBG("AICH recovery data rejected: {transfer: " << hash() << ", piece: " << index << "}");
+            restore_failed_piece(index);
+            return;
+        }
+
+        m_storage->async_aich_hash(index,
+            boost::bind(&transfer::on_aich_piece_hashed, shared_from_this(), _1, _2, blocks));
+    }
+
+    void transfer::on_aich_piece_hashed(int ret, disk_io_job const& j, std::vector<sha1_hash> blocks)
+    {
+        LIBED2K_ASSERT(m_ses.is_network_thread());
+
+        if (m_abort || !has_picker() || m_picker->have_piece(j.piece)) return;
+        if (ret == -1) handle_disk_error(j);
+
+        const int index = j.piece;
+        std::vector<sha1_hash> hashes;
+        for (size_t pos = 0; pos + sha1_hash::size <= j.str.size(); pos += sha1_hash::size)
+            hashes.push_back(sha1_hash(j.str.substr(pos, sha1_hash::size)));
+
+        if (ret < 0 || hashes.size() != blocks.size())
+        {
+            restore_failed_piece(index);
+            return;
+        }
+
+        // picker block is good when all AICH blocks covering it are good
+        const int piece_size = static_cast<int>(std::min<size_type>(PIECE_SIZE, size() - size_type(index)*PIECE_SIZE));
+        const int blocks_in_piece = m_picker->blocks_in_piece(index);
+        std::vector<bool> good(blocks_in_piece, true);
+        int failed_bytes = 0;
+
+        for (int b = 0; b < blocks_in_piece; ++b)
+        {
+            int begin = b * BLOCK_SIZE;
+            int end = std::min<int>(begin + BLOCK_SIZE, piece_size);
+
+            for (int a = begin / AICH_BLOCK_SIZE; a * AICH_BLOCK_SIZE < end; ++a)
+                if (hashes[a] != blocks[a]) good[b] = false;
+
+            if (!good[b]) failed_bytes += end - begin;
+        }
+
+        // AICH tree doesn't match the part hash, trust nothing
+        if (failed_bytes == 0)
+        {
+            restore_failed_piece(index);
+            return;
+        }
+
+        DBG("AICH recovered piece: {transfer: " << hash() << ", piece: " << index <<
+            ", corrupted: " << failed_bytes << "}");
+
+        add_failed_bytes(failed_bytes);
+        m_picker->restore_piece(index);
+
+        for (int b = 0; b < blocks_in_piece; ++b)
+            if (good[b]) m_picker->mark_as_finished(piece_block(index, b), 0);
+
+        restore_piece_state(index);
+        m_need_save_resume_data = true;
+    }
+
     void transfer::restore_piece_state(int index)
     {
         LIBED2K_ASSERT(has_picker());
@@ -1008,7 +1166,7 @@ namespace libed2k
 
     void transfer::on_files_deleted(int ret, disk_io_job const& j)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         if (ret != 0)
             m_ses.m_alerts.post_alert_should(delete_failed_transfer_alert(handle(), j.error));
@@ -1018,7 +1176,7 @@ namespace libed2k
 
     void transfer::on_file_renamed(int ret, disk_io_job const& j)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         LIBED2K_ASSERT(j.piece == 0);
 
@@ -1037,7 +1195,7 @@ namespace libed2k
 
     void transfer::on_storage_moved(int ret, disk_io_job const& j)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         if (ret == 0)
         {
@@ -1060,7 +1218,7 @@ namespace libed2k
 
     void transfer::on_transfer_paused(int ret, disk_io_job const& j)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         m_ses.m_alerts.post_alert_should(paused_transfer_alert(handle()));
     }
@@ -1073,11 +1231,15 @@ namespace libed2k
         std::vector<boost::uint8_t> file_prio;
         file_prio.push_back(1);
 
+        storage_constructor_type sc = default_storage_constructor;
+        if (m_seed_mode && settings().mmap_seed_storage) sc = mmap_storage_constructor;
+        else if (settings().use_io_uring) sc = uring_storage_constructor;
+
         // the shared_from_this() will create an intentional
         // cycle of ownership, see the hpp file for description.
         m_owning_storage = new piece_manager(
             shared_from_this(), m_info, m_save_path, m_ses.m_filepool,
-            m_ses.m_disk_thread, default_storage_constructor, m_storage_mode, file_prio);
+            m_ses.m_disk_thread, sc, m_storage_mode, file_prio);
         m_storage = m_owning_storage.get();
 
         if (has_picker())
@@ -1133,7 +1295,7 @@ namespace libed2k
 
     void transfer::on_resume_data_checked(int ret, disk_io_job const& j)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         if (ret == piece_manager::fatal_disk_error)
         {
@@ -1276,6 +1438,15 @@ namespace libed2k
         if (active()) m_last_active = 0;
         else m_last_active += div_ceil(tick_interval_ms, 1000);
 
+        // peers which don't answer AICH requests lose the chance to fix failed pieces
+        for (std::map<int, ptime>::iterator i = m_aich_recovery.begin(); i != m_aich_recovery.end();)
+        {
+            if (now - i->second < seconds(30)) { ++i; continue; }
+            int index = i->first;
+            m_aich_recovery.erase(i++);
+            if (has_picker()) restore_failed_piece(index);
+        }
+
         for (std::set<peer_connection*>::iterator i = m_connections.begin();
              i != m_connections.end();)
         {
@@ -1327,8 +1498,7 @@ namespace libed2k
 
     void transfer::on_piece_verified(int ret, disk_io_job const& j, boost::function<void(int)> f)
     {
-        //LIBED2K_ASSERT(m_ses.is_network_thread());
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         // return value:
         // 0: success, piece passed hash check
@@ -1494,7 +1664,7 @@ namespace libed2k
 
     void transfer::on_save_resume_data(int ret, disk_io_job const& j)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         if (!j.resume_data)
         {
@@ -1570,7 +1740,7 @@ namespace libed2k
 
     void transfer::on_piece_checked(int ret, disk_io_job const& j)
     {
-        boost::mutex::scoped_lock l(m_ses.m_mutex);
+        LIBED2K_ASSERT(m_ses.is_network_thread());
 
         if (ret == piece_manager::disk_check_aborted)
         {
@@ -1730,6 +1900,18 @@ namespace libed2k
             hv.push_back(piece_hashses.at(n).toString());
         }
 
+        // AICH blocks hashes and trusted master hash
+        if (!m_aich_master.is_all_zeros())
+            ret["aich-master"] = m_aich_master.to_string();
+
+        if (!m_aich.empty())
+        {
+            entry::string_type& aich_hashes = ret["aich-hashes"].string();
+            const std::vector<sha1_hash>& blocks = m_aich.block_hashes();
+            for (size_t n = 0; n < blocks.size(); ++n)
+                aich_hashes.append(blocks[n].to_string());
+        }
+
         ret["upload_rate_limit"] = upload_limit();
         ret["download_rate_limit"] = download_limit();
         // TODO - add real values
@@ -1767,6 +1949,21 @@ namespace libed2k
 
         int paused_ = rd.dict_find_int_value("paused", -1);
         if (paused_ != -1) m_paused = paused_;
+
+        std::string aich_hashes = rd.dict_find_string_value("aich-hashes");
+        if (m_aich.empty() && !aich_hashes.empty())
+        {
+            std::vector<sha1_hash> blocks;
+            for (size_t pos = 0; pos + sha1_hash::size <= aich_hashes.size(); pos += sha1_hash::size)
+                blocks.push_back(sha1_hash(aich_hashes.substr(pos, sha1_hash::size)));
+            m_aich = aich_hash_tree(size(), blocks);
+        }
+
+        std::string aich_master = rd.dict_find_string_value("aich-master");
+        if (!m_aich.empty())
+            m_aich_master = m_aich.master_hash();
+        else if (aich_master.size() == sha1_hash::size)
+            m_aich_master = sha1_hash(aich_master);
     }
 
     void transfer::handle_disk_write(const disk_io_job& j, peer_connection* c)
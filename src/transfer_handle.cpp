@@ -5,45 +5,37 @@
 using libed2k::aux::session_impl;
 
 
-#define LIBED2K_FORWARD(call) \
+// transfer state belongs to the network thread: setters are posted there,
+// getters wait for the result
+#define LIBED2K_ASYNC_CALL(x) \
     boost::shared_ptr<transfer> t = m_transfer.lock(); \
     if (!t) return; \
-    session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-    t->call
+    t->session().m_io_service.post(boost::bind(&transfer:: x, t))
 
-#define LIBED2K_FORWARD_RETURN(call, def) \
+#define LIBED2K_ASYNC_CALL1(x, a1) \
     boost::shared_ptr<transfer> t = m_transfer.lock(); \
-    if (!t) return def; \
-    session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-    return t->call
+    if (!t) return; \
+    t->session().m_io_service.post(boost::bind(&transfer:: x, t, a1))
 
-#define LIBED2K_FORWARD_RETURN2(call, def) \
+#define LIBED2K_ASYNC_CALL2(x, a1, a2) \
     boost::shared_ptr<transfer> t = m_transfer.lock(); \
-    if (!t) return def; \
-    session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-    t->call
-
-#if 0
+    if (!t) return; \
+    t->session().m_io_service.post(boost::bind(&transfer:: x, t, a1, a2))
 
-#define LIBED2K_FORWARD(call) \
+#define LIBED2K_SYNC_CALL1(x, a1) \
     boost::shared_ptr<transfer> t = m_transfer.lock(); \
-    if (!t) throw_invalid_handle(); \
-    session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-    t->call
+    if (!t) return; \
+    t->session().sync_call(boost::bind(&transfer:: x, t, a1))
 
-#define LIBED2K_FORWARD_RETURN(call, def) \
+#define LIBED2K_SYNC_CALL_RET(type, def, x) \
     boost::shared_ptr<transfer> t = m_transfer.lock(); \
-    if (!t) throw_invalid_handle(); \
-    session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-    return t->call
+    if (!t) return def; \
+    return t->session().sync_call_ret<type>(boost::bind(&transfer:: x, t))
 
-#define LIBED2K_FORWARD_RETURN2(call, def) \
+#define LIBED2K_SYNC_CALL_RET1(type, def, x, a1) \
     boost::shared_ptr<transfer> t = m_transfer.lock(); \
-    if (!t) throw_invalid_handle(); \
-    session_impl::mutex_t::scoped_lock l(t->session().m_mutex); \
-    t->call
-
-#endif
+    if (!t) return def; \
+    return t->session().sync_call_ret<type>(boost::bind(&transfer:: x, t, a1))
 
 namespace libed2k
 {
@@ -63,175 +55,177 @@ namespace libed2k
     md4_hash transfer_handle::hash() const
     {
         static const md4_hash empty_hash(md4_hash::terminal);
-        LIBED2K_FORWARD_RETURN(hash(), empty_hash);
+        LIBED2K_SYNC_CALL_RET(md4_hash, empty_hash, hash);
     }
 
     std::string transfer_handle::name() const
     {
-        LIBED2K_FORWARD_RETURN(name(), std::string());
+        LIBED2K_SYNC_CALL_RET(std::string, std::string(), name);
     }
 
     std::string transfer_handle::save_path() const
     {
-        LIBED2K_FORWARD_RETURN(save_path(), std::string());
+        LIBED2K_SYNC_CALL_RET(std::string, std::string(), save_path);
     }
 
     size_type transfer_handle::size() const
     {
-        LIBED2K_FORWARD_RETURN(size(), 0);
+        LIBED2K_SYNC_CALL_RET(size_type, 0, size);
     }
 
     add_transfer_params transfer_handle::params() const
     {
-        LIBED2K_FORWARD_RETURN(params(), add_transfer_params());
+        LIBED2K_SYNC_CALL_RET(add_transfer_params, add_transfer_params(), params);
     }
 
     bool transfer_handle::is_seed() const
     {
-        LIBED2K_FORWARD_RETURN(is_seed(), false);
+        LIBED2K_SYNC_CALL_RET(bool, false, is_seed);
     }
 
     bool transfer_handle::is_finished() const
     {
-        LIBED2K_FORWARD_RETURN(is_finished(), false);
+        LIBED2K_SYNC_CALL_RET(bool, false, is_finished);
     }
 
     bool transfer_handle::is_paused() const
     {
-        LIBED2K_FORWARD_RETURN(is_paused(), false);
+        LIBED2K_SYNC_CALL_RET(bool, false, is_paused);
     }
 
     bool transfer_handle::is_aborted() const
     {
-        LIBED2K_FORWARD_RETURN(is_aborted(), false);
+        LIBED2K_SYNC_CALL_RET(bool, false, is_aborted);
     }
 
     bool transfer_handle::is_announced() const
     {
-        LIBED2K_FORWARD_RETURN(is_announced(), false);
+        LIBED2K_SYNC_CALL_RET(bool, false, is_announced);
     }
 
     transfer_status transfer_handle::status() const
     {
-        LIBED2K_FORWARD_RETURN(status(), transfer_status());
+        LIBED2K_SYNC_CALL_RET(transfer_status, transfer_status(), status);
     }
 
     transfer_status::state_t transfer_handle::state() const
     {
         // TODO - some default status there?
-        LIBED2K_FORWARD_RETURN(state(), transfer_status::queued_for_checking);
+        LIBED2K_SYNC_CALL_RET(transfer_status::state_t, transfer_status::queued_for_checking, state);
     }
 
     void transfer_handle::get_peer_info(std::vector<peer_info>& infos) const
     {
-        LIBED2K_FORWARD(get_peer_info(infos));
+        LIBED2K_SYNC_CALL1(get_peer_info, boost::ref(infos));
     }
 
     void transfer_handle::piece_availability(std::vector<int>& avail) const
     {
-        LIBED2K_FORWARD(piece_availability(avail));
+        LIBED2K_SYNC_CALL1(piece_availability, boost::ref(avail));
     }
 
     void transfer_handle::set_piece_priority(int index, int priority) const
     {
-        LIBED2K_FORWARD(set_piece_priority(index, priority));
+        LIBED2K_ASYNC_CALL2(set_piece_priority, index, priority);
     }
 
     int transfer_handle::piece_priority(int index) const
     {
-        LIBED2K_FORWARD_RETURN(piece_priority(index), 0);
+        LIBED2K_SYNC_CALL_RET1(int, 0, piece_priority, index);
     }
 
 	std::vector<int> transfer_handle::piece_priorities() const
     {
         std::vector<int> ret;
-        LIBED2K_FORWARD_RETURN2(piece_priorities(&ret), std::vector<int>());
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t) return ret;
+        t->session().sync_call(boost::bind(&transfer::piece_priorities, t, &ret));
         return ret;
     }
 
     bool transfer_handle::is_sequential_download() const
     {
-        LIBED2K_FORWARD_RETURN(is_sequential_download(), false);
+        LIBED2K_SYNC_CALL_RET(bool, false, is_sequential_download);
     }
 
     void transfer_handle::set_sequential_download(bool sd) const
     {
-        LIBED2K_FORWARD(set_sequential_download(sd));
+        LIBED2K_ASYNC_CALL1(set_sequential_download, sd);
     }
 
     void transfer_handle::set_upload_limit(int limit) const
     {
-        LIBED2K_FORWARD(set_upload_limit(limit));
+        LIBED2K_ASYNC_CALL1(set_upload_limit, limit);
     }
 
     int transfer_handle::upload_limit() const
     {
-        LIBED2K_FORWARD_RETURN(upload_limit(), 0);
+        LIBED2K_SYNC_CALL_RET(int, 0, upload_limit);
     }
 
     void transfer_handle::set_download_limit(int limit) const
     {
-        LIBED2K_FORWARD(set_download_limit(limit));
+        LIBED2K_ASYNC_CALL1(set_download_limit, limit);
     }
 
     int transfer_handle::download_limit() const
     {
-        LIBED2K_FORWARD_RETURN(download_limit(), 0);
+        LIBED2K_SYNC_CALL_RET(int, 0, download_limit);
     }
 
     void transfer_handle::set_upload_mode(bool b) const
     {
-        LIBED2K_FORWARD(set_upload_mode(b));
+        LIBED2K_ASYNC_CALL1(set_upload_mode, b);
     }
 
     void transfer_handle::set_eager_mode(bool b) const
     {
-        LIBED2K_FORWARD(set_eager_mode(b));
+        LIBED2K_ASYNC_CALL1(set_eager_mode, b);
     }
 
     void transfer_handle::pause() const
     {
-        LIBED2K_FORWARD(pause());
+        LIBED2K_ASYNC_CALL(pause);
     }
 
     void transfer_handle::resume() const
     {
-        LIBED2K_FORWARD(resume());
+        LIBED2K_ASYNC_CALL(resume);
     }
 
     size_t transfer_handle::num_pieces() const
     {
-        LIBED2K_FORWARD_RETURN(num_pieces(), 0);
+        LIBED2K_SYNC_CALL_RET(size_t, 0, num_pieces);
     }
 
     int transfer_handle::num_peers() const
     {
-        LIBED2K_FORWARD_RETURN(num_peers(), 0);
+        LIBED2K_SYNC_CALL_RET(int, 0, num_peers);
     }
 
     int transfer_handle::num_seeds() const
     {
-        LIBED2K_FORWARD_RETURN(num_seeds(), 0);
+        LIBED2K_SYNC_CALL_RET(int, 0, num_seeds);
     }
 
     void transfer_handle::save_resume_data(int flags) const
     {
-        LIBED2K_FORWARD(save_resume_data(flags));
+        LIBED2K_ASYNC_CALL1(save_resume_data, flags);
     }
 
     bool transfer_handle::need_save_resume_data() const
     {
-        LIBED2K_FORWARD_RETURN(need_save_resume_data(), false);
+        LIBED2K_SYNC_CALL_RET(bool, false, need_save_resume_data);
     }
 
     void transfer_handle::move_storage(const std::string& save_path) const
     {
-        LIBED2K_FORWARD(move_storage(save_path));
+        LIBED2K_ASYNC_CALL1(move_storage, save_path);
     }
 
     bool transfer_handle::rename_file(const std::string& name) const
     {
-        LIBED2K_FORWARD_RETURN(rename_file(name), false);
+        LIBED2K_SYNC_CALL_RET1(bool, false, rename_file, name);
     }
 
     std::string transfer_status2string(const transfer_status& s)
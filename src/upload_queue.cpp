@@ -0,0 +1,274 @@
+#include <algorithm>
+
+#include "libed2k/upload_queue.hpp"
+#include "libed2k/client_credits.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/file.hpp"
+#include "libed2k/log.hpp"
+
+namespace libed2k
+{
+    namespace
+    {
+        // waiting peer which doesn't ask again during this time is forgotten
+        const int queue_entry_timeout = 60 * 60;
+
+        // ranks are sent not more often than once per this count of seconds
+        const int rankings_interval = 60;
+
+        struct score_less
+        {
+            template<typename Pair>
+            bool operator()(const Pair& lhs, const Pair& rhs) const { return lhs.first < rhs.first; }
+        };
+
+        boost::uint16_t rank_value(int rank)
+        {
+            return static_cast<boost::uint16_t>(std::min(rank, 0xFFFF));
+        }
+    }
+
+    upload_queue::upload_queue(const client_credits& credits) :
+        m_credits(credits), m_last_rankings(min_time())
+    {
+    }
+
+    bool upload_queue::request_upload(upload_peer* c, int priority, const session_settings& settings, ptime now)
+    {
+        if (has_slot(c))
+        {
+            c->upload_accepted();
+            return true;
+        }
+
+        queue_map::iterator itr = m_queue.find(c->upload_client());
+
+        if (itr == m_queue.end() && slot_free(settings))
+        {
+            grant(c, priority, now);
+            return true;
+        }
+
+        if (itr == m_queue.end())
+        {
+            if (queue_size() >= settings.upload_queue_size)
+            {
+                DBG("upload queue is full, ignore " << c->upload_client());
+                return false;
+            }
+
+            enqueue(c, priority, now);
+            itr = m_queue.find(c->upload_client());
+        }
+        else
+        {
+            // peer asks again, may be on new connection or for other file
+            itr->second.connection = c;
+            itr->second.priority = priority;
+            itr->second.last_request = now;
+
+            // peers disconnect after ranking, so free slot can't wait for tick when it is their turn
+            if (slot_free(settings) && first_connected(itr, now))
+            {
+                m_queue.erase(itr);
+                grant(c, priority, now);
+                return true;
+            }
+        }
+
+        int r = rank(c->upload_client(), now);
+        itr->second.sent_rank = r;
+        c->upload_ranked(rank_value(r));
+        return false;
+    }
+
+    bool upload_queue::has_slot(const upload_peer* c) const
+    {
+        for (slot_list::const_iterator i = m_slots.begin(); i != m_slots.end(); ++i)
+            if (i->connection == c) return true;
+        return false;
+    }
+
+    void upload_queue::release_slot(const upload_peer* c)
+    {
+        for (slot_list::iterator i = m_slots.begin(); i != m_slots.end(); ++i)
+        {
+            if (i->connection == c)
+            {
+                m_slots.erase(i);
+                return;
+            }
+        }
+    }
+
+    void upload_queue::remove_connection(const upload_peer* c)
+    {
+        release_slot(c);
+        queue_map::iterator itr = m_queue.find(c->upload_client());
+        if (itr != m_queue.end() && itr->second.connection == c) itr->second.connection = NULL;
+    }
+
+    void upload_queue::second_tick(const session_settings& settings, ptime now)
+    {
+        // forget peers which don't ask anymore
+        for (queue_map::iterator i = m_queue.begin(); i != m_queue.end(); )
+        {
+            if (!i->second.connection && total_seconds(now - i->second.last_request) > queue_entry_timeout)
+                m_queue.erase(i++);
+            else
+                ++i;
+        }
+
+        std::vector<queue_map::iterator> waiters;
+        ordered(waiters, now);
+
+        bool connected_waiters = false;
+        for (std::vector<queue_map::iterator>::const_iterator i = waiters.begin(); i != waiters.end(); ++i)
+            if ((*i)->second.connection) connected_waiters = true;
+
+        // slot quantum is over only when somebody waits for it
+        if (connected_waiters)
+        {
+            for (size_t n = 0; n < m_slots.size(); )
+            {
+                slot s = m_slots[n];
+                if (s.connection->uploaded_payload() - s.uploaded < settings.upload_slot_bytes &&
+                    total_seconds(now - s.started) < settings.upload_slot_time)
+                {
+                    ++n;
+                    continue;
+                }
+
+                DBG("upload slot is over for " << s.connection->upload_client());
+                m_slots.erase(m_slots.begin() + n);
+                s.connection->upload_slot_over();
+                enqueue(s.connection, s.priority, now);
+            }
+
+            ordered(waiters, now);
+        }
+
+        for (std::vector<queue_map::iterator>::const_iterator i = waiters.begin();
+             i != waiters.end() && slot_free(settings); ++i)
+        {
+            upload_peer* c = (*i)->second.connection;
+            if (!c || c->upload_closing()) continue;
+            int priority = (*i)->second.priority;
+            m_queue.erase(*i);
+            grant(c, priority, now);
+        }
+
+        if (total_seconds(now - m_last_rankings) >= rankings_interval)
+        {
+            send_rankings(now);
+            m_last_rankings = now;
+        }
+    }
+
+    int upload_queue::rank(const md4_hash& client, ptime now) const
+    {
+        queue_map::const_iterator itr = m_queue.find(client);
+        if (itr == m_queue.end()) return 0;
+
+        double s = entry_score(*itr, now);
+        int res = 1;
+
+        for (queue_map::const_iterator i = m_queue.begin(); i != m_queue.end(); ++i)
+            if (i != itr && entry_score(*i, now) > s) ++res;
+
+        return res;
+    }
+
+    double upload_queue::score(int priority, time_duration waiting, double credit)
+    {
+        double modifier;
+
+        switch (priority)
+        {
+            case PR_VERYHIGH:   modifier = 1.8; break;
+            case PR_HIGH:       modifier = 0.9; break;
+            case PR_LOW:        modifier = 0.6; break;
+            case PR_VERYLOW:    modifier = 0.2; break;
+            default:            modifier = 0.7; break;
+        }
+
+        return credit * modifier * std::max(total_seconds(waiting), 0);
+    }
+
+    double upload_queue::entry_score(const queue_map::value_type& e, ptime now) const
+    {
+        return score(e.second.priority, now - e.second.enqueued, m_credits.score_ratio(e.first));
+    }
+
+    bool upload_queue::first_connected(queue_map::const_iterator itr, ptime now) const
+    {
+        double s = entry_score(*itr, now);
+
+        for (queue_map::const_iterator i = m_queue.begin(); i != m_queue.end(); ++i)
+        {
+            if (i == itr || !i->second.connection || i->second.connection->upload_closing()) continue;
+            if (entry_score(*i, now) > s) return false;
+        }
+
+        return true;
+    }
+
+    bool upload_queue::slot_free(const session_settings& settings) const
+    {
+        return settings.unchoke_slots_limit < 0 || slots() < settings.unchoke_slots_limit;
+    }
+
+    void upload_queue::grant(upload_peer* c, int priority, ptime now)
+    {
+        DBG("upload slot granted to " << c->upload_client());
+        slot s;
+        s.connection = c;
+        s.priority = priority;
+        s.started = now;
+        s.uploaded = c->uploaded_payload();
+        m_slots.push_back(s);
+        c->upload_accepted();
+    }
+
+    void upload_queue::enqueue(upload_peer* c, int priority, ptime now)
+    {
+        waiter w;
+        w.connection = c;
+        w.priority = priority;
+        w.enqueued = now;
+        w.last_request = now;
+        w.sent_rank = 0;
+        m_queue[c->upload_client()] = w;
+    }
+
+    void upload_queue::ordered(std::vector<queue_map::iterator>& res, ptime now)
+    {
+        std::vector<std::pair<double, queue_map::iterator> > scores;
+        scores.reserve(m_queue.size());
+
+        for (queue_map::iterator i = m_queue.begin(); i != m_queue.end(); ++i)
+            scores.push_back(std::make_pair(-entry_score(*i, now), i));
+
+        // stable by score only, map iterators have no order
+        std::stable_sort(scores.begin(), scores.end(), score_less());
+
+        res.clear();
+        res.reserve(scores.size());
+        for (size_t n = 0; n < scores.size(); ++n) res.push_back(scores[n].second);
+    }
+
+    void upload_queue::send_rankings(ptime now)
+    {
+        std::vector<queue_map::iterator> waiters;
+        ordered(waiters, now);
+
+        for (size_t n = 0; n < waiters.size(); ++n)
+        {
+            waiter& w = waiters[n]->second;
+            int r = int(n) + 1;
+            if (!w.connection || w.connection->upload_closing() || w.sent_rank == r) continue;
+            w.sent_rank = r;
+            w.connection->upload_ranked(rank_value(r));
+        }
+    }
+}
@@ -0,0 +1,522 @@
+#include "libed2k/uring_storage.hpp"
+#include "libed2k/storage_defs.hpp"
+
+#if LIBED2K_USE_IO_URING
+
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "libed2k/filesystem.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/error_code.hpp"
+#include "libed2k/alloca.hpp"
+#include "libed2k/log.hpp"
+
+// syscall numbers are shared by all architectures but alpha
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+namespace libed2k
+{
+    // defined in storage.cpp
+    int copy_bufs(file::iovec_t const* bufs, int bytes, file::iovec_t* target);
+    void advance_bufs(file::iovec_t*& bufs, int bytes);
+    int bufs_size(file::iovec_t const* bufs, int num_bufs);
+    void clear_bufs(file::iovec_t const* bufs, int num_bufs);
+
+    namespace
+    {
+        // one ring serves all the storages of a device, deep enough
+        // for the writes of a whole write cache flush
+        const unsigned ring_entries = 256;
+
+        int io_uring_setup(unsigned entries, io_uring_params* p)
+        {
+            return int(syscall(__NR_io_uring_setup, entries, p));
+        }
+
+        int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+            return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+        }
+
+        template<typename T>
+        T* ring_field(void* ring, unsigned offset)
+        {
+            return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+        }
+
+        void* map_ring(int fd, size_t size, off_t offset)
+        {
+            void* ret = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+            return ret == MAP_FAILED ? 0 : ret;
+        }
+    }
+
+    io_ring::io_ring() :
+        m_fd(-1), m_failed(false), m_entries(0), m_batch_depth(0),
+        m_sq_ring(0), m_sq_ring_size(0), m_cq_ring(0), m_cq_ring_size(0), m_sqes(0), m_sqes_size(0),
+        m_sq_tail(0), m_sq_mask(0), m_sq_array(0), m_cq_head(0), m_cq_tail(0), m_cq_mask(0), m_cqes(0)
+    {
+    }
+
+    io_ring::~io_ring()
+    {
+        LIBED2K_ASSERT(m_batch.empty());
+        close();
+    }
+
+    bool io_ring::usable()
+    {
+        if (m_failed) return false;
+        if (is_open()) return true;
+
+        error_code ec;
+        if (!open(ring_entries, ec))
+        {
+            // old kernel or io_uring is forbidden by seccomp
+            DBG("io_uring is unavailable: " << ec.message());
+            m_failed = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool io_ring::open(unsigned entries, error_code& ec)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+
+        m_fd = io_uring_setup(entries, &p);
+        if (m_fd < 0)
+        {
+            ec.assign(errno, get_posix_category());
+            return false;
+        }
+
+        m_entries = p.sq_entries;
+        m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+        bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+        single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+#endif
+        if (single_mmap) m_sq_ring_size = m_cq_ring_size = (std::max)(m_sq_ring_size, m_cq_ring_size);
+
+        m_sq_ring = map_ring(m_fd, m_sq_ring_size, IORING_OFF_SQ_RING);
+        if (m_sq_ring) m_cq_ring = single_mmap ? m_sq_ring : map_ring(m_fd, m_cq_ring_size, IORING_OFF_CQ_RING);
+        if (m_cq_ring) m_sqes = map_ring(m_fd, m_sqes_size, IORING_OFF_SQES);
+
+        if (!m_sqes)
+        {
+            ec.assign(errno, get_posix_category());
+            close();
+            return false;
+        }
+
+        m_sq_tail = ring_field<unsigned>(m_sq_ring, p.sq_off.tail);
+        m_sq_mask = ring_field<unsigned>(m_sq_ring, p.sq_off.ring_mask);
+        m_sq_array = ring_field<unsigned>(m_sq_ring, p.sq_off.array);
+        m_cq_head = ring_field<unsigned>(m_cq_ring, p.cq_off.head);
+        m_cq_tail = ring_field<unsigned>(m_cq_ring, p.cq_off.tail);
+        m_cq_mask = ring_field<unsigned>(m_cq_ring, p.cq_off.ring_mask);
+        m_cqes = ring_field<void>(m_cq_ring, p.cq_off.cqes);
+        return true;
+    }
+
+    void io_ring::close()
+    {
+        if (m_sqes) munmap(m_sqes, m_sqes_size);
+        if (m_cq_ring && m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+        if (m_sq_ring) munmap(m_sq_ring, m_sq_ring_size);
+        if (m_fd >= 0) ::close(m_fd);
+        m_sqes = m_cq_ring = m_sq_ring = 0;
+        m_fd = -1;
+    }
+
+    bool io_ring::run(op const* ops, int num_ops, int* res, error_code& ec)
+    {
+        LIBED2K_ASSERT(is_open());
+        LIBED2K_ASSERT(!batching());
+
+        std::vector<pending_op> pending(num_ops);
+        for (int i = 0; i < num_ops; ++i)
+        {
+            pending[i].o = ops[i];
+            pending[i].res = 0;
+            pending[i].done = false;
+        }
+
+        bool ret = execute(pending, ec);
+        for (int i = 0; i < num_ops; ++i) res[i] = pending[i].res;
+        return ret;
+    }
+
+    void io_ring::queue(op const& o, boost::intrusive_ptr<file> const& f, handler_t const& h)
+    {
+        LIBED2K_ASSERT(batching());
+        m_batch.push_back(pending_op());
+        pending_op& p = m_batch.back();
+        p.o = o;
+        p.bufs.assign(o.bufs, o.bufs + o.num_bufs);
+        p.handle = f;
+        p.handler = h;
+        p.res = 0;
+        p.done = false;
+    }
+
+    void io_ring::end_batch()
+    {
+        LIBED2K_ASSERT(batching());
+        if (--m_batch_depth > 0 || m_batch.empty()) return;
+
+        std::vector<pending_op> batch;
+        batch.swap(m_batch);
+        for (size_t i = 0; i < batch.size(); ++i) batch[i].o.bufs = &batch[i].bufs[0];
+
+        error_code ec;
+        if (!execute(batch, ec))
+        {
+            ERR("io_uring failed, falling back to synchronous I/O: " << ec.message());
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            if (batch[i].handler) batch[i].handler(batch[i].res);
+        }
+    }
+
+    bool io_ring::execute(std::vector<pending_op>& ops, error_code& ec)
+    {
+        // transient errors of io_uring_enter() in a row before the ring is given up
+        const int max_retries = 16;
+
+        io_uring_sqe* sqes = static_cast<io_uring_sqe*>(m_sqes);
+
+        size_t next = 0;            // first operation not in the ring yet
+        size_t completed = 0;
+        unsigned unsubmitted = 0;   // in the ring, not taken by the kernel yet
+        unsigned in_flight = 0;     // taken by the kernel, not completed yet
+        int retries = 0;
+
+        while (completed < ops.size())
+        {
+            // keep the submission ring full
+            unsigned tail = *m_sq_tail;
+            for (; next < ops.size() && unsubmitted + in_flight < m_entries; ++next, ++tail, ++unsubmitted)
+            {
+                op const& o = ops[next].o;
+                unsigned index = tail & *m_sq_mask;
+                io_uring_sqe& sqe = sqes[index];
+                memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = o.write ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe.fd = o.fd;
+                sqe.off = o.offset;
+                sqe.addr = reinterpret_cast<unsigned long>(o.bufs);
+                sqe.len = o.num_bufs;
+                sqe.user_data = next;
+                m_sq_array[index] = index;
+            }
+
+            // the kernel must see the entries before the new tail
+            __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+
+            int ret = io_uring_enter(m_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+            if (ret < 0)
+            {
+                int error = errno;
+                if ((error == EINTR || error == EAGAIN || error == EBUSY) && ++retries <= max_retries)
+                {
+                    if (error == EINTR) continue;
+
+                    // the kernel is short of resources, with nothing in flight back
+                    // off briefly - 13.6 ms over all the retries at most
+                    if (in_flight == 0)
+                    {
+                        usleep(100 * retries);
+                        continue;
+                    }
+
+                    // completions free resources, wait for one of the operations
+                    // in flight and submit again after it is reaped
+                    if (io_uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) continue;
+                    ret = 0;
+                }
+                else
+                {
+                    // persistent failure, operations which didn't complete fail with it.
+                    // Teardown of the ring doesn't stop transfers in flight, wait for them
+                    // while the caller's buffers are still there
+                    int reap_retries = 0;
+                    while (in_flight > 0)
+                    {
+                        if (io_uring_enter(m_fd, 0, in_flight, IORING_ENTER_GETEVENTS) < 0
+                            && ((errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                                || ++reap_retries > max_retries))
+                            break;
+
+                        unsigned reaped = reap(ops);
+                        completed += reaped;
+                        in_flight -= reaped;
+                    }
+
+                    for (size_t i = 0; i < ops.size(); ++i)
+                    {
+                        if (ops[i].done) continue;
+                        ops[i].res = -error;
+                        ops[i].done = true;
+                    }
+
+                    ec.assign(error, get_posix_category());
+                    m_failed = true;
+
+                    if (in_flight == 0)
+                    {
+                        close();
+                    }
+                    else
+                    {
+                        // the kernel may still use the buffers, leave the ring open
+                        // rather than free them under it
+                        ERR("io_uring left " << in_flight << " operations in flight");
+                        m_fd = -1;
+                        m_sqes = m_cq_ring = m_sq_ring = 0;
+                    }
+
+                    return false;
+                }
+            }
+            retries = 0;
+            unsubmitted -= ret;
+            in_flight += ret;
+
+            unsigned reaped = reap(ops);
+            completed += reaped;
+            in_flight -= reaped;
+        }
+
+        return true;
+    }
+
+    unsigned io_ring::reap(std::vector<pending_op>& ops)
+    {
+        io_uring_cqe const* cqes = static_cast<io_uring_cqe const*>(m_cqes);
+        unsigned head = *m_cq_head;
+        unsigned cq_tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned ret = 0;
+
+        for (; head != cq_tail; ++head, ++ret)
+        {
+            io_uring_cqe const& cqe = cqes[head & *m_cq_mask];
+            pending_op& p = ops[size_t(cqe.user_data)];
+            p.res = cqe.res;
+            p.done = true;
+        }
+
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        return ret;
+    }
+
+    uring_storage::uring_storage(file_storage const& fs, file_storage const* mapped, std::string const& path
+        , file_pool& fp, std::vector<boost::uint8_t> const& file_prio) :
+        default_storage(fs, mapped, path, fp, file_prio)
+    {
+    }
+
+    int uring_storage::readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs)
+    {
+        fileop op = { &file::readv, &default_storage::read_unaligned
+            , m_settings ? settings().disk_io_read_mode : 0, file::read_only };
+        int ret = uring_readwritev(bufs, slot, offset, num_bufs, op);
+        if (ret == -2) ret = default_storage::readv(bufs, slot, offset, num_bufs);
+        return ret;
+    }
+
+    int uring_storage::writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs)
+    {
+        fileop op = { &file::writev, &default_storage::write_unaligned
+            , m_settings ? settings().disk_io_write_mode : 0, file::read_write };
+        int ret = uring_readwritev(bufs, slot, offset, num_bufs, op);
+        if (ret == -2) ret = default_storage::writev(bufs, slot, offset, num_bufs);
+        return ret;
+    }
+
+    int uring_storage::uring_readwritev(file::iovec_t const* bufs, int slot, int offset
+        , int num_bufs, fileop const& op)
+    {
+        // unbuffered files need aligned transfers, default_storage handles them
+        if (op.cache_setting != session_settings::enable_os_cache) return -2;
+
+        // storage isn't bound to the ring of its device worker yet
+        if (!m_ring || !m_ring->usable()) return -2;
+
+        LIBED2K_ASSERT(slot >= 0 && slot < m_files.num_pieces());
+        LIBED2K_ASSERT(offset >= 0 && offset < m_files.piece_size(slot));
+        LIBED2K_ASSERT(num_bufs > 0);
+
+        int size = bufs_size(bufs, num_bufs);
+        int bytes_left = (std::min)(size, int(m_files.piece_size(slot)) - offset);
+
+        size_type file_offset = slot * (size_type)m_files.piece_length() + offset;
+        file_storage::iterator file_iter = files().begin();
+        while (file_offset >= file_iter->size)
+        {
+            file_offset -= file_iter->size;
+            ++file_iter;
+            LIBED2K_ASSERT(file_iter != files().end());
+        }
+
+        // slices refer to their part of iov_store by index until all
+        // of them are laid out, then the vector doesn't move anymore
+        std::vector<file::iovec_t> iov_store;
+        std::vector<io_ring::op> ops;
+        std::vector<int> first_iov;
+        std::vector<int> slice_sizes;
+        // handles stay open until the batch completes
+        std::vector<boost::intrusive_ptr<file> > handles;
+        std::vector<file_storage::iterator> slice_files;
+
+        file::iovec_t* current_buf = LIBED2K_ALLOCA(file::iovec_t, num_bufs);
+        copy_bufs(bufs, size, current_buf);
+
+        for (int file_bytes_left; bytes_left > 0; ++file_iter, bytes_left -= file_bytes_left)
+        {
+            LIBED2K_ASSERT(file_iter != files().end());
+            file_bytes_left = bytes_left;
+            if (file_offset + file_bytes_left > file_iter->size)
+                file_bytes_left = (std::max)(static_cast<int>(file_iter->size - file_offset), 0);
+
+            if (file_bytes_left == 0) continue;
+
+            if (file_iter->pad_file)
+            {
+                if (op.mode == file::read_only)
+                {
+                    file::iovec_t* tmp_bufs = LIBED2K_ALLOCA(file::iovec_t, num_bufs);
+                    clear_bufs(tmp_bufs, copy_bufs(current_buf, file_bytes_left, tmp_bufs));
+                }
+                advance_bufs(current_buf, file_bytes_left);
+                file_offset = 0;
+                continue;
+            }
+
+            error_code ec;
+            boost::intrusive_ptr<file> file_handle = open_file(file_iter, op.mode, ec);
+            if (op.mode == file::read_write && ec == boost::system::errc::no_such_file_or_directory)
+            {
+                // the directory the file is in doesn't exist yet
+                ec.clear();
+                std::string path = combine_path(m_save_path, files().file_path(*file_iter));
+                create_directories(parent_path(path), ec);
+                if (!ec) file_handle = open_file(file_iter, op.mode, ec);
+            }
+
+            if (!file_handle || ec)
+            {
+                LIBED2K_ASSERT(ec);
+                set_error(combine_path(m_save_path, files().file_path(*file_iter)), ec);
+                return -1;
+            }
+
+            // file was opened unbuffered by another storage sharing the pool
+            if (file_handle->open_mode() & file::no_buffer) return -2;
+
+            first_iov.push_back(iov_store.size());
+            iov_store.resize(iov_store.size() + num_bufs);
+            int num_tmp_bufs = copy_bufs(current_buf, file_bytes_left, &iov_store[first_iov.back()]);
+            iov_store.resize(first_iov.back() + num_tmp_bufs);
+
+            io_ring::op o;
+            o.fd = file_handle->native_handle();
+            o.write = op.mode == file::read_write;
+            o.offset = files().file_base(*file_iter) + file_offset;
+            o.bufs = 0;
+            o.num_bufs = num_tmp_bufs;
+            ops.push_back(o);
+            slice_sizes.push_back(file_bytes_left);
+            handles.push_back(file_handle);
+            slice_files.push_back(file_iter);
+
+            advance_bufs(current_buf, file_bytes_left);
+            file_offset = 0;
+        }
+
+        if (ops.empty()) return size;
+
+        for (size_t i = 0; i < ops.size(); ++i) ops[i].bufs = &iov_store[first_iov[i]];
+
+        if (m_ring->batching() && op.mode == file::read_write)
+        {
+            // the disk worker waits for the batch before it releases the buffers,
+            // failures are reported through the storage error then
+            for (size_t i = 0; i < ops.size(); ++i)
+            {
+                m_ring->queue(ops[i], handles[i], boost::bind(&uring_storage::on_write_done, this
+                    , int(slice_files[i] - files().begin()), slice_sizes[i], _1));
+            }
+            return size;
+        }
+
+        std::vector<int> res(ops.size(), 0);
+        error_code ec;
+        if (!m_ring->run(&ops[0], int(ops.size()), &res[0], ec))
+        {
+            ERR("io_uring failed, falling back to synchronous I/O: " << ec.message());
+            return -2;
+        }
+
+        // like default_storage, a short transfer stops at the slice it happened in
+        int ret = 0;
+        for (size_t i = 0; i < ops.size(); ++i)
+        {
+            if (res[i] < 0)
+            {
+                set_error(combine_path(m_save_path, files().file_path(*slice_files[i]))
+                    , error_code(-res[i], get_posix_category()));
+                return -1;
+            }
+            ret += res[i];
+            if (res[i] != slice_sizes[i]) return ret;
+        }
+
+        return size;
+    }
+
+    void uring_storage::on_write_done(int file, int size, int res)
+    {
+        if (res == size) return;
+        // a short write leaves the block incomplete on disk
+        set_error(combine_path(m_save_path, files().file_path(file))
+            , error_code(res < 0 ? -res : EIO, get_posix_category()));
+    }
+}
+
+#endif
+
+namespace libed2k
+{
+    storage_interface* uring_storage_constructor(file_storage const& fs
+        , file_storage const* mapped, std::string const& path, file_pool& fp
+        , std::vector<boost::uint8_t> const& file_prio)
+    {
+#if LIBED2K_USE_IO_URING
+        return new uring_storage(fs, mapped, path, fp, file_prio);
+#else
+        return default_storage_constructor(fs, mapped, path, fp, file_prio);
+#endif
+    }
+}
@@ -1,12 +1,14 @@
 #include <algorithm>
 #include <locale.h>
 #include <cctype>
+#include <cmath>
 
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/tss.hpp>
 
 #include "libed2k/size_type.hpp"
 #include "libed2k/utf8.hpp"
@@ -14,6 +16,8 @@
 #include "libed2k/file.hpp"
 #include "libed2k/bitfield.hpp"
 #include "libed2k/log.hpp"
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.c"
 
 namespace libed2k 
 {
@@ -340,4 +344,119 @@ namespace libed2k
         DBG("filter comm : " << f.comment);
         return f;
     }
+
+    namespace
+    {
+        // huffman tables of decompressor take about 10KB, don't allocate them for each packet
+        boost::thread_specific_ptr<tinfl_decompressor> thread_decompressor;
+
+        // compressor state takes about 300KB
+        boost::thread_specific_ptr<tdefl_compressor> thread_compressor;
+
+        /**
+          * Shannon entropy in bits per byte of every step-th byte of data
+         */
+        double sample_entropy(const char* data, size_t size, size_t step)
+        {
+            size_t freq[256] = {0};
+            size_t count = 0;
+
+            for (size_t n = 0; n < size; n += step, ++count)
+                ++freq[static_cast<unsigned char>(data[n])];
+
+            double entropy = 0;
+
+            for (int n = 0; n < 256; ++n)
+            {
+                if (freq[n] == 0) continue;
+                double p = double(freq[n]) / count;
+                entropy -= p * std::log(p);
+            }
+
+            return entropy / std::log(2.0);
+        }
+    }
+
+    bool inflate_packet(const char* data, size_t size, socket_buffer& out, size_t max_size)
+    {
+        out.clear();
+        if (size == 0 || max_size == 0) return false;
+
+        tinfl_decompressor* decomp = thread_decompressor.get();
+
+        if (!decomp)
+        {
+            decomp = new tinfl_decompressor;
+            thread_decompressor.reset(decomp);
+        }
+
+        tinfl_init(decomp);
+
+        // usual ratio of eMule packets is about 1:3, previous packets of connection could leave more
+        size_t len = 0;
+        out.resize(std::min(max_size, std::max(out.capacity(), size * 4)));
+
+        for (;;)
+        {
+            size_t in_size = size;
+            size_t out_size = out.size() - len;
+            tinfl_status status = tinfl_decompress(decomp,
+                reinterpret_cast<const mz_uint8*>(data), &in_size,
+                reinterpret_cast<mz_uint8*>(&out[0]), reinterpret_cast<mz_uint8*>(&out[0] + len), &out_size,
+                TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+
+            data += in_size;
+            size -= in_size;
+            len += out_size;
+
+            if (status == TINFL_STATUS_DONE)
+            {
+                out.resize(len);
+                return true;
+            }
+
+            if (status != TINFL_STATUS_HAS_MORE_OUTPUT || out.size() >= max_size) break;
+            out.resize(std::min(max_size, out.size() * 2));
+        }
+
+        out.clear();
+        return false;
+    }
+
+    bool deflate_block(const char* data, size_t size, std::vector<char>& out)
+    {
+        out.clear();
+
+        // zlib header and block headers eat gain of tiny data
+        if (size < 64) return false;
+
+        // archives, media and encrypted data are close to 8 bits per byte,
+        // sample of 4KB is enough to recognize them
+        if (sample_entropy(data, size, std::max<size_t>(1, size / 4096)) > 7.5) return false;
+
+        tdefl_compressor* comp = thread_compressor.get();
+
+        if (!comp)
+        {
+            comp = new tdefl_compressor;
+            thread_compressor.reset(comp);
+        }
+
+        tdefl_init(comp, NULL, NULL,
+            tdefl_create_comp_flags_from_zip_params(MZ_DEFAULT_LEVEL, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY));
+
+        // output which doesn't fit in 90% of input isn't worth sending
+        size_t in_size = size;
+        size_t out_size = size - size / 10;
+        out.resize(out_size);
+
+        if (tdefl_compress(comp, data, &in_size, &out[0], &out_size, TDEFL_FINISH) != TDEFL_STATUS_DONE)
+        {
+            out.clear();
+            return false;
+        }
+
+        out.resize(out_size);
+        return true;
+    }
 }
@@ -0,0 +1,185 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/aich.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/archive.hpp"
+#include "libed2k/packet_struct.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_aich)
+
+namespace
+{
+    libed2k::sha1_hash random_hash()
+    {
+        libed2k::sha1_hash h;
+        for (int n = 0; n < libed2k::sha1_hash::size; ++n)
+            h[n] = static_cast<unsigned char>(rand());
+        return h;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_sha1)
+{
+    const char* abc = "abc";
+    BOOST_CHECK_EQUAL(libed2k::sha1_hasher(abc, 3).final().to_string(),
+        std::string("\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e\x25\x71\x78\x50\xc2\x6c\x9c\xd0\xd8\x9d", 20));
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_part_hasher)
+{
+    std::vector<char> data(libed2k::PIECE_SIZE);
+    for (size_t n = 0; n < data.size(); ++n) data[n] = static_cast<char>(n);
+
+    // feed by odd chunks and compare with block by block hashing
+    libed2k::aich_part_hasher ph;
+    for (size_t offset = 0; offset < data.size(); offset += 100003)
+        ph.update(&data[offset], std::min<size_t>(100003, data.size() - offset));
+    const std::vector<libed2k::sha1_hash>& hashes = ph.final();
+
+    BOOST_REQUIRE_EQUAL(static_cast<int>(hashes.size()), libed2k::aich_hash_tree::blocks_in_part(libed2k::PIECE_SIZE, 0));
+
+    for (size_t n = 0; n < hashes.size(); ++n)
+    {
+        size_t offset = n * libed2k::AICH_BLOCK_SIZE;
+        int len = std::min<size_t>(libed2k::AICH_BLOCK_SIZE, data.size() - offset);
+        BOOST_CHECK(hashes[n] == libed2k::sha1_hasher(&data[offset], len).final());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_recovery_data)
+{
+    const libed2k::size_type sizes[] =
+    {
+        100,
+        libed2k::AICH_BLOCK_SIZE,
+        libed2k::PIECE_SIZE,
+        libed2k::PIECE_SIZE + 1,
+        libed2k::PIECE_SIZE*2,
+        libed2k::PIECE_SIZE*7 + libed2k::AICH_BLOCK_SIZE*3 + 5
+    };
+
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+    {
+        std::vector<libed2k::sha1_hash> blocks(libed2k::aich_hash_tree::blocks_count(sizes[s]));
+        std::generate(blocks.begin(), blocks.end(), random_hash);
+        libed2k::aich_hash_tree tree(sizes[s], blocks);
+        BOOST_REQUIRE(!tree.empty());
+
+        int parts = static_cast<int>((sizes[s] + libed2k::PIECE_SIZE - 1) / libed2k::PIECE_SIZE);
+        int first_block = 0;
+
+        for (int part = 0; part < parts; ++part)
+        {
+            std::vector<libed2k::aich_node_hash> data;
+            std::vector<libed2k::sha1_hash> part_blocks;
+            BOOST_REQUIRE(tree.part_recovery_data(part, data));
+            BOOST_REQUIRE(libed2k::aich_hash_tree::verify_part_recovery_data(
+                sizes[s], tree.master_hash(), part, data, part_blocks));
+            BOOST_REQUIRE_EQUAL(static_cast<int>(part_blocks.size()), libed2k::aich_hash_tree::blocks_in_part(sizes[s], part));
+            BOOST_CHECK(std::equal(part_blocks.begin(), part_blocks.end(), blocks.begin() + first_block));
+            first_block += part_blocks.size();
+
+            // any corrupted hash breaks verification
+            data[data.size() / 2].second[0] ^= 0xFF;
+            BOOST_CHECK(!libed2k::aich_hash_tree::verify_part_recovery_data(
+                sizes[s], tree.master_hash(), part, data, part_blocks));
+        }
+
+        std::vector<libed2k::aich_node_hash> data;
+        BOOST_CHECK_EQUAL(first_block, static_cast<int>(blocks.size()));
+        BOOST_CHECK(!tree.part_recovery_data(parts, data));
+    }
+
+    // wrong blocks count gives empty tree
+    BOOST_CHECK(libed2k::aich_hash_tree(libed2k::PIECE_SIZE, std::vector<libed2k::sha1_hash>(3)).empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_answer_serialization)
+{
+    std::vector<libed2k::aich_node_hash> nodes;
+    nodes.push_back(std::make_pair(boost::uint32_t(2), random_hash()));
+    nodes.push_back(std::make_pair(boost::uint32_t(0x1FFFF), random_hash()));
+    nodes.push_back(std::make_pair(boost::uint32_t(7), random_hash()));
+
+    libed2k::client_aich_answer answer;
+    answer.m_nPart = 3;
+    answer.m_hMaster = random_hash();
+    answer.m_data = libed2k::aich_recovery_data(nodes);
+    BOOST_CHECK_EQUAL(answer.m_data.m_hashes16.m_collection.size(), 2U);
+    BOOST_CHECK_EQUAL(answer.m_data.m_hashes32.m_collection.size(), 1U);
+
+    std::ostringstream sstream(std::ios_base::binary);
+    libed2k::archive::ed2k_oarchive out_archive(sstream);
+    out_archive << answer;
+    BOOST_CHECK_EQUAL(sstream.str().size(), 16U + 2U + 20U + 2U + 2*(2U + 20U) + 2U + 4U + 20U);
+
+    std::istringstream istream(sstream.str(), std::ios_base::binary);
+    libed2k::archive::ed2k_iarchive in_archive(istream);
+    libed2k::client_aich_answer result;
+    in_archive >> result;
+    BOOST_CHECK_EQUAL(result.m_nPart, 3);
+    BOOST_CHECK(result.m_hMaster == answer.m_hMaster);
+
+    std::vector<libed2k::aich_node_hash> restored = result.m_data.nodes();
+    BOOST_REQUIRE_EQUAL(restored.size(), 3U);
+    BOOST_CHECK(std::find(restored.begin(), restored.end(), nodes[1]) != restored.end());
+
+    // negative answer is file hash only
+    std::ostringstream nostream(std::ios_base::binary);
+    libed2k::archive::ed2k_oarchive nout_archive(nostream);
+    libed2k::client_aich_answer negative;
+    nout_archive << negative;
+    BOOST_CHECK_EQUAL(nostream.str().size(), 16U);
+    std::istringstream nstream(nostream.str(), std::ios_base::binary);
+    libed2k::archive::ed2k_iarchive nin_archive(nstream);
+    libed2k::client_aich_answer nresult;
+    nin_archive >> nresult;
+    BOOST_CHECK(nresult.m_data.nodes().empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_master_votes)
+{
+    libed2k::sha1_hash good = random_hash();
+    libed2k::sha1_hash bad = random_hash();
+    libed2k::aich_master_votes votes;
+
+    // one source repeating its hash has one vote
+    for (int n = 0; n < 20; ++n)
+        votes.add(libed2k::address::from_string("10.0.0.1"), bad);
+    BOOST_CHECK(votes.trusted().is_all_zeros());
+    BOOST_CHECK_EQUAL(votes.sources(), 1);
+
+    // addresses of one /24 network are one source, it changed its mind
+    for (int n = 1; n < 20; ++n)
+    {
+        std::stringstream s;
+        s << "10.0.0." << n;
+        votes.add(libed2k::address::from_string(s.str()), good);
+    }
+    BOOST_CHECK(votes.trusted().is_all_zeros());
+    BOOST_CHECK_EQUAL(votes.sources(), 1);
+
+    for (int n = 1; n < libed2k::aich_master_votes::min_sources; ++n)
+    {
+        std::stringstream s;
+        s << "10.0." << n << ".1";
+        votes.add(libed2k::address::from_string(s.str()), good);
+    }
+    BOOST_CHECK(votes.trusted() == good);
+
+    // one dissenting source out of eleven breaks the majority
+    votes.add(libed2k::address::from_string("192.168.1.1"), bad);
+    BOOST_CHECK(votes.trusted().is_all_zeros());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
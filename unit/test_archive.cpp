@@ -827,4 +827,33 @@ BOOST_AUTO_TEST_CASE(test_incorrect_packet_2)
     BOOST_CHECK_NO_THROW(ia_corr >> t);
 }
 
+BOOST_AUTO_TEST_CASE(test_buffer_archive)
+{
+    const boost::uint16_t m_source_archive[4] = {0x0102, 0x0304, 0x0506, 0x0708};
+    const char* dataPtr = (const char*)&m_source_archive[0];
+
+    libed2k::archive::ed2k_iarchive ia(dataPtr, sizeof(m_source_archive));
+    SplittedStruct sp_struct(1,2, true, 100);
+    ia >> sp_struct;
+    BOOST_CHECK(!ia.error());
+    BOOST_CHECK_EQUAL(sp_struct.m_nC, m_source_archive[2]);
+    BOOST_CHECK_EQUAL(ia.bytes_left(), sizeof(boost::uint16_t));
+
+    // short read doesn't throw, gives zero and stops archive
+    boost::uint32_t nLongData = 1;
+    BOOST_CHECK_NO_THROW(ia >> nLongData);
+    BOOST_CHECK_EQUAL(nLongData, 0U);
+    BOOST_CHECK(ia.error() == static_cast<boost::system::error_code>(libed2k::errors::unexpected_istream_error));
+    BOOST_CHECK_EQUAL(ia.bytes_left(), 0U);
+
+    // huge collection size is rejected before allocation
+    char chPacket[] = {'\x11', '\x12', '\x14', '\xFF', '\xEE', '\x10', '\x10', '\x10', '\x10', '\x10', '\x10', '\x10', '\x10', '\x10', '\x10', '\x10',
+                '\x10', '\x00', '\x00',  '\x00'};
+    libed2k::archive::ed2k_iarchive ia_packet(chPacket, sizeof(chPacket));
+    libed2k::client_directory_content_result t;
+    BOOST_CHECK_NO_THROW(ia_packet >> t);
+    BOOST_CHECK(ia_packet.error() == static_cast<boost::system::error_code>(libed2k::errors::decode_packet_error));
+    BOOST_CHECK(t.m_files.m_collection.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
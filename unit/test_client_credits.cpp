@@ -0,0 +1,57 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <sstream>
+#include <cmath>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/client_credits.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_client_credits)
+
+BOOST_AUTO_TEST_CASE(test_client_credits)
+{
+    libed2k::md4_hash h = libed2k::md4_hash::fromString("1AA8AFE3018B38D9B4D880D0683CCEB5");
+    libed2k::md4_hash h2 = libed2k::md4_hash::fromString("2AA8AFE3018B38D9B4D880D0683CCEB5");
+    libed2k::client_credits credits;
+    BOOST_CHECK_EQUAL(credits.score_ratio(h), 1);
+
+    // too few downloaded bytes
+    credits.add_downloaded(h, 1000);
+    BOOST_CHECK_EQUAL(credits.score_ratio(h), 1);
+
+    // nothing uploaded - ratio is limited by downloaded size only
+    credits.add_downloaded(h, 7*1024*1024);
+    BOOST_CHECK_CLOSE(credits.score_ratio(h), std::sqrt(double(7*1024*1024 + 1000) / (1024*1024) + 2), 0.001);
+
+    // gave us less than got
+    credits.add_downloaded(h2, 2*1024*1024);
+    credits.add_uploaded(h2, 8*1024*1024);
+    BOOST_CHECK_EQUAL(credits.score_ratio(h2), 1);
+
+    credits.add_uploaded(h, libed2k::size_type(5) << 32);
+    BOOST_CHECK(credits.find(h)->uploaded() == libed2k::size_type(5) << 32);
+    BOOST_CHECK_EQUAL(credits.find(h)->m_nUploadedHi, 5U);
+
+    // clients.met entry layout
+    libed2k::credit_file cf;
+    cf.m_entries.m_collection.push_back(*credits.find(h));
+    std::ostringstream sstream(std::ios_base::binary);
+    libed2k::archive::ed2k_oarchive out_archive(sstream);
+    out_archive << cf;
+    BOOST_CHECK_EQUAL(sstream.str().size(), 1U + 4U + 119U);
+
+    std::istringstream istream(sstream.str(), std::ios_base::binary);
+    libed2k::archive::ed2k_iarchive in_archive(istream);
+    libed2k::credit_file result;
+    in_archive >> result;
+    BOOST_REQUIRE_EQUAL(result.m_entries.m_collection.size(), 1U);
+    BOOST_CHECK(result.m_entries.m_collection[0].m_hKey == h);
+    BOOST_CHECK(result.m_entries.m_collection[0].downloaded() == 7*1024*1024 + 1000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,94 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/util.hpp"
+#include "libed2k/compressed_cache.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_compression)
+
+BOOST_AUTO_TEST_CASE(test_inflate_packet)
+{
+    // "ed2k" repeated 25000 times, compressed far better than 1:10
+    const unsigned char packed[] =
+    {
+        0x78, 0x9c, 0xed, 0xc3, 0x31, 0x0d, 0x00, 0x00, 0x08, 0x03, 0x30, 0x4f, 0x68, 0x62, 0xd7, 0xfc,
+        0xff, 0xd8, 0xe0, 0x68, 0x93, 0x66, 0xa7, 0x51, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x5f, 0x3e, 0x44, 0xcd, 0x98, 0xe9
+    };
+
+    libed2k::socket_buffer out;
+    BOOST_REQUIRE(libed2k::inflate_packet(reinterpret_cast<const char*>(packed), sizeof(packed), out, 1024*1024));
+    BOOST_REQUIRE_EQUAL(out.size(), 100000U);
+    BOOST_CHECK_EQUAL(std::string(&out[0], 4), std::string("ed2k"));
+    BOOST_CHECK_EQUAL(std::string(&out[out.size() - 4], 4), std::string("ed2k"));
+
+    // output limit
+    BOOST_CHECK(!libed2k::inflate_packet(reinterpret_cast<const char*>(packed), sizeof(packed), out, 99999));
+    BOOST_CHECK(out.empty());
+
+    // truncated and corrupted streams
+    BOOST_CHECK(!libed2k::inflate_packet(reinterpret_cast<const char*>(packed), sizeof(packed) - 10, out, 1024*1024));
+    std::vector<char> corrupted(packed, packed + sizeof(packed));
+    corrupted[sizeof(packed) - 1] ^= 0xFF;
+    BOOST_CHECK(!libed2k::inflate_packet(&corrupted[0], corrupted.size(), out, 1024*1024));
+}
+
+BOOST_AUTO_TEST_CASE(test_deflate_block)
+{
+    std::string text;
+    while (text.size() < libed2k::BLOCK_SIZE) text += "the quick brown fox jumps over the lazy dog ";
+
+    std::vector<char> z;
+    BOOST_REQUIRE(libed2k::deflate_block(text.c_str(), text.size(), z));
+    BOOST_CHECK(z.size() < text.size() / 10);
+
+    libed2k::socket_buffer out;
+    BOOST_REQUIRE(libed2k::inflate_packet(&z[0], z.size(), out, text.size()));
+    BOOST_CHECK(std::string(out.begin(), out.end()) == text);
+
+    // noise has entropy close to 8 bits per byte
+    std::vector<char> noise(libed2k::BLOCK_SIZE);
+    for (size_t n = 0; n < noise.size(); ++n) noise[n] = static_cast<char>(rand());
+    BOOST_CHECK(!libed2k::deflate_block(&noise[0], noise.size(), z));
+    BOOST_CHECK(z.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_compressed_cache)
+{
+    libed2k::compressed_cache cache(2);
+    libed2k::md4_hash h = libed2k::md4_hash::fromString("1AA8AFE3018B38D9B4D880D0683CCEB5");
+    libed2k::compressed_block b1(new std::vector<char>(10));
+    libed2k::compressed_block b2(new std::vector<char>());
+    libed2k::compressed_block b3(new std::vector<char>(30));
+
+    cache.insert(h, 0, 100, b1);
+    cache.insert(h, 100, 100, b2);
+    BOOST_CHECK(cache.find(h, 0, 100) == b1);
+    BOOST_CHECK(!cache.find(h, 0, 50));
+
+    // least recently used block goes away
+    cache.insert(h, 200, 100, b3);
+    BOOST_CHECK_EQUAL(cache.size(), 2);
+    BOOST_CHECK(!cache.find(h, 100, 100));
+    BOOST_CHECK(cache.find(h, 0, 100) == b1);
+    BOOST_CHECK(cache.find(h, 200, 100) == b3);
+
+    cache.set_limit(0);
+    BOOST_CHECK_EQUAL(cache.size(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
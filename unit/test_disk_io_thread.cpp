@@ -0,0 +1,170 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "libed2k/config.hpp"
+#include "libed2k/disk_io_thread.hpp"
+#include "libed2k/storage.hpp"
+#include "libed2k/transfer_info.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/io_service.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_disk_io_thread)
+
+using namespace libed2k;
+
+#ifdef LIBED2K_LINUX
+
+namespace
+{
+    // release_files of blocking storages waits until the gate opens
+    struct gate
+    {
+        gate(): open(false), waiting(0) {}
+        boost::mutex m;
+        boost::condition_variable c;
+        bool open;
+        int waiting;
+    };
+
+    gate g_gate;
+
+    class gate_storage : public disabled_storage
+    {
+    public:
+        gate_storage(int piece_size, bool block): disabled_storage(piece_size), m_block(block) {}
+
+        bool release_files()
+        {
+            if (!m_block) return false;
+            boost::mutex::scoped_lock l(g_gate.m);
+            ++g_gate.waiting;
+            g_gate.c.notify_all();
+            while (!g_gate.open) g_gate.c.wait(l);
+            return false;
+        }
+    private:
+        bool m_block;
+    };
+
+    storage_interface* blocking_storage_constructor(file_storage const& fs
+        , file_storage const*, std::string const&, file_pool&, std::vector<boost::uint8_t> const&)
+    {
+        return new gate_storage(fs.piece_length(), true);
+    }
+
+    storage_interface* free_storage_constructor(file_storage const& fs
+        , file_storage const*, std::string const&, file_pool&, std::vector<boost::uint8_t> const&)
+    {
+        return new gate_storage(fs.piece_length(), false);
+    }
+
+    void count_job(int* counter, int, disk_io_job const&) { ++*counter; }
+
+    // runs completions on this thread until counter reaches value
+    bool wait_for(io_service& ios, const int& counter, int value)
+    {
+        for (int i = 0; i < 500 && counter < value; ++i)
+        {
+            ios.poll();
+            if (counter < value) boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        }
+        return counter >= value;
+    }
+
+    bool gate_waiting()
+    {
+        boost::mutex::scoped_lock l(g_gate.m);
+        for (int i = 0; i < 500 && g_gate.waiting == 0; ++i)
+            g_gate.c.timed_wait(l, boost::posix_time::milliseconds(10));
+        return g_gate.waiting > 0;
+    }
+
+    void open_gate()
+    {
+        boost::mutex::scoped_lock l(g_gate.m);
+        g_gate.open = true;
+        g_gate.c.notify_all();
+    }
+
+    const disk_device_status* find_device(const std::vector<disk_device_status>& st, boost::uint64_t device)
+    {
+        for (size_t i = 0; i < st.size(); ++i)
+            if (st[i].device == device) return &st[i];
+        return NULL;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_device_workers)
+{
+    io_service ios;
+    file_pool fp;
+    disk_io_thread dio(ios, boost::function<void()>(), fp);
+
+    boost::intrusive_ptr<transfer_info const> info(
+        new transfer_info(md4_hash(), "file", 100, std::vector<md4_hash>()));
+    std::vector<boost::uint8_t> prio;
+
+    // procfs and sysfs are devices of their own
+    boost::intrusive_ptr<piece_manager> blocked(new piece_manager(boost::shared_ptr<void>()
+        , info, ".", fp, dio, blocking_storage_constructor, storage_mode_sparse, prio));
+    boost::intrusive_ptr<piece_manager> unblocked(new piece_manager(boost::shared_ptr<void>()
+        , info, "/proc/libed2k_test", fp, dio, free_storage_constructor, storage_mode_sparse, prio));
+    boost::intrusive_ptr<piece_manager> late(new piece_manager(boost::shared_ptr<void>()
+        , info, "/sys/libed2k_test", fp, dio, free_storage_constructor, storage_mode_sparse, prio));
+
+    if (blocked->device() == unblocked->device() || blocked->device() == late->device()
+        || unblocked->device() == late->device())
+    {
+        BOOST_TEST_MESSAGE("test paths share a device, skip");
+        open_gate();
+        dio.abort();
+        dio.join();
+        return;
+    }
+
+    // worker of the first device stops in the storage, the second one still serves
+    int blocked_done = 0;
+    int unblocked_done = 0;
+    blocked->async_release_files(boost::bind(&count_job, &blocked_done, _1, _2));
+    BOOST_REQUIRE(gate_waiting());
+    blocked->async_release_files(boost::bind(&count_job, &blocked_done, _1, _2));
+    unblocked->async_release_files(boost::bind(&count_job, &unblocked_done, _1, _2));
+    BOOST_CHECK(wait_for(ios, unblocked_done, 1));
+    BOOST_CHECK_EQUAL(blocked_done, 0);
+
+    // jobs of the storages are in queues of their devices
+    std::vector<disk_device_status> st;
+    dio.device_status(st);
+    const disk_device_status* bs = find_device(st, blocked->device());
+    const disk_device_status* fs = find_device(st, unblocked->device());
+    BOOST_REQUIRE(bs && fs);
+    BOOST_CHECK_EQUAL(bs->job_queue_length, 1);
+    BOOST_CHECK_EQUAL(fs->job_queue_length, 0);
+    BOOST_CHECK_EQUAL(fs->jobs, 1);
+    BOOST_CHECK(find_device(st, late->device()) == NULL);
+
+    // worker of a new device starts after abort and quits after its job
+    dio.abort();
+    int late_done = 0;
+    late->async_release_files(boost::bind(&count_job, &late_done, _1, _2));
+    dio.device_status(st);
+    BOOST_CHECK(find_device(st, late->device()) != NULL);
+
+    open_gate();
+    dio.join();
+    ios.poll();
+}
+
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
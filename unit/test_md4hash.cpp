@@ -121,4 +121,57 @@ BOOST_AUTO_TEST_CASE(test_partial_hashing_and_hashset)
     }
 }
 
+BOOST_AUTO_TEST_CASE(test_multi_hasher)
+{
+    // streams of random data against scalar hasher, odd sizes cross 64 bytes blocks bounds
+    const int sizes[] = { 1, 55, 64, 100, 4096, 70001 };
+
+    for (int streams = 1; streams <= libed2k::multi_hasher::max_streams; ++streams)
+    {
+        std::vector<std::vector<char> > data(streams);
+        std::vector<libed2k::hasher> scalar(streams);
+        libed2k::multi_hasher mh(streams);
+        BOOST_CHECK_EQUAL(mh.streams(), streams);
+
+        for (size_t n = 0; n < sizeof(sizes)/sizeof(sizes[0]); ++n)
+        {
+            const char* ptrs[libed2k::multi_hasher::max_streams];
+
+            for (int i = 0; i < streams; ++i)
+            {
+                data[i].resize(sizes[n]);
+                for (int k = 0; k < sizes[n]; ++k) data[i][k] = static_cast<char>(rand());
+                scalar[i].update(&data[i][0], sizes[n]);
+                ptrs[i] = &data[i][0];
+            }
+
+            mh.update(ptrs, sizes[n]);
+        }
+
+        libed2k::md4_hash result[libed2k::multi_hasher::max_streams];
+        mh.final(result);
+
+        for (int i = 0; i < streams; ++i)
+        {
+            BOOST_CHECK_EQUAL(result[i], scalar[i].final());
+        }
+    }
+
+    // batch api and continue from partial hash
+    std::string str(1000, 'x');
+    const char* ptrs[] = { str.c_str(), str.c_str(), str.c_str() };
+    libed2k::md4_hash result[3];
+    libed2k::multi_hasher::hash(ptrs, str.size(), 3, result);
+    BOOST_CHECK_EQUAL(result[0], libed2k::hasher::from_string(str));
+    BOOST_CHECK_EQUAL(result[2], libed2k::hasher::from_string(str));
+
+    libed2k::hasher partial(str.c_str(), 10);
+    libed2k::multi_hasher mh(1);
+    mh.assign(0, partial);
+    const char* tail = str.c_str() + 10;
+    mh.update(&tail, str.size() - 10);
+    mh.final(result);
+    BOOST_CHECK_EQUAL(result[0], libed2k::hasher::from_string(str));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,174 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include "libed2k/config.hpp"
+
+#ifndef LIBED2K_WINDOWS
+
+#include <sys/mman.h>
+
+#include "libed2k/mmap_storage.hpp"
+#include "libed2k/file_mapping.hpp"
+#include "libed2k/file_storage.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/filesystem.hpp"
+#include "libed2k/chained_buffer.hpp"
+#include "libed2k/allocator.hpp"
+#include "libed2k/util.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_mmap_storage)
+
+using namespace libed2k;
+
+namespace
+{
+    const int piece_length = 64 * 1024;
+    const int block_length = 16 * 1024;
+    const std::string save_path = "mmap_storage_test";
+
+    // piece 1 crosses the border of the files
+    file_storage two_files()
+    {
+        file_storage fs;
+        fs.add_file("mmap/a", 100000);
+        fs.add_file("mmap/b", 60000);
+        fs.set_piece_length(piece_length);
+        fs.set_num_pieces(int(div_ceil(fs.total_size(), piece_length)));
+        return fs;
+    }
+
+    std::vector<char> pattern(int size, int seed)
+    {
+        std::vector<char> ret(size);
+        for (int i = 0; i < size; ++i) ret[i] = char((i * 7 + seed) & 0xff);
+        return ret;
+    }
+
+    // unmapped pages can't be synced
+    bool mapped(const char* p)
+    {
+        char* page = const_cast<char*>(p) - (reinterpret_cast<size_t>(p) % page_size());
+        return msync(page, page_size(), MS_ASYNC) == 0;
+    }
+
+    struct storage_fixture
+    {
+        storage_fixture(): pool(4), fs(two_files()),
+            storage(fs, 0, save_path, pool, std::vector<boost::uint8_t>())
+        {
+        }
+
+        ~storage_fixture()
+        {
+            error_code ec;
+            remove_all(save_path, ec);
+        }
+
+        int write_piece(int piece, int seed)
+        {
+            int size = fs.piece_size(piece);
+            std::vector<char> data = pattern(size, seed);
+            file::iovec_t b = { &data[0], size_t(size) };
+            return storage.writev(&b, piece, 0, 1);
+        }
+
+        file_pool pool;
+        file_storage fs;
+        mmap_storage storage;
+    };
+}
+
+BOOST_FIXTURE_TEST_CASE(test_map_block, storage_fixture)
+{
+    BOOST_REQUIRE_EQUAL(write_piece(0, 1), piece_length);
+    BOOST_REQUIRE_EQUAL(write_piece(1, 2), piece_length);
+    BOOST_REQUIRE_EQUAL(write_piece(2, 3), fs.piece_size(2));
+
+    char* data = NULL;
+    boost::intrusive_ptr<file_mapping> m;
+    std::vector<char> expected = pattern(piece_length, 1);
+    BOOST_REQUIRE(storage.map_block(0, block_length, block_length, data, m));
+    BOOST_REQUIRE(m);
+    BOOST_CHECK(std::memcmp(data, &expected[block_length], block_length) == 0);
+
+    // block of the second file
+    boost::intrusive_ptr<file_mapping> m2;
+    expected = pattern(fs.piece_size(2), 3);
+    BOOST_REQUIRE(storage.map_block(2, 0, block_length, data, m2));
+    BOOST_CHECK(std::memcmp(data, &expected[0], block_length) == 0);
+    BOOST_CHECK(m2 != m);
+
+    // file keeps one mapping
+    boost::intrusive_ptr<file_mapping> m3;
+    BOOST_REQUIRE(storage.map_block(0, 0, block_length, data, m3));
+    BOOST_CHECK(m3 == m);
+
+    // block on the files border is read the default way
+    boost::intrusive_ptr<file_mapping> m4;
+    BOOST_CHECK(!storage.map_block(1, 2 * block_length, block_length, data, m4));
+    BOOST_CHECK(!m4);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_remap_grown_file, storage_fixture)
+{
+    BOOST_REQUIRE_EQUAL(write_piece(0, 1), piece_length);
+
+    // data beyond end of file on disk isn't mapped
+    char* data = NULL;
+    boost::intrusive_ptr<file_mapping> m;
+    BOOST_CHECK(!storage.map_block(1, 0, block_length, data, m));
+    BOOST_REQUIRE(storage.map_block(0, 0, block_length, data, m));
+    BOOST_CHECK_EQUAL(m->size(), piece_length);
+
+    // grown file gets new mapping, the old one stays valid for its holders
+    BOOST_REQUIRE_EQUAL(write_piece(1, 2), piece_length);
+    char* data2 = NULL;
+    boost::intrusive_ptr<file_mapping> m2;
+    BOOST_REQUIRE(storage.map_block(1, 0, block_length, data2, m2));
+    BOOST_CHECK(m2 != m);
+    BOOST_CHECK_EQUAL(m2->size(), 100000);
+
+    std::vector<char> expected = pattern(piece_length, 1);
+    BOOST_CHECK(mapped(data));
+    BOOST_CHECK(std::memcmp(data, &expected[0], block_length) == 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_mapping_lifetime, storage_fixture)
+{
+    BOOST_REQUIRE_EQUAL(write_piece(0, 1), piece_length);
+
+    char* data = NULL;
+    boost::intrusive_ptr<file_mapping> m;
+    BOOST_REQUIRE(storage.map_block(0, 0, block_length, data, m));
+    BOOST_CHECK_EQUAL(m->refcount(), 2);
+
+    // send buffer holds mapping the way peer connection queues mapped block
+    chained_buffer buffer;
+    buffer.append_buffer(data, block_length, block_length, boost::bind(&release_mapped_block, _1, m));
+    m.reset();
+
+    // storage forgets its mappings, queued block is still readable
+    storage.release_files();
+    std::vector<char> expected = pattern(piece_length, 1);
+    BOOST_CHECK(mapped(data));
+    BOOST_CHECK(std::memcmp(data, &expected[0], block_length) == 0);
+
+    // sent block takes the last reference
+    buffer.pop_front(block_length);
+    BOOST_CHECK(buffer.empty());
+    BOOST_CHECK(!mapped(data));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "libed2k/fingerprint.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/session_impl.hpp"
+#include "libed2k/base_connection.hpp"
+#include "libed2k/socket_type.hpp"
+#include "libed2k/peer.hpp"
+#include "libed2k/peer_connection.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_network_thread)
+
+using namespace libed2k;
+
+namespace
+{
+    session_settings test_settings(int network_threads)
+    {
+        session_settings s;
+        s.listen_port = 0;
+        s.network_threads = network_threads;
+        return s;
+    }
+
+    struct session_fixture
+    {
+        session_fixture(int network_threads = 1):
+            ses(fingerprint(), "127.0.0.1", test_settings(network_threads))
+        {
+        }
+
+        aux::session_impl ses;
+    };
+
+    void increment(int* counter) { ++*counter; }
+
+    void increment_many(aux::session_impl* ses, int* counter, int times)
+    {
+        for (int i = 0; i < times; ++i)
+            ses->sync_call(boost::bind(&increment, counter));
+    }
+
+    // sync_call of network thread itself must not wait for its own queue
+    bool nested_call(aux::session_impl* ses)
+    {
+        return ses->sync_call_ret<bool>(boost::bind(&aux::session_impl::is_network_thread, ses));
+    }
+
+    bool network_done(aux::session_impl& ses)
+    {
+        aux::session_impl::mutex_t::scoped_lock l(ses.m_mutex);
+        return ses.m_network_done;
+    }
+
+    void wait_network_done(aux::session_impl& ses)
+    {
+        for (int i = 0; i < 100 && !network_done(ses); ++i)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+    }
+
+    struct shards_fixture : session_fixture
+    {
+        shards_fixture(): session_fixture(3) {}
+    };
+
+    io_service* next_io_service(aux::session_impl* ses)
+    {
+        return &ses->connection_io_service();
+    }
+
+    struct release_record
+    {
+        release_record(): destroyed(false), on_network_thread(false) {}
+
+        bool is_destroyed()
+        {
+            boost::mutex::scoped_lock l(m);
+            return destroyed;
+        }
+
+        void wait()
+        {
+            for (int i = 0; i < 100 && !is_destroyed(); ++i)
+                boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+        }
+
+        boost::mutex m;
+        bool destroyed;
+        bool on_network_thread;
+    };
+
+    class test_connection : public base_connection
+    {
+    public:
+        test_connection(aux::session_impl& ses, boost::shared_ptr<socket_type> s, release_record& r):
+            base_connection(ses, s, tcp::endpoint()), m_record(r)
+        {
+        }
+
+        ~test_connection()
+        {
+            boost::mutex::scoped_lock l(m_record.m);
+            m_record.destroyed = true;
+            m_record.on_network_thread = m_ses.is_network_thread();
+        }
+
+        void on_sent(const error_code& e, std::size_t bytes_transferred) {}
+
+    private:
+        release_record& m_record;
+    };
+
+    void drop_connection(boost::intrusive_ptr<base_connection>* c) { c->reset(); }
+
+    // connection on socket of the shard next to serve
+    boost::intrusive_ptr<base_connection> shard_connection(aux::session_impl& ses, release_record& r)
+    {
+        io_service& ios = *ses.sync_call_ret<io_service*>(boost::bind(&next_io_service, &ses));
+        boost::shared_ptr<socket_type> s(new socket_type(ios));
+        s->instantiate<stream_socket>(ios);
+        return boost::intrusive_ptr<base_connection>(new test_connection(ses, s, r));
+    }
+
+    struct socket_info
+    {
+        bool utp;
+        bool tcp;
+        io_service* ios;
+    };
+
+    // socket is created and dropped on network thread, uTP one belongs to session udp socket
+    socket_info peer_socket(aux::session_impl* ses, bool utp)
+    {
+        boost::shared_ptr<socket_type> s = ses->create_peer_socket(utp);
+        socket_info ret = { is_utp(*s), s->get<stream_socket>() != NULL, &s->get_io_service() };
+        return ret;
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_sync_call_on_network_thread, session_fixture)
+{
+    BOOST_CHECK(!ses.is_network_thread());
+    BOOST_CHECK(ses.sync_call_ret<bool>(boost::bind(&aux::session_impl::is_network_thread, &ses)));
+    BOOST_CHECK(ses.sync_call_ret<bool>(boost::bind(&nested_call, &ses)));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_sync_call_serializes_callers, session_fixture)
+{
+    const int threads = 4;
+    const int times = 500;
+
+    // counter is touched by the network thread only
+    int counter = 0;
+    boost::thread_group callers;
+    for (int i = 0; i < threads; ++i)
+        callers.create_thread(boost::bind(&increment_many, &ses, &counter, times));
+    callers.join_all();
+
+    BOOST_CHECK_EQUAL(counter, threads * times);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_sync_call_after_network_thread, session_fixture)
+{
+    ses.sync_call(boost::bind(&aux::session_impl::abort, &ses));
+
+    wait_network_done(ses);
+    BOOST_REQUIRE(network_done(ses));
+
+    // nobody serves the queue anymore, call runs in place
+    int counter = 0;
+    ses.sync_call(boost::bind(&increment, &counter));
+    BOOST_CHECK_EQUAL(counter, 1);
+    BOOST_CHECK(!ses.sync_call_ret<bool>(boost::bind(&aux::session_impl::is_network_thread, &ses)));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_single_network_thread, session_fixture)
+{
+    // without shards sockets are served by the network thread itself
+    BOOST_CHECK(ses.m_shards.empty());
+    BOOST_CHECK(ses.sync_call_ret<io_service*>(boost::bind(&next_io_service, &ses)) == &ses.m_io_service);
+    BOOST_CHECK(ses.sync_call_ret<io_service*>(boost::bind(&next_io_service, &ses)) == &ses.m_io_service);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_shards_round_robin, shards_fixture)
+{
+    BOOST_REQUIRE_EQUAL(ses.m_shards.size(), 3u);
+
+    std::vector<io_service*> services;
+    for (int i = 0; i < 6; ++i)
+        services.push_back(ses.sync_call_ret<io_service*>(boost::bind(&next_io_service, &ses)));
+
+    for (int i = 0; i < 3; ++i)
+    {
+        BOOST_CHECK(services[i] != &ses.m_io_service);
+        BOOST_CHECK(services[i] != services[(i + 1) % 3]);
+        BOOST_CHECK(services[i] == services[i + 3]);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_release_connection_on_shard, shards_fixture)
+{
+    release_record r;
+    boost::intrusive_ptr<base_connection> c = shard_connection(ses, r);
+
+    // last reference goes on shard thread, connection is destroyed on network thread
+    c->socket()->get_io_service().post(boost::bind(&drop_connection, &c));
+    r.wait();
+
+    BOOST_REQUIRE(r.is_destroyed());
+    BOOST_CHECK(r.on_network_thread);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_release_connection_after_network_thread, shards_fixture)
+{
+    release_record r;
+    boost::intrusive_ptr<base_connection> c = shard_connection(ses, r);
+
+    ses.sync_call(boost::bind(&aux::session_impl::abort, &ses));
+    wait_network_done(ses);
+    BOOST_REQUIRE(network_done(ses));
+
+    // nobody serves network thread queue, connection goes in place
+    c.reset();
+    BOOST_CHECK(r.is_destroyed());
+    BOOST_CHECK(!r.on_network_thread);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_create_peer_socket, shards_fixture)
+{
+    socket_info utp = ses.sync_call_ret<socket_info>(boost::bind(&peer_socket, &ses, true));
+    BOOST_CHECK(utp.utp);
+    BOOST_CHECK(!utp.tcp);
+    BOOST_CHECK(utp.ios == &ses.m_io_service);
+
+    socket_info tcp = ses.sync_call_ret<socket_info>(boost::bind(&peer_socket, &ses, false));
+    BOOST_CHECK(!tcp.utp);
+    BOOST_CHECK(tcp.tcp);
+    BOOST_CHECK(tcp.ios != &ses.m_io_service);
+}
+
+BOOST_AUTO_TEST_CASE(test_utp_fallback_to_tcp)
+{
+    session_settings settings;
+    peer p(tcp::endpoint(), true, 0);
+    BOOST_CHECK(!use_utp(p, settings));
+
+    settings.enable_outgoing_utp = true;
+    BOOST_CHECK(use_utp(p, settings));
+
+    // TCP failure counts
+    p.next_connect = 10;
+    BOOST_CHECK(!utp_connect_failed(&p, false));
+    BOOST_CHECK(p.supports_utp);
+    BOOST_CHECK_EQUAL(p.next_connect, 10);
+
+    // uTP failure doesn't, peer is reconnected over TCP at once
+    BOOST_CHECK(utp_connect_failed(&p, true));
+    BOOST_CHECK(!p.supports_utp);
+    BOOST_CHECK_EQUAL(p.next_connect, 0);
+    BOOST_CHECK(!use_utp(p, settings));
+
+    // only the first uTP failure of peer is forgiven
+    BOOST_CHECK(!utp_connect_failed(&p, true));
+    BOOST_CHECK(!utp_connect_failed(NULL, true));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,8 +9,10 @@
 #endif
 
 #include <fstream>
+#include <sstream>
 #include <boost/test/unit_test.hpp>
 #include "libed2k/packet_struct.hpp"
+#include "libed2k/util.hpp"
 #include "common.hpp"
 
 
@@ -48,4 +50,86 @@ BOOST_AUTO_TEST_CASE(test_extract_message){
 
 }
 
+BOOST_AUTO_TEST_CASE(test_sources_exchange_packets)
+{
+    libed2k::sources_request2 sr;
+    sr.file_hash = libed2k::md4_hash::fromString("1AA8AFE3018B38D9B4D880D0683CCEB5");
+    std::ostringstream rstream(std::ios_base::binary);
+    libed2k::archive::ed2k_oarchive rout(rstream);
+    rout << sr;
+    BOOST_REQUIRE_EQUAL(rstream.str().size(), 1U + 2U + 16U);
+    BOOST_CHECK_EQUAL(rstream.str()[0], SOURCE_EXCHG2_LEVEL);
+
+    for (int version = 1; version <= SOURCE_EXCHG2_LEVEL; ++version)
+    {
+        libed2k::sources_answer2 sa(version);
+        sa.file_hash = sr.file_hash;
+        libed2k::sources_answer_element sae(version);
+        sae.client_id = libed2k::net_identifier(0x0100007F, 4662);
+        sae.client_hash = libed2k::md4_hash::emule;
+        sa.elems.push_back(sae);
+        sa.elems.push_back(sae);
+
+        std::ostringstream sstream(std::ios_base::binary);
+        libed2k::archive::ed2k_oarchive out_archive(sstream);
+        out_archive << sa;
+
+        std::string packet = sstream.str();
+        size_t element_size = 12 + (version > 1 ? 16 : 0) + (version > 3 ? 1 : 0);
+        BOOST_CHECK_EQUAL(packet.size(), 1U + 16U + 2U + 2*element_size);
+
+        // version comes from packet
+        libed2k::archive::ed2k_iarchive in_archive(packet.c_str(), packet.size());
+        libed2k::sources_answer2 result(0);
+        in_archive >> result;
+        BOOST_CHECK(!in_archive.error());
+        BOOST_CHECK_EQUAL(result.sx_version, version);
+        BOOST_REQUIRE_EQUAL(result.elems.size(), 2U);
+        BOOST_CHECK(result.elems.front().client_id == sae.client_id);
+        BOOST_CHECK(result.elems.back().client_hash == (version > 1 ? libed2k::md4_hash::emule : libed2k::md4_hash()));
+    }
+
+    // count over packet end
+    std::string truncated("\x04" "1234567890123456" "\xFF\xFF", 19);
+    libed2k::archive::ed2k_iarchive in_archive(truncated.c_str(), truncated.size());
+    libed2k::sources_answer2 result(0);
+    in_archive >> result;
+    BOOST_CHECK(in_archive.error());
+}
+
+BOOST_AUTO_TEST_CASE(test_sources_answer_endpoints)
+{
+    const boost::uint32_t low_id = 5000;
+    const libed2k::tcp::endpoint high_ep(libed2k::ip::address::from_string("1.2.3.4"), 4662);
+    const boost::uint32_t high_id = libed2k::address2int(high_ep.address());
+
+    const int versions[] = { 1, 3 };
+    for (size_t v = 0; v < sizeof(versions)/sizeof(versions[0]); ++v)
+    {
+        int version = versions[v];
+        libed2k::sources_answer2 sa(version);
+        libed2k::sources_answer_element sae(version);
+        // hybrid id since version 3
+        sae.client_id = libed2k::net_identifier(version >= 3 ? ntohl(low_id) : low_id, 4662);
+        sa.elems.push_back(sae);
+        sae.client_id = libed2k::net_identifier(version >= 3 ? ntohl(high_id) : high_id, 4662);
+        sa.elems.push_back(sae);
+
+        std::ostringstream sstream(std::ios_base::binary);
+        libed2k::archive::ed2k_oarchive out_archive(sstream);
+        out_archive << sa;
+        std::string packet = sstream.str();
+        libed2k::archive::ed2k_iarchive in_archive(packet.c_str(), packet.size());
+        libed2k::sources_answer2 result(0);
+        in_archive >> result;
+        BOOST_REQUIRE(!in_archive.error());
+        BOOST_REQUIRE_EQUAL(result.elems.size(), 2U);
+
+        libed2k::tcp::endpoint ep;
+        BOOST_CHECK(!result.elems.front().source_endpoint(ep));
+        BOOST_CHECK(result.elems.back().source_endpoint(ep));
+        BOOST_CHECK_EQUAL(ep, high_ep);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
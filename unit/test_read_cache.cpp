@@ -0,0 +1,352 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <list>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/next_prior.hpp>
+#include "libed2k/constants.hpp"
+#include "libed2k/util.hpp"
+#include "libed2k/read_cache.hpp"
+#include "libed2k/disk_io_thread.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_read_cache)
+
+using namespace libed2k;
+
+namespace
+{
+    const int block_size = int(BLOCK_SIZE);
+    const int request_size = int(AICH_BLOCK_SIZE);
+    const int blocks_in_piece = int(div_ceil(PIECE_SIZE, BLOCK_SIZE));
+    const int requests_in_piece = int(div_ceil(PIECE_SIZE, AICH_BLOCK_SIZE));
+
+    struct piece
+    {
+        piece(int k, bool h): key(k), hot(h), num_blocks(blocks_in_piece),
+            expire(min_time()), copied(blocks_in_piece) {}
+        int key;
+        bool hot;
+        int num_blocks;
+        ptime expire;
+        std::vector<copied_range> copied;
+    };
+
+    struct piece_role
+    {
+        explicit piece_role(int pinned = -1): pinned_key(pinned) {}
+
+        read_piece_role operator()(const piece& p) const
+        {
+            if (p.key < 0) return piece_elsewhere;
+            return p.key == pinned_key ? piece_pinned : piece_evictable;
+        }
+
+        int pinned_key;
+    };
+
+    /**
+      * read cache of whole pieces on one device, replaced by the 2Q
+      * step of disk_io_thread. Pieces are in LRU order, the oldest first
+     */
+    class cache_model
+    {
+    public:
+        explicit cache_model(int capacity): m_capacity(capacity), m_ghost_hits(0) {}
+
+        /**
+          * peer reads request of piece
+          * @return true when it was a cache hit
+         */
+        bool read(int key, int request)
+        {
+            bool hit = true;
+            std::list<piece>::iterator p = find(key);
+            if (p == m_pieces.end())
+            {
+                hit = false;
+                bool ghost = m_ghosts.take(cache_piece_key(0, key));
+                if (ghost) ++m_ghost_hits;
+                while (int(m_pieces.size()) >= m_capacity) evict();
+                p = m_pieces.insert(m_pieces.end(), piece(key, ghost));
+            }
+
+            // same split into blocks as disk_io_thread::copy_from_piece
+            int begin = request * request_size;
+            int end = (std::min)(begin + request_size, int(PIECE_SIZE));
+            while (begin < end)
+            {
+                int block = begin / block_size;
+                int block_offset = begin % block_size;
+                int to_copy = (std::min)(block_size - block_offset, end - begin);
+                if (p->copied[block].copy(block_offset, block_offset + to_copy)) p->hot = true;
+                begin += to_copy;
+            }
+
+            m_pieces.splice(m_pieces.end(), m_pieces, p);
+            return hit;
+        }
+
+        void read_piece(int key)
+        {
+            for (int r = 0; r < requests_in_piece; ++r) read(key, r);
+        }
+
+        bool cached(int key) { return find(key) != m_pieces.end(); }
+        bool hot(int key) { return find(key)->hot; }
+
+        const std::vector<int>& evicted() const { return m_evicted; }
+        int ghost_hits() const { return m_ghost_hits; }
+    private:
+        std::list<piece>::iterator find(int key)
+        {
+            for (std::list<piece>::iterator i = m_pieces.begin(); i != m_pieces.end(); ++i)
+                if (i->key == key) return i;
+            return m_pieces.end();
+        }
+
+        void evict()
+        {
+            std::list<piece>::iterator i =
+                read_cache_victim(m_pieces.begin(), m_pieces.end(), piece_role(), time_now());
+            BOOST_REQUIRE(i != m_pieces.end());
+            m_ghosts.evicted(cache_piece_key(0, i->key), i->hot, m_capacity);
+            m_evicted.push_back(i->key);
+            m_pieces.erase(i);
+        }
+
+        int m_capacity;     //!< pieces
+        std::list<piece> m_pieces;
+        ghost_list m_ghosts;
+        std::vector<int> m_evicted;
+        int m_ghost_hits;
+    };
+}
+
+BOOST_AUTO_TEST_CASE(test_copied_range)
+{
+    copied_range r;
+    BOOST_CHECK(r.empty());
+
+    // one reader goes through a block in adjacent parts
+    BOOST_CHECK(!r.copy(0, 100));
+    BOOST_CHECK(!r.copy(100, 250));
+    BOOST_CHECK(!r.empty());
+
+    // another reader copies the same bytes
+    BOOST_CHECK(r.copy(50, 60));
+
+    copied_range back;
+    BOOST_CHECK(!back.copy(200, 300));
+    BOOST_CHECK(!back.copy(100, 200));
+    BOOST_CHECK(back.copy(299, 300));
+    BOOST_CHECK(!back.copy(300, 301));
+}
+
+BOOST_AUTO_TEST_CASE(test_sequential_reader_stays_probationary)
+{
+    // requests aren't aligned to cache blocks, but reading piece through
+    // copies every byte once
+    BOOST_REQUIRE(block_size % request_size != 0);
+    cache_model cache(4);
+    cache.read_piece(0);
+    BOOST_CHECK(!cache.hot(0));
+
+    // second peer reads one request of it
+    cache.read(0, 7);
+    BOOST_CHECK(cache.hot(0));
+}
+
+BOOST_AUTO_TEST_CASE(test_two_queue_victim)
+{
+    std::vector<int> blocks(4, 10);
+    typedef std::vector<int>::iterator iter;
+
+    // probationary pieces take more than a quarter - the oldest of them goes
+    {
+        two_queue_victim<iter> v(blocks.end());
+        v.add(blocks.begin(), true, 10);
+        v.add(blocks.begin() + 1, false, 10);
+        v.add(blocks.begin() + 2, true, 10);
+        v.add(blocks.begin() + 3, false, 10);
+        BOOST_CHECK(v.first() == blocks.begin() + 1);
+        BOOST_CHECK(v.second() == blocks.begin());
+    }
+
+    // probationary pieces take a quarter - the oldest hot one goes
+    {
+        two_queue_victim<iter> v(blocks.end());
+        v.add(blocks.begin(), false, 10);
+        v.add(blocks.begin() + 1, true, 10);
+        v.add(blocks.begin() + 2, true, 10);
+        v.pinned(10);
+        BOOST_CHECK(v.first() == blocks.begin() + 1);
+        BOOST_CHECK(v.second() == blocks.begin());
+    }
+
+    // only one kind of pieces
+    {
+        two_queue_victim<iter> v(blocks.end());
+        v.add(blocks.begin() + 2, true, 1);
+        v.pinned(100);
+        BOOST_CHECK(v.first() == blocks.begin() + 2);
+        BOOST_CHECK(v.second() == blocks.end());
+    }
+
+    {
+        two_queue_victim<iter> v(blocks.end());
+        v.pinned(10);
+        BOOST_CHECK(v.first() == blocks.end());
+        BOOST_CHECK(v.second() == blocks.end());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_read_cache_victim)
+{
+    typedef std::list<piece>::iterator iter;
+    ptime now = time_now();
+
+    std::list<piece> pieces;
+    pieces.push_back(piece(-1, false));   // other device
+    pieces.push_back(piece(1, false));
+    pieces.push_back(piece(2, true));
+    pieces.push_back(piece(3, false));
+    iter other = pieces.begin();
+    iter p1 = boost::next(other);
+    iter h2 = boost::next(p1);
+    iter p3 = boost::next(h2);
+
+    // pieces of another device don't count
+    BOOST_CHECK(read_cache_victim(pieces.begin(), pieces.end(), piece_role(), now) == p1);
+
+    // pinned piece is skipped but its blocks count
+    BOOST_CHECK(read_cache_victim(pieces.begin(), pieces.end(), piece_role(1), now) == p3);
+
+    // the first choice hasn't expired, the second one goes
+    p1->expire = now + seconds(10);
+    BOOST_CHECK(read_cache_victim(pieces.begin(), pieces.end(), piece_role(), now) == h2);
+
+    // neither did the second one
+    h2->expire = now + seconds(10);
+    BOOST_CHECK(read_cache_victim(pieces.begin(), pieces.end(), piece_role(), now) == pieces.end());
+}
+
+BOOST_AUTO_TEST_CASE(test_scan_keeps_working_set)
+{
+    const int capacity = 8;
+    cache_model cache(capacity);
+
+    // two peers read the same pieces
+    for (int key = 100; key < 103; ++key)
+    {
+        cache.read_piece(key);
+        cache.read_piece(key);
+        BOOST_CHECK(cache.hot(key));
+    }
+
+    // third peer reads a file through while the working set is still read
+    const int scan = 30;
+    for (int key = 0; key < scan; ++key)
+    {
+        cache.read_piece(key);
+        BOOST_CHECK(!cache.hot(key));
+        for (int w = 100; w < 103; ++w) BOOST_CHECK(cache.read(w, key % requests_in_piece));
+    }
+
+    // the scan only cycles through the probationary part, oldest first
+    BOOST_REQUIRE_EQUAL(int(cache.evicted().size()), scan - (capacity - 3));
+    for (int i = 0; i < int(cache.evicted().size()); ++i)
+        BOOST_CHECK_EQUAL(cache.evicted()[i], i);
+    for (int key = 100; key < 103; ++key) BOOST_CHECK(cache.cached(key));
+    BOOST_CHECK_EQUAL(cache.ghost_hits(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_ghost_hit)
+{
+    cache_model cache(2);
+    cache.read(0, 0);
+    cache.read(1, 0);
+    cache.read(2, 0);
+    BOOST_CHECK(!cache.cached(0));
+
+    // piece evicted while probationary comes back hot
+    BOOST_CHECK(!cache.read(0, 1));
+    BOOST_CHECK_EQUAL(cache.ghost_hits(), 1);
+    BOOST_CHECK(cache.hot(0));
+    BOOST_CHECK(!cache.hot(2));
+
+    // a hot piece doesn't go to the ghost list
+    cache.read(3, 0);
+    cache.read(4, 0);
+    BOOST_CHECK(cache.cached(0));
+}
+
+BOOST_AUTO_TEST_CASE(test_ghost_list)
+{
+    int storage1 = 0;
+    int storage2 = 0;
+    ghost_list ghosts;
+
+    for (int piece = 0; piece < 5; ++piece)
+        ghosts.push_back(cache_piece_key(&storage1, piece), 4);
+    ghosts.push_back(cache_piece_key(&storage2, 0), 4);
+    BOOST_CHECK_EQUAL(ghosts.size(), 4);
+
+    // the oldest keys are forgotten
+    BOOST_CHECK(!ghosts.take(cache_piece_key(&storage1, 0)));
+    BOOST_CHECK(!ghosts.take(cache_piece_key(&storage1, 1)));
+
+    // a hit is counted once
+    BOOST_CHECK(ghosts.take(cache_piece_key(&storage1, 3)));
+    BOOST_CHECK(!ghosts.take(cache_piece_key(&storage1, 3)));
+    BOOST_CHECK_EQUAL(ghosts.size(), 3);
+
+    ghosts.remove_storage(&storage1);
+    BOOST_CHECK_EQUAL(ghosts.size(), 1);
+    BOOST_CHECK(ghosts.take(cache_piece_key(&storage2, 0)));
+}
+
+BOOST_AUTO_TEST_CASE(test_transfer_cache_stats)
+{
+    md4_hash h1 = md4_hash::fromString("000102030405060708090A0B0C0D0E0F");
+    md4_hash h2 = md4_hash::fromString("0F0E0D0C0B0A09080706050403020100");
+
+    transfer_cache_stats stats;
+    stats.count_read(h1, false);
+    stats.count_read(h1, true);
+    stats.count_read(h1, true);
+    stats.count_read(h2, false);
+
+    cache_status st;
+    stats.status(st.transfers);
+    BOOST_REQUIRE_EQUAL(st.transfers.size(), 2U);
+    for (std::vector<transfer_cache_status>::const_iterator i = st.transfers.begin();
+        i != st.transfers.end(); ++i)
+    {
+        if (i->hash == h1)
+        {
+            BOOST_CHECK_EQUAL(i->blocks_read, 3);
+            BOOST_CHECK_EQUAL(i->blocks_read_hit, 2);
+        }
+        else
+        {
+            BOOST_CHECK(i->hash == h2);
+            BOOST_CHECK_EQUAL(i->blocks_read, 1);
+            BOOST_CHECK_EQUAL(i->blocks_read_hit, 0);
+        }
+    }
+
+    // aborted transfer is dropped
+    stats.remove(h1);
+    st.transfers.clear();
+    stats.status(st.transfers);
+    BOOST_REQUIRE_EQUAL(st.transfers.size(), 1U);
+    BOOST_CHECK(st.transfers[0].hash == h2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,147 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <vector>
+#include <limits>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/constants.hpp"
+#include "libed2k/util.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/piece_picker.hpp"
+#include "libed2k/peer_connection.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_request_queue)
+
+using namespace libed2k;
+
+namespace
+{
+    const size_type fsize = PIECE_SIZE * 3;
+}
+
+BOOST_AUTO_TEST_CASE(test_request_queue_depth)
+{
+    session_settings settings;
+    settings.request_queue_time = 3;
+    settings.min_request_queue = 2;
+    settings.max_out_request_queue = 32;
+
+    // idle peer keeps minimal pipeline
+    BOOST_CHECK_EQUAL(request_queue_depth(0, 0, settings), 2);
+    BOOST_CHECK_EQUAL(request_queue_depth(1024, 100, settings), 2);
+
+    // 1 MiB/s over 3s + 1s rtt is 16 blocks
+    BOOST_CHECK_EQUAL(request_queue_depth(1024*1024, 1000, settings), 16);
+    // partial block rounds up
+    BOOST_CHECK_EQUAL(request_queue_depth(1024*1024, 1001, settings), 17);
+
+    // fast peer and long rtt are capped, no overflow on huge products
+    BOOST_CHECK_EQUAL(request_queue_depth(100*1024*1024, 2000, settings), 32);
+    BOOST_CHECK_EQUAL(request_queue_depth(std::numeric_limits<int>::max(),
+        std::numeric_limits<int>::max() / 2, settings), 32);
+
+    settings.max_out_request_queue = 8;
+    BOOST_CHECK_EQUAL(request_queue_depth(1024*1024, 1000, settings), 8);
+
+    // at least one request is always kept
+    settings.min_request_queue = 0;
+    BOOST_CHECK_EQUAL(request_queue_depth(0, 0, settings), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_is_endgame)
+{
+    int blocks_per_piece = int(div_ceil(PIECE_SIZE, BLOCK_SIZE));
+    piece_picker picker;
+    picker.init(blocks_per_piece, blocks_per_piece, 3);
+    picker.inc_refcount_all();
+    int peer = 0;
+
+    BOOST_CHECK(!picker.is_endgame());
+    picker.mark_as_downloading(piece_block(0, 0), &peer, piece_picker::fast);
+    picker.mark_as_downloading(piece_block(1, 0), &peer, piece_picker::fast);
+    BOOST_CHECK(!picker.is_endgame());
+
+    // the last wanted piece is requested
+    picker.mark_as_downloading(piece_block(2, 0), &peer, piece_picker::fast);
+    BOOST_CHECK(picker.is_endgame());
+}
+
+BOOST_AUTO_TEST_CASE(test_cancel_pending_block)
+{
+    std::vector<pending_block> request_queue;
+    std::vector<pending_block> download_queue;
+    request_queue.push_back(pending_block(piece_block(0, 1), fsize));
+    request_queue.push_back(pending_block(piece_block(0, 2), fsize));
+    download_queue.push_back(pending_block(piece_block(0, 0), fsize));
+
+    // block is not requested from this peer at all
+    BOOST_CHECK(!cancel_pending_block(request_queue, download_queue, piece_block(1, 0)));
+    BOOST_CHECK_EQUAL(request_queue.size(), 2U);
+    BOOST_CHECK_EQUAL(download_queue.size(), 1U);
+
+    // request wasn't sent yet - dropped
+    BOOST_CHECK(cancel_pending_block(request_queue, download_queue, piece_block(0, 2)));
+    BOOST_REQUIRE_EQUAL(request_queue.size(), 1U);
+    BOOST_CHECK(request_queue[0].block == piece_block(0, 1));
+    BOOST_CHECK(!request_queue[0].not_wanted);
+
+    // request was sent - peer sends data anyway, it will be skipped
+    BOOST_CHECK(cancel_pending_block(request_queue, download_queue, piece_block(0, 0)));
+    BOOST_REQUIRE_EQUAL(download_queue.size(), 1U);
+    BOOST_CHECK(download_queue[0].not_wanted);
+}
+
+BOOST_AUTO_TEST_CASE(test_skip_pending_block)
+{
+    std::vector<pending_block> download_queue;
+    download_queue.push_back(pending_block(piece_block(0, 0), fsize));
+    download_queue.push_back(pending_block(piece_block(0, 1), fsize));
+    download_queue[0].not_wanted = true;
+
+    const int half = int(BLOCK_SIZE / 2);
+
+    // first half of the block arrives after cancel, part of it read already is thrown away too
+    BOOST_CHECK_EQUAL(skip_pending_block(download_queue, download_queue.begin(),
+        peer_request(0, 0, half)), half);
+    BOOST_REQUIRE_EQUAL(download_queue.size(), 2U);
+    BOOST_CHECK(!download_queue[0].completed());
+
+    // second half completes the block - it leaves the queue
+    BOOST_CHECK_EQUAL(skip_pending_block(download_queue, download_queue.begin(),
+        peer_request(0, half, half)), half);
+    BOOST_REQUIRE_EQUAL(download_queue.size(), 1U);
+    BOOST_CHECK(download_queue[0].block == piece_block(0, 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_received_block_bytes)
+{
+    pending_block b(piece_block(0, 1), fsize);
+    BOOST_CHECK_EQUAL(received_block_bytes(b), 0);
+
+    // block came in two requests, the first one was completed before cancel
+    const int half = int(BLOCK_SIZE / 2);
+    b.complete(std::make_pair(size_type(BLOCK_SIZE), size_type(BLOCK_SIZE + half)));
+    BOOST_CHECK_EQUAL(received_block_bytes(b), half);
+
+    // compressed block covers its compressed size only
+    pending_block z(piece_block(0, 2), fsize);
+    z.data_size = 1000;
+    z.data_left.shrink_end(1000);
+    z.complete(std::make_pair(size_type(2 * BLOCK_SIZE), size_type(2 * BLOCK_SIZE + 400)));
+    BOOST_CHECK_EQUAL(received_block_bytes(z), 400);
+
+    // skipped rest of cancelled block and its received part make the whole block
+    std::vector<pending_block> download_queue(1, b);
+    int wasted = received_block_bytes(download_queue[0]);
+    wasted += skip_pending_block(download_queue, download_queue.begin(),
+        peer_request(0, int(BLOCK_SIZE) + half, half));
+    BOOST_CHECK_EQUAL(wasted, int(BLOCK_SIZE));
+    BOOST_CHECK(download_queue.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,188 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/chained_buffer.hpp"
+#include "libed2k/send_queue.hpp"
+
+#ifdef LIBED2K_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+BOOST_AUTO_TEST_SUITE(test_send_queue)
+
+using namespace libed2k;
+
+namespace
+{
+    void free_nothing(char*) {}
+}
+
+BOOST_AUTO_TEST_CASE(test_sent_payload)
+{
+    // header, 100 bytes of payload, header, 50 bytes of payload
+    std::vector<payload_range> payloads;
+    payloads.push_back(payload_range(10, 100));
+    payloads.push_back(payload_range(120, 50));
+
+    BOOST_CHECK_EQUAL(sent_payload(payloads, 5), 0);
+    BOOST_CHECK_EQUAL(sent_payload(payloads, 10), 5);
+    BOOST_REQUIRE_EQUAL(payloads.size(), 2U);
+    BOOST_CHECK_EQUAL(payloads[0].start, 0);
+    BOOST_CHECK_EQUAL(payloads[0].length, 95);
+
+    // end of first payload, whole header and start of second payload
+    BOOST_CHECK_EQUAL(sent_payload(payloads, 115), 115 - 10);
+    BOOST_REQUIRE_EQUAL(payloads.size(), 1U);
+    BOOST_CHECK_EQUAL(payloads[0].start, 0);
+    BOOST_CHECK_EQUAL(payloads[0].length, 40);
+
+    BOOST_CHECK_EQUAL(sent_payload(payloads, 40), 40);
+    BOOST_CHECK(payloads.empty());
+    BOOST_CHECK_EQUAL(sent_payload(payloads, 7), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_chained_buffer_iovec)
+{
+    std::vector<char> data(100*10);
+    chained_buffer cb;
+
+    for (size_t n = 0; n < 100; ++n)
+        cb.append_buffer(&data[n*10], 10, 10, &free_nothing);
+
+    BOOST_CHECK_EQUAL(cb.size(), 1000);
+
+    // partial last buffer
+    chained_buffer::iovec_range r = cb.build_iovec(25);
+    BOOST_REQUIRE_EQUAL(std::distance(r.begin(), r.end()), 3);
+    BOOST_CHECK_EQUAL(boost::asio::buffer_size(*(r.begin() + 2)), 5U);
+    BOOST_CHECK(boost::asio::buffer_cast<const char*>(*r.begin()) == &data[0]);
+
+    // one gather write takes no more than max_iovec buffers
+    r = cb.build_iovec(cb.size());
+    BOOST_CHECK_EQUAL(std::distance(r.begin(), r.end()), int(chained_buffer::max_iovec));
+
+    cb.pop_front(995);
+    r = cb.build_iovec(cb.size());
+    BOOST_REQUIRE_EQUAL(std::distance(r.begin(), r.end()), 1);
+    BOOST_CHECK_EQUAL(boost::asio::buffer_size(*r.begin()), 5U);
+}
+
+#ifdef LIBED2K_LINUX
+namespace
+{
+    boost::intrusive_ptr<block_pipe> file_pipe(int fd, size_type offset, int size)
+    {
+        error_code ec;
+        boost::intrusive_ptr<block_pipe> p(new block_pipe(size, ec));
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE(p->fill(fd, offset, ec));
+        BOOST_REQUIRE_EQUAL(p->size(), size);
+        return p;
+    }
+}
+
+/**
+  * drives the send queue the way base_connection::do_write() and its write
+  * handlers do, over a socket pair with small quota so every part goes in pieces
+ */
+BOOST_AUTO_TEST_CASE(test_pipe_queue_order)
+{
+    const char* file_name = "send_queue.dat";
+    std::string content;
+    for (int i = 0; i < 5000; ++i) content += char('a' + i % 26);
+
+    int fd = ::open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    BOOST_REQUIRE(fd >= 0);
+    BOOST_REQUIRE_EQUAL(::write(fd, content.data(), content.size()), ssize_t(content.size()));
+
+    int sockets[2];
+    BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    char header1[] = "HEADER-ONE";
+    char header2[] = "HEADER-TWO";
+
+    // header -> pipe -> header -> pipe
+    chained_buffer buffer;
+    pipe_queue pipes;
+    std::vector<payload_range> payloads;
+
+    buffer.append_buffer(header1, 10, 10, &free_nothing);
+    pipes.push_back(file_pipe(fd, 0, 3000), buffer.size());
+    payloads.push_back(payload_range(buffer.size() + pipes.bytes() - 3000, 3000));
+    buffer.append_buffer(header2, 10, 10, &free_nothing);
+    pipes.push_back(file_pipe(fd, 3000, 2000), buffer.size());
+    payloads.push_back(payload_range(buffer.size() + pipes.bytes() - 2000, 2000));
+
+    BOOST_CHECK_EQUAL(buffer.size() + pipes.bytes(), 5020);
+
+    const int quota = 700;
+    int payload = 0;
+    int protocol = 0;
+
+    while (!buffer.empty() || !pipes.empty())
+    {
+        int sent = 0;
+        if (boost::intrusive_ptr<block_pipe> p = pipes.ready())
+        {
+            error_code ec;
+            sent = p->send(sockets[0], (std::min)(p->size(), quota), ec);
+            BOOST_REQUIRE(!ec);
+            pipes.pipe_sent(sent);
+        }
+        else
+        {
+            int amount = pipes.buffer_limit((std::min)(buffer.size(), quota));
+            BOOST_REQUIRE(amount > 0);
+            chained_buffer::iovec_range r = buffer.build_iovec(amount);
+            for (chained_buffer::iovec_range::const_iterator i = r.begin(); i != r.end(); ++i)
+            {
+                int size = int(boost::asio::buffer_size(*i));
+                BOOST_REQUIRE_EQUAL(::send(sockets[0], boost::asio::buffer_cast<const char*>(*i), size, 0)
+                    , ssize_t(size));
+                sent += size;
+            }
+            buffer.pop_front(sent);
+            pipes.buffer_sent(sent);
+        }
+
+        int sent_payload_bytes = sent_payload(payloads, sent);
+        payload += sent_payload_bytes;
+        protocol += sent - sent_payload_bytes;
+    }
+
+    BOOST_CHECK_EQUAL(payload, 5000);
+    BOOST_CHECK_EQUAL(protocol, 20);
+    BOOST_CHECK(payloads.empty());
+    BOOST_CHECK_EQUAL(pipes.bytes(), 0);
+
+    std::string received(5020, '\0');
+    int got = 0;
+    while (got < int(received.size()))
+    {
+        ssize_t ret = ::recv(sockets[1], &received[got], received.size() - got, 0);
+        BOOST_REQUIRE(ret > 0);
+        got += int(ret);
+    }
+
+    std::string expected = std::string(header1, 10) + content.substr(0, 3000)
+        + std::string(header2, 10) + content.substr(3000, 2000);
+    BOOST_CHECK(received == expected);
+
+    ::close(sockets[0]);
+    ::close(sockets[1]);
+    ::close(fd);
+    ::unlink(file_name);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -35,7 +35,7 @@ namespace libed2k
 
         test_transfer_params_maker(alert_manager& am, const std::string& known_file);
     protected:
-        void process_item();
+        void process_item(const std::string& filepath, const bool& cancel);
     private:
         int m_index;
     };
@@ -48,7 +48,7 @@ namespace libed2k
     public:
         cancel_transfer_params_maker_progress(alert_manager& am, const std::string& known_file);
     protected:
-        void process_item();
+        void process_item(const std::string& filepath, const bool& cancel);
     };
 
     template<class Maker>
@@ -71,11 +71,11 @@ namespace libed2k
 
     test_transfer_params_maker::test_transfer_params_maker(alert_manager& am, const std::string& known_file) : transfer_params_maker(am, known_file), m_index(0) {}
 
-    void test_transfer_params_maker::process_item()
+    void test_transfer_params_maker::process_item(const std::string& filepath, const bool& cancel)
     {
         DBG("process item " << m_index);
         add_transfer_params atp;
-        atp.file_path = m_current_filepath;
+        atp.file_path = filepath;
         m_am.post_alert_should(transfer_params_alert(atp, m_errors[m_index]));
         ++m_index;
         m_index = m_index % TCOUNT;
@@ -83,13 +83,13 @@ namespace libed2k
 
     cancel_transfer_params_maker_progress::cancel_transfer_params_maker_progress(alert_manager& am, const std::string& known_file): transfer_params_maker(am, known_file){}
 
-    void cancel_transfer_params_maker_progress::process_item()
+    void cancel_transfer_params_maker_progress::process_item(const std::string& filepath, const bool& cancel)
     {
         try
         {
             while(1)
             {
-                if (m_abort_current || m_abort)
+                if (cancel)
                 {
                     throw libed2k_exception(errors::file_params_making_was_cancelled);
                 }
@@ -98,7 +98,7 @@ namespace libed2k
         }
         catch(libed2k_exception& e)
         {
-            m_am.post_alert_should(transfer_params_alert(add_transfer_params(m_current_filepath), e.error()));
+            m_am.post_alert_should(transfer_params_alert(add_transfer_params(filepath), e.error()));
         }
     }
 }
@@ -317,6 +317,210 @@ BOOST_AUTO_TEST_CASE(test_add_transfer_params_maker)
     DBG("test_add_transfer_params_maker {completed}");
 }
 
+BOOST_AUTO_TEST_CASE(test_file2atp_pipeline)
+{
+    test_files_holder tfh;
+    const char* filename = "test_pipeline_filename";
+    BOOST_REQUIRE(generate_test_file(libed2k::PIECE_SIZE*4, filename));
+    tfh.hold(filename);
+
+    bool cancel = false;
+    libed2k::file2atp fatp;
+    std::pair<libed2k::add_transfer_params, libed2k::error_code> rp = fatp(filename, cancel);
+    BOOST_CHECK(!rp.second);
+    BOOST_CHECK_EQUAL(rp.first.file_hash, libed2k::md4_hash::fromString("9385DCEF4CB89FD5A4334F5034C28893"));
+    // 4 pieces are read even from page cache in measurable time
+    BOOST_CHECK(libed2k::total_microseconds(fatp.read_time) > 0);
+    BOOST_CHECK(libed2k::total_microseconds(fatp.hash_time) > 0);
+
+    // reader stops on cancel and hasher gets error
+    cancel = true;
+    rp = fatp(filename, cancel);
+    BOOST_CHECK(rp.second == libed2k::errors::make_error_code(libed2k::errors::file_params_making_was_cancelled));
+}
+
+BOOST_AUTO_TEST_CASE(test_known_file_index)
+{
+    libed2k::known_file_collection kfc;
+    libed2k::add_transfer_params atp;
+    atp.file_path = "/some/dir/known_name.bin";
+    atp.file_size = 100;
+    atp.file_hash = libed2k::md4_hash::fromString("1AA8AFE3018B38D9B4D880D0683CCEB5");
+    atp.piece_hashses.push_back(atp.file_hash);
+    kfc.append(atp, 1000);
+
+    libed2k::add_transfer_params res = kfc.extract_transfer_params(1000, 100, "/other/dir/known_name.bin");
+    BOOST_CHECK_EQUAL(res.file_hash, atp.file_hash);
+    BOOST_CHECK_EQUAL(res.file_size, atp.file_size);
+    BOOST_CHECK_EQUAL(res.file_path, std::string("/other/dir/known_name.bin"));
+    BOOST_CHECK(res.piece_hashses == atp.piece_hashses);
+
+    BOOST_CHECK(!kfc.extract_transfer_params(1001, 100, atp.file_path).file_hash.defined());
+    BOOST_CHECK(!kfc.extract_transfer_params(1000, 101, atp.file_path).file_hash.defined());
+    BOOST_CHECK(!kfc.extract_transfer_params(1000, 100, "/some/dir/other_name.bin").file_hash.defined());
+
+    // same key replaces entry
+    atp.file_hash = libed2k::md4_hash::fromString("E76BADB8F958D7685B4549D874699EE9");
+    atp.piece_hashses[0] = atp.file_hash;
+    kfc.append(atp, 1000);
+    BOOST_CHECK_EQUAL(kfc.m_known_file_list.m_collection.size(), 1U);
+    BOOST_CHECK_EQUAL(kfc.extract_transfer_params(1000, 100, atp.file_path).file_hash, atp.file_hash);
+}
+
+BOOST_AUTO_TEST_CASE(test_known_file_writer)
+{
+    libed2k::session_impl_test<libed2k::test_transfer_params_maker> sit(libed2k::ss);
+    sit.m_alerts.set_alert_mask(libed2k::alert::all_categories);
+    const char* known_filepath = "test_known.met";
+    const size_t sz = 3;
+    const char* filename = "test_known_filename";
+    test_files_holder tfh;
+    tfh.hold(known_filepath);
+    std::map<std::string, libed2k::md4_hash> hashes;
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_REQUIRE(generate_test_file(libed2k::PIECE_SIZE*n + 100, s.str()));
+        tfh.hold(s.str());
+    }
+
+    // first pass hashes files and writes known file on stop, second pass takes them from known file
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        libed2k::transfer_params_maker tpm(sit.m_alerts, known_filepath);
+        tpm.start();
+
+        for (size_t n = 0; n < sz; ++n)
+        {
+            std::stringstream s;
+            s << filename << n;
+            tpm.make_transfer_params(s.str());
+        }
+
+        WAIT_TPM(tpm)
+        BOOST_CHECK_EQUAL(tpm.status().total_files, static_cast<libed2k::size_type>(pass == 0 ? sz : 0));
+        tpm.stop();
+
+        for (size_t n = 0; n < sz; ++n)
+        {
+            BOOST_REQUIRE(sit.m_alerts.wait_for_alert(libed2k::milliseconds(10)));
+            std::auto_ptr<libed2k::alert> aptr = sit.m_alerts.get();
+            libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+            BOOST_REQUIRE(a);
+            BOOST_CHECK(!a->m_ec);
+
+            if (pass == 0)
+                hashes[a->m_atp.file_path] = a->m_atp.file_hash;
+            else
+                BOOST_CHECK_EQUAL(a->m_atp.file_hash, hashes[a->m_atp.file_path]);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(hashes.size(), sz);
+}
+
+BOOST_AUTO_TEST_CASE(test_known_file_append)
+{
+    libed2k::session_impl_test<libed2k::test_transfer_params_maker> sit(libed2k::ss);
+    sit.m_alerts.set_alert_mask(libed2k::alert::all_categories);
+    const char* known_filepath = "test_known_append.met";
+    const size_t sz = 3;
+    const char* filename = "test_known_append_filename";
+    test_files_holder tfh;
+    tfh.hold(known_filepath);
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_REQUIRE(generate_test_file(1000 + n*100, s.str()));
+        tfh.hold(s.str());
+    }
+
+    // first pass writes known file, next passes append one new file each, the last one hashes nothing
+    for (size_t pass = 1; pass <= sz + 1; ++pass)
+    {
+        size_t files = std::min(pass, sz);
+        libed2k::transfer_params_maker tpm(sit.m_alerts, known_filepath);
+        tpm.start();
+
+        for (size_t n = 0; n < files; ++n)
+        {
+            std::stringstream s;
+            s << filename << n;
+            tpm.make_transfer_params(s.str());
+        }
+
+        WAIT_TPM(tpm)
+        BOOST_CHECK_EQUAL(tpm.status().total_files, static_cast<libed2k::size_type>(pass <= sz ? 1 : 0));
+        tpm.stop();
+
+        for (size_t n = 0; n < files; ++n)
+        {
+            BOOST_REQUIRE(sit.m_alerts.wait_for_alert(libed2k::milliseconds(10)));
+            std::auto_ptr<libed2k::alert> aptr = sit.m_alerts.get();
+            libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+            BOOST_REQUIRE(a);
+            BOOST_CHECK(!a->m_ec);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_transfer_params_maker_pool)
+{
+    libed2k::session_impl_test<libed2k::test_transfer_params_maker> sit(libed2k::ss);
+    sit.m_alerts.set_alert_mask(libed2k::alert::all_categories);
+    libed2k::transfer_params_maker tpm(sit.m_alerts, "", 4, 0);
+
+    test_files_holder tfh;
+    const size_t sz = 8;
+    const char* filename = "test_pool_filename";
+    std::map<std::string, libed2k::md4_hash> hashes;
+    bool cancel = false;
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_REQUIRE(generate_test_file(libed2k::PIECE_SIZE + n*1000, s.str()));
+        tfh.hold(s.str());
+        hashes[s.str()] = libed2k::file2atp()(s.str(), cancel).first.file_hash;
+    }
+
+    tpm.start();
+
+    for (std::map<std::string, libed2k::md4_hash>::const_iterator itr = hashes.begin(); itr != hashes.end(); ++itr)
+    {
+        tpm.make_transfer_params(itr->first);
+    }
+
+    WAIT_TPM(tpm)
+
+    libed2k::hashing_status hs = tpm.status();
+    BOOST_CHECK_EQUAL(hs.workers, 4);
+    BOOST_CHECK_EQUAL(hs.active, 0);
+    BOOST_CHECK_EQUAL(hs.queued, 0);
+    BOOST_CHECK_EQUAL(hs.total_files, static_cast<libed2k::size_type>(sz));
+    tpm.stop();
+
+    // workers complete files in any order
+    for (size_t n = 0; n < sz; ++n)
+    {
+        BOOST_REQUIRE(sit.m_alerts.wait_for_alert(libed2k::milliseconds(10)));
+        std::auto_ptr<libed2k::alert> aptr = sit.m_alerts.get();
+        libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+        BOOST_REQUIRE(a);
+        BOOST_CHECK(!a->m_ec);
+        BOOST_REQUIRE(hashes.count(a->m_atp.file_path));
+        BOOST_CHECK_EQUAL(a->m_atp.file_hash, hashes[a->m_atp.file_path]);
+        hashes.erase(a->m_atp.file_path);
+    }
+
+    BOOST_CHECK(hashes.empty());
+}
+
 BOOST_AUTO_TEST_CASE(test_cancel_filename_in_progress)
 {
     const char* filepath = "it is simple test name";
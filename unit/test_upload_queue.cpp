@@ -0,0 +1,304 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/upload_queue.hpp"
+#include "libed2k/client_credits.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/file.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_upload_queue)
+
+using namespace libed2k;
+
+namespace
+{
+    class fake_peer : public upload_peer
+    {
+    public:
+        explicit fake_peer(char id):
+            hash(md4_hash::fromString(std::string(31, '0') + id)),
+            payload(0), closing(false), accepted(0), rank(0), rankings(0), slots_over(0)
+        {}
+
+        virtual md4_hash upload_client() const { return hash; }
+        virtual size_type uploaded_payload() const { return payload; }
+        virtual bool upload_closing() const { return closing; }
+        virtual void upload_accepted() { ++accepted; }
+        virtual void upload_ranked(boost::uint16_t r) { rank = r; ++rankings; }
+        virtual void upload_slot_over() { ++slots_over; }
+
+        md4_hash hash;
+        size_type payload;
+        bool closing;
+        int accepted;
+        int rank;       //!< last rank told to peer
+        int rankings;
+        int slots_over;
+    };
+
+    session_settings slot_settings(int slots)
+    {
+        session_settings s;
+        s.unchoke_slots_limit = slots;
+        s.upload_queue_size = 10;
+        s.upload_slot_bytes = 1000;
+        s.upload_slot_time = 60;
+        return s;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_upload_queue_score)
+{
+    BOOST_CHECK_EQUAL(upload_queue::score(PR_NORMAL, seconds(0), 1), 0);
+    BOOST_CHECK(upload_queue::score(PR_NORMAL, seconds(100), 1) >
+        upload_queue::score(PR_NORMAL, seconds(50), 1));
+
+    // priority order matches eMule
+    const int priorities[] = { PR_VERYLOW, PR_LOW, PR_NORMAL, PR_HIGH, PR_VERYHIGH };
+    for (size_t n = 1; n < sizeof(priorities)/sizeof(priorities[0]); ++n)
+        BOOST_CHECK(upload_queue::score(priorities[n], seconds(60), 1) >
+            upload_queue::score(priorities[n - 1], seconds(60), 1));
+
+    BOOST_CHECK_EQUAL(upload_queue::score(PR_AUTO, seconds(60), 1),
+        upload_queue::score(PR_NORMAL, seconds(60), 1));
+
+    // long waiting peer on low priority file overtakes newcomer on high priority one
+    BOOST_CHECK(upload_queue::score(PR_LOW, minutes(60), 1) >
+        upload_queue::score(PR_HIGH, minutes(30), 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_grant_slots)
+{
+    client_credits credits;
+    upload_queue queue(credits);
+    session_settings settings = slot_settings(2);
+    settings.upload_queue_size = 2;
+    ptime now = time_now_hires();
+
+    fake_peer a('1'), b('2'), c('3'), d('4'), e('5');
+    BOOST_CHECK(queue.request_upload(&a, PR_NORMAL, settings, now));
+    BOOST_CHECK(queue.request_upload(&b, PR_NORMAL, settings, now));
+    BOOST_CHECK_EQUAL(a.accepted, 1);
+    BOOST_CHECK(queue.has_slot(&a) && queue.has_slot(&b));
+    BOOST_CHECK_EQUAL(queue.slots(), 2);
+
+    // slots are taken - peers wait and learn their ranks
+    BOOST_CHECK(!queue.request_upload(&c, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&d, PR_NORMAL, settings, now + seconds(10)));
+    BOOST_CHECK_EQUAL(c.accepted, 0);
+    BOOST_CHECK_EQUAL(c.rank, 1);
+    BOOST_CHECK_EQUAL(d.rank, 2);
+    BOOST_CHECK_EQUAL(queue.queue_size(), 2);
+
+    // full queue ignores newcomer
+    BOOST_CHECK(!queue.request_upload(&e, PR_NORMAL, settings, now + seconds(10)));
+    BOOST_CHECK_EQUAL(e.rankings, 0);
+    BOOST_CHECK_EQUAL(queue.queue_size(), 2);
+    BOOST_CHECK_EQUAL(queue.rank(e.hash, now), 0);
+
+    // peer with slot asks again and is accepted again
+    BOOST_CHECK(queue.request_upload(&a, PR_NORMAL, settings, now + seconds(20)));
+    BOOST_CHECK_EQUAL(a.accepted, 2);
+    BOOST_CHECK_EQUAL(queue.slots(), 2);
+    BOOST_CHECK_EQUAL(queue.rank(a.hash, now), 0);
+
+    // higher priority of requested file moves peer up
+    BOOST_CHECK(!queue.request_upload(&d, PR_VERYHIGH, settings, now + seconds(20)));
+    BOOST_CHECK_EQUAL(d.rank, 1);
+    BOOST_CHECK_EQUAL(queue.rank(c.hash, now + seconds(20)), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_slot_rotation_bytes)
+{
+    client_credits credits;
+    upload_queue queue(credits);
+    session_settings settings = slot_settings(1);
+    settings.upload_slot_time = 3600;
+    ptime now = time_now_hires();
+
+    fake_peer a('1'), c('3');
+    a.payload = 5000;
+    c.payload = 10000;
+    BOOST_CHECK(queue.request_upload(&a, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&c, PR_NORMAL, settings, now));
+
+    // quantum is counted from slot start
+    a.payload += settings.upload_slot_bytes - 1;
+    queue.second_tick(settings, now + seconds(1));
+    BOOST_CHECK(queue.has_slot(&a));
+    BOOST_CHECK_EQUAL(a.slots_over, 0);
+
+    // slot is over, peer goes back to queue and waiter gets slot
+    a.payload += 1;
+    queue.second_tick(settings, now + seconds(2));
+    BOOST_CHECK(!queue.has_slot(&a));
+    BOOST_CHECK_EQUAL(a.slots_over, 1);
+    BOOST_CHECK(queue.has_slot(&c));
+    BOOST_CHECK_EQUAL(c.accepted, 1);
+    BOOST_CHECK_EQUAL(queue.queue_size(), 1);
+    BOOST_CHECK_EQUAL(queue.rank(a.hash, now + seconds(2)), 1);
+
+    // new slot owner starts its own quantum
+    queue.second_tick(settings, now + seconds(3));
+    BOOST_CHECK(queue.has_slot(&c));
+
+    // nobody connected waits - slot is kept over quantum
+    queue.remove_connection(&a);
+    c.payload += 5 * settings.upload_slot_bytes;
+    queue.second_tick(settings, now + seconds(4));
+    BOOST_CHECK(queue.has_slot(&c));
+    BOOST_CHECK_EQUAL(c.slots_over, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_slot_rotation_time)
+{
+    client_credits credits;
+    upload_queue queue(credits);
+    session_settings settings = slot_settings(1);
+    settings.upload_slot_bytes = 1 << 30;
+    ptime now = time_now_hires();
+
+    fake_peer a('1'), c('3');
+    BOOST_CHECK(queue.request_upload(&a, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&c, PR_NORMAL, settings, now));
+
+    queue.second_tick(settings, now + seconds(settings.upload_slot_time - 1));
+    BOOST_CHECK(queue.has_slot(&a));
+
+    queue.second_tick(settings, now + seconds(settings.upload_slot_time));
+    BOOST_CHECK(!queue.has_slot(&a));
+    BOOST_CHECK_EQUAL(a.slots_over, 1);
+    BOOST_CHECK(queue.has_slot(&c));
+}
+
+BOOST_AUTO_TEST_CASE(test_release_slot)
+{
+    client_credits credits;
+    upload_queue queue(credits);
+    session_settings settings = slot_settings(1);
+    ptime now = time_now_hires();
+
+    fake_peer a('1'), c('3');
+    BOOST_CHECK(queue.request_upload(&a, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&c, PR_NORMAL, settings, now));
+
+    // freed slot goes to waiter on next tick
+    queue.release_slot(&a);
+    BOOST_CHECK(!queue.has_slot(&a));
+    BOOST_CHECK_EQUAL(queue.slots(), 0);
+    BOOST_CHECK(!queue.has_slot(&c));
+    BOOST_CHECK_EQUAL(a.slots_over, 0);
+
+    queue.second_tick(settings, now + seconds(1));
+    BOOST_CHECK(queue.has_slot(&c));
+    BOOST_CHECK_EQUAL(queue.queue_size(), 0);
+
+    // released peer asks again and waits
+    BOOST_CHECK(!queue.request_upload(&a, PR_NORMAL, settings, now + seconds(2)));
+    BOOST_CHECK_EQUAL(a.rank, 1);
+
+    // releasing peer without slot changes nothing
+    queue.release_slot(&a);
+    BOOST_CHECK_EQUAL(queue.slots(), 1);
+    BOOST_CHECK_EQUAL(queue.queue_size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_remove_connection)
+{
+    client_credits credits;
+    upload_queue queue(credits);
+    session_settings settings = slot_settings(1);
+    ptime now = time_now_hires();
+
+    fake_peer a('1'), c('3'), d('4');
+    BOOST_CHECK(queue.request_upload(&a, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&c, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&d, PR_NORMAL, settings, now + seconds(50)));
+
+    // waiter disconnects, its entry stays
+    queue.remove_connection(&c);
+    BOOST_CHECK_EQUAL(queue.queue_size(), 2);
+
+    // slot owner disconnects, slot isn't given to disconnected or closing waiter
+    queue.remove_connection(&a);
+    BOOST_CHECK_EQUAL(queue.slots(), 0);
+    d.closing = true;
+    queue.second_tick(settings, now + seconds(60));
+    BOOST_CHECK_EQUAL(queue.slots(), 0);
+    d.closing = false;
+
+    // peer reconnects, keeps its waiting time and is ahead of other waiter
+    fake_peer c2('3');
+    BOOST_CHECK(queue.request_upload(&c2, PR_NORMAL, settings, now + seconds(100)));
+    BOOST_CHECK(queue.has_slot(&c2));
+    BOOST_CHECK(!queue.has_slot(&d));
+    BOOST_CHECK_EQUAL(queue.queue_size(), 1);
+
+    // disconnected waiter is forgotten after an hour without requests
+    queue.remove_connection(&d);
+    queue.second_tick(settings, now + seconds(50 + 3600));
+    BOOST_CHECK_EQUAL(queue.queue_size(), 1);
+    queue.second_tick(settings, now + seconds(50 + 3601));
+    BOOST_CHECK_EQUAL(queue.queue_size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_reconnect_ask_again)
+{
+    client_credits credits;
+    upload_queue queue(credits);
+    session_settings settings = slot_settings(1);
+    ptime now = time_now_hires();
+
+    fake_peer a('1'), c('3'), d('4');
+    BOOST_CHECK(queue.request_upload(&a, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&c, PR_NORMAL, settings, now));
+    BOOST_CHECK(!queue.request_upload(&d, PR_NORMAL, settings, now + seconds(10)));
+
+    // waiters disconnect after their ranks came, slot is freed while nobody is connected
+    queue.remove_connection(&c);
+    queue.remove_connection(&d);
+    queue.remove_connection(&a);
+    queue.second_tick(settings, now + seconds(20));
+    BOOST_CHECK_EQUAL(queue.slots(), 0);
+    BOOST_CHECK_EQUAL(queue.queue_size(), 2);
+
+    // disconnected better waiter doesn't hold free slot
+    fake_peer d2('4');
+    BOOST_CHECK(queue.request_upload(&d2, PR_NORMAL, settings, now + seconds(30)));
+    BOOST_CHECK(queue.has_slot(&d2));
+    BOOST_CHECK_EQUAL(d2.accepted, 1);
+    BOOST_CHECK_EQUAL(queue.queue_size(), 1);
+
+    // slots are taken - peer waits again
+    fake_peer c2('3');
+    BOOST_CHECK(!queue.request_upload(&c2, PR_NORMAL, settings, now + seconds(40)));
+    BOOST_CHECK_EQUAL(c2.rank, 1);
+    queue.remove_connection(&c2);
+
+    // connected waiter with better score keeps its turn
+    fake_peer e('5');
+    BOOST_CHECK(!queue.request_upload(&e, PR_NORMAL, settings, now + seconds(50)));
+    queue.remove_connection(&e);
+    fake_peer c3('3');
+    BOOST_CHECK(!queue.request_upload(&c3, PR_NORMAL, settings, now + seconds(60)));
+    queue.release_slot(&d2);
+    fake_peer e2('5');
+    BOOST_CHECK(!queue.request_upload(&e2, PR_NORMAL, settings, now + seconds(70)));
+    BOOST_CHECK_EQUAL(e2.accepted, 0);
+    BOOST_CHECK_EQUAL(e2.rank, 2);
+
+    // and takes slot when it asks again
+    fake_peer c4('3');
+    BOOST_CHECK(queue.request_upload(&c4, PR_NORMAL, settings, now + seconds(80)));
+    BOOST_CHECK(queue.has_slot(&c4));
+    BOOST_CHECK_EQUAL(queue.queue_size(), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,125 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/config.hpp"
+
+#if LIBED2K_USE_IO_URING
+
+#include "libed2k/uring_storage.hpp"
+#include "libed2k/file_storage.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/filesystem.hpp"
+#include "libed2k/util.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_uring_storage)
+
+using namespace libed2k;
+
+namespace
+{
+    const int piece_length = 64 * 1024;
+    const std::string save_path = "uring_storage_test";
+
+    // piece 1 crosses the border of the files
+    file_storage two_files()
+    {
+        file_storage fs;
+        fs.add_file("uring/a", 100000);
+        fs.add_file("uring/b", 60000);
+        fs.set_piece_length(piece_length);
+        fs.set_num_pieces(int(div_ceil(fs.total_size(), piece_length)));
+        return fs;
+    }
+
+    std::vector<char> pattern(int size, int seed)
+    {
+        std::vector<char> ret(size);
+        for (int i = 0; i < size; ++i) ret[i] = char((i * 7 + seed) & 0xff);
+        return ret;
+    }
+
+    struct storage_fixture
+    {
+        storage_fixture(): pool(4), fs(two_files()),
+            storage(fs, 0, save_path, pool, std::vector<boost::uint8_t>())
+        {
+            storage.m_ring = &ring;
+            if (!ring.usable()) BOOST_TEST_MESSAGE("io_uring is unavailable, storage goes the default way");
+        }
+
+        ~storage_fixture()
+        {
+            error_code ec;
+            remove_all(save_path, ec);
+        }
+
+        io_ring ring;
+        file_pool pool;
+        file_storage fs;
+        uring_storage storage;
+    };
+}
+
+BOOST_FIXTURE_TEST_CASE(test_read_write_across_files, storage_fixture)
+{
+    // two buffers, the file border falls into the second one
+    std::vector<char> data = pattern(piece_length, 1);
+    file::iovec_t bufs[2] = { { &data[0], 16000 }, { &data[16000], piece_length - 16000 } };
+    BOOST_REQUIRE_EQUAL(storage.writev(bufs, 1, 0, 2), piece_length);
+    BOOST_CHECK(!storage.error());
+
+    std::vector<char> result(piece_length);
+    file::iovec_t rbufs[2] = { { &result[0], 40000 }, { &result[40000], piece_length - 40000 } };
+    BOOST_REQUIRE_EQUAL(storage.readv(rbufs, 1, 0, 2), piece_length);
+    BOOST_CHECK(data == result);
+
+    // last piece is short
+    int last_size = int(fs.total_size() - 2 * piece_length);
+    std::vector<char> tail = pattern(last_size, 2);
+    file::iovec_t tbuf = { &tail[0], size_t(last_size) };
+    BOOST_REQUIRE_EQUAL(storage.writev(&tbuf, 2, 0, 1), last_size);
+
+    std::vector<char> tail_result(last_size);
+    file::iovec_t trbuf = { &tail_result[0], size_t(last_size) };
+    BOOST_REQUIRE_EQUAL(storage.readv(&trbuf, 2, 0, 1), last_size);
+    BOOST_CHECK(tail == tail_result);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_batched_writes, storage_fixture)
+{
+    std::vector<char> first = pattern(piece_length, 3);
+    std::vector<char> second = pattern(piece_length, 4);
+    file::iovec_t b1 = { &first[0], size_t(piece_length) };
+    file::iovec_t b2 = { &second[0], size_t(piece_length) };
+
+    // writes come back when the outermost batch ends
+    ring.begin_batch();
+    ring.begin_batch();
+    BOOST_CHECK_EQUAL(storage.writev(&b1, 0, 0, 1), piece_length);
+    ring.end_batch();
+    BOOST_CHECK_EQUAL(storage.writev(&b2, 1, 0, 1), piece_length);
+    ring.end_batch();
+    BOOST_CHECK(!ring.batching());
+    BOOST_CHECK(!storage.error());
+
+    std::vector<char> result(2 * piece_length);
+    file::iovec_t rbuf = { &result[0], size_t(piece_length) };
+    BOOST_REQUIRE_EQUAL(storage.readv(&rbuf, 0, 0, 1), piece_length);
+    rbuf.iov_base = &result[piece_length];
+    BOOST_REQUIRE_EQUAL(storage.readv(&rbuf, 1, 0, 1), piece_length);
+    BOOST_CHECK(std::equal(first.begin(), first.end(), result.begin()));
+    BOOST_CHECK(std::equal(second.begin(), second.end(), result.begin() + piece_length));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+#endif